@@ -26,6 +26,7 @@ libpaho-mqtt3_local_src_c_files_common := \
 	$(libpaho-mqtt3_lib_path)/Heap.c \
 	$(libpaho-mqtt3_lib_path)/MQTTPacket.c \
 	$(libpaho-mqtt3_lib_path)/Clients.c \
+	$(libpaho-mqtt3_lib_path)/Timers.c \
 	$(libpaho-mqtt3_lib_path)/Thread.c \
 	$(libpaho-mqtt3_lib_path)/utf-8.c \
 	$(libpaho-mqtt3_lib_path)/StackTrace.c \
@@ -38,6 +39,9 @@ libpaho-mqtt3_local_src_c_files_common := \
 	$(libpaho-mqtt3_lib_path)/MQTTPacketOut.c \
 	$(libpaho-mqtt3_lib_path)/SocketBuffer.c \
 	$(libpaho-mqtt3_lib_path)/MQTTPersistenceDefault.c \
+	$(libpaho-mqtt3_lib_path)/MQTTPersistenceLog.c \
+	$(libpaho-mqtt3_lib_path)/MQTTPersistenceWriter.c \
+	$(libpaho-mqtt3_lib_path)/MQTTPersistenceMemory.c \
 
 libpaho-mqtt3_local_src_c_files_c := \
 	$(libpaho-mqtt3_lib_path)/MQTTClient.c \
@@ -23,9 +23,14 @@
 
 #include "Clients.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#include "Heap.h"
+
+#define Clients_indexed(sock) ((sock) > 0 && (sock) < CLIENTS_SOCKET_INDEX_MAX)
+
 
 /**
  * List callback function for comparing clients by clientid
@@ -53,3 +58,79 @@ int clientSocketCompare(void* a, void* b)
 	/*printf("comparing %d with %d\n", (char*)a, (char*)b); */
 	return client->net.socket == *(SOCKET*)b;
 }
+
+
+/**
+ * Add a client to the index of clients by socket, when it has a new socket.  If the index
+ * can't be extended, the client can still be found, by searching.
+ * @param states the client states
+ * @param client the client
+ */
+void Clients_addSocket(ClientStates* states, Clients* client)
+{
+	SOCKET sock = client->net.socket;
+
+	if (!Clients_indexed(sock))
+		return;
+	if ((int)sock >= states->sockets_size)
+	{
+		int size = (states->sockets_size == 0) ? 64 : states->sockets_size;
+		Clients** sockets = NULL;
+
+		while (size <= (int)sock)
+			size *= 2;
+		if (states->sockets == NULL)
+			sockets = malloc(size * sizeof(Clients*));
+		else
+			sockets = realloc(states->sockets, size * sizeof(Clients*));
+		if (sockets == NULL)
+			return;
+		memset(&sockets[states->sockets_size], '\0', (size - states->sockets_size) * sizeof(Clients*));
+		states->sockets = sockets;
+		states->sockets_size = size;
+	}
+	if (states->sockets[sock] == NULL)
+		states->sockets_count++;
+	states->sockets[sock] = client;
+}
+
+
+/**
+ * Remove a client from the index of clients by socket, before its socket is closed.
+ * The index is freed when there are no clients left in it.
+ * @param states the client states
+ * @param client the client
+ */
+void Clients_removeSocket(ClientStates* states, Clients* client)
+{
+	SOCKET sock = client->net.socket;
+
+	if (!Clients_indexed(sock) || (int)sock >= states->sockets_size || states->sockets[sock] != client)
+		return;
+	states->sockets[sock] = NULL;
+	if (--states->sockets_count == 0)
+	{
+		free(states->sockets);
+		states->sockets = NULL;
+		states->sockets_size = 0;
+	}
+}
+
+
+/**
+ * Find the client using a socket
+ * @param states the client states
+ * @param sock the socket
+ * @return the client, or NULL if no client is using the socket
+ */
+Clients* Clients_findSocket(ClientStates* states, SOCKET sock)
+{
+	Clients* client = NULL;
+	ListElement* found = NULL;
+
+	if (Clients_indexed(sock) && (int)sock < states->sockets_size && states->sockets[sock] != NULL)
+		client = states->sockets[sock];
+	else if ((found = ListFindItem(states->clients, &sock, clientSocketCompare)) != NULL)
+		client = (Clients*)(found->content);
+	return client;
+}
@@ -34,6 +34,7 @@
 #include "LinkedList.h"
 #include "MQTTClientPersistence.h"
 #include "Socket.h"
+#include "Timers.h"
 
 /**
  * Stored publication data to minimize copying
@@ -64,6 +65,38 @@ typedef struct
 	int len;				/**> length of the whole structure+data */
 } Messages;
 
+/**
+ * Number of message ids in each page of a message index
+ */
+#define MESSAGE_INDEX_PAGE_SIZE 256
+
+typedef struct
+{
+	int count;                                       /**< number of message ids in use in the page */
+	ListElement* elements[MESSAGE_INDEX_PAGE_SIZE];  /**< message list elements, by message id */
+} messageIndexPage;
+
+/**
+ * Bitmap of the message ids in use, so that a free one can be found a word at a time.
+ * The words are allocated when the first id is added.
+ */
+typedef struct
+{
+	uint64_t* words;       /**< 65536 / 64 words, bit n of word w for message id w * 64 + n */
+	int incomplete;        /**< the words couldn't be allocated, so ids in use may be missing */
+} messageIdMap;
+
+/**
+ * Index of a list of in flight messages by message id, so that acknowledgements can be matched
+ * without searching the list.  Pages of the 64K message ids are only allocated while in use.
+ */
+typedef struct
+{
+	messageIndexPage* pages[65536 / MESSAGE_INDEX_PAGE_SIZE];
+	int incomplete;        /**< a page couldn't be allocated, so the list must be searched */
+	messageIdMap ids;      /**< the message ids in the index */
+} messageIndex;
+
 /**
  * Client will message data
  */
@@ -93,6 +126,12 @@ typedef struct
 	int websocket; /**< socket has been upgraded to use web sockets */
 	char *websocket_key;
 	const MQTTClient_nameValue* httpHeaders;
+	char* coalesced;         /**< packets waiting to be written in one go */
+	size_t coalesced_len;    /**< length of the data in coalesced */
+	size_t coalesced_size;   /**< allocated size of coalesced */
+	int coalescing;          /**< number of open write batches: packets are coalesced while > 0 */
+	int uncommitted;         /**< records have been persisted which must be committed before the next write */
+	int commit_pending;      /**< packets are held until queued persistence writes are carried out */
 } networkHandles;
 
 
@@ -112,6 +151,17 @@ typedef struct
 /** Disconnecting */
 #define DISCONNECTING    -2
 
+/**
+ * The contents of a persistence index record, read when a client's persistence is opened
+ */
+typedef struct
+{
+	char** keys;      /**< the keys of the persisted records, other than those of commands */
+	int nkeys;        /**< the number of keys */
+	char* commands;   /**< the index of the persisted commands, in the API's own format */
+	int commandslen;  /**< the length of the commands index */
+} persistenceIndex;
+
 /**
  * Data related to one client
  */
@@ -133,10 +183,14 @@ typedef struct
 	int msgID;                      /**< the MQTT message id */
 	int keepAliveInterval;          /**< the MQTT keep alive interval */
 	int retryInterval;              /**< the MQTT retry interval for QoS > 0 */
+	Timer keepaliveTimer;           /**< when the keepalive processing is next due */
+	Timer retryTimer;               /**< when the first outbound message is next due to be retried */
 	int maxInflightMessages;        /**< the max number of inflight outbound messages we allow */
 	willMessages* will;             /**< the MQTT will message, if any */
 	List* inboundMsgs;              /**< inbound in flight messages */
 	List* outboundMsgs;				/**< outbound in flight messages */
+	messageIndex inboundIndex;      /**< inboundMsgs by message id */
+	messageIndex outboundIndex;     /**< outboundMsgs by message id */
 	int connect_count;              /**< the number of outbound messages on reconnect - to ensure we send them all */
 	int connect_sent;               /**< the current number of outbound messages on reconnect that we've sent */
 	List* messageQueue;             /**< inbound complete but undelivered messages */
@@ -144,6 +198,9 @@ typedef struct
 	unsigned int qentry_seqno;
 	void* phandle;                  /**< the persistence handle */
 	MQTTClient_persistence* persistence; /**< a persistence implementation */
+	int durability;                 /**< MQTTCLIENT_PERSISTENCE_DURABILITY_* for persisted records */
+	int maxQueuedWrites;            /**< if > 0, persistence writes are queued for a writer thread */
+	persistenceIndex* pindex;       /**< the persistence index read on open, until the restore is done */
     MQTTPersistence_beforeWrite* beforeWrite; /**< persistence write callback */
     MQTTPersistence_afterRead* afterRead; /**< persistence read callback */
     void* beforeWrite_context;      /**< context to be used with the persistence beforeWrite callbacks */
@@ -162,6 +219,11 @@ typedef struct
 int clientIDCompare(void* a, void* b);
 int clientSocketCompare(void* a, void* b);
 
+/**
+ * Sockets below this are indexed to find their clients, higher ones are found by searching
+ */
+#define CLIENTS_SOCKET_INDEX_MAX 65536
+
 /**
  * Configuration data related to all clients
  */
@@ -169,6 +231,13 @@ typedef struct
 {
 	const char* version;
 	List* clients;
+	Clients** sockets;  /**< clients indexed by socket, allocated while any are indexed */
+	int sockets_size;   /**< number of sockets the index has room for */
+	int sockets_count;  /**< number of clients in the index */
 } ClientStates;
 
+void Clients_addSocket(ClientStates* states, Clients* client);
+void Clients_removeSocket(ClientStates* states, Clients* client);
+Clients* Clients_findSocket(ClientStates* states, SOCKET sock);
+
 #endif
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "Heap.h"
+#include "Pool.h"
 
 
 static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*), int freeContent);
@@ -89,7 +90,7 @@ void ListAppendNoMalloc(List* aList, void* content, ListElement* newel, size_t s
  */
 ListElement* ListAppend(List* aList, void* content, size_t size)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = Pool_malloc(sizeof(ListElement));
 	if (newel)
 		ListAppendNoMalloc(aList, content, newel, size);
 	return newel;
@@ -106,7 +107,7 @@ ListElement* ListAppend(List* aList, void* content, size_t size)
  */
 ListElement* ListInsert(List* aList, void* content, size_t size, ListElement* index)
 {
-	ListElement* newel = malloc(sizeof(ListElement));
+	ListElement* newel = Pool_malloc(sizeof(ListElement));
 
 	if (newel == NULL)
 		return newel;
@@ -226,7 +227,7 @@ static int ListUnlink(List* aList, void* content, int(*callback)(void*, void*),
     }
 	if (saved == aList->current)
 		saveddeleted = 1;
-	free(aList->current);
+	Pool_free(aList->current, sizeof(ListElement));
 	if (saveddeleted)
 		aList->current = next;
 	else
@@ -279,7 +280,7 @@ void* ListDetachHead(List* aList)
 		aList->first = aList->first->next;
 		if (aList->first)
 			aList->first->prev = NULL;
-		free(first);
+		Pool_free(first, sizeof(ListElement));
 		--(aList->count);
 	}
 	return content;
@@ -317,7 +318,7 @@ void* ListPopTail(List* aList)
 		aList->last = aList->last->prev;
 		if (aList->last)
 			aList->last->next = NULL;
-		free(last);
+		Pool_free(last, sizeof(ListElement));
 		--(aList->count);
 	}
 	return content;
@@ -367,7 +368,7 @@ void ListEmpty(List* aList)
                         first->content = NULL;
                 }
 		aList->first = first->next;
-		free(first);
+		Pool_free(first, sizeof(ListElement));
 	}
 	aList->count = 0;
 	aList->size = 0;
@@ -395,7 +396,7 @@ void ListFreeNoContent(List* aList)
 	{
 		ListElement* first = aList->first;
 		aList->first = first->next;
-		free(first);
+		Pool_free(first, sizeof(ListElement));
 	}
 	free(aList);
 }
@@ -51,6 +51,7 @@
 
 #if !defined(NO_PERSISTENCE)
 #include "MQTTPersistence.h"
+#include "MQTTPersistenceWriter.h"
 #endif
 #include "MQTTAsync.h"
 #include "MQTTAsyncUtils.h"
@@ -61,6 +62,7 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 #include "OsWrapper.h"
 #include "WebSocket.h"
 
@@ -73,7 +75,9 @@ const char *client_version_eye = "MQTTAsyncV3_Version " CLIENT_VERSION;
 
 volatile int global_initialized = 0;
 List* MQTTAsync_handles = NULL;
-List* MQTTAsync_commands = NULL;
+List* MQTTAsync_readyClients = NULL; /* clients with queued commands, in the order the send thread serves them */
+List* MQTTAsync_sendBatchClients = NULL; /* clients for which the send thread has a batch of writes open */
+sem_type send_sem = NULL; /* posted when the send thread may have a command it can process */
 int MQTTAsync_tostop = 0;
 
 static ClientStates ClientState =
@@ -129,11 +133,13 @@ void MQTTAsync_init_rand(void)
 mutex_type mqttasync_mutex = NULL;
 mutex_type socket_mutex = NULL;
 mutex_type mqttcommand_mutex = NULL;
-sem_type send_sem = NULL;
 #if !defined(NO_HEAP_TRACKING)
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 #endif
+#if defined(USE_POOLS)
+extern mutex_type pool_mutex;
+#endif
 extern mutex_type log_mutex;
 
 int MQTTAsync_init(void)
@@ -178,6 +184,14 @@ int MQTTAsync_init(void)
 			printf("heap_mutex error %d\n", rc);
 			goto exit;
 		}
+#endif
+#if defined(USE_POOLS)
+		if ((pool_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("pool_mutex error %d\n", rc);
+			goto exit;
+		}
 #endif
 		if ((log_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
@@ -209,6 +223,10 @@ void MQTTAsync_cleanup(void)
 		CloseHandle(stack_mutex);
 	if (heap_mutex)
 		CloseHandle(heap_mutex);
+#endif
+#if defined(USE_POOLS)
+	if (pool_mutex)
+		CloseHandle(pool_mutex);
 #endif
 	if (log_mutex)
 		CloseHandle(log_mutex);
@@ -264,9 +282,6 @@ mutex_type socket_mutex = &socket_mutex_store;
 static pthread_mutex_t mqttcommand_mutex_store = PTHREAD_MUTEX_INITIALIZER;
 mutex_type mqttcommand_mutex = &mqttcommand_mutex_store;
 
-static cond_type_struct send_cond_store = { PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
-cond_type send_cond = &send_cond_store;
-
 int MQTTAsync_init(void)
 {
 	pthread_mutexattr_t attr;
@@ -284,10 +299,6 @@ int MQTTAsync_init(void)
 		printf("MQTTAsync: error %d initializing command_mutex\n", rc);
 	else if ((rc = pthread_mutex_init(socket_mutex, &attr)) != 0)
 		printf("MQTTClient: error %d initializing socket_mutex\n", rc);
-	else if ((rc = pthread_cond_init(&send_cond->cond, NULL)) != 0)
-		printf("MQTTAsync: error %d initializing send_cond cond\n", rc);
-	else if ((rc = pthread_mutex_init(&send_cond->mutex, &attr)) != 0)
-		printf("MQTTAsync: error %d initializing send_cond mutex\n", rc);
 
 	return rc;
 }
@@ -319,7 +330,9 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		goto exit;
 	}
 
-	if (strlen(clientId) == 0 && persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT)
+	if (strlen(clientId) == 0 && (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_LOG ||
+		(persistence_type == MQTTCLIENT_PERSISTENCE_MEMORY && persistence_context != NULL)))
 	{
 		rc = MQTTASYNC_PERSISTENCE_ERROR;
 		goto exit;
@@ -349,14 +362,35 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 	}
 
 	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 ||
-					options->struct_version < 0 || options->struct_version > 2))
+					options->struct_version < 0 || options->struct_version > 8))
 	{
 		rc = MQTTASYNC_BAD_STRUCTURE;
 		goto exit;
 	}
 
+	if (options && options->struct_version >= 7 && (options->persistenceDurability < 0 ||
+			options->persistenceDurability > MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC || options->groupCommitWindow < 0))
+	{
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (options && options->struct_version >= 8 && options->maxQueuedPersistenceWrites < 0)
+	{
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
 	if (!global_initialized)
 	{
+#if !defined(_WIN32) && !defined(_WIN64)
+		if (send_sem == NULL && (send_sem = Thread_create_sem(&rc)) == NULL)
+		{
+			printf("MQTTAsync: error %d creating send_sem\n", rc);
+			rc = MQTTASYNC_FAILURE;
+			goto exit;
+		}
+#endif
 		#if !defined(NO_HEAP_TRACKING)
 			Heap_initialize();
 		#endif
@@ -366,8 +400,12 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		Socket_setWriteContinueCallback(MQTTAsync_writeContinue);
 		Socket_setWriteCompleteCallback(MQTTAsync_writeComplete);
 		Socket_setWriteAvailableCallback(MQTTProtocol_writeAvailable);
+#if !defined(NO_PERSISTENCE)
+		MQTTPersistenceWriter_setWrittenCallback(MQTTAsync_persistenceWritten);
+#endif
 		MQTTAsync_handles = ListInitialize();
-		MQTTAsync_commands = ListInitialize();
+		MQTTAsync_readyClients = ListInitialize();
+		MQTTAsync_sendBatchClients = ListInitialize();
 #if defined(OPENSSL)
 		SSLSocket_initialize();
 #endif
@@ -412,6 +450,7 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
+	m->commands = ListInitialize();
 	m->responses = ListInitialize();
 	ListAppend(MQTTAsync_handles, m, sizeof(MQTTAsyncs));
 
@@ -446,6 +485,10 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 		memcpy(m->createOptions, options, sizeof(MQTTAsync_createOptions));
 		if (options->struct_version > 0)
 			m->c->MQTTVersion = options->MQTTVersion;
+		if (options->struct_version >= 7)
+			m->c->durability = options->persistenceDurability;
+		if (options->struct_version >= 8)
+			m->c->maxQueuedWrites = options->maxQueuedPersistenceWrites;
 	}
 
 #if !defined(NO_PERSISTENCE)
@@ -463,6 +506,7 @@ int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const
 				MQTTPersistence_restoreMessageQueue(m->c);
 			}
 		}
+		MQTTPersistence_freeIndex(m->c);
 	}
 #endif
 	ListAppend(bstate->clients, m->c, sizeof(Clients) + 3*sizeof(List));
@@ -495,12 +539,20 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 		goto exit;
 
 	MQTTAsync_closeSession(m->c, MQTTREASONCODE_SUCCESS, NULL);
+	MQTTAsync_cancelDelivery(m);
 
 	MQTTAsync_NULLPublishResponses(m);
 	MQTTAsync_freeResponses(m);
 	MQTTAsync_NULLPublishCommands(m);
+#if !defined(NO_PERSISTENCE)
+	MQTTAsync_persistIndex(m); /* while the commands are still queued */
+#endif
 	MQTTAsync_freeCommands(m);
+	ListFree(m->commands);
 	ListFree(m->responses);
+	MQTTProtocol_emptyMsgIds(&m->commandIds);
+	MQTTProtocol_emptyMsgIds(&m->responseIds);
+	MQTTAsync_cancelTimeouts(m);
 
 	if (m->c)
 	{
@@ -535,6 +587,7 @@ void MQTTAsync_destroy(MQTTAsync* handle)
 		free(m->willProps);
 		m->willProps = NULL;
 	}
+	ListDetach(MQTTAsync_sendBatchClients, m);
 	if (!ListRemove(MQTTAsync_handles, m))
 		Log(LOG_ERROR, -1, "free error");
 	*handle = NULL;
@@ -665,6 +718,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 		receiveThread_state = STARTING;
 		Paho_thread_start(MQTTAsync_receiveThread, handle);
 	}
+	MQTTAsync_startCallbackThreads(m);
 	if (locked)
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
 
@@ -911,7 +965,7 @@ int MQTTAsync_connect(MQTTAsync handle, const MQTTAsync_connectOptions* options)
 	}
 
 	/* Add connect request to operation queue */
-	if ((conn = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((conn = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -952,13 +1006,14 @@ int MQTTAsync_reconnect(MQTTAsync handle)
 			m->currentIntervalBase = m->minRetryInterval;
 			m->currentInterval = m->minRetryInterval;
 			m->retrying = 1;
+			MQTTAsync_scheduleTimeouts(m);
 			rc = MQTTASYNC_SUCCESS;
 		}
 	}
 	else
 	{
 		/* to reconnect, put the connect command to the head of the command queue */
-		MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
+		MQTTAsync_queuedCommand* conn = Pool_malloc(sizeof(MQTTAsync_queuedCommand));
 		if (!conn)
 		{
 			rc = PAHO_MEMORY_ERROR;
@@ -1030,7 +1085,7 @@ int MQTTAsync_subscribeMany(MQTTAsync handle, int count, char* const* topic, con
 		goto exit;
 
 	/* Add subscribe request to operation queue */
-	if ((sub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((sub = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1149,7 +1204,7 @@ int MQTTAsync_unsubscribeMany(MQTTAsync handle, int count, char* const* topic, M
 		goto exit;
 
 	/* Add unsubscribe request to operation queue */
-	if ((unsub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((unsub = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -1195,15 +1250,15 @@ int MQTTAsync_unsubscribe(MQTTAsync handle, const char* topic, MQTTAsync_respons
 }
 
 
-int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload,
-							 int qos, int retained, MQTTAsync_responseOptions* response)
+/**
+ * Check whether a client is in a state to accept messages for publication.
+ * @param m the client
+ * @return ::MQTTASYNC_SUCCESS or the reason the messages can't be accepted
+ */
+static int MQTTAsync_checkSendState(MQTTAsyncs* m)
 {
 	int rc = MQTTASYNC_SUCCESS;
-	MQTTAsyncs* m = handle;
-	MQTTAsync_queuedCommand* pub;
-	int msgid = 0;
 
-	FUNC_ENTRY;
 	if (m == NULL || m->c == NULL)
 		rc = MQTTASYNC_FAILURE;
 	else if (m->c->connected == 0)
@@ -1215,20 +1270,26 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		else if (m->shouldBeConnected == 0 && (m->createOptions->struct_version < 2 || m->createOptions->allowDisconnectedSendAtAnyTime == 0))
 			rc = MQTTASYNC_DISCONNECTED;
 	}
+	return rc;
+}
 
-	if (rc != MQTTASYNC_SUCCESS)
-		goto exit;
+
+/**
+ * Check the parameters of one message for publication.
+ * @param m the client
+ * @param destinationName the topic
+ * @param qos the qos
+ * @param response the response options, or NULL
+ * @return ::MQTTASYNC_SUCCESS or the reason the message can't be accepted
+ */
+static int MQTTAsync_checkSendParms(MQTTAsyncs* m, const char* destinationName, int qos, MQTTAsync_responseOptions* response)
+{
+	int rc = MQTTASYNC_SUCCESS;
 
 	if (!UTF8_validateString(destinationName))
 		rc = MQTTASYNC_BAD_UTF8_STRING;
 	else if (qos < 0 || qos > 2)
 		rc = MQTTASYNC_BAD_QOS;
-	else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
-		rc = MQTTASYNC_NO_MORE_MSGIDS;
-	else if (m->createOptions &&
-			(m->createOptions->struct_version < 2 || m->createOptions->deleteOldestMessages == 0) &&
-			(MQTTAsync_getNoBufferedMessages(m) >= m->createOptions->maxBufferedMessages))
-		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
 	else if (response)
 	{
 		if (m->c->MQTTVersion >= MQTTVERSION_5)
@@ -1242,20 +1303,81 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 				rc = MQTTASYNC_BAD_MQTT_OPTION;
 		}
 	}
+	return rc;
+}
 
-	if (rc != MQTTASYNC_SUCCESS)
+
+/**
+ * Check that there is room in the offline buffer for a number of messages.
+ * @param m the client
+ * @param count the number of messages to be added
+ * @param bytes the number of payload bytes in the messages to be added
+ * @return ::MQTTASYNC_SUCCESS or ::MQTTASYNC_MAX_BUFFERED_MESSAGES
+ */
+static int MQTTAsync_checkBufferSpace(MQTTAsyncs* m, int count, size_t bytes)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	size_t maxBytes = 0;
+
+	if (m->createOptions == NULL)
 		goto exit;
+	if (m->createOptions->struct_version >= 6)
+		maxBytes = m->createOptions->maxBufferedBytes;
+	if (maxBytes > 0 && bytes > maxBytes)
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES; /* too large to be buffered, whichever messages are deleted */
+	else if ((m->createOptions->struct_version < 2 || m->createOptions->deleteOldestMessages == 0) &&
+			(MQTTAsync_getNoBufferedMessages(m) + count > m->createOptions->maxBufferedMessages ||
+			(maxBytes > 0 && MQTTAsync_getNoBufferedBytes(m) + bytes > maxBytes)))
+		rc = MQTTASYNC_MAX_BUFFERED_MESSAGES;
+exit:
+	return rc;
+}
 
-	/* Add publish request to operation queue */
-	if ((pub = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
-	{
-		rc = PAHO_MEMORY_ERROR;
+
+/**
+ * Create a publish command, copying the topic and payload.
+ * @param m the client
+ * @param msgid the message id, which is also the token
+ * @param destinationName the topic
+ * @param payloadlen the length of the payload
+ * @param payload the payload
+ * @param owned boolean - is the payload taken over by the command, rather than copied?
+ * @param qos the qos
+ * @param retained the retained flag
+ * @param response the response options, or NULL.  The token is set in it.
+ * @return the command, or NULL if memory couldn't be allocated
+ */
+static MQTTAsync_queuedCommand* MQTTAsync_newPublish(MQTTAsyncs* m, int msgid, const char* destinationName,
+		int payloadlen, const void* payload, int owned, int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	MQTTAsync_queuedCommand* pub = NULL;
+
+	if ((pub = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 		goto exit;
-	}
 	memset(pub, '\0', sizeof(MQTTAsync_queuedCommand));
 	pub->client = m;
 	pub->command.type = PUBLISH;
 	pub->command.token = msgid;
+	if ((pub->command.details.pub.destinationName = MQTTStrdup(destinationName)) == NULL)
+	{
+		Pool_free(pub, sizeof(MQTTAsync_queuedCommand));
+		pub = NULL;
+		goto exit;
+	}
+	pub->command.details.pub.payloadlen = payloadlen;
+	if (owned)
+		pub->command.details.pub.payload = (void*)payload; /* freed with the command from now on */
+	else if ((pub->command.details.pub.payload = malloc(payloadlen)) == NULL)
+	{
+		free(pub->command.details.pub.destinationName);
+		Pool_free(pub, sizeof(MQTTAsync_queuedCommand));
+		pub = NULL;
+		goto exit;
+	}
+	else
+		memcpy(pub->command.details.pub.payload, payload, payloadlen);
+	pub->command.details.pub.qos = qos;
+	pub->command.details.pub.retained = retained;
 	if (response)
 	{
 		pub->command.onSuccess = response->onSuccess;
@@ -1267,26 +1389,150 @@ int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen
 		if (m->c->MQTTVersion >= MQTTVERSION_5)
 			pub->command.properties = MQTTProperties_copy(&response->properties);
 	}
-	if ((pub->command.details.pub.destinationName = MQTTStrdup(destinationName)) == NULL)
+exit:
+	return pub;
+}
+
+
+/**
+ * Publish a message, copying the payload or taking it over
+ * @param owned boolean - is the payload taken over, rather than copied?  If so, it is freed
+ * by the library whether or not the message is accepted
+ */
+static int MQTTAsync_send1(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload,
+							 int owned, int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	MQTTAsync_queuedCommand* pub;
+	int msgid = 0;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTAsync_checkSendState(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	if ((rc = MQTTAsync_checkSendParms(m, destinationName, qos, response)) != MQTTASYNC_SUCCESS)
+		;
+	else if (qos > 0 && (msgid = MQTTAsync_assignMsgId(m)) == 0)
+		rc = MQTTASYNC_NO_MORE_MSGIDS;
+	else
+		rc = MQTTAsync_checkBufferSpace(m, 1, (payloadlen > 0) ? (size_t)payloadlen : 0);
+
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	/* Add publish request to operation queue */
+	if ((pub = MQTTAsync_newPublish(m, msgid, destinationName, payloadlen, payload, owned, qos, retained, response)) == NULL)
 	{
-		free(pub);
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
-	pub->command.details.pub.payloadlen = payloadlen;
-	if ((pub->command.details.pub.payload = malloc(payloadlen)) == NULL)
+	owned = 0; /* the payload belongs to the command now, even if adding it fails */
+	rc = MQTTAsync_addCommand(pub, sizeof(pub));
+
+exit:
+	if (owned)
+		free((void*)payload);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+int MQTTAsync_send(MQTTAsync handle, const char* destinationName, int payloadlen, const void* payload,
+							 int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	return MQTTAsync_send1(handle, destinationName, payloadlen, payload, 0, qos, retained, response);
+}
+
+
+int MQTTAsync_sendBuffer(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload,
+							 int qos, int retained, MQTTAsync_responseOptions* response)
+{
+	return MQTTAsync_send1(handle, destinationName, payloadlen, payload, 1, qos, retained, response);
+}
+
+
+int MQTTAsync_sendMany(MQTTAsync handle, int count, char* const* destinationNames, const MQTTAsync_message* msgs,
+		MQTTAsync_responseOptions* responses)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+	MQTTAsync_queuedCommand** pubs = NULL;
+	int* msgids = NULL;
+	int qos_count = 0;
+	size_t bytes = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTAsync_checkSendState(m)) != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (count <= 0 || destinationNames == NULL || msgs == NULL)
+	{
+		rc = MQTTASYNC_NULL_PARAMETER;
+		goto exit;
+	}
+
+	/* check all the messages before any are accepted, so that the batch is accepted or not as a whole */
+	for (i = 0; i < count; ++i)
+	{
+		const MQTTAsync_message* msg = &msgs[i];
+
+		if (strncmp(msg->struct_id, "MQTM", 4) != 0 || (msg->struct_version != 0 && msg->struct_version != 1))
+			rc = MQTTASYNC_BAD_STRUCTURE;
+		else if (destinationNames[i] == NULL)
+			rc = MQTTASYNC_NULL_PARAMETER;
+		else
+			rc = MQTTAsync_checkSendParms(m, destinationNames[i], msg->qos, responses ? &responses[i] : NULL);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		if (msg->qos > 0)
+			++qos_count;
+		if (msg->payloadlen > 0)
+			bytes += msg->payloadlen;
+	}
+	if ((rc = MQTTAsync_checkBufferSpace(m, count, bytes)) != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	if ((pubs = malloc(sizeof(MQTTAsync_queuedCommand*) * count)) == NULL ||
+		(qos_count > 0 && (msgids = malloc(sizeof(int) * qos_count)) == NULL))
 	{
-		free(pub->command.details.pub.destinationName);
-		free(pub);
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
-	memcpy(pub->command.details.pub.payload, payload, payloadlen);
-	pub->command.details.pub.qos = qos;
-	pub->command.details.pub.retained = retained;
-	rc = MQTTAsync_addCommand(pub, sizeof(pub));
+	if (qos_count > 0 && MQTTAsync_assignMsgIds(m, msgids, qos_count) < qos_count)
+	{
+		rc = MQTTASYNC_NO_MORE_MSGIDS;
+		goto exit;
+	}
+
+	for (i = 0, qos_count = 0; i < count; ++i)
+	{
+		const MQTTAsync_message* msg = &msgs[i];
+		MQTTAsync_responseOptions* response = responses ? &responses[i] : NULL;
+
+		if (response && m->c->MQTTVersion >= MQTTVERSION_5)
+			response->properties = msg->properties;
+		if ((pubs[i] = MQTTAsync_newPublish(m, (msg->qos > 0) ? msgids[qos_count++] : 0, destinationNames[i],
+				msg->payloadlen, msg->payload, 0, msg->qos, msg->retained, response)) == NULL)
+		{
+			while (--i >= 0)
+			{
+				MQTTProperties_free(&pubs[i]->command.properties);
+				free(pubs[i]->command.details.pub.destinationName);
+				free(pubs[i]->command.details.pub.payload);
+				Pool_free(pubs[i], sizeof(MQTTAsync_queuedCommand));
+			}
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+	}
+	rc = MQTTAsync_addCommands(pubs, count, sizeof(MQTTAsync_queuedCommand));
 
 exit:
+	if (pubs)
+		free(pubs);
+	if (msgids)
+		free(msgids);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1351,6 +1597,8 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 	int rc = MQTTASYNC_SUCCESS;
 	MQTTAsyncs* m = handle;
 	ListElement* current = NULL;
+	int found = 0;
+	int i;
 
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -1361,15 +1609,24 @@ int MQTTAsync_isComplete(MQTTAsync handle, MQTTAsync_token dt)
 		goto exit;
 	}
 
-	/* First check unprocessed commands */
+	/* First check unprocessed commands, including those restored but not yet queued */
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
 	current = NULL;
-	while (ListNextElement(MQTTAsync_commands, &current))
+	while (ListNextElement(m->commands, &current))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (cmd->client == m && cmd->command.token == dt)
-			goto exit;
+		if (cmd->command.token == dt)
+			break;
 	}
+	for (i = m->restore_next; current == NULL && i < m->restore_count; ++i)
+	{
+		if (m->restore_entries[i].token == dt)
+			found = 1;
+	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (current || found)
+		goto exit;
 
 	/* Now check the inflight messages */
 	if (m->c && m->c->outboundMsgs->count > 0)
@@ -1439,12 +1696,28 @@ exit:
 }
 
 
+int MQTTAsync_getBufferedBytes(MQTTAsync handle, size_t* bytes)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	MQTTAsyncs* m = handle;
+
+	FUNC_ENTRY;
+	if (m == NULL || bytes == NULL)
+		rc = MQTTASYNC_FAILURE;
+	else
+		*bytes = MQTTAsync_getNoBufferedBytes(m);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 {
 	int rc = MQTTASYNC_SUCCESS;
 	MQTTAsyncs* m = handle;
 	ListElement* current = NULL;
 	int count = 0;
+	int i;
 
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -1458,11 +1731,16 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 	}
 
 	/* calculate the number of pending tokens - commands plus inflight */
-	while (ListNextElement(MQTTAsync_commands, &current))
+	while (ListNextElement(m->commands, &current))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (cmd->client == m && cmd->command.type == PUBLISH)
+		if (cmd->command.type == PUBLISH)
+			count++;
+	}
+	for (i = m->restore_next; i < m->restore_count; ++i)
+	{
+		if (m->restore_entries[i].type == PUBLISH)
 			count++;
 	}
 	if (m->c)
@@ -1479,13 +1757,18 @@ int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens)
 	/* First add the unprocessed commands to the pending tokens */
 	current = NULL;
 	count = 0;
-	while (ListNextElement(MQTTAsync_commands, &current))
+	while (ListNextElement(m->commands, &current))
 	{
 		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (cmd->client == m  && cmd->command.type == PUBLISH)
+		if (cmd->command.type == PUBLISH)
 			(*tokens)[count++] = cmd->command.token;
 	}
+	for (i = m->restore_next; i < m->restore_count; ++i)
+	{
+		if (m->restore_entries[i].type == PUBLISH)
+			(*tokens)[count++] = m->restore_entries[i].token;
+	}
 
 	/* Now add the inflight messages */
 	if (m->c && m->c->outboundMsgs->count > 0)
@@ -1820,7 +2103,7 @@ void MQTTAsync_freeMessage(MQTTAsync_message** message)
 {
 	FUNC_ENTRY;
 	MQTTProperties_free(&(*message)->properties);
-	free((*message)->payload);
+	MQTTAsync_freePayload(*message);
 	free(*message);
 	*message = NULL;
 	FUNC_EXIT;
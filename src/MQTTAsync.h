@@ -939,15 +939,26 @@ LIBMQTT_API int MQTTAsync_reconnect(MQTTAsync handle);
  * storage and provides some protection against message loss in the case of
  * unexpected failure.
  * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use file system-based persistence which
+ * appends records to segment files instead of writing a file for each
+ * message.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY: Keep messages in memory, and write any
+ * left to a snapshot file when the client is destroyed, to be restored when it
+ * is next created.
+ * <br>
  * ::MQTTCLIENT_PERSISTENCE_USER: Use an application-specific persistence
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
- * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
+ * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT and
+ * ::MQTTCLIENT_PERSISTENCE_LOG persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * For ::MQTTCLIENT_PERSISTENCE_MEMORY persistence, it is the location of the
+ * directory for the snapshot file, or NULL for no snapshot.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTASYNC_SUCCESS if the client is successfully created, otherwise
@@ -961,10 +972,16 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQCO. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0, 1, 2 or 3
+	/** The version number of this structure.  Must be 0, 1, 2, 3, 4, 5, 6, 7 or 8.
 	 * 0 means no MQTTVersion
-	 * 1 means no allowDisconnectedSendAtAnyTime, deleteOldestMessages, restoreMessages
-	 * 2 means no persistQoS0
+	 * 1 adds MQTTVersion
+	 * 2 adds allowDisconnectedSendAtAnyTime, deleteOldestMessages, restoreMessages, persistQoS0
+	 * 3 adds maxPacketsPerRead
+	 * 4 adds callbackThreads
+	 * 5 adds zeroCopyReceive
+	 * 6 adds maxBufferedBytes
+	 * 7 adds persistenceDurability, groupCommitWindow
+	 * 8 adds maxQueuedPersistenceWrites
 	 */
 	int struct_version;
 	/** Whether to allow messages to be sent when the client library is not connected. */
@@ -995,11 +1012,90 @@ typedef struct
 	 * Persist QoS0 publish commands - an option to not persist them.
 	 */
 	int persistQoS0;
+	/**
+	 * The maximum number of incoming packets to process for this client, one after the
+	 * other, when they have already been read from the network.  Further packets are left
+	 * until the other clients' sockets have been checked, so one busy connection can't
+	 * starve the others.  1, the default, processes one packet each time the socket is
+	 * found to be ready.  Larger values handle bursts, such as a flood of retained messages
+	 * after a subscribe, with fewer passes through the receive loop.
+	 */
+	int maxPacketsPerRead;
+	/**
+	 * The number of callback threads to use to call the messageArrived callback for this
+	 * client.  0, the default, calls messageArrived on the thread which reads from the network,
+	 * so a slow callback holds up the network processing for all clients.  If greater than 0,
+	 * incoming messages are queued and messageArrived is called on a pool of callback threads,
+	 * without the library's internal lock held.  Messages for one client are still delivered
+	 * one at a time, in the order they arrived.  The pool is shared between all clients, and
+	 * has as many threads as the largest number requested, up to MQTTASYNC_MAX_CALLBACK_THREADS.
+	 */
+	int callbackThreads;
+	/**
+	 * Whether the payloads of incoming messages are left in the buffer the packet was read
+	 * into, rather than copied.  0, the default, copies each payload.  If 1, the buffer is
+	 * handed over to the message, and released when the message is freed, so the payload must
+	 * only be freed with MQTTAsync_freeMessage(), never on its own.  Large payloads, which cost
+	 * the most to copy, then take no copies on their way to messageArrived.  Small payloads,
+	 * and those of QoS 2 messages, which have to be kept until the PUBREL is received, are
+	 * still copied.  When the buffer is handed over, the MQTT V5 properties of the message
+	 * are taken from the incoming packet too, rather than copied.
+	 */
+	int zeroCopyReceive;
+	/**
+	 * The maximum number of payload bytes allowed to be buffered, as maxBufferedMessages
+	 * limits the number of messages.  0, the default, means no limit.  When the limit would be
+	 * exceeded, the newest message is rejected, or the oldest messages deleted, as set by
+	 * deleteOldestMessages.  A message with a payload larger than the limit is always rejected.
+	 * The payloads of buffered messages which have been written to persistence are counted too.
+	 * See MQTTAsync_getBufferedBytes().
+	 */
+	size_t maxBufferedBytes;
+	/**
+	 * How soon records written to persistence reach stable storage: one of
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_NONE, ::MQTTCLIENT_PERSISTENCE_DURABILITY_OS or
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC.  0, the default, is the same as
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_OS.  With ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC,
+	 * the records for QoS 1 and 2 messages are forced to stable storage before the packets
+	 * which depend on them are sent, so that messages are not lost if the system fails.
+	 * With ::MQTTCLIENT_PERSISTENCE_LOG, all the records persisted for the packets written
+	 * together are committed with one sync.
+	 */
+	int persistenceDurability;
+	/**
+	 * With ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC, the number of milliseconds to keep
+	 * collecting packets to be sent, once one is waiting for a commit, so that more records
+	 * share each sync.  0, the default, commits whenever the send thread runs out of
+	 * commands to process.  Larger values mean fewer syncs for a stream of messages, at the
+	 * cost of each message being sent up to this much later.
+	 */
+	int groupCommitWindow;
+	/**
+	 * The number of writes to persistence which can be queued for a writer thread.  0, the
+	 * default, writes to persistence on the thread which needs the write, so a slow disk
+	 * holds up the application's calls and the library's network processing.  If greater
+	 * than 0, writes are copied to a queue and carried out in order on a thread of the
+	 * client's own.  Calls which need a write only wait when the queue is full, and then before
+	 * taking any of the library's locks, so network processing carries on.  Packets
+	 * which depend on queued writes, such as a QoS 1 or 2 PUBLISH or a PUBREC, are held back
+	 * until the writes are done - and synced, with ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC -
+	 * while other clients, and reading from the network, carry on.  If a queued write, or
+	 * its sync, fails, the packets held for it are never sent: sending them fails, as it
+	 * would if the write had failed on the sending thread.  The error is kept until the client
+	 * is destroyed, so later writes fail straight away.
+	 */
+	int maxQueuedPersistenceWrites;
 } MQTTAsync_createOptions;
 
-#define MQTTAsync_createOptions_initializer  { {'M', 'Q', 'C', 'O'}, 2, 0, 100, MQTTVERSION_DEFAULT, 0, 0, 1, 1}
+#define MQTTAsync_createOptions_initializer  { {'M', 'Q', 'C', 'O'}, 8, 0, 100, MQTTVERSION_DEFAULT, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0}
 
-#define MQTTAsync_createOptions_initializer5 { {'M', 'Q', 'C', 'O'}, 2, 0, 100, MQTTVERSION_5, 0, 0, 1, 1}
+#define MQTTAsync_createOptions_initializer5 { {'M', 'Q', 'C', 'O'}, 8, 0, 100, MQTTVERSION_5, 0, 0, 1, 1, 1, 0, 0, 0, 0, 0, 0}
+
+/**
+ * The maximum number of threads in the pool used for messageArrived callbacks.
+ * See MQTTAsync_createOptions.callbackThreads.
+ */
+#define MQTTASYNC_MAX_CALLBACK_THREADS 16
 
 
 LIBMQTT_API int MQTTAsync_createWithOptions(MQTTAsync* handle, const char* serverURI, const char* clientId,
@@ -1617,6 +1713,54 @@ LIBMQTT_API int MQTTAsync_send(MQTTAsync handle, const char* destinationName, in
   */
 LIBMQTT_API int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationName, const MQTTAsync_message* msg, MQTTAsync_responseOptions* response);
 
+/**
+  * This function publishes a message as MQTTAsync_send() does, but takes over the payload
+  * buffer rather than copying it.  The buffer must have been allocated with
+  * MQTTAsync_malloc(), and belongs to the library once this function is called, whether or
+  * not the message is accepted: the library frees it when it is no longer needed, which is
+  * once the message has been written for QoS 0, or acknowledged for QoS 1 and 2, or
+  * sooner, once it has been written to persistence.  The application must not change or
+  * free it.  The payload passed to the onSuccess callback is not necessarily this buffer:
+  * if the message was persisted, the buffer may have been freed, and the payload read back
+  * from persistence, when the message is sent.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param destinationName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the payload of the message, allocated with MQTTAsync_malloc().
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param response A pointer to an ::MQTTAsync_responseOptions structure. Used to set callback functions.
+  * This is optional and can be set to NULL.
+  * @return ::MQTTASYNC_SUCCESS if the message is accepted for publication.
+  * An error code is returned if there was a problem accepting the message.
+  */
+LIBMQTT_API int MQTTAsync_sendBuffer(MQTTAsync handle, const char* destinationName, int payloadlen, void* payload, int qos,
+		int retained, MQTTAsync_responseOptions* response);
+
+/**
+  * This function attempts to publish a set of messages (see also
+  * ::MQTTAsync_sendMessage()). The messages are accepted or rejected as a whole,
+  * and are queued for sending together, which is cheaper than calling
+  * ::MQTTAsync_sendMessage() once for each of them.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param count The number of messages to be published.
+  * @param destinationNames An array (of length <i>count</i>) of pointers to the
+  * topics associated with the messages.
+  * @param msgs An array (of length <i>count</i>) of valid MQTTAsync_message
+  * structures containing the payloads and attributes of the messages.
+  * @param responses An array (of length <i>count</i>) of ::MQTTAsync_responseOptions
+  * structures, one for each message. Used to set callback functions, and the token
+  * for each message is returned in its structure. This is optional and can be set to NULL.
+  * @return ::MQTTASYNC_SUCCESS if the messages are accepted for publication.
+  * An error code is returned if there was a problem accepting the messages, in which
+  * case none of them have been accepted, with one exception: if persisting a message
+  * fails the others are still queued, as for ::MQTTAsync_sendMessage().
+  */
+LIBMQTT_API int MQTTAsync_sendMany(MQTTAsync handle, int count, char* const* destinationNames, const MQTTAsync_message* msgs,
+		MQTTAsync_responseOptions* responses);
+
 
 /**
   * This function sets a pointer to an array of tokens for
@@ -1638,6 +1782,18 @@ LIBMQTT_API int MQTTAsync_sendMessage(MQTTAsync handle, const char* destinationN
   */
 LIBMQTT_API int MQTTAsync_getPendingTokens(MQTTAsync handle, MQTTAsync_token **tokens);
 
+/**
+  * This function gets the number of payload bytes in the messages buffered for sending,
+  * which are limited by MQTTAsync_createOptions.maxBufferedBytes.  Messages which have
+  * been sent, but not yet acknowledged, are not counted.
+  * @param handle A valid client handle from a successful call to
+  * MQTTAsync_create().
+  * @param bytes The address of a variable which is set to the number of bytes.
+  * @return ::MQTTASYNC_SUCCESS if the function returns successfully.
+  * An error code is returned if there was a problem getting the number of bytes.
+  */
+LIBMQTT_API int MQTTAsync_getBufferedBytes(MQTTAsync handle, size_t* bytes);
+
 /**
  * Tests whether a request corresponding to a token is complete.
  *
@@ -1779,6 +1935,11 @@ LIBMQTT_API const char* MQTTAsync_strerror(int code);
   * for individual requests, in the ::MQTTAsync_responseOptions structure.  Applications
   * can be written as a chain of callback functions.
   *
+  * By default the message arrived callback is called on the thread which reads from the
+  * network, so a callback which takes a long time delays the network processing for all
+  * clients.  Setting MQTTAsync_createOptions.callbackThreads calls it on a separate pool
+  * of callback threads instead, still one message at a time and in order for each client.
+  *
   * @page callbacks Callbacks
   * Any function from this API may be used within a callback.  It is not advisable to
   * use ::MQTTAsync_waitForCompletion within a callback, however, as it is the only
@@ -33,16 +33,18 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 #include "OsWrapper.h"
 #include "WebSocket.h"
 #include "Proxy.h"
 
-static int clientSockCompare(void* a, void* b);
 static int MQTTAsync_checkConn(MQTTAsync_command* command, MQTTAsyncs* client, int was_connected);
 #if !defined(NO_PERSISTENCE)
 static int MQTTAsync_unpersistCommand(MQTTAsync_queuedCommand* qcmd);
 static int MQTTAsync_persistCommand(MQTTAsync_queuedCommand* qcmd);
 static MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int buflen, int MQTTVersion, MQTTAsync_queuedCommand*);
+static void MQTTAsync_queueRestored(MQTTAsyncs* m);
+static int MQTTAsync_dropRestoreEntry(MQTTAsyncs* m);
 #endif
 static void MQTTAsync_startConnectRetry(MQTTAsyncs* m);
 static void MQTTAsync_checkDisconnect(MQTTAsync handle, MQTTAsync_command* command);
@@ -51,10 +53,11 @@ static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command);
 static void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command);
 static int MQTTAsync_processCommand(void);
 static void MQTTAsync_checkTimeouts(void);
+static void MQTTAsync_checkClientTimeouts(MQTTAsyncs* m);
+static ELAPSED_TIME_TYPE MQTTAsync_timeoutInterval(START_TIME_TYPE start, ELAPSED_TIME_TYPE timeout);
 static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack);
 static void MQTTAsync_stop(void);
 static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode, MQTTProperties* props);
-static int clientStructCompare(void* a, void* b);
 static int MQTTAsync_cleanSession(Clients* client);
 static int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topicLen, MQTTAsync_message* mm);
 static int MQTTAsync_disconnect_internal(MQTTAsync handle, int timeout);
@@ -62,6 +65,19 @@ static int cmdMessageIDCompare(void* a, void* b);
 static void MQTTAsync_retry(void);
 static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc);
 static int MQTTAsync_connecting(MQTTAsyncs* m);
+static int MQTTAsync_queueCommand(MQTTAsync_queuedCommand* command, ListElement* newel, int command_size, int at_head);
+static void MQTTAsync_detachCommand(MQTTAsync_queuedCommand* command);
+static int MQTTAsync_isHeadCommand(MQTTAsync_queuedCommand* command);
+static void MQTTAsync_wakeSendThread(MQTTAsyncs* m);
+static void MQTTAsync_startBatch(MQTTAsyncs* m, int* batch);
+static void MQTTAsync_endBatch(MQTTAsyncs* m, int* batch);
+static int MQTTAsync_endSendBatches(int force);
+static void MQTTAsync_completeCoalesced(MQTTAsyncs* m, int rc);
+static int MQTTAsync_usesCallbackThreads(MQTTAsyncs* m);
+static void MQTTAsync_scheduleDelivery(MQTTAsyncs* m);
+static void MQTTAsync_deliverQueued(MQTTAsyncs* m);
+static int MQTTAsync_isCallbackThread(thread_id_type thread_id);
+static int MQTTAsync_bufferOverfull(MQTTAsyncs* m);
 
 extern MQTTProtocol state; /* defined in MQTTAsync.c */
 extern ClientStates* bstate; /* defined in MQTTAsync.c */
@@ -73,9 +89,27 @@ extern thread_id_type sendThread_id,
 
 extern volatile int global_initialized;
 extern List* MQTTAsync_handles;
-extern List* MQTTAsync_commands;
+extern List* MQTTAsync_readyClients;
+extern List* MQTTAsync_sendBatchClients;
 extern int MQTTAsync_tostop;
 
+static List* MQTTAsync_deliveryClients = NULL; /* clients with messages waiting for a callback thread */
+static sem_type callback_sem = NULL; /* posted when a client is added to MQTTAsync_deliveryClients */
+static int callbackThreads_count = 0; /* the number of callback threads started and not yet ended */
+static thread_id_type callbackThread_ids[MQTTASYNC_MAX_CALLBACK_THREADS];
+
+#if !defined(MQTTASYNC_SEND_BATCH_COMMANDS)
+#define MQTTASYNC_SEND_BATCH_COMMANDS 100 /* the send thread writes its coalesced packets at least this often */
+#endif
+
+#if !defined(MQTTASYNC_RESTORE_WINDOW)
+#define MQTTASYNC_RESTORE_WINDOW 1000 /* commands restored from the persistence index are queued this many at a time */
+#endif
+
+#define MQTTASYNC_TIMEOUT_INTERVAL 3000 /* milliseconds between checks of a connect, disconnect or reconnect in progress */
+
+static Timers timeout_timers; /* MQTTAsyncs.timeoutTimer for each client with a connect, disconnect or reconnect in progress */
+
 #if defined(_WIN32) || defined(_WIN64)
 	#if defined(_MSC_VER) && _MSC_VER < 1900
 		#define snprintf _snprintf
@@ -83,7 +117,6 @@ extern int MQTTAsync_tostop;
 extern mutex_type mqttasync_mutex;
 extern mutex_type socket_mutex;
 extern mutex_type mqttcommand_mutex;
-extern sem_type send_sem;
 #if !defined(NO_HEAP_TRACKING)
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
@@ -93,8 +126,8 @@ extern mutex_type log_mutex;
 extern mutex_type mqttasync_mutex;
 extern mutex_type socket_mutex;
 extern mutex_type mqttcommand_mutex;
-extern cond_type send_cond;
 #endif
+extern sem_type send_sem;
 
 #if !defined(min)
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -150,19 +183,6 @@ int MQTTAsync_randomJitter(int currentIntervalBase, int minInterval, int maxInte
 }
 
 
-/**
- * List callback function for comparing clients by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
- */
-static int clientSockCompare(void* a, void* b)
-{
-	MQTTAsyncs* m = (MQTTAsyncs*)a;
-	return m->c->net.socket == *(int*)b;
-}
-
-
 void MQTTAsync_lock_mutex(mutex_type amutex)
 {
 	int rc = Paho_thread_lock_mutex(amutex);
@@ -204,12 +224,17 @@ void MQTTAsync_terminate(void)
 	/* don't destroy global data if a new client was created while waiting for background threads to terminate */
 	if (global_initialized && bstate->clients->count == 0)
 	{
-		ListElement* elem = NULL;
 		ListFree(bstate->clients);
 		ListFree(MQTTAsync_handles);
-		while (ListNextElement(MQTTAsync_commands, &elem))
-			MQTTAsync_freeCommand1((MQTTAsync_queuedCommand*)(elem->content));
-		ListFree(MQTTAsync_commands);
+		ListFreeNoContent(MQTTAsync_readyClients); /* the clients themselves have already been freed */
+		MQTTAsync_readyClients = NULL;
+		ListFreeNoContent(MQTTAsync_sendBatchClients);
+		MQTTAsync_sendBatchClients = NULL;
+		if (MQTTAsync_deliveryClients)
+		{
+			ListFreeNoContent(MQTTAsync_deliveryClients);
+			MQTTAsync_deliveryClients = NULL;
+		}
 		MQTTAsync_handles = NULL;
 		WebSocket_terminate();
 		#if !defined(NO_HEAP_TRACKING)
@@ -222,6 +247,260 @@ void MQTTAsync_terminate(void)
 }
 
 
+/**
+ * Get the message id a command holds while it is queued or waiting for a response
+ * @param command the command
+ * @return the message id, or 0 if the command doesn't hold one
+ */
+static int MQTTAsync_commandMsgId(MQTTAsync_queuedCommand* command)
+{
+	int type = command->command.type;
+
+	return (type == PUBLISH || type == SUBSCRIBE || type == UNSUBSCRIBE) ? command->command.token : 0;
+}
+
+
+/**
+ * Add a command to its client's command queue, and make sure the client is on the list
+ * of clients served by the send thread.  Must be called with mqttcommand_mutex locked.
+ * @param command the command to add
+ * @param newel list element allocated by the caller for a tail add, or NULL
+ * @param command_size the size of the command, for heap tracking
+ * @param at_head boolean - add the command to the head of the queue, rather than the tail
+ * @return boolean - whether the send thread needs to be woken to see the command.  Commands
+ * added behind others can't be processed until those before them have been.
+ */
+static int MQTTAsync_queueCommand(MQTTAsync_queuedCommand* command, ListElement* newel, int command_size, int at_head)
+{
+	MQTTAsyncs* m = command->client;
+	int rc = at_head;
+
+	if (m->commands->count == 0)
+	{
+		ListAppend(MQTTAsync_readyClients, m, sizeof(MQTTAsyncs));
+		rc = 1;
+	}
+	if (at_head)
+		ListInsert(m->commands, command, command_size, m->commands->first);
+	else if (newel)
+		ListAppendNoMalloc(m->commands, command, newel, command_size);
+	else
+		ListAppend(m->commands, command, command_size);
+	MQTTProtocol_addMsgId(&m->commandIds, MQTTAsync_commandMsgId(command));
+	return rc;
+}
+
+
+/**
+ * Remove a command from its client's command queue, without freeing it.  The client is
+ * taken off the list of clients served by the send thread when it has no more commands.
+ * @param command the command to remove
+ */
+static void MQTTAsync_detachCommand(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	ListDetach(m->commands, command);
+	MQTTProtocol_removeMsgId(&m->commandIds, MQTTAsync_commandMsgId(command));
+	if (m->commands->count == 0)
+		ListDetach(MQTTAsync_readyClients, m);
+#if !defined(NO_PERSISTENCE)
+	if (command->restored && --m->restores_queued < MQTTASYNC_RESTORE_WINDOW / 2 && m->restore_next < m->restore_count)
+		MQTTAsync_queueRestored(m); /* keep restored commands ahead of any added since */
+#endif
+}
+
+
+/**
+ * Add a command to its client's list of commands waiting for a response.
+ * Must be called with mqttasync_mutex locked.
+ * @param command the command to add
+ */
+static void MQTTAsync_appendResponse(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+
+	ListAppend(m->responses, command, sizeof(command));
+	MQTTProtocol_addMsgId(&m->responseIds, MQTTAsync_commandMsgId(command));
+	if (command->coalesced)
+		m->coalesced_publishes++;
+}
+
+
+/**
+ * Remove a command from its client's list of commands waiting for a response, without freeing it.
+ * Must be called with mqttasync_mutex locked.
+ * @param command the command to remove
+ * @return boolean - whether the command was found in the list
+ */
+static int MQTTAsync_detachResponse(MQTTAsync_queuedCommand* command)
+{
+	MQTTAsyncs* m = command->client;
+	int rc = 0;
+
+	if ((rc = ListDetach(m->responses, command)) != 0)
+	{
+		MQTTProtocol_removeMsgId(&m->responseIds, MQTTAsync_commandMsgId(command));
+		if (command->coalesced)
+			m->coalesced_publishes--;
+	}
+	return rc;
+}
+
+
+/**
+ * Wake the send thread if a client has commands queued.  They may have been blocked on
+ * something that has just changed, such as an ack freeing an inflight slot.
+ * Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+static void MQTTAsync_wakeSendThread(MQTTAsyncs* m)
+{
+	int wake = 0;
+
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	wake = (m->commands->count > 0);
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	if (wake)
+		Thread_post_sem(send_sem);
+}
+
+
+/**
+ * Start a batch of writes for a client on behalf of the send or receive thread, so that the
+ * packets written are coalesced.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ * @param batch the thread's batch flag for the client: &m->send_batch or &m->receive_batch
+ */
+static void MQTTAsync_startBatch(MQTTAsyncs* m, int* batch)
+{
+	if (*batch == 0)
+	{
+		*batch = 1;
+		MQTTPacket_startCoalescing(&m->c->net);
+	}
+}
+
+
+/**
+ * Add a client to those the send thread ends batches of writes for, and writes the packets
+ * held for persistence commits of.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+static void MQTTAsync_addSendBatchClient(MQTTAsyncs* m)
+{
+	if (ListFindItem(MQTTAsync_sendBatchClients, m, NULL) == NULL)
+		ListAppend(MQTTAsync_sendBatchClients, m, sizeof(MQTTAsyncs));
+}
+
+
+/**
+ * End a batch of writes started by MQTTAsync_startBatch, writing the packets coalesced if
+ * there is no other batch for the client.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ * @param batch the thread's batch flag for the client: &m->send_batch or &m->receive_batch
+ */
+static void MQTTAsync_endBatch(MQTTAsyncs* m, int* batch)
+{
+	if (*batch)
+	{
+		*batch = 0;
+		if (MQTTPacket_stopCoalescing(&m->c->net) == SOCKET_ERROR)
+		{
+			m->c->good = 0;
+			Log(TRACE_PROTOCOL, 29, NULL, m->c->clientID, m->c->net.socket, Socket_getpeer(m->c->net.socket));
+			MQTTProtocol_closeSession(m->c, 1);
+		}
+		else
+		{
+			if (m->c->net.commit_pending)
+				MQTTAsync_addSendBatchClient(m); /* the send thread writes the packets held */
+			MQTTAsync_completeCoalesced(m, 1);
+		}
+	}
+}
+
+
+/**
+ * Write the packets held back for a client until the persistence writes they depend on were
+ * done, if no batch of writes is open.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+static void MQTTAsync_flushCommitted(MQTTAsyncs* m)
+{
+	if (m->c->net.commit_pending && m->c->net.coalescing == 0)
+	{
+		if (MQTTPacket_flushCoalesced(&m->c->net) == SOCKET_ERROR)
+		{
+			m->c->good = 0;
+			Log(TRACE_PROTOCOL, 29, NULL, m->c->clientID, m->c->net.socket, Socket_getpeer(m->c->net.socket));
+			MQTTProtocol_closeSession(m->c, 1);
+		}
+		else
+			MQTTAsync_completeCoalesced(m, 1);
+	}
+}
+
+
+/**
+ * Called by a persistence writer thread when it has carried out writes, which packets might
+ * have been held back for.  The send thread writes them.
+ */
+void MQTTAsync_persistenceWritten(void)
+{
+	Thread_post_sem(send_sem);
+}
+
+
+/**
+ * End the send thread's batches of writes for all clients.  The batch of a client with a
+ * group commit window is kept open, while its packets have been waiting for a commit for
+ * less than the window, so that the records for more packets share the sync.
+ * Only the clients with a batch open are looked at.
+ * @param force whether to end all the batches, whatever the group commit windows
+ * @return the number of milliseconds until a batch kept open is due to be ended, or 0
+ */
+static int MQTTAsync_endSendBatches(int force)
+{
+	ListElement* current = NULL;
+	int due = 0;
+
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	current = MQTTAsync_sendBatchClients->first;
+	while (current)
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+
+		current = current->next; /* m may be removed from the list */
+		if (!force && m->send_batch && m->c->net.uncommitted && m->createOptions &&
+				m->createOptions->struct_version >= 7 && m->createOptions->groupCommitWindow > 0)
+		{
+			int window = m->createOptions->groupCommitWindow;
+			ELAPSED_TIME_TYPE elapsed = 0;
+
+			if (!m->commit_waiting)
+			{
+				m->commit_waiting = 1;
+				m->commit_wait_start = MQTTTime_start_clock();
+			}
+			if ((elapsed = MQTTTime_elapsed(m->commit_wait_start)) < (ELAPSED_TIME_TYPE)window)
+			{
+				if (due == 0 || window - (int)elapsed < due)
+					due = window - (int)elapsed;
+				continue;
+			}
+		}
+		m->commit_waiting = 0;
+		MQTTAsync_endBatch(m, &m->send_batch);
+		MQTTAsync_flushCommitted(m);
+		if (!m->c->net.commit_pending)
+			ListDetach(MQTTAsync_sendBatchClients, m); /* otherwise flushed on a later pass */
+	}
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	return due;
+}
+
+
 #if !defined(NO_PERSISTENCE)
 static int MQTTAsync_unpersistCommand(MQTTAsync_queuedCommand* qcmd)
 {
@@ -439,7 +718,7 @@ static MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int bufle
 
 	if (qcommand == NULL)
 	{
-		if ((qcommand = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+		if ((qcommand = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 			goto exit;
 		memset(qcommand, '\0', sizeof(MQTTAsync_queuedCommand));
 		qcommand->not_restored = 1; /* don't restore all the command on the first call */
@@ -593,12 +872,12 @@ static MQTTAsync_queuedCommand* MQTTAsync_restoreCommand(char* buffer, int bufle
 			MQTTProperties_read(&command->properties, &ptr, buffer + buflen) != 1)
 	{
 			Log(LOG_ERROR, -1, "Error restoring properties from persistence");
-			free(qcommand);
+			Pool_free(qcommand, sizeof(MQTTAsync_queuedCommand));
 			qcommand = NULL;
 	}
 	goto exit;
 error_exit:
-	free(qcommand);
+	Pool_free(qcommand, sizeof(MQTTAsync_queuedCommand));
 	qcommand = NULL;
 exit:
 	FUNC_EXIT;
@@ -615,6 +894,275 @@ static int cmpkeys(const void *p1, const void *p2)
 }
 
 
+/**
+ * Make the persistence key of a restore entry.
+ * @param entry the restore entry
+ * @param key the buffer for the key, of PERSISTENCE_MAX_KEY_LENGTH + 1 chars
+ * @return completion code
+ */
+static int MQTTAsync_restoreEntryKey(MQTTAsync_restoreEntry* entry, char* key)
+{
+	int rc = 0;
+	int chars = snprintf(key, PERSISTENCE_MAX_KEY_LENGTH + 1, "%s%u",
+		(entry->MQTTVersion >= MQTTVERSION_5) ? PERSISTENCE_V5_COMMAND_KEY : PERSISTENCE_COMMAND_KEY, entry->seqno);
+
+	if (chars >= PERSISTENCE_MAX_KEY_LENGTH + 1)
+	{
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+		Log(LOG_ERROR, 0, "Error writing %d chars with snprintf", chars);
+	}
+	return rc;
+}
+
+
+static void MQTTAsync_freeRestoreEntries(MQTTAsyncs* m)
+{
+	if (m->restore_entries)
+		free(m->restore_entries);
+	m->restore_entries = NULL;
+	m->restore_count = m->restore_next = 0;
+}
+
+
+/**
+ * Put the next restore entries of a client on its command queue, as commands which are read
+ * from persistence when they are processed, until a window of them is queued.  They go after
+ * any connect or disconnect at the head of the queue and the commands restored before them,
+ * but ahead of any commands added since the restore.  Must be called with mqttcommand_mutex
+ * locked.
+ * @param m the client
+ */
+static void MQTTAsync_queueRestored(MQTTAsyncs* m)
+{
+	ListElement* before = NULL;
+	int queued = 0;
+
+	FUNC_ENTRY;
+	while (ListNextElement(m->commands, &before))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(before->content);
+
+		if (!cmd->restored && !MQTTAsync_isHeadCommand(cmd))
+			break;
+	}
+	while (m->restore_next < m->restore_count && m->restores_queued < MQTTASYNC_RESTORE_WINDOW)
+	{
+		MQTTAsync_restoreEntry* entry = &m->restore_entries[m->restore_next];
+		MQTTAsync_queuedCommand* cmd = NULL;
+		char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
+
+		if (MQTTAsync_restoreEntryKey(entry, key) != 0)
+			break;
+		if ((cmd = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+			break;
+		memset(cmd, '\0', sizeof(MQTTAsync_queuedCommand));
+		if ((cmd->key = MQTTStrdup(key)) == NULL)
+		{
+			Pool_free(cmd, sizeof(MQTTAsync_queuedCommand));
+			break;
+		}
+		cmd->client = m;
+		cmd->seqno = entry->seqno;
+		cmd->not_restored = 1;
+		cmd->restored = 1;
+		cmd->command.type = entry->type;
+		cmd->command.token = entry->token;
+		if (entry->type == PUBLISH)
+		{
+			cmd->command.details.pub.payloadlen = entry->payloadlen;
+			cmd->command.details.pub.qos = entry->qos;
+		}
+		if (m->commands->count == 0)
+			ListAppend(MQTTAsync_readyClients, m, sizeof(MQTTAsyncs));
+		ListInsert(m->commands, cmd, sizeof(MQTTAsync_queuedCommand), before);
+		m->restore_next++;
+		m->restores_queued++;
+		queued++;
+	}
+	if (m->restore_next == m->restore_count)
+		MQTTAsync_freeRestoreEntries(m);
+	Log(TRACE_MINIMUM, -1, "%d restored commands queued for client %s", queued, m->c->clientID);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Delete the oldest PUBLISH in the restore entries of a client, because the buffer is over
+ * full and it is older than any PUBLISH on the command queue.  Must be called with
+ * mqttcommand_mutex locked.
+ * @param m the client
+ * @return boolean - whether a PUBLISH was deleted
+ */
+static int MQTTAsync_dropRestoreEntry(MQTTAsyncs* m)
+{
+	MQTTAsync_restoreEntry entry;
+	char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	for (i = m->restore_next; i < m->restore_count; ++i)
+	{
+		if (m->restore_entries[i].type == PUBLISH)
+			break;
+	}
+	if (i == m->restore_count)
+		goto exit;
+
+	entry = m->restore_entries[i];
+	if (MQTTAsync_restoreEntryKey(&entry, key) == 0 &&
+			m->c->persistence->premove(m->c->phandle, key) != 0)
+		Log(LOG_ERROR, 0, "Error removing command from persistence");
+	MQTTProtocol_removeMsgId(&m->commandIds, entry.token);
+	m->noBufferedMessages--;
+	m->noBufferedBytes -= entry.payloadlen;
+
+	/* keep the entries before it in order */
+	memmove(&m->restore_entries[m->restore_next + 1], &m->restore_entries[m->restore_next],
+		(i - m->restore_next) * sizeof(MQTTAsync_restoreEntry));
+	if (++m->restore_next == m->restore_count)
+		MQTTAsync_freeRestoreEntries(m);
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Restore the commands of a client from its persistence index, without reading them.  The
+ * index holds what is needed of each command until it is processed, when it is read in full.
+ * @param client the client
+ * @return completion code - if not success, the commands have to be read instead
+ */
+static int MQTTAsync_restoreIndexedCommands(MQTTAsyncs* client)
+{
+	int rc = 0;
+	Clients* c = client->c;
+	MQTTAsync_restoreEntry* entries = (MQTTAsync_restoreEntry*)c->pindex->commands;
+	int count = c->pindex->commandslen / (int)sizeof(MQTTAsync_restoreEntry);
+	int i;
+
+	FUNC_ENTRY;
+	if (c->pindex->commandslen % sizeof(MQTTAsync_restoreEntry) != 0)
+		rc = MQTTASYNC_PERSISTENCE_ERROR;
+	for (i = 0; rc == 0 && i < count; ++i)
+	{
+		if ((entries[i].type != PUBLISH && entries[i].type != SUBSCRIBE && entries[i].type != UNSUBSCRIBE) ||
+				entries[i].seqno >= PERSISTENCE_SEQNO_LIMIT || entries[i].payloadlen < 0)
+			rc = MQTTASYNC_PERSISTENCE_ERROR;
+	}
+	if (rc != 0)
+	{
+		Log(LOG_ERROR, 0, "Command index of client %s not valid, reading the commands", c->clientID);
+		goto exit;
+	}
+	if (count == 0)
+		goto exit;
+
+	if ((client->restore_entries = malloc(count * sizeof(MQTTAsync_restoreEntry))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memcpy(client->restore_entries, entries, count * sizeof(MQTTAsync_restoreEntry));
+	client->restore_count = count;
+	client->restore_next = 0;
+	for (i = 0; i < count; ++i)
+	{
+		/* the tokens of the commands not yet queued mustn't be reused */
+		MQTTProtocol_addMsgId(&client->commandIds, entries[i].token);
+		client->command_seqno = max(client->command_seqno, entries[i].seqno);
+		if (entries[i].type == PUBLISH)
+		{
+			client->noBufferedMessages++;
+			client->noBufferedBytes += entries[i].payloadlen;
+		}
+	}
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	MQTTAsync_queueRestored(client);
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+exit:
+	Log(TRACE_MINIMUM, -1, "%d commands restored from the persistence index for client %s", (rc == 0) ? count : 0, c->clientID);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Write the persistence index of a client which is being destroyed, listing its persisted
+ * commands in order, so that the next restore can queue them without reading them.  Any
+ * restore entries not yet queued are included, and freed.  Must be called before the
+ * commands are freed.
+ * @param m the client
+ * @return completion code
+ */
+int MQTTAsync_persistIndex(MQTTAsyncs* m)
+{
+	int rc = 0;
+	MQTTAsync_restoreEntry* entries = NULL;
+	int count = 0;
+	int unqueued = m->restore_count - m->restore_next;
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	if (m->c->persistence == NULL)
+		goto exit;
+	if ((entries = malloc((m->commands->count + unqueued + 1) * sizeof(MQTTAsync_restoreEntry))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	while (ListNextElement(m->commands, &current))
+	{
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
+		MQTTAsync_restoreEntry* entry = &entries[count];
+
+		memset(entry, '\0', sizeof(MQTTAsync_restoreEntry));
+		entry->seqno = cmd->seqno;
+		entry->token = cmd->command.token;
+		entry->type = cmd->command.type;
+		if (cmd->key)
+			entry->MQTTVersion = (strncmp(cmd->key, PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) == 0)
+				? MQTTVERSION_5 : MQTTVERSION_3_1_1;
+		else
+			entry->MQTTVersion = m->c->MQTTVersion;
+
+		if (cmd->command.type == PUBLISH)
+		{
+			if (cmd->key == NULL)
+				continue; /* not persisted */
+			entry->payloadlen = cmd->command.details.pub.payloadlen;
+			entry->qos = cmd->command.details.pub.qos;
+		}
+		else if (cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE)
+		{
+			char key[PERSISTENCE_MAX_KEY_LENGTH + 1];
+
+			if (cmd->key == NULL && (MQTTAsync_restoreEntryKey(entry, key) != 0 ||
+					m->c->persistence->pcontainskey(m->c->phandle, key) != 0))
+				continue; /* not persisted */
+		}
+		else
+			continue;
+		count++;
+	}
+	if (unqueued > 0)
+		memcpy(&entries[count], &m->restore_entries[m->restore_next], unqueued * sizeof(MQTTAsync_restoreEntry));
+	count += unqueued;
+
+	if (count > 0)
+		rc = MQTTPersistence_writeIndex(m->c, (char*)entries, count * (int)sizeof(MQTTAsync_restoreEntry));
+	Log(TRACE_MINIMUM, -1, "%d commands indexed for client %s", count, m->c->clientID);
+exit:
+	if (entries)
+		free(entries);
+	MQTTAsync_freeRestoreEntries(m);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 {
 	int rc = 0;
@@ -625,6 +1173,8 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 	int commands_restored = 0;
 
 	FUNC_ENTRY;
+	if (c->pindex && MQTTAsync_restoreIndexedCommands(client) == 0)
+		goto exit;
 	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0 && nkeys > 0)
 	{
 		/* let's have the sequence number array sorted */
@@ -662,11 +1212,14 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 					cmd->client = client;
 					cmd->seqno = atoi(strchr(msgkeys[i], '-')+1); /* key format is tag'-'seqno */
 					/* we can just append the commands to the list as they've already been sorted */
-					ListAppend(MQTTAsync_commands, cmd, sizeof(MQTTAsync_queuedCommand));
+					MQTTAsync_queueCommand(cmd, NULL, sizeof(MQTTAsync_queuedCommand), 0);
 					client->command_seqno = max(client->command_seqno, cmd->seqno);
 					commands_restored++;
 					if (cmd->command.type == PUBLISH)
+					{
 						client->noBufferedMessages++;
+						client->noBufferedBytes += cmd->command.details.pub.payloadlen;
+					}
 				}
 			}
 			if (buffer)
@@ -679,6 +1232,7 @@ int MQTTAsync_restoreCommands(MQTTAsyncs* client)
 			free(msgkeys);
 	}
 	Log(TRACE_MINIMUM, -1, "%d commands restored for client %s", commands_restored, c->clientID);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -784,51 +1338,70 @@ static int clientCompareConnectCommand(void* a, void* b)
 #endif
 
 
-int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
+/**
+ * Whether a command goes to the head of its client's queue rather than the tail.
+ * @param command the command
+ * @return boolean
+ */
+static int MQTTAsync_isHeadCommand(MQTTAsync_queuedCommand* command)
+{
+	return command->command.type == CONNECT ||
+		(command->command.type == DISCONNECT && command->command.details.dis.internal);
+}
+
+
+/**
+ * Are more messages, or more payload bytes, buffered for a client than its create options
+ * allow?  Must be called with mqttcommand_mutex locked.
+ * @param m the client
+ * @return boolean
+ */
+static int MQTTAsync_bufferOverfull(MQTTAsyncs* m)
+{
+	MQTTAsync_createOptions* options = m->createOptions;
+
+	return options && (m->noBufferedMessages > options->maxBufferedMessages ||
+		(options->struct_version >= 6 && options->maxBufferedBytes > 0 && m->noBufferedBytes > options->maxBufferedBytes));
+}
+
+
+/**
+ * Add one command to its client's queue, persisting it if it is added to the tail.
+ * Must be called with mqttcommand_mutex locked.
+ * @param command the command to add
+ * @param newel list element allocated by the caller for a tail add, or NULL for a head add
+ * @param command_size the size of the command, for heap tracking
+ * @param wake set to 1 if the send thread needs to be woken to see the command
+ * @return completion code
+ */
+static int MQTTAsync_addCommand1(MQTTAsync_queuedCommand* command, ListElement* newel, int command_size, int* wake)
 {
 	int rc = MQTTASYNC_SUCCESS;
-	int rc1 = 0;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttcommand_mutex);
 	/* Don't set start time if the connect command is already in process #218 */
 	if ((command->command.type != CONNECT) || (command->client->c->connect_state == NOT_IN_PROGRESS))
 		command->command.start_time = MQTTTime_start_clock();
 
-	if (command->command.type == CONNECT ||
-		(command->command.type == DISCONNECT && command->command.details.dis.internal))
+	if (MQTTAsync_isHeadCommand(command))
 	{
-		MQTTAsync_queuedCommand* head = NULL;
-		ListElement* current = MQTTAsync_commands->first;
+		ListElement* head = command->client->commands->first;
 
-		/* Look for any connect or disconnect command belonging to this client.  All the connects/disconnects
-		 * are at the head of the list, so we don't search any further if we meet anything other than a
-		 * connect or disconnect for any client.
+		/* Look for any connect or disconnect command for this client.  The connects/disconnects
+		 * are at the head of the client's queue.
 		 */
-		while (current)
-		{
-			MQTTAsync_queuedCommand* cur_cmd = (MQTTAsync_queuedCommand*)(current->content);
-			if (cur_cmd->command.type != CONNECT && cur_cmd->command.type != DISCONNECT)
-				break; /* end search if we meet anything other than connect or disconnect */
-			if (cur_cmd->client == command->client)
-			{
-				head = cur_cmd;
-				break;
-			}
-			current = current->prev;
-		}
-
-		if (head)
+		if (head && (((MQTTAsync_queuedCommand*)(head->content))->command.type == CONNECT ||
+				((MQTTAsync_queuedCommand*)(head->content))->command.type == DISCONNECT))
 		{
 			MQTTAsync_freeCommand(command); /* ignore duplicate connect or disconnect command */
 			rc = MQTTASYNC_COMMAND_IGNORED;
 		}
 		else
-			ListInsert(MQTTAsync_commands, command, command_size, MQTTAsync_commands->first); /* add to the head of the list */
+			*wake |= MQTTAsync_queueCommand(command, NULL, command_size, 1); /* add to the head of the queue */
 	}
 	else
 	{
-		ListAppend(MQTTAsync_commands, command, command_size);
+		*wake |= MQTTAsync_queueCommand(command, newel, command_size, 0);
 #if !defined(NO_PERSISTENCE)
 		if (command->client->c->persistence)
 		{
@@ -869,53 +1442,143 @@ int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
 #endif
 		if (command->command.type == PUBLISH)
 		{
-			/* delete oldest message if buffer is full.  We wouldn't be here if delete newest was in operation */
-			if (command->client->createOptions && (command->client->noBufferedMessages >= command->client->createOptions->maxBufferedMessages))
+			command->client->noBufferedMessages++;
+			command->client->noBufferedBytes += command->command.details.pub.payloadlen;
+
+			/* delete oldest messages while the buffer is over full.  We wouldn't be here if delete newest was in operation */
+			while (MQTTAsync_bufferOverfull(command->client))
 			{
 				MQTTAsync_queuedCommand* first_publish = NULL;
 				ListElement* current = NULL;
 
-				/* Find first publish command for this client and detach it */
-				while (ListNextElement(MQTTAsync_commands, &current))
+				/* Find first publish command for this client, other than this one, and detach it */
+				while (ListNextElement(command->client->commands, &current))
 				{
 					MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(current->content);
 
-					if (cmd->client == command->client && cmd->command.type == PUBLISH)
+					if (cmd->command.type == PUBLISH && cmd != command)
 					{
 						first_publish = cmd;
 						break;
 					}
 				}
-				if (first_publish)
-				{
-					ListDetach(MQTTAsync_commands, first_publish);
+	#if !defined(NO_PERSISTENCE)
+				/* restored commands not yet queued are older than any not restored */
+				if ((first_publish == NULL || !first_publish->restored) && MQTTAsync_dropRestoreEntry(command->client))
+					continue;
+	#endif
+				if (first_publish == NULL)
+					break;
+				MQTTAsync_detachCommand(first_publish);
+				command->client->noBufferedMessages--;
+				command->client->noBufferedBytes -= first_publish->command.details.pub.payloadlen;
 
 	#if !defined(NO_PERSISTENCE)
-					if (command->client->c->persistence)
-						MQTTAsync_unpersistCommand(first_publish);
+				if (command->client->c->persistence)
+					MQTTAsync_unpersistCommand(first_publish);
 	#endif
 
-					MQTTAsync_freeCommand(first_publish);
-				}
+				MQTTAsync_freeCommand(first_publish);
 			}
-			else
-				command->client->noBufferedMessages++;
 		}
 	}
 exit:
-	MQTTAsync_unlock_mutex(mqttcommand_mutex);
-#if !defined(_WIN32) && !defined(_WIN64)
-	if ((rc1 = Thread_signal_cond(send_cond)) != 0)
-		Log(LOG_ERROR, 0, "Error %d from signal cond", rc1);
-#else
-	if ((rc1 = Thread_post_sem(send_sem)) != 0)
-		Log(LOG_ERROR, 0, "Error %d from signal cond", rc1);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Add a set of commands to the command queues, taking the command lock and waking the
+ * send thread at most once.  The commands are owned by the queues afterwards, or freed.
+ * If the client's persistence has a writer thread, this first waits for room in its queue,
+ * so it must not be called with the client's locks held.
+ * @param commands the array of commands to add
+ * @param count the number of commands in the array
+ * @param command_size the size of each command, for heap tracking
+ * @return completion code of the first command that failed, or MQTTASYNC_SUCCESS
+ */
+int MQTTAsync_addCommands(MQTTAsync_queuedCommand** commands, int count, int command_size)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	int wake = 0;
+	int i;
+	ListElement* spare = NULL;
+
+	FUNC_ENTRY;
+#if !defined(NO_PERSISTENCE)
+	/* commands added to the tail are persisted, so wait for room in the queue of a persistence
+	   writer thread now, rather than with the command lock held */
+	for (i = 0; i < count; ++i)
+	{
+		if (!MQTTAsync_isHeadCommand(commands[i]))
+		{
+			MQTTPersistence_waitForWriter(commands[i]->client->c);
+			break;
+		}
+	}
 #endif
+	/* allocate the list elements for tail adds before taking the command lock, so that the
+	   allocations aren't made with it held.  The lock is still held while each command is
+	   queued, persisted and counted, and the oldest publishes dropped if the buffer is over
+	   full: calls to the persistence have to be serialized with those of the send and receive
+	   threads.  With a persistence writer thread they only copy the records to its queue.
+	   The spare elements are chained through their next pointers until they are used. */
+	for (i = 0; i < count; ++i)
+	{
+		ListElement* newel = NULL;
+
+		if (MQTTAsync_isHeadCommand(commands[i]))
+			continue;
+		if ((newel = Pool_malloc(sizeof(ListElement))) == NULL)
+		{
+			while (spare)
+			{
+				newel = spare->next;
+				Pool_free(spare, sizeof(ListElement));
+				spare = newel;
+			}
+			for (i = 0; i < count; ++i)
+				MQTTAsync_freeCommand(commands[i]);
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		newel->next = spare;
+		spare = newel;
+	}
+
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	for (i = 0; i < count; ++i)
+	{
+		ListElement* newel = NULL;
+		int rc1;
+
+		if (!MQTTAsync_isHeadCommand(commands[i]))
+		{
+			newel = spare;
+			spare = spare->next;
+		}
+		rc1 = MQTTAsync_addCommand1(commands[i], newel, command_size, &wake);
+		if (rc == MQTTASYNC_SUCCESS)
+			rc = rc1;
+	}
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	/* only wake the send thread when it can do something new: while a burst of commands is
+	   being added for a client, the send thread keeps working through its queue unprompted */
+	if (wake)
+		Thread_post_sem(send_sem);
+exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
+int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size)
+{
+	return MQTTAsync_addCommands(&command, 1, command_size);
+}
+
+
 void MQTTAsync_startConnectRetry(MQTTAsyncs* m)
 {
 	if (m->automaticReconnect && m->shouldBeConnected)
@@ -931,6 +1594,7 @@ void MQTTAsync_startConnectRetry(MQTTAsyncs* m)
 			m->retrying = 1;
 		}
 		m->currentInterval = MQTTAsync_randomJitter(m->currentIntervalBase, m->minRetryInterval, m->maxRetryInterval);
+		MQTTAsync_scheduleTimeouts(m);
 	}
 }
 
@@ -976,13 +1640,13 @@ void MQTTAsync_checkDisconnect(MQTTAsync handle, MQTTAsync_command* command)
 
 
 /**
- * Call Socket_noPendingWrites(int socket) with protection by socket_mutex, see https://github.com/eclipse/paho.mqtt.c/issues/385
+ * Call Socket_writeQueueFull(int socket) with protection by socket_mutex, see https://github.com/eclipse/paho.mqtt.c/issues/385
  */
-static int MQTTAsync_Socket_noPendingWrites(SOCKET socket)
+static int MQTTAsync_Socket_writeQueueFull(SOCKET socket)
 {
     int rc;
     MQTTAsync_lock_mutex(socket_mutex);
-    rc = Socket_noPendingWrites(socket);
+    rc = Socket_writeQueueFull(socket);
     MQTTAsync_unlock_mutex(socket_mutex);
     return rc;
 }
@@ -1058,26 +1722,126 @@ static void MQTTAsync_freeCommand1(MQTTAsync_queuedCommand *command)
 static void MQTTAsync_freeCommand(MQTTAsync_queuedCommand *command)
 {
 	MQTTAsync_freeCommand1(command);
-	free(command);
+	Pool_free(command, sizeof(MQTTAsync_queuedCommand));
 }
 
 
-void MQTTAsync_writeContinue(SOCKET socket)
+/**
+ * Call the success or failure callback of a QoS 0 publish, once its packet has been written.
+ * Must be called with mqttasync_mutex locked.
+ * @param m the client
+ * @param command the publish command
+ * @param rc 1 if the packet was written, otherwise the failure code
+ */
+static void MQTTAsync_completeQoS0Publish(MQTTAsyncs* m, MQTTAsync_command* command, int rc)
 {
-	ListElement* found = NULL;
+	if (rc == 1)
+	{
+		if (command->onSuccess)
+		{
+			MQTTAsync_successData data;
 
-	if ((found = ListFindItem(MQTTAsync_handles, &socket, clientSockCompare)) != NULL)
+			data.token = command->token;
+			data.alt.pub.destinationName = command->details.pub.destinationName;
+			data.alt.pub.message.payload = command->details.pub.payload;
+			data.alt.pub.message.payloadlen = command->details.pub.payloadlen;
+			data.alt.pub.message.qos = command->details.pub.qos;
+			data.alt.pub.message.retained = command->details.pub.retained;
+			Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
+			(*(command->onSuccess))(command->context, &data);
+		}
+		else if (command->onSuccess5)
+		{
+			MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
+
+			data.token = command->token;
+			data.alt.pub.destinationName = command->details.pub.destinationName;
+			data.alt.pub.message.payload = command->details.pub.payload;
+			data.alt.pub.message.payloadlen = command->details.pub.payloadlen;
+			data.alt.pub.message.qos = command->details.pub.qos;
+			data.alt.pub.message.retained = command->details.pub.retained;
+			data.properties = command->properties;
+			Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
+			(*(command->onSuccess5))(command->context, &data);
+		}
+	}
+	else
 	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
+		if (command->onFailure)
+		{
+			MQTTAsync_failureData data;
 
-		m->c->net.lastSent = MQTTTime_now();
+			data.token = command->token;
+			data.code = rc;
+			data.message = NULL;
+			Log(TRACE_MIN, -1, "Calling publish failure for client %s", m->c->clientID);
+			(*(command->onFailure))(command->context, &data);
+		}
+		else if (command->onFailure5)
+		{
+			MQTTAsync_failureData5 data;
+
+			data.token = command->token;
+			data.code = rc;
+			data.message = NULL;
+			data.packet_type = PUBLISH;
+			Log(TRACE_MIN, -1, "Calling publish failure for client %s", m->c->clientID);
+			(*(command->onFailure5))(command->context, &data);
+		}
 	}
 }
 
 
+/**
+ * Complete the QoS 0 publishes whose packets were coalesced with others, once all the
+ * coalesced packets have been written, or if the connection has failed.  The payloads
+ * were copied, so still belong to the commands.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ * @param rc -1 if the connection has failed, otherwise the publishes complete if their
+ * packets have been written
+ */
+static void MQTTAsync_completeCoalesced(MQTTAsyncs* m, int rc)
+{
+	ListElement* cur_response = NULL;
+	int count = 0;
+
+	if (m->coalesced_publishes == 0)
+		return;
+	if (rc != -1 && (m->c->net.coalesced_len > 0 || !Socket_noPendingWrites(m->c->net.socket)))
+		return; /* not written yet */
+	/* the publishes were the last responses added, apart from others they were coalesced with,
+	 * so find the first of them from the end of the list, then complete them in order */
+	cur_response = m->responses->last;
+	while (cur_response && (count += ((MQTTAsync_queuedCommand*)(cur_response->content))->coalesced) < m->coalesced_publishes)
+		cur_response = cur_response->prev;
+	if (cur_response == NULL)
+		cur_response = m->responses->first;
+	while (cur_response && m->coalesced_publishes > 0)
+	{
+		MQTTAsync_queuedCommand* com = (MQTTAsync_queuedCommand*)(cur_response->content);
+
+		cur_response = cur_response->next; /* com may be removed */
+		if (!com->coalesced)
+			continue;
+		MQTTAsync_detachResponse(com);
+		MQTTAsync_completeQoS0Publish(m, &com->command, (rc == -1) ? -1 : 1);
+		MQTTAsync_freeCommand(com);
+	}
+}
+
+
+void MQTTAsync_writeContinue(SOCKET socket)
+{
+	Clients* client = NULL;
+
+	if ((client = Clients_findSocket(bstate, socket)) != NULL)
+		client->net.lastSent = MQTTTime_now();
+}
+
+
 void MQTTAsync_writeComplete(SOCKET socket, int rc)
 {
-	ListElement* found = NULL;
+	Clients* client = NULL;
 
 	FUNC_ENTRY;
 
@@ -1086,102 +1850,38 @@ void MQTTAsync_writeComplete(SOCKET socket, int rc)
 	MQTTProtocol_checkPendingWrites();
 
 	/* find the client using this socket */
-	if ((found = ListFindItem(MQTTAsync_handles, &socket, clientSockCompare)) != NULL)
+	if ((client = Clients_findSocket(bstate, socket)) != NULL)
 	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
+		MQTTAsyncs* m = (MQTTAsyncs*)(client->context);
+		ListElement* cur_response = m->responses->first;
 
 		m->c->net.lastSent = MQTTTime_now();
 
-		/* see if there is a pending write flagged */
-		if (m->pending_write)
+		/* the writes queued on the socket are finished, so complete any QoS 0 publishes waiting for them */
+		while (cur_response)
 		{
-			ListElement* cur_response = NULL;
-			MQTTAsync_command* command = m->pending_write;
-			MQTTAsync_queuedCommand* com = NULL;
-
-			cur_response = NULL;
-			while (ListNextElement(m->responses, &cur_response))
-			{
-				com = (MQTTAsync_queuedCommand*)(cur_response->content);
-				if (&com->command == m->pending_write)
-					break;
-			}
-
-			if (cur_response) /* we found a response */
-			{
-				if (command->type == PUBLISH)
-				{
-					if (rc == 1 && command->details.pub.qos == 0)
-					{
-						if (command->onSuccess)
-						{
-							MQTTAsync_successData data;
-
-							data.token = command->token;
-							data.alt.pub.destinationName = command->details.pub.destinationName;
-							data.alt.pub.message.payload = command->details.pub.payload;
-							data.alt.pub.message.payloadlen = command->details.pub.payloadlen;
-							data.alt.pub.message.qos = command->details.pub.qos;
-							data.alt.pub.message.retained = command->details.pub.retained;
-							Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
-							(*(command->onSuccess))(command->context, &data);
-						}
-						else if (command->onSuccess5)
-						{
-							MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
-
-							data.token = command->token;
-							data.alt.pub.destinationName = command->details.pub.destinationName;
-							data.alt.pub.message.payload = command->details.pub.payload;
-							data.alt.pub.message.payloadlen = command->details.pub.payloadlen;
-							data.alt.pub.message.qos = command->details.pub.qos;
-							data.alt.pub.message.retained = command->details.pub.retained;
-							data.properties = command->properties;
-							Log(TRACE_MIN, -1, "Calling publish success for client %s", m->c->clientID);
-							(*(command->onSuccess5))(command->context, &data);
-						}
-					}
-					else if (rc == -1)
-					{
-						if (command->onFailure)
-						{
-							MQTTAsync_failureData data;
-
-							data.token = command->token;
-							data.code = rc;
-							data.message = NULL;
-							Log(TRACE_MIN, -1, "Calling publish failure for client %s", m->c->clientID);
-							(*(command->onFailure))(command->context, &data);
-						}
-						else if (command->onFailure5)
-						{
-							MQTTAsync_failureData5 data;
-
-							data.token = command->token;
-							data.code = rc;
-							data.message = NULL;
-							data.packet_type = PUBLISH;
-							Log(TRACE_MIN, -1, "Calling publish failure for client %s", m->c->clientID);
-							(*(command->onFailure5))(command->context, &data);
-						}
-					}
-					else
-						com = NULL; /* Don't delete response we haven't acknowledged */
-					/* QoS 0 payloads are freed elsewhere after a write complete,
-					 * so we should indicate that.
-					 */
-					if (command->details.pub.qos == 0)
-						command->details.pub.payload = NULL;
-				}
-				if (com)
-				{
-					Log(TRACE_PROTOCOL, -1, "writeComplete: Removing response for msgid %d", com->command.token);
-					ListDetach(m->responses, com);
-					MQTTAsync_freeCommand(com);
-				}
-			} /* if cur_response */
-			m->pending_write = NULL;
-		} /* if pending_write */
+			MQTTAsync_queuedCommand* com = (MQTTAsync_queuedCommand*)(cur_response->content);
+			MQTTAsync_command* command = &com->command;
+
+			cur_response = cur_response->next; /* com may be removed */
+			if (command->type != PUBLISH || command->details.pub.qos != 0 || com->coalesced)
+				continue;
+			if (rc == 1 || rc == -1)
+				MQTTAsync_completeQoS0Publish(m, command, rc);
+			else
+				continue; /* Don't delete response we haven't acknowledged */
+			/* QoS 0 payloads are freed elsewhere after a write complete,
+			 * so we should indicate that.
+			 */
+			command->details.pub.payload = NULL;
+			Log(TRACE_PROTOCOL, -1, "writeComplete: Removing response for msgid %d", com->command.token);
+			MQTTAsync_detachResponse(com);
+			MQTTAsync_freeCommand(com);
+		}
+		if (m->c->net.coalescing == 0)
+			MQTTPacket_flushCoalesced(&m->c->net); /* packets written while the write was pending */
+		MQTTAsync_completeCoalesced(m, rc);
+		MQTTAsync_wakeSendThread(m); /* commands may have been waiting for the write to finish */
 	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT;
@@ -1192,29 +1892,23 @@ static int MQTTAsync_processCommand(void)
 {
 	int rc = 0;
 	MQTTAsync_queuedCommand* command = NULL;
-	ListElement* cur_command = NULL;
-	List* ignored_clients = NULL;
+	ListElement* cur_client = NULL;
 
 	FUNC_ENTRY;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	MQTTAsync_lock_mutex(mqttcommand_mutex);
 
-	/* only the first command in the list must be processed for any particular client, so if we skip
-	   a command for a client, we must skip all following commands for that client.  Use a list of
-	   ignored clients to keep track
+	/* only the first command in its queue can be processed for any particular client.  Clients are
+	   served in turn: the client whose command is taken moves to the back of the ready list.
 	*/
-	ignored_clients = ListInitialize();
-
-	/* don't try a command until there isn't a pending write for that client, and we are not connecting */
-	while (ListNextElement(MQTTAsync_commands, &cur_command))
+	/* don't try a command until there is room in the write queue for that client, and we are not connecting */
+	while (ListNextElement(MQTTAsync_readyClients, &cur_client))
 	{
-		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(cur_command->content);
-
-		if (ListFind(ignored_clients, cmd->client))
-			continue;
+		MQTTAsyncs* client = (MQTTAsyncs*)(cur_client->content);
+		MQTTAsync_queuedCommand* cmd = (MQTTAsync_queuedCommand*)(client->commands->first->content);
 
 		if (cmd->command.type == CONNECT || cmd->command.type == DISCONNECT || (cmd->client->c->connected &&
-			cmd->client->c->connect_state == NOT_IN_PROGRESS && MQTTAsync_Socket_noPendingWrites(cmd->client->c->net.socket)))
+			cmd->client->c->connect_state == NOT_IN_PROGRESS && !MQTTAsync_Socket_writeQueueFull(cmd->client->c->net.socket)))
 		{
 			if ((cmd->command.type == PUBLISH || cmd->command.type == SUBSCRIBE || cmd->command.type == UNSUBSCRIBE) &&
 				cmd->client->c->outboundMsgs->count >= MAX_MSG_ID - 1)
@@ -1234,14 +1928,28 @@ static int MQTTAsync_processCommand(void)
 				break;
 			}
 		}
-		ListAppend(ignored_clients, cmd->client, sizeof(cmd->client));
 	}
-	ListFreeNoContent(ignored_clients);
 	if (command)
 	{
+		MQTTAsyncs* client = command->client;
+
+		if (!client->send_batch)
+		{
+			MQTTAsync_startBatch(client, &client->send_batch);
+			MQTTAsync_addSendBatchClient(client);
+		}
 		if (command->command.type == PUBLISH)
-			command->client->noBufferedMessages--;
-		ListDetach(MQTTAsync_commands, command);
+		{
+			client->noBufferedMessages--;
+			client->noBufferedBytes -= command->command.details.pub.payloadlen;
+		}
+		MQTTAsync_detachCommand(command);
+		if (client->commands->count > 0 && MQTTAsync_readyClients->last->content != client)
+		{
+			/* round robin: this client goes to the back of the queue */
+			ListDetach(MQTTAsync_readyClients, client);
+			ListAppend(MQTTAsync_readyClients, client, sizeof(MQTTAsyncs));
+		}
 #if !defined(NO_PERSISTENCE)
 		/*printf("outboundmsgs count %d max inflight %d qos %d %d %d\n", command->client->c->outboundMsgs->count, command->client->c->maxInflightMessages,
 				command->command.details.pub.qos, command->client->c->MQTTVersion, command->command.type);*/
@@ -1408,7 +2116,7 @@ static int MQTTAsync_processCommand(void)
 		Publish* p = NULL;
 		MQTTProperties initialized = MQTTProperties_initializer;
 
-		if ((p = malloc(sizeof(Publish))) == NULL)
+		if ((p = Pool_malloc(sizeof(Publish))) == NULL)
 		{
 			rc = PAHO_MEMORY_ERROR;
 			goto exit;
@@ -1432,33 +2140,13 @@ static int MQTTAsync_processCommand(void)
 		{
 			if (rc == TCPSOCKET_COMPLETE)
 			{
-				if (command->command.onSuccess)
-				{
-					MQTTAsync_successData data;
-
-					data.token = command->command.token;
-					data.alt.pub.destinationName = command->command.details.pub.destinationName;
-					data.alt.pub.message.payload = command->command.details.pub.payload;
-					data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
-					data.alt.pub.message.qos = command->command.details.pub.qos;
-					data.alt.pub.message.retained = command->command.details.pub.retained;
-					Log(TRACE_MIN, -1, "Calling publish success for client %s", command->client->c->clientID);
-					(*(command->command.onSuccess))(command->command.context, &data);
-				}
-				else if (command->command.onSuccess5)
-				{
-					MQTTAsync_successData5 data = MQTTAsync_successData5_initializer;
-
-					data.token = command->command.token;
-					data.alt.pub.destinationName = command->command.details.pub.destinationName;
-					data.alt.pub.message.payload = command->command.details.pub.payload;
-					data.alt.pub.message.payloadlen = command->command.details.pub.payloadlen;
-					data.alt.pub.message.qos = command->command.details.pub.qos;
-					data.alt.pub.message.retained = command->command.details.pub.retained;
-					data.properties = command->command.properties;
-					Log(TRACE_MIN, -1, "Calling publish success for client %s", command->client->c->clientID);
-					(*(command->command.onSuccess5))(command->command.context, &data);
-				}
+				Clients* c = command->client->c;
+
+				/* a packet coalesced with others completes when they are written */
+				if (c->net.coalesced_len > 0 || !Socket_noPendingWrites(c->net.socket))
+					command->coalesced = 1;
+				else
+					MQTTAsync_completeQoS0Publish(command->client, &command->command, 1);
 			}
 			else
 			{
@@ -1467,10 +2155,9 @@ static int MQTTAsync_processCommand(void)
 					command->command.details.pub.payload = NULL; /* this will be freed by the protocol code */
 					command->command.details.pub.destinationName = NULL; /* this will be freed by the protocol code */
 				}
-				command->client->pending_write = &command->command;
 			}
 		}
-		free(p); /* should this be done if the write isn't complete? */
+		Pool_free(p, sizeof(Publish)); /* should this be done if the write isn't complete? */
 	}
 	else if (command->command.type == DISCONNECT)
 	{
@@ -1513,18 +2200,20 @@ static int MQTTAsync_processCommand(void)
 	if (command->command.type == CONNECT && rc != SOCKET_ERROR && rc != MQTTASYNC_PERSISTENCE_ERROR)
 	{
 		command->client->connect = command->command;
+		MQTTAsync_scheduleTimeouts(command->client);
 		MQTTAsync_freeCommand(command);
 	}
 	else if (command->command.type == DISCONNECT)
 	{
 		command->client->disconnect = command->command;
+		MQTTAsync_scheduleTimeouts(command->client);
 		MQTTAsync_freeCommand(command);
 	}
 	else if (command->command.type == PUBLISH && command->command.details.pub.qos == 0 &&
 			rc != SOCKET_ERROR && rc != MQTTASYNC_PERSISTENCE_ERROR)
 	{
-		if (rc == TCPSOCKET_INTERRUPTED)
-			ListAppend(command->client->responses, command, sizeof(command));
+		if (rc == TCPSOCKET_INTERRUPTED || command->coalesced)
+			MQTTAsync_appendResponse(command);
 		else
 			MQTTAsync_freeCommand(command);
 	}
@@ -1586,7 +2275,7 @@ static int MQTTAsync_processCommand(void)
 		}
 	}
 	else /* put the command into a waiting for response queue for each client, indexed by msgid */
-		ListAppend(command->client->responses, command, sizeof(command));
+		MQTTAsync_appendResponse(command);
 
 exit:
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
@@ -1616,7 +2305,7 @@ static void nextOrClose(MQTTAsyncs* m, int rc, char* message)
 			connectionLost_called = 1;
 		}
 		/* put the connect command back to the head of the command queue, using the next serverURI */
-		if ((conn = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+		if ((conn = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 			goto exit;
 		memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
 		conn->client = m;
@@ -1680,99 +2369,178 @@ exit:
 }
 
 
-static void MQTTAsync_checkTimeouts(void)
+/**
+ * Get the milliseconds from now until a timeout is next to be checked.  That is when it expires,
+ * or MQTTASYNC_TIMEOUT_INTERVAL if that is sooner, as what is waited for may happen first.
+ * @param start when the timeout started
+ * @param timeout the timeout in milliseconds
+ * @return the interval
+ */
+static ELAPSED_TIME_TYPE MQTTAsync_timeoutInterval(START_TIME_TYPE start, ELAPSED_TIME_TYPE timeout)
 {
-	ListElement* current = NULL;
-	static START_TIME_TYPE last = START_TIME_ZERO;
-	START_TIME_TYPE now;
+	ELAPSED_TIME_TYPE elapsed = MQTTTime_elapsed(start);
+
+	return (elapsed < timeout) ? min(timeout - elapsed, MQTTASYNC_TIMEOUT_INTERVAL) : MQTTASYNC_TIMEOUT_INTERVAL;
+}
+
+
+/**
+ * Schedule the next check of the connect, disconnect or automatic reconnect a client has in
+ * progress, or cancel it if there is none.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+void MQTTAsync_scheduleTimeouts(MQTTAsyncs* m)
+{
+	ELAPSED_TIME_TYPE interval = MQTTASYNC_TIMEOUT_INTERVAL;
+	int check = 0;
 
 	FUNC_ENTRY;
-	MQTTAsync_lock_mutex(mqttasync_mutex);
-	now = MQTTTime_now();
-	if (MQTTTime_difftime(now, last) < (DIFF_TIME_TYPE)3000)
-		goto exit;
-	last = now;
-	while (ListNextElement(MQTTAsync_handles, &current))		/* for each client */
+	if (m->c->connect_state == DISCONNECTING)
 	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(current->content);
+		interval = min(interval, MQTTAsync_timeoutInterval(m->disconnect.start_time, m->disconnect.details.dis.timeout));
+		check = 1;
+	}
+	if (m->c->connect_state != NOT_IN_PROGRESS)
+	{
+		interval = min(interval, MQTTAsync_timeoutInterval(m->connect.start_time, m->connectTimeout * 1000));
+		check = 1;
+	}
+	if (m->automaticReconnect && m->retrying)
+	{
+		if (m->reconnectNow)
+			interval = 0;
+		else
+			interval = min(interval, MQTTAsync_timeoutInterval(m->lastConnectionFailedTime, m->currentInterval * 1000));
+		check = 1;
+	}
+	if (check == 0)
+		Timers_cancel(&timeout_timers, &m->timeoutTimer);
+	else
+	{
+		m->timeoutTimer.context = m;
+		if (Timers_schedule(&timeout_timers, &m->timeoutTimer, MQTTTime_now(), interval) != 0)
+			Log(LOG_ERROR, -1, "Couldn't schedule timeout check for client %s", m->c->clientID);
+	}
+	FUNC_EXIT;
+}
 
-		/* check disconnect timeout */
-		if (m->c->connect_state == DISCONNECTING)
-			MQTTAsync_checkDisconnect(m, &m->disconnect);
 
-		/* check connect timeout */
-		if (m->c->connect_state != NOT_IN_PROGRESS && MQTTTime_elapsed(m->connect.start_time) > (ELAPSED_TIME_TYPE)(m->connectTimeout * 1000))
-		{
-			nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
-			continue;
-		}
+/**
+ * Cancel the timeout check of a client which is being destroyed.  Must be called with
+ * mqttasync_mutex locked.
+ * @param m the client
+ */
+void MQTTAsync_cancelTimeouts(MQTTAsyncs* m)
+{
+	Timers_cancel(&timeout_timers, &m->timeoutTimer);
+}
 
-		/* There was a section here that removed timed-out responses.  But if the command had completed and
-		 * there was a response, then we may as well report it, no?
-		 *
-		 * In any case, that section was disabled when automatic reconnect was implemented.
-		 */
 
-		if (m->automaticReconnect && m->retrying)
+/**
+ * Check the connect, disconnect and automatic reconnect timeouts of a client.
+ * @param m the client
+ */
+static void MQTTAsync_checkClientTimeouts(MQTTAsyncs* m)
+{
+	FUNC_ENTRY;
+	/* check disconnect timeout */
+	if (m->c->connect_state == DISCONNECTING)
+		MQTTAsync_checkDisconnect(m, &m->disconnect);
+
+	/* check connect timeout */
+	if (m->c->connect_state != NOT_IN_PROGRESS && MQTTTime_elapsed(m->connect.start_time) > (ELAPSED_TIME_TYPE)(m->connectTimeout * 1000))
+	{
+		nextOrClose(m, MQTTASYNC_FAILURE, "TCP connect timeout");
+		goto exit;
+	}
+
+	/* There was a section here that removed timed-out responses.  But if the command had completed and
+	 * there was a response, then we may as well report it, no?
+	 *
+	 * In any case, that section was disabled when automatic reconnect was implemented.
+	 */
+
+	if (m->automaticReconnect && m->retrying)
+	{
+		if (m->reconnectNow || MQTTTime_elapsed(m->lastConnectionFailedTime) > (ELAPSED_TIME_TYPE)(m->currentInterval * 1000))
 		{
-			if (m->reconnectNow || MQTTTime_elapsed(m->lastConnectionFailedTime) > (ELAPSED_TIME_TYPE)(m->currentInterval * 1000))
+			/* to reconnect put the connect command to the head of the command queue */
+			MQTTAsync_queuedCommand* conn = Pool_malloc(sizeof(MQTTAsync_queuedCommand));
+			if (!conn)
+				goto exit;
+			memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
+			conn->client = m;
+			conn->command = m->connect;
+  			/* make sure that the version attempts are restarted */
+			if (m->c->MQTTVersion == MQTTVERSION_DEFAULT)
+				conn->command.details.conn.MQTTVersion = 0;
+			if (m->updateConnectOptions)
 			{
-				/* to reconnect put the connect command to the head of the command queue */
-				MQTTAsync_queuedCommand* conn = malloc(sizeof(MQTTAsync_queuedCommand));
-				if (!conn)
-					goto exit;
-				memset(conn, '\0', sizeof(MQTTAsync_queuedCommand));
-				conn->client = m;
-				conn->command = m->connect;
-	  			/* make sure that the version attempts are restarted */
-				if (m->c->MQTTVersion == MQTTVERSION_DEFAULT)
-					conn->command.details.conn.MQTTVersion = 0;
-				if (m->updateConnectOptions)
-				{
-					MQTTAsync_connectData connectData = MQTTAsync_connectData_initializer;
-					int callback_rc = MQTTASYNC_SUCCESS;
+				MQTTAsync_connectData connectData = MQTTAsync_connectData_initializer;
+				int callback_rc = MQTTASYNC_SUCCESS;
 
-					connectData.username = m->c->username;
-					connectData.binarypwd.data = m->c->password;
-					connectData.binarypwd.len = m->c->passwordlen;
-					Log(TRACE_MIN, -1, "Calling updateConnectOptions for client %s", m->c->clientID);
-					callback_rc = (*(m->updateConnectOptions))(m->updateConnectOptions_context, &connectData);
+				connectData.username = m->c->username;
+				connectData.binarypwd.data = m->c->password;
+				connectData.binarypwd.len = m->c->passwordlen;
+				Log(TRACE_MIN, -1, "Calling updateConnectOptions for client %s", m->c->clientID);
+				callback_rc = (*(m->updateConnectOptions))(m->updateConnectOptions_context, &connectData);
 
-					if (callback_rc)
+				if (callback_rc)
+				{
+					if (connectData.username != m->c->username)
 					{
-						if (connectData.username != m->c->username)
-						{
-							if (m->c->username)
-								free((void*)m->c->username);
-							if (connectData.username)
-								m->c->username = connectData.username; /* must be allocated by MQTTAsync_malloc in the callback */
-							else
-								m->c->username = NULL;
-						}
-						if (connectData.binarypwd.data != m->c->password)
+						if (m->c->username)
+							free((void*)m->c->username);
+						if (connectData.username)
+							m->c->username = connectData.username; /* must be allocated by MQTTAsync_malloc in the callback */
+						else
+							m->c->username = NULL;
+					}
+					if (connectData.binarypwd.data != m->c->password)
+					{
+						if (m->c->password)
+							free((void*)m->c->password);
+						if (connectData.binarypwd.data)
 						{
-							if (m->c->password)
-								free((void*)m->c->password);
-							if (connectData.binarypwd.data)
-							{
-								m->c->passwordlen = connectData.binarypwd.len;
-								m->c->password = connectData.binarypwd.data; /* must be allocated by MQTTAsync_malloc in the callback */
-							}
-							else
-							{
-								m->c->password = NULL;
-								m->c->passwordlen = 0;
-							}
+							m->c->passwordlen = connectData.binarypwd.len;
+							m->c->password = connectData.binarypwd.data; /* must be allocated by MQTTAsync_malloc in the callback */
+						}
+						else
+						{
+							m->c->password = NULL;
+							m->c->passwordlen = 0;
 						}
 					}
 				}
-				Log(TRACE_MIN, -1, "Automatically attempting to reconnect");
-				MQTTAsync_addCommand(conn, sizeof(m->connect));
-				m->reconnectNow = 0;
 			}
+			Log(TRACE_MIN, -1, "Automatically attempting to reconnect");
+			MQTTAsync_addCommand(conn, sizeof(m->connect));
+			m->reconnectNow = 0;
 		}
 	}
 exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Check the timeouts of the clients whose timeout checks are due.
+ */
+static void MQTTAsync_checkTimeouts(void)
+{
+	Timer* timer = NULL;
+	START_TIME_TYPE now;
+
+	FUNC_ENTRY;
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	now = MQTTTime_now();
+	while ((timer = Timers_nextDue(&timeout_timers, now)) != NULL)
+	{
+		MQTTAsyncs* m = (MQTTAsyncs*)(timer->context);
+
+		MQTTAsync_checkClientTimeouts(m);
+		MQTTAsync_scheduleTimeouts(m);
+	}
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
 	FUNC_EXIT;
 }
@@ -1792,28 +2560,32 @@ thread_return_type WINAPI MQTTAsync_sendThread(void* n)
 	{
 		int rc;
 		int command_count = 0;
+		int batch_count = 0;
+		int due = 0;
 
 		MQTTAsync_lock_mutex(mqttcommand_mutex);
-		command_count = MQTTAsync_commands->count;
+		command_count = MQTTAsync_readyClients->count;
 		MQTTAsync_unlock_mutex(mqttcommand_mutex);
 		while (command_count > 0)
 		{
 			if (MQTTAsync_processCommand() == 0)
 				break;  /* no commands were processed, so go into a wait */
+			if (++batch_count == MQTTASYNC_SEND_BATCH_COMMANDS)
+			{
+				MQTTAsync_endSendBatches(1);
+				batch_count = 0;
+			}
 			MQTTAsync_lock_mutex(mqttcommand_mutex);
-			command_count = MQTTAsync_commands->count;
+			command_count = MQTTAsync_readyClients->count;
 			MQTTAsync_unlock_mutex(mqttcommand_mutex);
 		}
-#if !defined(_WIN32) && !defined(_WIN64)
-		if ((rc = Thread_wait_cond(send_cond, timeout)) != 0 && rc != ETIMEDOUT)
-			Log(LOG_ERROR, -1, "Error %d waiting for condition variable", rc);
-#else
-		if ((rc = Thread_wait_sem(send_sem, timeout)) != 0 && rc != ETIMEDOUT)
+		due = MQTTAsync_endSendBatches(0); /* write the packets for the commands just processed */
+		if ((rc = Thread_wait_sem(send_sem, (due > 0 && due < timeout) ? due : timeout)) != 0 && rc != ETIMEDOUT)
 			Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
-#endif
 		timeout = 1000; /* 1 second for follow on waits */
 		MQTTAsync_checkTimeouts();
 	}
+	MQTTAsync_endSendBatches(1);
 	sendThread_state = STOPPING;
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	sendThread_state = STOPPED;
@@ -1847,7 +2619,7 @@ void MQTTAsync_emptyMessageQueue(Clients* client)
 		{
 			qEntry* qe = (qEntry*)(current->content);
 			free(qe->topicName);
-			free(qe->msg->payload);
+			MQTTAsync_freePayload(qe->msg);
 			free(qe->msg);
 		}
 		ListEmpty(client->messageQueue);
@@ -1863,12 +2635,10 @@ void MQTTAsync_freeResponses(MQTTAsyncs* m)
 	FUNC_ENTRY;
 	if (m->responses)
 	{
-		ListElement* cur_response = NULL;
+		MQTTAsync_queuedCommand* command = NULL;
 
-		while (ListNextElement(m->responses, &cur_response))
+		while ((command = ListDetachHead(m->responses)) != NULL)
 		{
-			MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(cur_response->content);
-
 			if (command->command.onFailure)
 			{
 				MQTTAsync_failureData data;
@@ -1894,10 +2664,12 @@ void MQTTAsync_freeResponses(MQTTAsyncs* m)
 				(*(command->command.onFailure5))(command->command.context, &data);
 			}
 
-			MQTTAsync_freeCommand1(command);
+			MQTTAsync_freeCommand(command);
 			count++;
 		}
 		ListEmpty(m->responses);
+		MQTTProtocol_emptyMsgIds(&m->responseIds);
+		m->coalesced_publishes = 0;
 	}
 	Log(TRACE_MINIMUM, -1, "%d responses removed for client %s", count, m->c->clientID);
 	FUNC_EXIT;
@@ -1912,46 +2684,43 @@ void MQTTAsync_freeCommands(MQTTAsyncs* m)
 
 	FUNC_ENTRY;
 	/* remove commands in the command queue relating to this client */
-	current = ListNextElement(MQTTAsync_commands, &next);
-	ListNextElement(MQTTAsync_commands, &next);
+	current = ListNextElement(m->commands, &next);
+	ListNextElement(m->commands, &next);
 	while (current)
 	{
 		MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (command->client == m)
-		{
-			ListDetach(MQTTAsync_commands, command);
-
-			if (command->command.onFailure)
-			{
-				MQTTAsync_failureData data;
+		MQTTAsync_detachCommand(command);
 
-				data.token = command->command.token;
-				data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
-				data.message = NULL;
+		if (command->command.onFailure)
+		{
+			MQTTAsync_failureData data;
 
-				Log(TRACE_MIN, -1, "Calling %s failure for client %s",
-							MQTTPacket_name(command->command.type), m->c->clientID);
-					(*(command->command.onFailure))(command->command.context, &data);
-			}
-			else if (command->command.onFailure5)
-			{
-				MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
+			data.token = command->command.token;
+			data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
+			data.message = NULL;
 
-				data.token = command->command.token;
-				data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
-				data.message = NULL;
+			Log(TRACE_MIN, -1, "Calling %s failure for client %s",
+						MQTTPacket_name(command->command.type), m->c->clientID);
+				(*(command->command.onFailure))(command->command.context, &data);
+		}
+		else if (command->command.onFailure5)
+		{
+			MQTTAsync_failureData5 data = MQTTAsync_failureData5_initializer;
 
-				Log(TRACE_MIN, -1, "Calling %s failure for client %s",
-							MQTTPacket_name(command->command.type), m->c->clientID);
-					(*(command->command.onFailure5))(command->command.context, &data);
-			}
+			data.token = command->command.token;
+			data.code = MQTTASYNC_OPERATION_INCOMPLETE; /* interrupted return code */
+			data.message = NULL;
 
-			MQTTAsync_freeCommand(command);
-			count++;
+			Log(TRACE_MIN, -1, "Calling %s failure for client %s",
+						MQTTPacket_name(command->command.type), m->c->clientID);
+				(*(command->command.onFailure5))(command->command.context, &data);
 		}
+
+		MQTTAsync_freeCommand(command);
+		count++;
 		current = next;
-		ListNextElement(MQTTAsync_commands, &next);
+		ListNextElement(m->commands, &next);
 	}
 	Log(TRACE_MINIMUM, -1, "%d commands removed for client %s", count, m->c->clientID);
 	FUNC_EXIT;
@@ -1972,6 +2741,7 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 			m->c->connected = 1;
 			m->c->good = 1;
 			m->c->connect_state = NOT_IN_PROGRESS;
+			MQTTProtocol_scheduleKeepalive(m->c);
 			if (m->c->cleansession || m->c->cleanstart)
 				rc = MQTTAsync_cleanSession(m->c);
 			else if (m->c->MQTTVersion >= MQTTVERSION_3_1_1 && connack->flags.bits.sessionPresent == 0)
@@ -1995,11 +2765,7 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 			}
 		}
 		m->pack = NULL;
-#if !defined(_WIN32) && !defined(_WIN64)
-		Thread_signal_cond(send_cond);
-#else
 		Thread_post_sem(send_sem);
-#endif
 	}
 	FUNC_EXIT_RC(rc);
 	return rc;
@@ -2010,19 +2776,27 @@ static int MQTTAsync_completeConnection(MQTTAsyncs* m, Connack* connack)
 thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 {
 	long timeout = 10L; /* first time in we have a small timeout.  Gets things started more quickly */
+	SOCKET next_sock = 0; /* socket with packets already read, to be processed without polling */
+	int packets_read = 0; /* number of packets processed in succession for next_sock */
 
 	FUNC_ENTRY;
 	Thread_set_name("MQTTAsync_rcv");
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	receiveThread_state = RUNNING;
 	receiveThread_id = Paho_thread_getid();
+	if (Socket_hasWakeup())
+		timeout = 1000L; /* new sockets interrupt the wait, so there's no need to poll quickly */
 	while (!MQTTAsync_tostop)
 	{
 		int rc = SOCKET_ERROR;
-		SOCKET sock = -1;
+		SOCKET sock = next_sock;
 		MQTTAsyncs* m = NULL;
+		Clients* client = NULL;
 		MQTTPacket* pack = NULL;
 
+		if (next_sock == 0)
+			packets_read = 0;
+		next_sock = 0;
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
 		pack = MQTTAsync_cycle(&sock, timeout, &rc);
 		MQTTAsync_lock_mutex(mqttasync_mutex);
@@ -2034,13 +2808,13 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 		timeout = 1000L;
 
 		/* find client corresponding to socket */
-		if (ListFindItem(MQTTAsync_handles, &sock, clientSockCompare) == NULL)
+		if ((client = Clients_findSocket(bstate, sock)) == NULL)
 		{
 			Log(TRACE_MINIMUM, -1, "Could not find client corresponding to socket %d", sock);
 			/* Socket_close(sock); - removing socket in this case is not necessary (Bug 442400) */
 			continue;
 		}
-		m = (MQTTAsyncs*)(MQTTAsync_handles->current->content);
+		m = (MQTTAsyncs*)(client->context);
 		if (m == NULL)
 		{
 			Log(LOG_ERROR, -1, "Client structure was NULL for socket %d - removing socket", sock);
@@ -2054,7 +2828,9 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 		}
 		else
 		{
-			if (m->c->messageQueue->count > 0 && m->ma)
+			if (m->c->messageQueue->count > 0 && m->ma && MQTTAsync_usesCallbackThreads(m))
+				MQTTAsync_scheduleDelivery(m); /* retry delivery on a callback thread */
+			else if (m->c->messageQueue->count > 0 && m->ma)
 			{
 				qEntry* qe = (qEntry*)(m->c->messageQueue->first->content);
 				int topicLen = qe->topicLen;
@@ -2160,7 +2936,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 						if (command->command.token == ((Suback*)pack)->msgId)
 						{
 							Suback* sub = (Suback*)pack;
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
+							if (!MQTTAsync_detachResponse(command)) /* remove the response from the list */
 								Log(LOG_ERROR, -1, "Subscribe command not removed from command list");
 
 							/* Call the failure callback if there is one subscribe in the MQTT packet and
@@ -2258,7 +3034,7 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 						if (command->command.token == ((Unsuback*)pack)->msgId)
 						{
-							if (!ListDetach(m->responses, command)) /* remove the response from the list */
+							if (!MQTTAsync_detachResponse(command)) /* remove the response from the list */
 								Log(LOG_ERROR, -1, "Unsubscribe command not removed from command list");
 							if (command->command.onSuccess || command->command.onSuccess5)
 							{
@@ -2316,18 +3092,25 @@ thread_return_type WINAPI MQTTAsync_receiveThread(void* n)
 					nextOrClose(m, discrc, "Received disconnect");
 				}
 			}
+			/* carry on with packets already read for this client, up to its limit: in the
+			 * read ahead buffer for a plain socket, or in the SSL buffer for a TLS one */
+			if (m->createOptions && m->createOptions->struct_version >= 3 &&
+					++packets_read < m->createOptions->maxPacketsPerRead && m->c->net.socket == sock &&
+#if defined(OPENSSL)
+					(m->c->net.ssl ? SSLSocket_removePendingRead(sock) : SocketBuffer_removePendingRead(sock)))
+#else
+					SocketBuffer_removePendingRead(sock))
+#endif
+				next_sock = sock;
 		}
+		if (next_sock == 0)
+			MQTTAsync_endBatch(m, &m->receive_batch); /* write the acks for the packets just read */
 	}
 	receiveThread_state = STOPPED;
 	receiveThread_id = 0;
 	MQTTAsync_unlock_mutex(mqttasync_mutex);
-#if !defined(_WIN32) && !defined(_WIN64)
-	if (sendThread_state != STOPPED)
-		Thread_signal_cond(send_cond);
-#else
 	if (sendThread_state != STOPPED)
 		Thread_post_sem(send_sem);
-#endif
 
 #if defined(OPENSSL)
 #if OPENSSL_VERSION_NUMBER < 0x1010000fL
@@ -2352,7 +3135,7 @@ static void MQTTAsync_stop(void)
 #endif
 
 	FUNC_ENTRY;
-	if (sendThread_state != STOPPED || receiveThread_state != STOPPED)
+	if (sendThread_state != STOPPED || receiveThread_state != STOPPED || callbackThreads_count > 0)
 	{
 		int conn_count = 0;
 		ListElement* current = NULL;
@@ -2372,8 +3155,16 @@ static void MQTTAsync_stop(void)
 		if (conn_count == 0)
 		{
 			int count = 0;
+			int i = 0;
+			/* if we are being called on a callback thread, don't wait for it to end */
+			int self = MQTTAsync_isCallbackThread(Paho_thread_getid());
+
 			MQTTAsync_tostop = 1;
-			while ((sendThread_state != STOPPED || receiveThread_state != STOPPED) && MQTTAsync_tostop != 0 && ++count < 100)
+			Socket_wakeup(); /* interrupt the receive thread's wait for a socket */
+			for (i = 0; i < callbackThreads_count; ++i)
+				Thread_post_sem(callback_sem);
+			while ((sendThread_state != STOPPED || receiveThread_state != STOPPED || callbackThreads_count > self)
+					&& MQTTAsync_tostop != 0 && ++count < 100)
 			{
 				MQTTAsync_unlock_mutex(mqttasync_mutex);
 				Log(TRACE_MIN, -1, "sleeping");
@@ -2392,6 +3183,8 @@ static void MQTTAsync_stop(void)
 
 static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode, MQTTProperties* props)
 {
+	MQTTAsyncs* m = (MQTTAsyncs*)(client->context);
+
 	FUNC_ENTRY;
 	client->good = 0;
 	client->ping_outstanding = 0;
@@ -2399,8 +3192,12 @@ static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode
 	if (client->net.socket > 0)
 	{
 		MQTTProtocol_checkPendingWrites();
+		MQTTPacket_commit(&client->net, 1); /* wait for any persistence writes packets are held for */
+		MQTTPacket_flushCoalesced(&client->net); /* packets already written go before the disconnect */
+		MQTTAsync_completeCoalesced(m, 1);
 		if (client->connected && Socket_noPendingWrites(client->net.socket))
 			MQTTPacket_send_disconnect(client, reasonCode, props);
+		MQTTPacket_flushCoalesced(&client->net);
 		MQTTAsync_lock_mutex(socket_mutex);
 		WebSocket_close(&client->net, WebSocket_CLOSE_NORMAL, NULL);
 #if defined(OPENSSL)
@@ -2409,12 +3206,19 @@ static void MQTTAsync_closeOnly(Clients* client, enum MQTTReasonCodes reasonCode
 		SSLSocket_close(&client->net);
 #endif
 		MQTTAsync_unlock_mutex(socket_mutex);
+		Clients_removeSocket(bstate, client);
 		Socket_close(client->net.socket); /* Socket_close locks socket mutex itself */
 		client->net.socket = 0;
 #if defined(OPENSSL)
 		client->net.ssl = NULL;
 #endif
 	}
+	/* a new connection starts with no batches of writes */
+	MQTTAsync_completeCoalesced(m, -1); /* publishes whose packets were never written */
+	MQTTPacket_freeCoalesced(&client->net);
+	client->net.coalescing = 0;
+	m->send_batch = m->receive_batch = 0;
+	ListDetach(MQTTAsync_sendBatchClients, m);
 	client->connected = 0;
 	client->connect_state = NOT_IN_PROGRESS;
 	FUNC_EXIT;
@@ -2434,19 +3238,6 @@ void MQTTAsync_closeSession(Clients* client, enum MQTTReasonCodes reasonCode, MQ
 }
 
 
-/**
- * List callback function for comparing clients by client structure
- * @param a Async structure
- * @param b Client structure
- * @return boolean indicating whether a and b are equal
- */
-static int clientStructCompare(void* a, void* b)
-{
-	MQTTAsyncs* m = (MQTTAsyncs*)a;
-	return m->c == (Clients*)b;
-}
-
-
 /*
  * Set destinationName and payload to NULL in all responses
  * for a client, so that these memory locations aren't freed twice as they
@@ -2463,7 +3254,7 @@ void MQTTAsync_NULLPublishResponses(MQTTAsyncs* m)
 		while (ListNextElement(m->responses, &cur_response))
 		{
 			MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(cur_response->content);
-			if (command->command.type == PUBLISH)
+			if (command->command.type == PUBLISH && !command->coalesced) /* coalesced packets are copies */
 			{
 				/* these values are going to be freed in RemovePublication */
 				command->command.details.pub.destinationName = NULL;
@@ -2487,20 +3278,20 @@ void MQTTAsync_NULLPublishCommands(MQTTAsyncs* m)
 	ListElement *next = NULL;
 
 	FUNC_ENTRY;
-	current = ListNextElement(MQTTAsync_commands, &next);
-	ListNextElement(MQTTAsync_commands, &next);
+	current = ListNextElement(m->commands, &next);
+	ListNextElement(m->commands, &next);
 	while (current)
 	{
 		MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 
-		if (command->client == m && command->command.type == PUBLISH)
+		if (command->command.type == PUBLISH)
 		{
 			/* these values are going to be freed in RemovePublication */
 			command->command.details.pub.destinationName = NULL;
 			command->command.details.pub.payload = NULL;
 		}
 		current = next;
-		ListNextElement(MQTTAsync_commands, &next);
+		ListNextElement(m->commands, &next);
 	}
 	FUNC_EXIT;
 }
@@ -2515,7 +3306,7 @@ void MQTTAsync_NULLPublishCommands(MQTTAsyncs* m)
 static int MQTTAsync_cleanSession(Clients* client)
 {
 	int rc = 0;
-	ListElement* found = NULL;
+	MQTTAsyncs* m = (MQTTAsyncs*)client->context;
 
 	FUNC_ENTRY;
 #if !defined(NO_PERSISTENCE)
@@ -2523,15 +3314,16 @@ static int MQTTAsync_cleanSession(Clients* client)
 #endif
 	MQTTProtocol_emptyMessageList(client->inboundMsgs);
 	MQTTProtocol_emptyMessageList(client->outboundMsgs);
+	MQTTProtocol_emptyMessageIndex(&client->inboundIndex);
+	MQTTProtocol_emptyMessageIndex(&client->outboundIndex);
 	client->msgID = 0;
-	if ((found = ListFindItem(MQTTAsync_handles, client, clientStructCompare)) != NULL)
+	if (m)
 	{
-		MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
 		MQTTAsync_NULLPublishResponses(m);
 		MQTTAsync_freeResponses(m);
 	}
 	else
-		Log(LOG_ERROR, -1, "cleanSession: did not find client structure in handles list");
+		Log(LOG_ERROR, -1, "cleanSession: client structure has no handle");
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -2560,18 +3352,57 @@ static int MQTTAsync_deliverMessage(MQTTAsyncs* m, char* topicName, size_t topic
 }
 
 
+/**
+ * Free the payload of a message, or the receive buffer it points into.
+ * The message must have been allocated by the library, as an MQTTPersistence_message.
+ * @param mm the message
+ */
+void MQTTAsync_freePayload(MQTTAsync_message* mm)
+{
+	char* buffer = ((MQTTPersistence_message*)mm)->buffer;
+
+	FUNC_ENTRY;
+	free(buffer ? buffer : mm->payload);
+	FUNC_EXIT;
+}
+
+
 void Protocol_processPublication(Publish* publish, Clients* client, int allocatePayload)
 {
 	MQTTAsync_message* mm = NULL;
 	MQTTAsync_message initialized = MQTTAsync_message_initializer;
+	MQTTAsyncs* m = (MQTTAsyncs*)client->context;
+	char* buf = NULL;
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if ((mm = malloc(sizeof(MQTTAsync_message))) == NULL)
+	/* allocated with room for the receive buffer pointer, which MQTTAsync_freePayload checks */
+	if ((mm = malloc(sizeof(MQTTPersistence_message))) == NULL)
 		goto exit;
+	memset(mm, '\0', sizeof(MQTTPersistence_message));
 	memcpy(mm, &initialized, sizeof(MQTTAsync_message));
 
-	if (allocatePayload)
+	if (m == NULL)
+		Log(LOG_ERROR, -1, "processPublication: client structure has no handle");
+
+	/* with zeroCopyReceive, the message is given the buffer the packet was read into, if worthwhile */
+	if (allocatePayload && m && m->createOptions && m->createOptions->struct_version >= 5 &&
+			m->createOptions->zeroCopyReceive)
+		buf = SocketBuffer_takeData(publish->payload, publish->payloadlen);
+
+	if (buf)
+	{
+		((MQTTPersistence_message*)mm)->buffer = buf;
+		mm->payload = publish->payload;
+		if (publish->MQTTVersion >= MQTTVERSION_5)
+		{
+			MQTTProperties empty = MQTTProperties_initializer;
+
+			mm->properties = publish->properties;
+			publish->properties = empty;
+		}
+	}
+	else if (allocatePayload)
 	{
 		if ((mm->payload = malloc(publish->payloadlen)) == NULL)
 		{
@@ -2579,7 +3410,8 @@ void Protocol_processPublication(Publish* publish, Clients* client, int allocate
 			goto exit;
 		}
 		memcpy(mm->payload, publish->payload, publish->payloadlen);
-	} else
+	}
+	else
 		mm->payload = publish->payload;
 	mm->payloadlen = publish->payloadlen;
 	mm->qos = publish->header.bits.qos;
@@ -2590,25 +3422,16 @@ void Protocol_processPublication(Publish* publish, Clients* client, int allocate
 		mm->dup = publish->header.bits.dup;
 	mm->msgid = publish->msgId;
 
-	if (publish->MQTTVersion >= MQTTVERSION_5)
+	if (publish->MQTTVersion >= MQTTVERSION_5 && !buf)
 		mm->properties = MQTTProperties_copy(&publish->properties);
 
-	if (client->messageQueue->count == 0 && client->connected)
+	if (m && client->messageQueue->count == 0 && client->connected && !MQTTAsync_usesCallbackThreads(m))
 	{
-		ListElement* found = NULL;
-
-		if ((found = ListFindItem(MQTTAsync_handles, client, clientStructCompare)) == NULL)
-			Log(LOG_ERROR, -1, "processPublication: did not find client structure in handles list");
+		if (m->ma)
+			rc = MQTTAsync_deliverMessage(m, publish->topic, publish->topiclen, mm);
 		else
-		{
-			MQTTAsyncs* m = (MQTTAsyncs*)(found->content);
-
-			if (m->ma)
-				rc = MQTTAsync_deliverMessage(m, publish->topic, publish->topiclen, mm);
-			else
-				Log(LOG_ERROR, -1, "Message arrived for client %s but can't deliver it. No messageArrived callback",
-						m->c->clientID);
-		}
+			Log(LOG_ERROR, -1, "Message arrived for client %s but can't deliver it. No messageArrived callback",
+					m->c->clientID);
 	}
 
 	if (rc == 0) /* if message was not delivered, queue it up */
@@ -2625,6 +3448,8 @@ void Protocol_processPublication(Publish* publish, Clients* client, int allocate
 		if (client->persistence)
 			MQTTPersistence_persistQueueEntry(client, (MQTTPersistence_qEntry*)qe);
 #endif
+		if (m && m->ma && MQTTAsync_usesCallbackThreads(m))
+			MQTTAsync_scheduleDelivery(m);
 	}
 exit:
 	publish->topic = NULL;
@@ -2632,6 +3457,243 @@ exit:
 }
 
 
+/**
+ * Does this client have its messageArrived callbacks called on the callback threads?
+ * @param m the client
+ * @return boolean
+ */
+static int MQTTAsync_usesCallbackThreads(MQTTAsyncs* m)
+{
+	return m->createOptions && m->createOptions->struct_version >= 4 && m->createOptions->callbackThreads > 0;
+}
+
+
+static int MQTTAsync_isCallbackThread(thread_id_type thread_id)
+{
+	int i;
+
+	for (i = 0; i < MQTTASYNC_MAX_CALLBACK_THREADS; ++i)
+	{
+		if (callbackThread_ids[i] == thread_id)
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Start enough callback threads for this client, if it uses them.
+ * Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+void MQTTAsync_startCallbackThreads(MQTTAsyncs* m)
+{
+	int threads = 0;
+
+	FUNC_ENTRY;
+	if (!MQTTAsync_usesCallbackThreads(m))
+		goto exit;
+	if (callback_sem == NULL)
+	{
+		int rc = 0;
+
+		if ((callback_sem = Thread_create_sem(&rc)) == NULL)
+		{
+			Log(LOG_ERROR, -1, "Error %d creating callback thread semaphore", rc);
+			goto exit;
+		}
+	}
+	if (MQTTAsync_deliveryClients == NULL)
+		MQTTAsync_deliveryClients = ListInitialize();
+	threads = min(m->createOptions->callbackThreads, MQTTASYNC_MAX_CALLBACK_THREADS);
+	while (callbackThreads_count < threads)
+	{
+		callbackThreads_count++;
+		Paho_thread_start(MQTTAsync_callbackThread, NULL);
+	}
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Queue a client for a callback thread to deliver its next message.  A client is only ever on
+ * the queue once, and not while a callback thread is delivering a message for it, so its
+ * messages are delivered one at a time, in order.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+static void MQTTAsync_scheduleDelivery(MQTTAsyncs* m)
+{
+	if (m->delivery_scheduled || m->delivery_thread != 0 || MQTTAsync_deliveryClients == NULL)
+		return;
+	m->delivery_scheduled = 1;
+	ListAppend(MQTTAsync_deliveryClients, m, sizeof(MQTTAsyncs));
+	Thread_post_sem(callback_sem);
+}
+
+
+/**
+ * Stop any further message deliveries on the callback threads for a client which is being
+ * destroyed, waiting for one in progress on another thread to finish.
+ * Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+void MQTTAsync_cancelDelivery(MQTTAsyncs* m)
+{
+	thread_id_type thread_id = Paho_thread_getid();
+
+	FUNC_ENTRY;
+	if (m->delivery_thread != 0 && m->delivery_thread != thread_id)
+	{
+		int rc = 0;
+
+		if ((m->delivery_ended = Thread_create_sem(&rc)) == NULL)
+			Log(LOG_ERROR, -1, "Error %d creating delivery semaphore", rc);
+		while (m->delivery_thread != 0)
+		{
+			MQTTAsync_unlock_mutex(mqttasync_mutex);
+			if (m->delivery_ended == NULL)
+				MQTTAsync_sleep(10L);
+			else if ((rc = Thread_wait_sem(m->delivery_ended, 1000)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+		}
+		if (m->delivery_ended)
+		{
+			Thread_destroy_sem(m->delivery_ended);
+			m->delivery_ended = NULL;
+		}
+	}
+	if (m->delivery_scheduled)
+	{
+		ListDetach(MQTTAsync_deliveryClients, m);
+		m->delivery_scheduled = 0;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Call messageArrived for the first message queued for a client.  The internal lock is
+ * released while the callback runs.  Must be called with mqttasync_mutex locked.
+ * @param m the client
+ */
+static void MQTTAsync_deliverQueued(MQTTAsyncs* m)
+{
+	qEntry* qe = NULL;
+	size_t topicLen = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (m->c->messageQueue->count == 0 || m->ma == NULL)
+		goto exit;
+	qe = (qEntry*)(m->c->messageQueue->first->content);
+	topicLen = qe->topicLen;
+	if (strlen(qe->topicName) == topicLen)
+		topicLen = 0;
+
+	/* take the message off the queue while the lock is released, so it isn't freed underneath us */
+	ListDetach(m->c->messageQueue, qe);
+	m->delivery_thread = Paho_thread_getid();
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+	rc = MQTTAsync_deliverMessage(m, qe->topicName, topicLen, qe->msg);
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+
+	if (MQTTAsync_handles == NULL || ListFind(MQTTAsync_handles, m) == NULL)
+	{
+		/* the client was destroyed in the callback */
+		if (rc == 0)
+		{
+			free(qe->topicName);
+			MQTTAsync_freePayload(qe->msg);
+			MQTTProperties_free(&qe->msg->properties);
+			free(qe->msg);
+		}
+		free(qe);
+		goto exit;
+	}
+	m->delivery_thread = 0;
+	if (m->delivery_ended)
+		Thread_post_sem(m->delivery_ended); /* the client is being destroyed on another thread */
+	if (rc)
+	{
+#if !defined(NO_PERSISTENCE)
+		if (m->c->persistence)
+			MQTTPersistence_unpersistQueueEntry(m->c, (MQTTPersistence_qEntry*)qe);
+#endif
+		free(qe);
+		if (m->c->messageQueue->count > 0)
+			MQTTAsync_scheduleDelivery(m);
+	}
+	else
+	{
+		/* put the message back, to be retried when the next packet arrives for this client */
+		ListInsert(m->c->messageQueue, qe, sizeof(qe) + sizeof(qe->msg) + qe->msg->payloadlen + strlen(qe->topicName)+1,
+				m->c->messageQueue->first);
+		Log(TRACE_MIN, -1, "False returned from messageArrived for client %s, message remains on queue",
+			m->c->clientID);
+	}
+exit:
+	FUNC_EXIT;
+}
+
+
+/* This is the thread function that calls messageArrived for clients using callback threads */
+thread_return_type WINAPI MQTTAsync_callbackThread(void* n)
+{
+	int i;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTTAsync_cb");
+	MQTTAsync_lock_mutex(mqttasync_mutex);
+	for (i = 0; i < MQTTASYNC_MAX_CALLBACK_THREADS; ++i)
+	{
+		if (callbackThread_ids[i] == 0)
+		{
+			callbackThread_ids[i] = Paho_thread_getid();
+			break;
+		}
+	}
+	while (!MQTTAsync_tostop && MQTTAsync_deliveryClients)
+	{
+		MQTTAsyncs* m = NULL;
+
+		if (MQTTAsync_deliveryClients->count > 0)
+		{
+			m = (MQTTAsyncs*)(MQTTAsync_deliveryClients->first->content);
+			ListDetach(MQTTAsync_deliveryClients, m);
+			m->delivery_scheduled = 0;
+			MQTTAsync_deliverQueued(m);
+		}
+		else
+		{
+			int rc = 0;
+
+			MQTTAsync_unlock_mutex(mqttasync_mutex);
+			if ((rc = Thread_wait_sem(callback_sem, 1000)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+			MQTTAsync_lock_mutex(mqttasync_mutex);
+		}
+	}
+	for (i = 0; i < MQTTASYNC_MAX_CALLBACK_THREADS; ++i)
+	{
+		if (callbackThread_ids[i] == Paho_thread_getid())
+		{
+			callbackThread_ids[i] = 0;
+			break;
+		}
+	}
+	callbackThreads_count--;
+	MQTTAsync_unlock_mutex(mqttasync_mutex);
+
+	FUNC_EXIT;
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+
 static int retryLoopIntervalms = 5000;
 
 void setRetryLoopInterval(int keepalive)
@@ -2666,7 +3728,7 @@ int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* o
 	}
 
 	/* Add disconnect request to operation queue */
-	if ((dis = malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
+	if ((dis = Pool_malloc(sizeof(MQTTAsync_queuedCommand))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
@@ -2720,17 +3782,21 @@ static int cmdMessageIDCompare(void* a, void* b)
 
 
 /**
- * Assign a new message id for a client.  Make sure it isn't already being used and does
- * not exceed the maximum.
- * @param m a client structure
- * @return the next message id to use, or 0 if none available
+ * Assign a set of free message ids for a client.  The ids in use by its commands, responses
+ * and outbound messages are found from their message id maps, rather than by searching the lists.
+ * @param m the client
+ * @param msgids array to receive the message ids
+ * @param count the number of message ids wanted
+ * @return the number of message ids assigned, which is less than count if they ran out
  */
-int MQTTAsync_assignMsgId(MQTTAsyncs* m)
+int MQTTAsync_assignMsgIds(MQTTAsyncs* m, int* msgids, int count)
 {
 	int start_msgid;
 	int msgid;
+	int assigned = 0;
 	thread_id_type thread_id = 0;
 	int locked = 0;
+	messageIdMap* maps[3];
 
 	/* need to check: commands list and response list for a client */
 	FUNC_ENTRY;
@@ -2747,24 +3813,47 @@ int MQTTAsync_assignMsgId(MQTTAsyncs* m)
 	msgid = start_msgid;
 
 	MQTTAsync_lock_mutex(mqttcommand_mutex);
-	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-	while (ListFindItem(MQTTAsync_commands, &msgid, cmdMessageIDCompare) ||
-			ListFindItem(m->c->outboundMsgs, &msgid, messageIDCompare) ||
-			ListFindItem(m->responses, &msgid, cmdMessageIDCompare))
-	{
-		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-		if (msgid == start_msgid)
-		{ /* we've tried them all - none free */
-			msgid = 0;
-			break;
+	maps[0] = &m->commandIds;
+	maps[1] = &m->responseIds;
+	maps[2] = &m->c->outboundIndex.ids;
+	while (assigned < count)
+	{
+		/* the ids assigned so far are behind us, so the search won't find them again
+		   before wrapping back to start_msgid */
+		int next = MQTTProtocol_findFreeMsgId(maps, 3, msgid, start_msgid);
+
+		if (next == -1)
+		{
+			/* a map is incomplete, so check each id in turn */
+			next = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
+			while (ListFindItem(m->commands, &next, cmdMessageIDCompare) ||
+					MQTTProtocol_findMessage(m->c->outboundMsgs, &m->c->outboundIndex, next) ||
+					ListFindItem(m->responses, &next, cmdMessageIDCompare))
+			{
+				if (next == start_msgid)
+					break;
+				next = (next == MAX_MSG_ID) ? 1 : next + 1;
+			}
 		}
+		if (next == 0 || next == start_msgid)
+			break; /* we've tried them all - none free */
+		msgids[assigned++] = msgid = next;
 	}
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
-	if (msgid != 0)
-		m->c->msgID = msgid;
+	if (assigned > 0)
+		m->c->msgID = msgids[assigned - 1];
 	if (locked)
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
-	FUNC_EXIT_RC(msgid);
+	FUNC_EXIT_RC(assigned);
+	return assigned;
+}
+
+
+int MQTTAsync_assignMsgId(MQTTAsyncs* m)
+{
+	int msgid = 0;
+
+	MQTTAsync_assignMsgIds(m, &msgid, 1);
 	return msgid;
 }
 
@@ -2782,8 +3871,6 @@ static void MQTTAsync_retry(void)
 		MQTTProtocol_keepalive(now);
 		MQTTProtocol_retry(now, 1, 0);
 	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
 	FUNC_EXIT;
 }
 
@@ -3005,10 +4092,14 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 	int rc1 = 0;
 
 	FUNC_ENTRY;
+	if (*sock > 0)
+		Log(TRACE_MAX, -1, "Processing next packet already read for socket %d", *sock);
 #if defined(OPENSSL)
-	if ((*sock = SSLSocket_getPendingRead()) == -1)
-	{
+	else if ((*sock = SSLSocket_getPendingRead()) == -1)
+#else
+	else
 #endif
+	{
 		int should_stop = 0;
 
 		/* 0 from getReadySocket indicates no work to do, rc -1 == error */
@@ -3017,17 +4108,18 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 		MQTTAsync_lock_mutex(mqttasync_mutex);
 		should_stop = MQTTAsync_tostop;
 		MQTTAsync_unlock_mutex(mqttasync_mutex);
-		if (!should_stop && *sock == 0 && (timeout > 0L))
+		/* without a wakeup descriptor, a wait with no sockets to wait on can return immediately */
+		if (!should_stop && *sock == 0 && (timeout > 0L) && !Socket_hasWakeup())
 			MQTTAsync_sleep(100L);
-#if defined(OPENSSL)
 	}
-#endif
 	MQTTAsync_lock_mutex(mqttasync_mutex);
 	if (*sock > 0 && rc1 == 0)
 	{
 		MQTTAsyncs* m = NULL;
-		if (ListFindItem(MQTTAsync_handles, sock, clientSockCompare) != NULL)
-			m = (MQTTAsync)(MQTTAsync_handles->current->content);
+		Clients* client = NULL;
+
+		if ((client = Clients_findSocket(bstate, *sock)) != NULL)
+			m = (MQTTAsync)(client->context);
 		if (m != NULL)
 		{
 			Log(TRACE_MINIMUM, -1, "m->c->connect_state = %d", m->c->connect_state);
@@ -3045,6 +4137,8 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 		{
 			int freed = 1;
 
+			if (m)
+				MQTTAsync_startBatch(m, &m->receive_batch); /* coalesce the acks for packets read together */
 			/* Note that these handle... functions free the packet structure that they are dealing with */
 			if (pack->header.bits.type == PUBLISH)
 				*rc = MQTTProtocol_handlePublishes(pack, *sock);
@@ -3081,6 +4175,8 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 					*rc = MQTTProtocol_handlePubacks(pack, *sock, &pubToRemove);
 				if (!m)
 					Log(LOG_ERROR, -1, "PUBCOMP, PUBACK or PUBREC received for no client, msgid %d", msgid);
+				else
+					MQTTAsync_wakeSendThread(m); /* an inflight slot may have been freed */
 				if (m && (msgtype != PUBREC || ackrc >= MQTTREASONCODE_UNSPECIFIED_ERROR))
 				{
 					ListElement* current = NULL;
@@ -3096,7 +4192,7 @@ static MQTTPacket* MQTTAsync_cycle(SOCKET* sock, unsigned long timeout, int* rc)
 						MQTTAsync_queuedCommand* command = (MQTTAsync_queuedCommand*)(current->content);
 						if (command->command.token == msgid)
 						{
-							if (!ListDetach(m->responses, command)) /* then remove the response from the list */
+							if (!MQTTAsync_detachResponse(command)) /* then remove the response from the list */
 								Log(LOG_ERROR, -1, "Publish command not removed from command list");
 							if (command->command.onSuccess)
 							{
@@ -3182,3 +4278,14 @@ int MQTTAsync_getNoBufferedMessages(MQTTAsyncs* m)
 	MQTTAsync_unlock_mutex(mqttcommand_mutex);
 	return count;
 }
+
+
+size_t MQTTAsync_getNoBufferedBytes(MQTTAsyncs* m)
+{
+	size_t bytes = 0;
+
+	MQTTAsync_lock_mutex(mqttcommand_mutex);
+	bytes = m->noBufferedBytes;
+	MQTTAsync_unlock_mutex(mqttcommand_mutex);
+	return bytes;
+}
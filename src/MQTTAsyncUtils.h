@@ -86,6 +86,17 @@ typedef struct
 	} details;
 } MQTTAsync_command;
 
+/* a persisted command read from the persistence index, which is not yet on the command queue */
+typedef struct
+{
+	unsigned int seqno; /* of the persistence key */
+	MQTTAsync_token token;
+	int type;
+	int payloadlen; /* for a PUBLISH */
+	int qos; /* for a PUBLISH */
+	int MQTTVersion; /* the version of the persistence key */
+} MQTTAsync_restoreEntry;
+
 typedef struct MQTTAsync_struct
 {
 	char* serverURI;
@@ -114,9 +125,12 @@ typedef struct MQTTAsync_struct
 	   any call to reconnect, or an automatic reconnect attempt */
 	MQTTAsync_command connect;		/* Connect operation properties */
 	MQTTAsync_command disconnect;		/* Disconnect operation properties */
-	MQTTAsync_command* pending_write;       /* Is there a socket write pending? */
 
+	List* commands; /* commands waiting to be processed by the send thread, in order */
 	List* responses;
+	messageIdMap commandIds; /* message ids of the commands, changed with mqttcommand_mutex locked */
+	messageIdMap responseIds; /* message ids of the responses, changed with mqttasync_mutex locked */
+	Timer timeoutTimer; /* when to next check the connect, disconnect or reconnect in progress */
 	unsigned int command_seqno;
 
 	MQTTPacket* pack;
@@ -125,6 +139,7 @@ typedef struct MQTTAsync_struct
 	MQTTAsync_createOptions* createOptions;
 	int shouldBeConnected;
 	int noBufferedMessages; /* the current number of buffered (publish) messages for this client */
+	size_t noBufferedBytes; /* the number of payload bytes in the buffered messages */
 
 	/* added for automatic reconnect */
 	int automaticReconnect;
@@ -144,6 +159,26 @@ typedef struct MQTTAsync_struct
 	MQTTProperties* connectProps;
 	MQTTProperties* willProps;
 
+	/* added for callback threads */
+	int delivery_scheduled; /* is this client waiting for a callback thread? */
+	thread_id_type delivery_thread; /* the callback thread calling messageArrived for this client, or 0 */
+	sem_type delivery_ended; /* posted when delivery_thread is reset, while the client is being destroyed */
+
+	/* added for write coalescing */
+	int send_batch; /* has the send thread started a batch of writes for this client? */
+	int receive_batch; /* has the receive thread started a batch of writes for this client? */
+	int coalesced_publishes; /* the number of QoS 0 publish responses waiting for coalesced packets to be written */
+
+	/* added for group commit */
+	int commit_waiting; /* is the send thread keeping its batch open for more records to commit? */
+	START_TIME_TYPE commit_wait_start; /* when the send thread started keeping its batch open */
+
+	/* added for indexed restore */
+	MQTTAsync_restoreEntry* restore_entries; /* persisted commands to be queued after those restored so far */
+	int restore_count; /* the number of restore entries */
+	int restore_next; /* the next restore entry to be queued */
+	int restores_queued; /* the number of restored commands on the command queue */
+
 } MQTTAsyncs;
 
 typedef struct
@@ -153,6 +188,8 @@ typedef struct
 	unsigned int seqno; /* only used on restore */
 	int not_restored;
 	char* key; /* if not_restored, this holds the key */
+	int restored; /* queued from the persistence index, so ahead of any commands added since */
+	int coalesced; /* a QoS 0 publish whose packet is coalesced with others, and not yet written */
 } MQTTAsync_queuedCommand;
 
 void MQTTAsync_lock_mutex(mutex_type amutex);
@@ -160,8 +197,10 @@ void MQTTAsync_unlock_mutex(mutex_type amutex);
 void MQTTAsync_terminate(void);
 #if !defined(NO_PERSISTENCE)
 int MQTTAsync_restoreCommands(MQTTAsyncs* client);
+int MQTTAsync_persistIndex(MQTTAsyncs* m);
 #endif
 int MQTTAsync_addCommand(MQTTAsync_queuedCommand* command, int command_size);
+int MQTTAsync_addCommands(MQTTAsync_queuedCommand** commands, int count, int command_size);
 void MQTTAsync_emptyMessageQueue(Clients* client);
 void MQTTAsync_freeResponses(MQTTAsyncs* m);
 void MQTTAsync_freeCommands(MQTTAsyncs* m);
@@ -169,12 +208,20 @@ int MQTTAsync_unpersistCommandsAndMessages(Clients* c);
 void MQTTAsync_closeSession(Clients* client, enum MQTTReasonCodes reasonCode, MQTTProperties* props);
 int MQTTAsync_disconnect1(MQTTAsync handle, const MQTTAsync_disconnectOptions* options, int internal);
 int MQTTAsync_assignMsgId(MQTTAsyncs* m);
+int MQTTAsync_assignMsgIds(MQTTAsyncs* m, int* msgids, int count);
 int MQTTAsync_getNoBufferedMessages(MQTTAsyncs* m);
+size_t MQTTAsync_getNoBufferedBytes(MQTTAsyncs* m);
 void MQTTAsync_writeContinue(SOCKET socket);
 void MQTTAsync_writeComplete(SOCKET socket, int rc);
+void MQTTAsync_persistenceWritten(void);
 void setRetryLoopInterval(int keepalive);
 void MQTTAsync_NULLPublishResponses(MQTTAsyncs* m);
 void MQTTAsync_NULLPublishCommands(MQTTAsyncs* m);
+void MQTTAsync_startCallbackThreads(MQTTAsyncs* m);
+void MQTTAsync_cancelDelivery(MQTTAsyncs* m);
+void MQTTAsync_scheduleTimeouts(MQTTAsyncs* m);
+void MQTTAsync_cancelTimeouts(MQTTAsyncs* m);
+void MQTTAsync_freePayload(MQTTAsync_message* mm);
 
 #if defined(_WIN32) || defined(_WIN64)
 #else
@@ -182,6 +229,7 @@ void MQTTAsync_NULLPublishCommands(MQTTAsyncs* m);
 #endif
 
 thread_return_type WINAPI MQTTAsync_sendThread(void* n);
+thread_return_type WINAPI MQTTAsync_callbackThread(void* n);
 thread_return_type WINAPI MQTTAsync_receiveThread(void* n);
 
 #endif /* MQTTASYNCUTILS_H_ */
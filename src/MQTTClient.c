@@ -66,6 +66,7 @@
 #include "SocketBuffer.h"
 #include "StackTrace.h"
 #include "Heap.h"
+#include "Pool.h"
 
 #if defined(OPENSSL)
 #include <openssl/ssl.h>
@@ -122,6 +123,9 @@ static mutex_type connect_mutex = NULL;
 extern mutex_type stack_mutex;
 extern mutex_type heap_mutex;
 #endif
+#if defined(USE_POOLS)
+extern mutex_type pool_mutex;
+#endif
 extern mutex_type log_mutex;
 
 int MQTTClient_init(void)
@@ -161,6 +165,14 @@ int MQTTClient_init(void)
 			printf("heap_mutex error %d\n", rc);
 			goto exit;
 		}
+#endif
+#if defined(USE_POOLS)
+		if ((pool_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
+		{
+			rc = GetLastError();
+			printf("pool_mutex error %d\n", rc);
+			goto exit;
+		}
 #endif
 		if ((log_mutex = CreateMutex(NULL, 0, NULL)) == NULL)
 		{
@@ -190,6 +202,10 @@ void MQTTClient_cleanup(void)
 		CloseHandle(stack_mutex);
 	if (heap_mutex)
 		CloseHandle(heap_mutex);
+#endif
+#if defined(USE_POOLS)
+	if (pool_mutex)
+		CloseHandle(pool_mutex);
 #endif
 	if (log_mutex)
 		CloseHandle(log_mutex);
@@ -338,7 +354,6 @@ static int MQTTClient_deliverMessage(
 		int rc, MQTTClients* m,
 		char** topicName, int* topicLen,
 		MQTTClient_message** message);
-static int clientSockCompare(void* a, void* b);
 static thread_return_type WINAPI connectionLost_call(void* context);
 static thread_return_type WINAPI MQTTClient_run(void* n);
 static int MQTTClient_stop(void);
@@ -388,7 +403,9 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		goto exit;
 	}
 
-	if (strlen(clientId) == 0 && persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT)
+	if (strlen(clientId) == 0 && (persistence_type == MQTTCLIENT_PERSISTENCE_DEFAULT ||
+		persistence_type == MQTTCLIENT_PERSISTENCE_LOG ||
+		(persistence_type == MQTTCLIENT_PERSISTENCE_MEMORY && persistence_context != NULL)))
 	{
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 		goto exit;
@@ -411,12 +428,20 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		}
 	}
 
-	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 || options->struct_version != 0))
+	if (options && (strncmp(options->struct_id, "MQCO", 4) != 0 ||
+					options->struct_version < 0 || options->struct_version > 1))
 	{
 		rc = MQTTCLIENT_BAD_STRUCTURE;
 		goto exit;
 	}
 
+	if (options && options->struct_version >= 1 && (options->persistenceDurability < 0 ||
+			options->persistenceDurability > MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC))
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
 	if (!library_initialized)
 	{
 		#if !defined(NO_HEAP_TRACKING)
@@ -495,6 +520,8 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 	memset(m->c, '\0', sizeof(Clients));
 	m->c->context = m;
 	m->c->MQTTVersion = (options) ? options->MQTTVersion : MQTTVERSION_DEFAULT;
+	if (options && options->struct_version >= 1)
+		m->c->durability = options->persistenceDurability;
 	m->c->outboundMsgs = ListInitialize();
 	m->c->inboundMsgs = ListInitialize();
 	m->c->messageQueue = ListInitialize();
@@ -512,6 +539,7 @@ int MQTTClient_createWithOptions(MQTTClient* handle, const char* serverURI, cons
 		rc = MQTTPersistence_initialize(m->c, m->serverURI);
 		if (rc == 0)
 			MQTTPersistence_restoreMessageQueue(m->c);
+		MQTTPersistence_freeIndex(m->c); /* commands are only persisted by MQTTAsync */
 	}
 #endif
 	ListAppend(bstate->clients, m->c, sizeof(Clients) + 3*sizeof(List));
@@ -684,19 +712,6 @@ static int MQTTClient_deliverMessage(int rc, MQTTClients* m, char** topicName, i
 }
 
 
-/**
- * List callback function for comparing clients by socket
- * @param a first integer value
- * @param b second integer value
- * @return boolean indicating whether a and b are equal
- */
-static int clientSockCompare(void* a, void* b)
-{
-	MQTTClients* m = (MQTTClients*)a;
-	return m->c->net.socket == *(int*)b;
-}
-
-
 /**
  * Wrapper function to call connection lost on a separate thread.  A separate thread is needed to allow the
  * connectionLost function to make API calls (e.g. connect)
@@ -836,6 +851,7 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 		int rc = SOCKET_ERROR;
 		SOCKET sock = -1;
 		MQTTClients* m = NULL;
+		Clients* client = NULL;
 		MQTTPacket* pack = NULL;
 
 		Paho_thread_unlock_mutex(mqttclient_mutex);
@@ -846,12 +862,12 @@ static thread_return_type WINAPI MQTTClient_run(void* n)
 		timeout = 100L;
 
 		/* find client corresponding to socket */
-		if (ListFindItem(handles, &sock, clientSockCompare) == NULL)
+		if ((client = Clients_findSocket(bstate, sock)) == NULL)
 		{
 			/* assert: should not happen */
 			continue;
 		}
-		m = (MQTTClient)(handles->current->content);
+		m = (MQTTClient)(client->context);
 		if (m == NULL)
 		{
 			/* assert: should not happen */
@@ -1109,6 +1125,7 @@ static void MQTTClient_closeSession(Clients* client, enum MQTTReasonCodes reason
 		SSLSocket_close(&client->net);
 #endif
 		Paho_thread_unlock_mutex(socket_mutex);
+		Clients_removeSocket(bstate, client);
 		Socket_close(client->net.socket);
 		client->net.socket = 0;
 #if defined(OPENSSL)
@@ -1134,6 +1151,8 @@ static int MQTTClient_cleanSession(Clients* client)
 #endif
 	MQTTProtocol_emptyMessageList(client->inboundMsgs);
 	MQTTProtocol_emptyMessageList(client->outboundMsgs);
+	MQTTProtocol_emptyMessageIndex(&client->inboundIndex);
+	MQTTProtocol_emptyMessageIndex(&client->outboundIndex);
 	MQTTClient_emptyMessageQueue(client);
 	client->msgID = 0;
 	FUNC_EXIT_RC(rc);
@@ -1428,6 +1447,7 @@ static MQTTResponse MQTTClient_connectURIVersion(MQTTClient handle, MQTTClient_c
 				m->c->connected = 1;
 				m->c->good = 1;
 				m->c->connect_state = NOT_IN_PROGRESS;
+				MQTTProtocol_scheduleKeepalive(m->c);
 				if (MQTTVersion == 4)
 					sessionPresent = connack->flags.bits.sessionPresent;
 				if (m->c->cleansession || m->c->cleanstart)
@@ -2335,8 +2355,13 @@ int MQTTClient_unsubscribe(MQTTClient handle, const char* topic)
 }
 
 
-MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
-		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+/**
+ * Publish a message, copying the payload or taking it over
+ * @param owned boolean - is the payload taken over, rather than copied?  If so, it is freed
+ * by the library whether or not the message is accepted
+ */
+static MQTTResponse MQTTClient_publish5_1(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
+		int owned, int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
 {
 	int rc = MQTTCLIENT_SUCCESS;
 	MQTTClients* m = handle;
@@ -2385,7 +2410,7 @@ MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int p
 		goto exit;
 	}
 
-	if ((p = malloc(sizeof(Publish))) == NULL)
+	if ((p = Pool_malloc(sizeof(Publish))) == NULL)
 	{
 		rc = PAHO_MEMORY_ERROR;
 		goto exit_and_free;
@@ -2393,7 +2418,12 @@ MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int p
 	memset(p->mask, '\0', sizeof(p->mask));
 	p->payload = NULL;
 	p->payloadlen = payloadlen;
-	if (payloadlen > 0)
+	if (owned)
+	{
+		p->payload = (void*)payload; /* freed with the packet from now on */
+		owned = 0;
+	}
+	else if (payloadlen > 0)
 	{
 		if ((p->payload = malloc(payloadlen)) == NULL)
 		{
@@ -2457,7 +2487,7 @@ exit_and_free:
 			free(p->topic);
 		if (p->payload)
 			free(p->payload);
-		free(p);
+		Pool_free(p, sizeof(Publish));
 	}
 
 	if (rc == SOCKET_ERROR)
@@ -2469,12 +2499,28 @@ exit_and_free:
 
 exit:
 	Paho_thread_unlock_mutex(mqttclient_mutex);
+	if (owned)
+		free((void*)payload);
 	resp.reasonCode = rc;
 	FUNC_EXIT_RC(resp.reasonCode);
 	return resp;
 }
 
 
+MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+{
+	return MQTTClient_publish5_1(handle, topicName, payloadlen, payload, 0, qos, retained, properties, deliveryToken);
+}
+
+
+MQTTResponse MQTTClient_publishBuffer5(MQTTClient handle, const char* topicName, int payloadlen, void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* deliveryToken)
+{
+	return MQTTClient_publish5_1(handle, topicName, payloadlen, payload, 1, qos, retained, properties, deliveryToken);
+}
+
+
 int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
 							 int qos, int retained, MQTTClient_deliveryToken* deliveryToken)
 {
@@ -2489,6 +2535,23 @@ int MQTTClient_publish(MQTTClient handle, const char* topicName, int payloadlen,
 }
 
 
+int MQTTClient_publishBuffer(MQTTClient handle, const char* topicName, int payloadlen, void* payload,
+							 int qos, int retained, MQTTClient_deliveryToken* deliveryToken)
+{
+	MQTTClients* m = handle;
+	MQTTResponse rc = MQTTResponse_initializer;
+
+	if (m->c->MQTTVersion >= MQTTVERSION_5)
+	{
+		free(payload);
+		rc.reasonCode = MQTTCLIENT_WRONG_MQTT_VERSION;
+	}
+	else
+		rc = MQTTClient_publishBuffer5(handle, topicName, payloadlen, payload, qos, retained, NULL, deliveryToken);
+	return rc.reasonCode;
+}
+
+
 MQTTResponse MQTTClient_publishMessage5(MQTTClient handle, const char* topicName, MQTTClient_message* message,
 								MQTTClient_deliveryToken* deliveryToken)
 {
@@ -2550,8 +2613,6 @@ static void MQTTClient_retry(void)
 		MQTTProtocol_keepalive(now);
 		MQTTProtocol_retry(now, 1, 0);
 	}
-	else
-		MQTTProtocol_retry(now, 0, 0);
 	FUNC_EXIT;
 }
 
@@ -2581,8 +2642,10 @@ static MQTTPacket* MQTTClient_cycle(SOCKET* sock, ELAPSED_TIME_TYPE timeout, int
 	if (*sock > 0 && rc1 == 0)
 	{
 		MQTTClients* m = NULL;
-		if (ListFindItem(handles, sock, clientSockCompare) != NULL)
-			m = (MQTTClient)(handles->current->content);
+		Clients* client = NULL;
+
+		if ((client = Clients_findSocket(bstate, *sock)) != NULL)
+			m = (MQTTClient)(client->context);
 		if (m != NULL)
 		{
 			if (m->c->connect_state == TCP_IN_PROGRESS || m->c->connect_state == SSL_IN_PROGRESS)
@@ -2802,8 +2865,9 @@ int MQTTClient_receive(MQTTClient handle, char** topicName, int* topicLen, MQTTC
 
 		if (rc == SOCKET_ERROR)
 		{
-			if (ListFindItem(handles, &sock, clientSockCompare) && 	/* find client corresponding to socket */
-			  (MQTTClient)(handles->current->content) == handle)
+			Clients* client = Clients_findSocket(bstate, sock); /* find client corresponding to socket */
+
+			if (client && (MQTTClient)(client->context) == handle)
 				break; /* there was an error on the socket we are interested in */
 		}
 		elapsed = MQTTTime_elapsed(start);
@@ -2840,11 +2904,13 @@ void MQTTClient_yield(void)
 	do
 	{
 		SOCKET sock = -1;
+		Clients* client = NULL;
+
 		MQTTClient_cycle(&sock, (timeout > elapsed) ? timeout - elapsed : 0L, &rc);
 		Paho_thread_lock_mutex(mqttclient_mutex);
-		if (rc == SOCKET_ERROR && ListFindItem(handles, &sock, clientSockCompare))
+		if (rc == SOCKET_ERROR && (client = Clients_findSocket(bstate, sock)) != NULL)
 		{
-			MQTTClients* m = (MQTTClient)(handles->current->content);
+			MQTTClients* m = (MQTTClient)(client->context);
 			if (m->c->connect_state != DISCONNECTING)
 				MQTTClient_disconnect_internal(m, 0);
 		}
@@ -2887,7 +2953,7 @@ int MQTTClient_waitForCompletion(MQTTClient handle, MQTTClient_deliveryToken mdt
 			rc = MQTTCLIENT_DISCONNECTED;
 			goto exit;
 		}
-		if (ListFindItem(m->c->outboundMsgs, &mdt, messageIDCompare) == NULL)
+		if (MQTTProtocol_findMessage(m->c->outboundMsgs, &m->c->outboundIndex, mdt) == NULL)
 		{
 			rc = MQTTCLIENT_SUCCESS; /* well we couldn't find it */
 			goto exit;
@@ -3087,7 +3153,7 @@ static void MQTTProtocol_checkPendingWrites(void)
 
 static void MQTTClient_writeComplete(SOCKET socket, int rc)
 {
-	ListElement* found = NULL;
+	Clients* client = NULL;
 
 	FUNC_ENTRY;
 	/* a partial write is now complete for a socket - this will be on a publish*/
@@ -3095,24 +3161,16 @@ static void MQTTClient_writeComplete(SOCKET socket, int rc)
 	MQTTProtocol_checkPendingWrites();
 
 	/* find the client using this socket */
-	if ((found = ListFindItem(handles, &socket, clientSockCompare)) != NULL)
-	{
-		MQTTClients* m = (MQTTClients*)(found->content);
-
-		m->c->net.lastSent = MQTTTime_now();
-	}
+	if ((client = Clients_findSocket(bstate, socket)) != NULL)
+		client->net.lastSent = MQTTTime_now();
 	FUNC_EXIT;
 }
 
 
 static void MQTTClient_writeContinue(SOCKET socket)
 {
-	ListElement* found = NULL;
+	Clients* client = NULL;
 
-	if ((found = ListFindItem(handles, &socket, clientSockCompare)) != NULL)
-	{
-		MQTTClients* m = (MQTTClients*)(found->content);
-
-		m->c->net.lastSent = MQTTTime_now();
-	}
+	if ((client = Clients_findSocket(bstate, socket)) != NULL)
+		client->net.lastSent = MQTTTime_now();
 }
@@ -527,15 +527,26 @@ LIBMQTT_API int MQTTClient_setPublished(MQTTClient handle, void* context, MQTTCl
  * storage and provides some protection against message loss in the case of
  * unexpected failure.
  * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use file system-based persistence which
+ * appends records to segment files instead of writing a file for each
+ * message.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY: Keep messages in memory, and write any
+ * left to a snapshot file when the client is destroyed, to be restored when it
+ * is next created.
+ * <br>
  * ::MQTTCLIENT_PERSISTENCE_USER: Use an application-specific persistence
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
- * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
+ * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT and
+ * ::MQTTCLIENT_PERSISTENCE_LOG persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * For ::MQTTCLIENT_PERSISTENCE_MEMORY persistence, it is the location of the
+ * directory for the snapshot file, or NULL for no snapshot.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @return ::MQTTCLIENT_SUCCESS if the client is successfully created, otherwise
@@ -549,7 +560,9 @@ typedef struct
 {
 	/** The eyecatcher for this structure.  must be MQCO. */
 	char struct_id[4];
-	/** The version number of this structure.  Must be 0 */
+	/** The version number of this structure.  Must be 0 or 1
+	 * 0 means no persistenceDurability
+	 */
 	int struct_version;
 	/** Whether the MQTT version is 3.1, 3.1.1, or 5.  To use V5, this must be set.
 	 *  MQTT V5 has to be chosen here, because during the create call the message persistence
@@ -557,9 +570,18 @@ typedef struct
 	 *  is appropriate for the MQTT version we are going to connect with.  Selecting 3.1 or
 	 *  3.1.1 and attempting to read 5.0 persisted messages will result in an error on create.  */
 	int MQTTVersion;
+	/**
+	 * How soon records written to persistence reach stable storage: one of
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_NONE, ::MQTTCLIENT_PERSISTENCE_DURABILITY_OS or
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC.  0, the default, is the same as
+	 * ::MQTTCLIENT_PERSISTENCE_DURABILITY_OS.  With ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC,
+	 * the records for QoS 1 and 2 messages are forced to stable storage before the packets
+	 * which depend on them are sent, so that messages are not lost if the system fails.
+	 */
+	int persistenceDurability;
 } MQTTClient_createOptions;
 
-#define MQTTClient_createOptions_initializer { {'M', 'Q', 'C', 'O'}, 0, MQTTVERSION_DEFAULT }
+#define MQTTClient_createOptions_initializer { {'M', 'Q', 'C', 'O'}, 1, MQTTVERSION_DEFAULT, 0 }
 
 /**
  * A version of :MQTTClient_create() with additional options.
@@ -590,15 +612,26 @@ typedef struct
  * storage and provides some protection against message loss in the case of
  * unexpected failure.
  * <br>
+ * ::MQTTCLIENT_PERSISTENCE_LOG: Use file system-based persistence which
+ * appends records to segment files instead of writing a file for each
+ * message.
+ * <br>
+ * ::MQTTCLIENT_PERSISTENCE_MEMORY: Keep messages in memory, and write any
+ * left to a snapshot file when the client is destroyed, to be restored when it
+ * is next created.
+ * <br>
  * ::MQTTCLIENT_PERSISTENCE_USER: Use an application-specific persistence
  * implementation. Using this type of persistence gives control of the
  * persistence mechanism to the application. The application has to implement
  * the MQTTClient_persistence interface.
  * @param persistence_context If the application uses
  * ::MQTTCLIENT_PERSISTENCE_NONE persistence, this argument is unused and should
- * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT persistence, it
+ * be set to NULL. For ::MQTTCLIENT_PERSISTENCE_DEFAULT and
+ * ::MQTTCLIENT_PERSISTENCE_LOG persistence, it
  * should be set to the location of the persistence directory (if set
  * to NULL, the persistence directory used is the working directory).
+ * For ::MQTTCLIENT_PERSISTENCE_MEMORY persistence, it is the location of the
+ * directory for the snapshot file, or NULL for no snapshot.
  * Applications that use ::MQTTCLIENT_PERSISTENCE_USER persistence set this
  * argument to point to a valid MQTTClient_persistence structure.
  * @param options additional options for the create.
@@ -1255,6 +1288,51 @@ LIBMQTT_API int MQTTClient_publish(MQTTClient handle, const char* topicName, int
   */
 LIBMQTT_API MQTTResponse MQTTClient_publish5(MQTTClient handle, const char* topicName, int payloadlen, const void* payload,
 		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* dt);
+
+/**
+  * This function publishes a message as MQTTClient_publish() does, but takes over the
+  * payload buffer rather than copying it.  The buffer must have been allocated with
+  * MQTTClient_malloc(), and belongs to the library once this function is called, whether
+  * or not the message is accepted: the library frees it when it is no longer needed, which
+  * is once the message has been written for QoS 0, or acknowledged for QoS 1 and 2.  The
+  * application must not change or free it.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param topicName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the payload of the message, allocated with MQTTClient_malloc().
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param dt A pointer to an ::MQTTClient_deliveryToken. This is populated
+  * with a token representing the message when the function returns
+  * successfully. If your application does not use delivery tokens, set this
+  * argument to NULL.
+  * @return ::MQTTCLIENT_SUCCESS if the message is accepted for publication.
+  * An error code is returned if there was a problem accepting the message.
+  */
+LIBMQTT_API int MQTTClient_publishBuffer(MQTTClient handle, const char* topicName, int payloadlen, void* payload, int qos, int retained,
+		MQTTClient_deliveryToken* dt);
+
+/**
+  * This function publishes a message using MQTT version 5.0, as MQTTClient_publish5() does,
+  * but takes over the payload buffer rather than copying it, as MQTTClient_publishBuffer()
+  * does.
+  * @param handle A valid client handle from a successful call to
+  * MQTTClient_create().
+  * @param topicName The topic associated with this message.
+  * @param payloadlen The length of the payload in bytes.
+  * @param payload A pointer to the payload of the message, allocated with MQTTClient_malloc().
+  * @param qos The @ref qos of the message.
+  * @param retained The retained flag for the message.
+  * @param properties the MQTT 5.0 properties to be used
+  * @param dt A pointer to an ::MQTTClient_deliveryToken. This is populated
+  * with a token representing the message when the function returns
+  * successfully. If your application does not use delivery tokens, set this
+  * argument to NULL.
+  * @return the MQTT 5.0 response information: error codes and properties.
+  */
+LIBMQTT_API MQTTResponse MQTTClient_publishBuffer5(MQTTClient handle, const char* topicName, int payloadlen, void* payload,
+		int qos, int retained, MQTTProperties* properties, MQTTClient_deliveryToken* dt);
 /**
   * This function attempts to publish a message to a given topic (see also
   * MQTTClient_publish()). An ::MQTTClient_deliveryToken is issued when
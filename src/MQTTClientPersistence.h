@@ -30,6 +30,27 @@
  * representing the location of the persistence directory. If the context 
  * argument is NULL, the working directory will be used. 
  *
+ * The ::MQTTCLIENT_PERSISTENCE_LOG persistence type uses the same directory,
+ * but appends records to segment files, keeping an index of the keys in
+ * memory, instead of writing and deleting a file for each message.  Segments
+ * whose records have mostly been removed are compacted in the background.
+ *
+ * The ::MQTTCLIENT_PERSISTENCE_MEMORY persistence type keeps the messages in
+ * memory while the client exists, so persisting them costs no file system
+ * operations.  If the <i>persistence_context</i> is a directory, any messages
+ * left when the client is destroyed are written to one snapshot file in the
+ * client's directory there, and read back when the client is next created.
+ * Messages are lost if the application ends without destroying the client.
+ *
+ * How soon persisted records reach stable storage is set by the durability
+ * option when the client is created.  With ::MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC,
+ * the file system-based persistence types force the records out before the
+ * packets which depend on them are sent.  The default persistence does that
+ * for each file as it is written.  ::MQTTCLIENT_PERSISTENCE_LOG does it once
+ * for all the records persisted since the last time, so one sync covers many
+ * messages.  Application-specific persistence is responsible for its own
+ * durability.
+ *
  * To use memory-based persistence, an application passes 
  * ::MQTTCLIENT_PERSISTENCE_NONE as the <i>persistence_type</i> to 
  * MQTTClient_create(). This can lead to message loss in certain situations, 
@@ -77,6 +98,42 @@
   * persistence mechanism (see MQTTClient_create()).
   */
 #define MQTTCLIENT_PERSISTENCE_USER 2
+/**
+  * This <i>persistence_type</i> value specifies a file system-based
+  * persistence mechanism which appends records to a few segment files, rather
+  * than writing a file for each message (see MQTTClient_create()).
+  */
+#define MQTTCLIENT_PERSISTENCE_LOG 3
+/**
+  * This <i>persistence_type</i> value specifies a memory-based persistence
+  * mechanism which can keep the messages over a restart of the application, by
+  * writing them to a snapshot file when the client is destroyed (see
+  * MQTTClient_create()).
+  */
+#define MQTTCLIENT_PERSISTENCE_MEMORY 4
+
+/**
+  * This durability value selects the default, which is
+  * ::MQTTCLIENT_PERSISTENCE_DURABILITY_OS.
+  */
+#define MQTTCLIENT_PERSISTENCE_DURABILITY_DEFAULT 0
+/**
+  * This durability value lets the persistence keep records in its own buffers
+  * until it chooses to write them, so they can be lost if the process ends
+  * unexpectedly.
+  */
+#define MQTTCLIENT_PERSISTENCE_DURABILITY_NONE 1
+/**
+  * This durability value hands each record to the operating system as it is
+  * persisted, so it survives the process ending but not the system failing.
+  */
+#define MQTTCLIENT_PERSISTENCE_DURABILITY_OS 2
+/**
+  * This durability value forces records to stable storage before any packet
+  * which depends on them, such as a QoS 1 or 2 PUBLISH, is written to the
+  * network.  Records persisted together are forced out together.
+  */
+#define MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC 3
 
 /** 
   * Application-specific persistence functions must return this error code if 
@@ -39,6 +39,7 @@
 #include <string.h>
 
 #include "Heap.h"
+#include "Pool.h"
 
 #if !defined(min)
 #define min(A,B) ( (A) < (B) ? (A):(B))
@@ -154,18 +155,12 @@ void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error)
 			else if (header.bits.type == PUBLISH && header.bits.qos == 2)
 			{
 				int buf0len;
-				char *buf = malloc(10);
+				char buf[10];
 
-				if (buf == NULL)
-				{
-					*error = SOCKET_ERROR;
-					goto exit;
-				}
 				buf[0] = header.byte;
 				buf0len = 1 + MQTTPacket_encode(&buf[1], remaining_length);
 				*error = MQTTPersistence_putPacket(net->socket, buf, buf0len, 1,
 					&data, &remaining_length, header.bits.type, ((Publish *)pack)->msgId, 1, MQTTVersion);
-				free(buf);
 			}
 #endif
 		}
@@ -181,6 +176,244 @@ exit:
 }
 
 
+/**
+ * Whether packets written to a connection are to be coalesced.  Once some packets have been
+ * coalesced, later ones must be too, until they have all been written, to keep them in order.
+ * Websocket frames are not coalesced.
+ * @param net the network connection
+ * @return boolean
+ */
+static int MQTTPacket_isCoalescing(networkHandles* net)
+{
+	return !net->websocket && (net->coalescing > 0 || net->coalesced_len > 0);
+}
+
+
+/**
+ * Make sure there is room for some more data in the coalesced packet buffer.
+ * @param net the network connection
+ * @param len the number of bytes to be added
+ * @return the completion code
+ */
+static int MQTTPacket_reserveCoalesced(networkHandles* net, size_t len)
+{
+	int rc = TCPSOCKET_COMPLETE;
+
+	if (net->coalesced_len + len > net->coalesced_size)
+	{
+		size_t newsize = net->coalesced_size * 2;
+		char* newbuf = NULL;
+
+		if (newsize < net->coalesced_len + len)
+			newsize = net->coalesced_len + len;
+		if (newsize < 1024)
+			newsize = 1024;
+		if (net->coalesced)
+			newbuf = realloc(net->coalesced, newsize);
+		else
+			newbuf = malloc(newsize);
+		if (newbuf == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		net->coalesced = newbuf;
+		net->coalesced_size = newsize;
+	}
+exit:
+	return rc;
+}
+
+
+/**
+ * Before packets are written to a connection, commit the records persisted for them: force
+ * them to stable storage if the client's durability requires it, and check that any queued
+ * for a persistence writer thread have been written.  All the records persisted since the
+ * last write are committed together, so a batch of packets written in one go costs one sync.
+ * @param net the network connection
+ * @param wait whether to wait for writes queued for a persistence writer thread
+ * @return TCPSOCKET_COMPLETE if the packets can be written now, TCPSOCKET_INTERRUPTED if they
+ * have to be held until the writer thread has caught up, or SOCKET_ERROR if the records could
+ * not be committed, so the packets must not be written at all.
+ */
+int MQTTPacket_commit(networkHandles* net, int wait)
+{
+	int rc = TCPSOCKET_COMPLETE;
+
+#if !defined(NO_PERSISTENCE)
+	if (net->uncommitted || net->commit_pending)
+	{
+		if ((rc = MQTTPersistence_commit(net->socket, wait)) == PERSISTENCE_COMMIT_PENDING)
+			rc = TCPSOCKET_INTERRUPTED;
+		else if (rc != 0)
+			rc = SOCKET_ERROR;
+	}
+#endif
+	return rc;
+}
+
+
+/**
+ * Write the coalesced packets, followed by any other buffers, in one system call.
+ * @param net the network connection
+ * @param bufs buffers to be written after the coalesced data
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+static int MQTTPacket_writeCoalesced(networkHandles* net, PacketBuffers* bufs)
+{
+	int rc = SOCKET_ERROR;
+
+#if defined(OPENSSL)
+	if (net->ssl)
+		rc = SSLSocket_putdatas(net->ssl, net->socket, net->coalesced, net->coalesced_len, *bufs);
+	else
+#endif
+		rc = Socket_putdatas(net->socket, net->coalesced, net->coalesced_len, *bufs);
+	if (rc == TCPSOCKET_COMPLETE)
+		net->lastSent = MQTTTime_now();
+	else if (rc == TCPSOCKET_INTERRUPTED)
+	{
+		/* the buffer now belongs to the pending write */
+		net->coalesced = NULL;
+		net->coalesced_size = 0;
+	}
+	net->coalesced_len = 0;
+	return rc;
+}
+
+
+/**
+ * Add a packet to those being coalesced for a connection.  The packet data is copied, so
+ * the caller keeps ownership of its buffers unless TCPSOCKET_INTERRUPTED is returned, as for
+ * a direct write.  A large last buffer is not copied: it is written along with the coalesced
+ * packets straight away.
+ * @param net the network connection
+ * @param buf0 the packet header
+ * @param buf0len the length of the packet header
+ * @param bufs the rest of the packet
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+static int MQTTPacket_putCoalesced(networkHandles* net, char* buf0, size_t buf0len, PacketBuffers* bufs)
+{
+	int rc = TCPSOCKET_COMPLETE;
+	int i, copy_count = bufs->count;
+	size_t len = buf0len;
+
+	FUNC_ENTRY;
+	if (bufs->count > 0 && bufs->buflens[bufs->count - 1] > MQTTPACKET_COALESCE_COPY_LIMIT &&
+			!Socket_writeQueueFull(net->socket) && MQTTPacket_commit(net, 0) == TCPSOCKET_COMPLETE)
+		copy_count--;
+	for (i = 0; i < copy_count; i++)
+		len += bufs->buflens[i];
+	if ((rc = MQTTPacket_reserveCoalesced(net, len)) != TCPSOCKET_COMPLETE)
+		goto exit;
+	memcpy(&net->coalesced[net->coalesced_len], buf0, buf0len);
+	net->coalesced_len += buf0len;
+	for (i = 0; i < copy_count; i++)
+	{
+		if (bufs->buffers[i] != NULL && bufs->buflens[i] > 0)
+		{
+			memcpy(&net->coalesced[net->coalesced_len], bufs->buffers[i], bufs->buflens[i]);
+			net->coalesced_len += bufs->buflens[i];
+		}
+	}
+
+	if (copy_count < bufs->count)
+	{
+		PacketBuffers last = {1, &bufs->buffers[copy_count], &bufs->buflens[copy_count], &bufs->frees[copy_count], {0, 0, 0, 0}};
+
+		if ((rc = MQTTPacket_writeCoalesced(net, &last)) == TCPSOCKET_INTERRUPTED)
+		{
+			/* the copied buffers are not part of the pending write, so they won't be freed with it */
+			free(buf0);
+			for (i = 0; i < copy_count; i++)
+			{
+				if (bufs->frees[i])
+					free(bufs->buffers[i]);
+			}
+		}
+	}
+	else if (net->coalescing == 0 || net->coalesced_len >= MQTTPACKET_COALESCE_SIZE)
+	{
+		/* the packet has been copied, so it's complete as far as the caller is concerned */
+		if ((rc = MQTTPacket_flushCoalesced(net)) != SOCKET_ERROR)
+			rc = TCPSOCKET_COMPLETE;
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Start a batch of writes to a connection.  Packets are coalesced until every batch
+ * started has been stopped, and then written with as few system calls as possible.
+ * @param net the network connection
+ */
+void MQTTPacket_startCoalescing(networkHandles* net)
+{
+	net->coalescing++;
+}
+
+
+/**
+ * Stop a batch of writes to a connection, writing the coalesced packets if it was the last.
+ * @param net the network connection
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+int MQTTPacket_stopCoalescing(networkHandles* net)
+{
+	int rc = TCPSOCKET_COMPLETE;
+
+	if (net->coalescing > 0 && --net->coalescing == 0)
+		rc = MQTTPacket_flushCoalesced(net);
+	return rc;
+}
+
+
+/**
+ * Write any coalesced packets for a connection now, or queue them behind a partial write.
+ * If the socket's write queue is full, they are kept until there is room.
+ * @param net the network connection
+ * @return the completion code (TCPSOCKET_COMPLETE etc)
+ */
+int MQTTPacket_flushCoalesced(networkHandles* net)
+{
+	int rc = TCPSOCKET_COMPLETE;
+
+	FUNC_ENTRY;
+	if (net->coalesced_len == 0)
+		;
+	else if (net->socket == 0)
+		net->coalesced_len = 0; /* the connection has gone */
+	else if (Socket_writeQueueFull(net->socket))
+		rc = TCPSOCKET_INTERRUPTED;
+	else if ((rc = MQTTPacket_commit(net, 0)) == TCPSOCKET_COMPLETE)
+	{
+		PacketBuffers nobufs = {0, NULL, NULL, NULL, {0, 0, 0, 0}};
+
+		rc = MQTTPacket_writeCoalesced(net, &nobufs);
+	}
+	/* else held until the persistence writes they depend on are done, or never written if
+	 * those could not be committed */
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Discard any coalesced packets for a connection, and free the buffer used to hold them.
+ * @param net the network connection
+ */
+void MQTTPacket_freeCoalesced(networkHandles* net)
+{
+	if (net->coalesced)
+		free(net->coalesced);
+	net->coalesced = NULL;
+	net->coalesced_len = net->coalesced_size = 0;
+}
+
+
 /**
  * Sends an MQTT packet in one system call write
  * @param socket the socket to which to write the data
@@ -224,11 +457,15 @@ int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buf
 	packetbufs.buflens = &buflen;
 	packetbufs.frees = &freeData;
 	memset(packetbufs.mask, '\0', sizeof(packetbufs.mask));
-	rc = WebSocket_putdatas(net, &buf, &buf0len, &packetbufs);
+	/* a packet is held while the persistence writes it depends on are pending, and is not
+	 * written at all if they could not be committed */
+	if (MQTTPacket_isCoalescing(net) ||
+			(rc = MQTTPacket_commit(net, net->websocket)) == TCPSOCKET_INTERRUPTED)
+		rc = MQTTPacket_putCoalesced(net, buf, buf0len, &packetbufs);
+	else if (rc == TCPSOCKET_COMPLETE &&
+			(rc = WebSocket_putdatas(net, &buf, &buf0len, &packetbufs)) == TCPSOCKET_COMPLETE)
+		net->lastSent = MQTTTime_now(); /* coalesced packets count as sent when they're written */
 
-	if (rc == TCPSOCKET_COMPLETE)
-		net->lastSent = MQTTTime_now();
-	
 	if (rc != TCPSOCKET_INTERRUPTED)
 	  free(buf);
 
@@ -278,11 +515,15 @@ int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* bufs, in
 			header.bits.type, msgId, 0, MQTTVersion);
 	}
 #endif
-	rc = WebSocket_putdatas(net, &buf, &buf0len, bufs);
+	/* a packet is held while the persistence writes it depends on are pending, and is not
+	 * written at all if they could not be committed */
+	if (MQTTPacket_isCoalescing(net) ||
+			(rc = MQTTPacket_commit(net, net->websocket)) == TCPSOCKET_INTERRUPTED)
+		rc = MQTTPacket_putCoalesced(net, buf, buf0len, bufs);
+	else if (rc == TCPSOCKET_COMPLETE &&
+			(rc = WebSocket_putdatas(net, &buf, &buf0len, bufs)) == TCPSOCKET_COMPLETE)
+		net->lastSent = MQTTTime_now(); /* coalesced packets count as sent when they're written */
 
-	if (rc == TCPSOCKET_COMPLETE)
-		net->lastSent = MQTTTime_now();
-	
 	if (rc != TCPSOCKET_INTERRUPTED)
 	  free(buf);
 exit:
@@ -560,14 +801,14 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 	char* enddata = &data[datalen];
 
 	FUNC_ENTRY;
-	if ((pack = malloc(sizeof(Publish))) == NULL)
+	if ((pack = Pool_malloc(sizeof(Publish))) == NULL)
 		goto exit;
 	memset(pack, '\0', sizeof(Publish));
 	pack->MQTTVersion = MQTTVersion;
 	pack->header.byte = aHeader;
 	if ((pack->topic = readUTFlen(&curdata, enddata, &pack->topiclen)) == NULL) /* Topic name on which to publish */
 	{
-		free(pack);
+		Pool_free(pack, sizeof(Publish));
 		pack = NULL;
 		goto exit;
 	}
@@ -575,7 +816,7 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 	{
 		if (enddata - curdata < 2)  /* Is there enough data for the msgid? */
 		{
-			free(pack);
+			Pool_free(pack, sizeof(Publish));
 			pack = NULL;
 			goto exit;
 		}
@@ -592,7 +833,7 @@ void* MQTTPacket_publish(int MQTTVersion, unsigned char aHeader, char* data, siz
 			if (pack->properties.array)
 				free(pack->properties.array);
 			if (pack)
-				free(pack);
+				Pool_free(pack, sizeof(Publish));
 			pack = NULL; /* signal protocol error */
 			goto exit;
 		}
@@ -616,7 +857,7 @@ void MQTTPacket_freePublish(Publish* pack)
 		free(pack->topic);
 	if (pack->MQTTVersion >= MQTTVERSION_5)
 		MQTTProperties_free(&pack->properties);
-	free(pack);
+	Pool_free(pack, sizeof(Publish));
 	FUNC_EXIT;
 }
 
@@ -225,6 +225,15 @@ typedef Ack Pubrec;
 typedef Ack Pubrel;
 typedef Ack Pubcomp;
 
+#if !defined(MQTTPACKET_COALESCE_SIZE)
+/** coalesced packets are written once there are this many bytes of them */
+#define MQTTPACKET_COALESCE_SIZE 65536
+#endif
+#if !defined(MQTTPACKET_COALESCE_COPY_LIMIT)
+/** the last buffer of a packet (a publish payload) is written from where it is if larger than this */
+#define MQTTPACKET_COALESCE_COPY_LIMIT 4096
+#endif
+
 int MQTTPacket_encode(char* buf, size_t length);
 int MQTTPacket_decode(networkHandles* net, size_t* value);
 int readInt(char** pptr);
@@ -240,6 +249,11 @@ const char* MQTTPacket_name(int ptype);
 void* MQTTPacket_Factory(int MQTTVersion, networkHandles* net, int* error);
 int MQTTPacket_send(networkHandles* net, Header header, char* buffer, size_t buflen, int free, int MQTTVersion);
 int MQTTPacket_sends(networkHandles* net, Header header, PacketBuffers* buffers, int MQTTVersion);
+void MQTTPacket_startCoalescing(networkHandles* net);
+int MQTTPacket_stopCoalescing(networkHandles* net);
+int MQTTPacket_flushCoalesced(networkHandles* net);
+void MQTTPacket_freeCoalesced(networkHandles* net);
+int MQTTPacket_commit(networkHandles* net, int wait);
 
 void* MQTTPacket_header_only(int MQTTVersion, unsigned char aHeader, char* data, size_t datalen);
 int MQTTPacket_send_disconnect(Clients* client, enum MQTTReasonCodes reason, MQTTProperties* props);
@@ -28,6 +28,9 @@
 
 #include "MQTTPersistence.h"
 #include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceMemory.h"
+#include "MQTTPersistenceWriter.h"
 #include "MQTTProtocolClient.h"
 #include "Heap.h"
 
@@ -38,6 +41,11 @@
 
 static MQTTPersistence_qEntry* MQTTPersistence_restoreQueueEntry(char* buffer, size_t buflen, int MQTTVersion);
 static void MQTTPersistence_insertInSeqOrder(List* list, MQTTPersistence_qEntry* qEntry, size_t size);
+static void MQTTPersistence_setDurability(Clients* c);
+static void MQTTPersistence_setUncommitted(Clients* c);
+static int MQTTPersistence_readIndex(Clients* c);
+static int MQTTPersistence_syncStore(Clients* c);
+static int MQTTPersistence_keys(Clients* c, char*** keys, int* nkeys);
 
 /**
  * Creates a ::MQTTClient_persistence structure representing a persistence implementation.
@@ -61,6 +69,7 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 			per = NULL;
 			break;
 		case MQTTCLIENT_PERSISTENCE_DEFAULT :
+		case MQTTCLIENT_PERSISTENCE_LOG :
 			per = malloc(sizeof(MQTTClient_persistence));
 			if ( per != NULL )
 			{
@@ -82,6 +91,42 @@ int MQTTPersistence_create(MQTTClient_persistence** persistence, int type, void*
 				per->pkeys        = pstkeys;
 				per->pclear       = pstclear;
 				per->pcontainskey = pstcontainskey;
+				if (type == MQTTCLIENT_PERSISTENCE_LOG)
+				{
+					/* log-structured file functions */
+					per->popen        = plogopen;
+					per->pclose       = plogclose;
+					per->pput         = plogput;
+					per->pget         = plogget;
+					per->premove      = plogremove;
+					per->pkeys        = plogkeys;
+					per->pclear       = plogclear;
+					per->pcontainskey = plogcontainskey;
+				}
+			}
+			else
+				rc = PAHO_MEMORY_ERROR;
+			break;
+		case MQTTCLIENT_PERSISTENCE_MEMORY :
+			per = malloc(sizeof(MQTTClient_persistence));
+			if ( per != NULL )
+			{
+				per->context = NULL; /* no snapshot */
+				if (pcontext != NULL && (per->context = MQTTStrdup(pcontext)) == NULL)
+				{
+					free(per);
+					rc = PAHO_MEMORY_ERROR;
+					goto exit;
+				}
+				/* in-memory functions */
+				per->popen        = pmemopen;
+				per->pclose       = pmemclose;
+				per->pput         = pmemput;
+				per->pget         = pmemget;
+				per->premove      = pmemremove;
+				per->pkeys        = pmemkeys;
+				per->pclear       = pmemclear;
+				per->pcontainskey = pmemcontainskey;
 			}
 			else
 				rc = PAHO_MEMORY_ERROR;
@@ -106,6 +151,268 @@ exit:
 }
 
 
+/**
+ * Is a persistence key that of an async client command?
+ * @param key the key
+ * @return boolean
+ */
+static int MQTTPersistence_isCommandKey(char* key)
+{
+	return strncmp(key, PERSISTENCE_COMMAND_KEY, strlen(PERSISTENCE_COMMAND_KEY)) == 0 ||
+		strncmp(key, PERSISTENCE_V5_COMMAND_KEY, strlen(PERSISTENCE_V5_COMMAND_KEY)) == 0;
+}
+
+
+/**
+ * Decode a persistence index record.  The record holds a version number and a count of keys,
+ * the keys as null terminated strings, then the index of the commands to the end of the record.
+ * @param buffer the record
+ * @param buflen the length of the record
+ * @return the index, or NULL if the record is not valid
+ */
+static persistenceIndex* MQTTPersistence_parseIndex(char* buffer, int buflen)
+{
+	persistenceIndex* pindex = NULL;
+	char* ptr = buffer;
+	char* endpos = &buffer[buflen];
+	int version, nkeys, i;
+
+	FUNC_ENTRY;
+	if (buflen < 2 * (int)sizeof(int))
+		goto exit;
+	version = *(int*)ptr;
+	ptr += sizeof(int);
+	nkeys = *(int*)ptr;
+	ptr += sizeof(int);
+	if (version != PERSISTENCE_INDEX_VERSION || nkeys < 0 || nkeys > endpos - ptr)
+		goto exit;
+
+	if ((pindex = malloc(sizeof(persistenceIndex))) == NULL)
+		goto exit;
+	memset(pindex, '\0', sizeof(persistenceIndex));
+	if (nkeys > 0)
+	{
+		if ((pindex->keys = malloc(nkeys * sizeof(char*))) == NULL)
+			goto error_exit;
+		memset(pindex->keys, '\0', nkeys * sizeof(char*));
+	}
+	for (i = 0; i < nkeys; ++i)
+	{
+		size_t data_size = strnlen(ptr, endpos - ptr);
+
+		if (data_size == endpos - ptr)
+			goto error_exit; /* no null found */
+		if ((pindex->keys[i] = MQTTStrdup(ptr)) == NULL)
+			goto error_exit;
+		pindex->nkeys++;
+		ptr += data_size + 1;
+	}
+	if ((pindex->commandslen = (int)(endpos - ptr)) > 0)
+	{
+		if ((pindex->commands = malloc(pindex->commandslen)) == NULL)
+			goto error_exit;
+		memcpy(pindex->commands, ptr, pindex->commandslen);
+	}
+	goto exit;
+error_exit:
+	for (i = 0; i < pindex->nkeys; ++i)
+		free(pindex->keys[i]);
+	if (pindex->keys)
+		free(pindex->keys);
+	free(pindex);
+	pindex = NULL;
+exit:
+	FUNC_EXIT;
+	return pindex;
+}
+
+
+/**
+ * Read the index of the persisted records of a client into its pindex, if one was written
+ * when the client was last destroyed, so that the keys don't have to be listed from the store.
+ * The record is removed as soon as it has been read: it describes the store as it was closed,
+ * and if the store is not closed cleanly again, the next restore lists the keys instead.
+ * @param client the client as ::Clients.
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise.
+ */
+static int MQTTPersistence_readIndex(Clients* c)
+{
+	int rc = 0;
+	char* buffer = NULL;
+	int buflen = 0;
+
+	FUNC_ENTRY;
+	if (c->persistence->pcontainskey(c->phandle, PERSISTENCE_INDEX_KEY) != 0)
+		goto exit; /* not closed cleanly, or no commands were persisted */
+
+	if (c->persistence->pget(c->phandle, PERSISTENCE_INDEX_KEY, &buffer, &buflen) == 0 &&
+			(c->afterRead == NULL || c->afterRead(c->afterRead_context, &buffer, &buflen) == 0))
+		c->pindex = MQTTPersistence_parseIndex(buffer, buflen);
+	if (c->pindex == NULL)
+		Log(LOG_ERROR, 0, "Persistence index of client %s not valid, listing the keys", c->clientID);
+
+	if ((rc = c->persistence->premove(c->phandle, PERSISTENCE_INDEX_KEY)) == 0 &&
+			c->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC)
+	{
+		/* a crash must not bring back an index of records which have since changed */
+		rc = MQTTPersistence_syncStore(c);
+	}
+	if (rc != 0)
+	{
+		Log(LOG_ERROR, 0, "Error %d removing the persistence index of client %s", rc, c->clientID);
+		MQTTPersistence_freeIndex(c);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+exit:
+	if (buffer)
+		free(buffer);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Get the keys of the persisted records of a client: from its persistence index if one was
+ * read, otherwise from the store.  The keys and the array are to be freed by the caller.
+ * @param client the client as ::Clients.
+ * @param keys set to the array of keys
+ * @param nkeys set to the number of keys
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise.
+ */
+static int MQTTPersistence_keys(Clients* c, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (c->pindex == NULL)
+	{
+		rc = c->persistence->pkeys(c->phandle, keys, nkeys);
+		goto exit;
+	}
+	*keys = NULL;
+	*nkeys = 0;
+	if (c->pindex->nkeys == 0)
+		goto exit;
+	if ((*keys = malloc(c->pindex->nkeys * sizeof(char*))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	for (i = 0; i < c->pindex->nkeys; ++i)
+	{
+		if (((*keys)[i] = MQTTStrdup(c->pindex->keys[i])) == NULL)
+		{
+			while (--i >= 0)
+				free((*keys)[i]);
+			free(*keys);
+			*keys = NULL;
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+	}
+	*nkeys = c->pindex->nkeys;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Write the index of the persisted records of a client, so that the next restore doesn't
+ * have to list the keys from the store.  Called when the client is destroyed, after which
+ * the persisted records don't change until the index is read again.
+ * @param client the client as ::Clients.
+ * @param commands the index of the persisted commands, which the API layer reads back
+ * @param commandslen the length of the commands index
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR or #PAHO_MEMORY_ERROR otherwise.
+ */
+int MQTTPersistence_writeIndex(Clients* c, char* commands, int commandslen)
+{
+	int rc = 0;
+	char** msgkeys = NULL;
+	int nkeys = 0;
+	int header[2];
+	char** bufs = NULL;
+	int* lens = NULL;
+	int nbufs = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (c->persistence == NULL)
+		goto exit;
+	if ((rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) != 0)
+		goto exit;
+	if ((bufs = malloc((nkeys + 2) * sizeof(char*))) == NULL ||
+			(lens = malloc((nkeys + 2) * sizeof(int))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+
+	header[0] = PERSISTENCE_INDEX_VERSION;
+	header[1] = 0;
+	bufs[nbufs] = (char*)header;
+	lens[nbufs++] = sizeof(header);
+	for (i = 0; i < nkeys; ++i)
+	{
+		/* the commands are indexed by the API layer, which knows what it needs of them */
+		if (MQTTPersistence_isCommandKey(msgkeys[i]) || strcmp(msgkeys[i], PERSISTENCE_INDEX_KEY) == 0)
+			continue;
+		bufs[nbufs] = msgkeys[i];
+		lens[nbufs++] = (int)strlen(msgkeys[i]) + 1;
+		header[1]++;
+	}
+	if (commandslen > 0)
+	{
+		bufs[nbufs] = commands;
+		lens[nbufs++] = commandslen;
+	}
+
+	if (c->beforeWrite)
+		rc = c->beforeWrite(c->beforeWrite_context, nbufs, bufs, lens);
+	if (rc == 0)
+		rc = c->persistence->pput(c->phandle, PERSISTENCE_INDEX_KEY, nbufs, bufs, lens);
+	if (rc != 0)
+		Log(LOG_ERROR, 0, "Error %d writing the persistence index of client %s", rc, c->clientID);
+exit:
+	if (msgkeys)
+	{
+		for (i = 0; i < nkeys; ++i)
+			free(msgkeys[i]);
+		free(msgkeys);
+	}
+	if (bufs)
+		free(bufs);
+	if (lens)
+		free(lens);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Free the persistence index of a client, once the persisted records have been restored.
+ * @param client the client as ::Clients.
+ */
+void MQTTPersistence_freeIndex(Clients* c)
+{
+	persistenceIndex* pindex = c->pindex;
+	int i;
+
+	if (pindex == NULL)
+		return;
+	for (i = 0; i < pindex->nkeys; ++i)
+		free(pindex->keys[i]);
+	if (pindex->keys)
+		free(pindex->keys);
+	if (pindex->commands)
+		free(pindex->commands);
+	free(pindex);
+	c->pindex = NULL;
+}
+
+
 /**
  * Open persistent store and restore any persisted messages.
  * @param client the client as ::Clients.
@@ -121,7 +428,19 @@ int MQTTPersistence_initialize(Clients *c, const char *serverURI)
 	{
 		rc = c->persistence->popen(&(c->phandle), c->clientID, serverURI, c->persistence->context);
 		if ( rc == 0 )
-			rc = MQTTPersistence_restorePackets(c);
+		{
+			MQTTPersistence_setDurability(c);
+			if ((rc = MQTTPersistence_readIndex(c)) == 0)
+				rc = MQTTPersistence_restorePackets(c);
+		}
+		if (rc == 0 && c->maxQueuedWrites > 0)
+		{
+			int (*sync)(void*) = NULL;
+
+			if (c->persistence->popen == plogopen && c->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC)
+				sync = plogsync; /* each batch of writes is synced in one go */
+			rc = MQTTPersistenceWriter_start(c, c->maxQueuedWrites, sync);
+		}
 	}
 
 	FUNC_EXIT_RC(rc);
@@ -129,6 +448,109 @@ int MQTTPersistence_initialize(Clients *c, const char *serverURI)
 }
 
 
+/**
+ * Apply the durability option of a client to its persistence, if it is one of the built-in
+ * implementations.  Application-specific persistence handles durability itself.
+ * @param client the client as ::Clients.
+ */
+static void MQTTPersistence_setDurability(Clients* c)
+{
+	if (c->persistence->popen == plogopen)
+		plogsetdurability(c->phandle, c->durability);
+	else if (c->persistence->popen == pmemopen)
+		pmemsetdurability(c->phandle, c->durability);
+	else if (c->persistence->popen == pstopen && c->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC)
+		c->persistence->pput = pstputsync; /* no group commit: each file has to be synced on its own */
+}
+
+
+/**
+ * Mark the connection of a client as having records persisted which must be committed
+ * before any more packets are written to it.
+ * @param client the client as ::Clients.
+ */
+static void MQTTPersistence_setUncommitted(Clients* c)
+{
+	if (c->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC || MQTTPersistenceWriter_isWriter(c->persistence))
+		c->net.uncommitted = 1;
+}
+
+
+/**
+ * Force the changes made to one of the built-in stores of a client to stable storage.
+ * The default persistence syncs each record as it is put, so only its directory is synced,
+ * for the records removed.  Application-specific persistence handles durability itself.
+ * @param client the client as ::Clients.
+ * @return 0 if success, non-zero if the store could not be synced.
+ */
+static int MQTTPersistence_syncStore(Clients* c)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (c->persistence->popen == plogopen)
+		rc = plogsync(c->phandle);
+	else if (c->persistence->popen == pstopen)
+		rc = pstsyncdir(c->phandle);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * If a client's persistence has a writer thread, wait until there is room to queue more
+ * writes.  Must be called without any of the client's locks held.
+ * @param c the client
+ */
+void MQTTPersistence_waitForWriter(Clients* c)
+{
+	if (MQTTPersistenceWriter_isWriter(c->persistence))
+		MQTTPersistenceWriter_waitForRoom(c->phandle);
+}
+
+
+/**
+ * Commit the records persisted for a client: force those written since the last commit to
+ * stable storage, if the client's durability is MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC, and
+ * if writes are queued for a writer thread, check they have been carried out.  Called before
+ * packets are written to the network, so that one commit covers all the records that the
+ * packets being written depend on.
+ * @param socket the socket of the client's connection
+ * @param wait whether to wait for queued writes, rather than return #PERSISTENCE_COMMIT_PENDING
+ * @return 0 if the records are committed, #PERSISTENCE_COMMIT_PENDING if the packets have to
+ * wait for queued writes, #MQTTCLIENT_PERSISTENCE_ERROR if the records could not be synced.
+ */
+int MQTTPersistence_commit(SOCKET socket, int wait)
+{
+	int rc = 0;
+	extern ClientStates* bstate;
+	Clients* client = NULL;
+
+	FUNC_ENTRY;
+	client = Clients_findSocket(bstate, socket);
+	if (client == NULL)
+		goto exit;
+	if (MQTTPersistenceWriter_isWriter(client->persistence))
+	{
+		/* the writer thread syncs each batch of writes itself */
+		/* after an error, the writer is asked again each time, so held packets are never sent */
+		if ((rc = MQTTPersistenceWriter_commit(client->phandle, client->net.uncommitted, wait)) != 0 &&
+				rc != PERSISTENCE_COMMIT_PENDING)
+			Log(LOG_ERROR, 0, "Error committing persisted records for client %s, rc %d", client->clientID, rc);
+		client->net.uncommitted = 0;
+		client->net.commit_pending = (rc != 0);
+		goto exit;
+	}
+	if (client->persistence != NULL && (rc = MQTTPersistence_syncStore(client)) != 0)
+		Log(LOG_ERROR, 0, "Error committing persisted records for client %s, rc %d", client->clientID, rc);
+	if (rc == 0)
+		client->net.uncommitted = 0; /* otherwise the next write tries again */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * Close persistent store.
  * @param client the client as ::Clients.
@@ -142,9 +564,13 @@ int MQTTPersistence_close(Clients *c)
 #if !defined(NO_PERSISTENCE)
 	if (c->persistence != NULL)
 	{
+		if (MQTTPersistenceWriter_isWriter(c->persistence))
+			MQTTPersistenceWriter_stop(c); /* after the queued writes are done */
+		MQTTPersistence_freeIndex(c);
 		rc = c->persistence->pclose(c->phandle);
 
-		if (c->persistence->popen == pstopen) {
+		if (c->persistence->popen == pstopen || c->persistence->popen == plogopen ||
+				c->persistence->popen == pmemopen) {
 			if (c->persistence->context)
 				free(c->persistence->context);
 			free(c->persistence);
@@ -193,7 +619,7 @@ int MQTTPersistence_restorePackets(Clients *c)
 	int msgs_rcvd = 0;
 
 	FUNC_ENTRY;
-	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
+	if (c->persistence && (rc = MQTTPersistence_keys(c, &msgkeys, &nkeys)) == 0)
 	{
 		while (rc == 0 && i < nkeys)
 		{
@@ -251,7 +677,7 @@ int MQTTPersistence_restorePackets(Clients *c)
 						msg = MQTTProtocol_createMessage(publish, &msg, publish->header.bits.qos, publish->header.bits.retain, 1);
 						msg->nextMessageType = PUBREL;
 						/* order does not matter for persisted received messages */
-						ListAppend(c->inboundMsgs, msg, msg->len);
+						MQTTProtocol_indexMessage(&c->inboundIndex, msg->msgid, ListAppend(c->inboundMsgs, msg, msg->len));
 						if (c->MQTTVersion >= MQTTVERSION_5)
 						{
 							free(msg->publish->payload);
@@ -295,7 +721,8 @@ int MQTTPersistence_restorePackets(Clients *c)
 							/* else: PUBLISH QoS1, or PUBLISH QoS2 and PUBREL not sent */
 							/* retry at the first opportunity */
 							memset(&msg->lastTouch, '\0', sizeof(msg->lastTouch));
-							MQTTPersistence_insertInOrder(c->outboundMsgs, msg, msg->len);
+							MQTTProtocol_indexMessage(&c->outboundIndex, msg->msgid,
+									MQTTPersistence_insertInOrder(c->outboundMsgs, msg, msg->len));
 							publish->topic = NULL;
 							MQTTPacket_freePublish(publish);
 							msgs_sent++;
@@ -410,11 +837,13 @@ void* MQTTPersistence_restorePacket(int MQTTVersion, char* buffer, size_t buflen
  * @param list the list to insert the message into.
  * @param content the message to add.
  * @param size size of the message.
+ * @return the new list element, or NULL if it couldn't be allocated
  */
-void MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
+ListElement* MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
 {
 	ListElement* index = NULL;
 	ListElement* current = NULL;
+	ListElement* newel = NULL;
 
 	FUNC_ENTRY;
 	while(ListNextElement(list, &current) != NULL && index == NULL)
@@ -423,8 +852,9 @@ void MQTTPersistence_insertInOrder(List* list, void* content, size_t size)
 			index = current;
 	}
 
-	ListInsert(list, content, size, index);
+	newel = ListInsert(list, content, size, index);
 	FUNC_EXIT;
+	return newel;
 }
 
 
@@ -456,7 +886,7 @@ int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int cou
 	Clients* client = NULL;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, socket);
 	if (client->persistence != NULL)
 	{
 		const size_t keysize = PERSISTENCE_MAX_KEY_LENGTH + 1;
@@ -522,6 +952,8 @@ int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int cou
 
 		if (rc == 0)
 			rc = client->persistence->pput(client->phandle, key, nbufs, bufs, lens);
+		if (rc == 0)
+			MQTTPersistence_setUncommitted(client);
 
 		free(key);
 		free(lens);
@@ -763,6 +1195,8 @@ int MQTTPersistence_persistQueueEntry(Clients* aclient, MQTTPersistence_qEntry*
 
 		if (rc == 0 && (rc = aclient->persistence->pput(aclient->phandle, key, bufindex, (char**)bufs, lens)) != 0)
 			Log(LOG_ERROR, 0, "Error persisting queue entry, rc %d", rc);
+		else if (rc == 0)
+			MQTTPersistence_setUncommitted(aclient); /* to be committed before the ack is sent */
 	}
 	if (props_allocated != 0)
 		free(bufs[props_allocated]);
@@ -875,7 +1309,7 @@ int MQTTPersistence_restoreMessageQueue(Clients* c)
 	int entries_restored = 0;
 
 	FUNC_ENTRY;
-	if (c->persistence && (rc = c->persistence->pkeys(c->phandle, &msgkeys, &nkeys)) == 0)
+	if (c->persistence && (rc = MQTTPersistence_keys(c, &msgkeys, &nkeys)) == 0)
 	{
 		while (rc == 0 && i < nkeys)
 		{
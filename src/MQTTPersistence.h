@@ -49,10 +49,16 @@
 #define PERSISTENCE_QUEUE_KEY "q-"
 /** Stem of the key for an MQTT V5 incoming message queue */
 #define PERSISTENCE_V5_QUEUE_KEY "q5-"
+/** Key of the index of the persisted records, written when a client is destroyed */
+#define PERSISTENCE_INDEX_KEY "i-0"
+/** Version of the format of the persistence index record */
+#define PERSISTENCE_INDEX_VERSION 1
 /** Maximum length of a stem for a persistence key */
 #define PERSISTENCE_MAX_STEM_LENGTH 4
 /** Maximum allowed length of a persistence key */
 #define PERSISTENCE_MAX_KEY_LENGTH 10
+/** Returned by MQTTPersistence_commit when packets have to wait for queued writes */
+#define PERSISTENCE_COMMIT_PENDING 1
 /** Maximum size of an integer sequence number appended to a persistence key */
 #define PERSISTENCE_SEQNO_LIMIT 1000000 /*10^(PERSISTENCE_MAX_KEY_LENGTH - PERSISTENCE_MAX_STEM_LENGTH)*/
 
@@ -62,11 +68,15 @@ int MQTTPersistence_close(Clients* c);
 int MQTTPersistence_clear(Clients* c);
 int MQTTPersistence_restorePackets(Clients* c);
 void* MQTTPersistence_restorePacket(int MQTTVersion, char* buffer, size_t buflen);
-void MQTTPersistence_insertInOrder(List* list, void* content, size_t size);
+ListElement* MQTTPersistence_insertInOrder(List* list, void* content, size_t size);
 int MQTTPersistence_putPacket(SOCKET socket, char* buf0, size_t buf0len, int count,
 						char** buffers, size_t* buflens, int htype, int msgId, int scr, int MQTTVersion);
 int MQTTPersistence_remove(Clients* c, char* type, int qos, int msgId);
+void MQTTPersistence_waitForWriter(Clients* c);
+int MQTTPersistence_commit(SOCKET socket, int wait);
 void MQTTPersistence_wrapMsgID(Clients *c);
+int MQTTPersistence_writeIndex(Clients* c, char* commands, int commandslen);
+void MQTTPersistence_freeIndex(Clients* c);
 
 typedef struct
 {
@@ -79,6 +89,7 @@ typedef struct
 	int dup;
 	int msgid;
 	MQTTProperties properties;
+	char* buffer; /* receive buffer the payload points into, freed with the message, or NULL */
 } MQTTPersistence_message;
 
 typedef struct
@@ -38,6 +38,7 @@
 
 #if defined(_WIN32) || defined(_WIN64)
 	#include <direct.h>
+	#include <io.h>
 	/* Windows doesn't have strtok_r, so remap it to strtok */
 	#define strtok_r( A, B, C ) strtok( A, B )
 	#define snprintf _snprintf
@@ -48,6 +49,7 @@
 	#include <sys/stat.h>
 	#include <dirent.h>
 	#include <unistd.h>
+	#include <fcntl.h>
 	int keysUnix(char *, char ***, int *);
 	int clearUnix(char *);
 	int containskeyUnix(char *, char *);
@@ -189,10 +191,70 @@ int pstmkdir( char *pPathname )
 
 
 
+static int pstwrite(void* handle, char* key, int bufcount, char* buffers[], int buflens[], int sync);
+
 /** Write wire message to the client persistence directory.
  *  See ::Persistence_put
  */
 int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	return pstwrite(handle, key, bufcount, buffers, buflens, 0);
+}
+
+
+/** Write wire message to the client persistence directory, and force it and the directory
+ *  entry for it to stable storage before returning.
+ *  See ::Persistence_put
+ */
+int pstputsync(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	return pstwrite(handle, key, bufcount, buffers, buflens, 1);
+}
+
+
+/**
+ * Force the data written to a file to stable storage.
+ * @param fp the file
+ * @return 0 if success, non-zero otherwise
+ */
+static int pstsyncfile(FILE* fp)
+{
+	int rc = fflush(fp);
+
+#if defined(_WIN32) || defined(_WIN64)
+	if (rc == 0)
+		rc = _commit(_fileno(fp));
+#else
+	if (rc == 0)
+		rc = fsync(fileno(fp));
+#endif
+	return rc;
+}
+
+
+/**
+ * Force the entries of a directory to stable storage, so that files created in it are found
+ * after a system failure.  Not needed on Windows, where the file's metadata is committed with it.
+ * @param dirname the directory
+ * @return 0 if success, non-zero otherwise
+ */
+int pstsyncdir(char* dirname)
+{
+	int rc = 0;
+#if !defined(_WIN32) && !defined(_WIN64)
+	int fd = open(dirname, O_RDONLY);
+
+	if (fd < 0 || fsync(fd) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (fd >= 0)
+		close(fd);
+#endif
+	return rc;
+}
+
+
+/** Write wire message to the client persistence directory, syncing it if requested */
+static int pstwrite(void* handle, char* key, int bufcount, char* buffers[], int buflens[], int sync)
 {
 	int rc = 0;
 	char *clientDir = handle;
@@ -201,6 +263,7 @@ int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]
 	size_t bytesWritten = 0,
 	       bytesTotal = 0;
 	int i;
+	int synced = 1;
 	size_t alloclen = 0;
 
 	FUNC_ENTRY;
@@ -232,12 +295,14 @@ int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]
 			bytesTotal += buflens[i];
 			bytesWritten += fwrite(buffers[i], sizeof(char), buflens[i], fp );
 		}
+		if (sync && bytesWritten == bytesTotal && (pstsyncfile(fp) != 0 || pstsyncdir(clientDir) != 0))
+			synced = 0; /* not known to be on stable storage, so not to be kept */
 		fclose(fp);
 		fp = NULL;
 	} else
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
 
-	if (bytesWritten != bytesTotal)
+	if (bytesWritten != bytesTotal || !synced)
 	{
 		pstremove(handle, key);
 		rc = MQTTCLIENT_PERSISTENCE_ERROR;
@@ -24,6 +24,7 @@
 int pstopen(void** handle, const char* clientID, const char* serverURI, void* context); 
 int pstclose(void* handle); 
 int pstput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]); 
+int pstputsync(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
 int pstget(void* handle, char* key, char** buffer, int* buflen); 
 int pstremove(void* handle, char* key); 
 int pstkeys(void* handle, char*** keys, int* nkeys); 
@@ -31,6 +32,7 @@ int pstclear(void* handle);
 int pstcontainskey(void* handle, char* key);
 
 int pstmkdir(char *pPathname);
+int pstsyncdir(char* dirname);
 
 #endif
 
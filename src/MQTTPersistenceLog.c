@@ -0,0 +1,1278 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A log-structured file system based persistence implementation.
+ *
+ * The directory for the client is the same as for the default persistence (see
+ * ::pstopen), but instead of one file per key, records are appended to segment files.
+ * Each record is a header - a CRC32, the record type and the key and data lengths - followed
+ * by the key and the data.  Removing a key appends a record with no data.  An index of the
+ * segment and offset of the current data for each key is kept in memory, and is rebuilt
+ * by reading the segments in order when the store is opened.  A record which is incomplete
+ * or fails its CRC check ends the reading of its segment.
+ *
+ * When the oldest segment holds mostly records which have been replaced or removed, or the
+ * segments in total do, a compaction thread copies the current records from the oldest
+ * segment to the newest and deletes it.  Only ever deleting the oldest segment means that
+ * a removal record is never deleted while an older copy of the data for its key remains.
+ *
+ * Records are flushed to the operating system as they are appended.  For the
+ * MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC durability, ::plogsync is called before packets
+ * which depend on them are sent, so one sync of the segment commits all the records
+ * appended since the last one.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <io.h>
+	#define snprintf _snprintf
+	#define fsync _commit
+	#define fileno _fileno
+#else
+	#include <dirent.h>
+	#include <unistd.h>
+	#define WINAPI
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceLog.h"
+#include "LinkedList.h"
+#include "Tree.h"
+#include "Thread.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#define LOG_RECORD_PUT 1     /**< record type for the data of a key */
+#define LOG_RECORD_REMOVE 2  /**< record type for the removal of a key */
+#define LOG_HEADER_LENGTH 13 /**< CRC (4 bytes), type (1), key length (4), data length (4) */
+#define LOG_MAX_KEY_LENGTH 1024 /**< longer keys in a record header mean the record is corrupt */
+
+/**
+ * A segment file
+ */
+typedef struct
+{
+	unsigned int number; /**< the segment file name is made from this */
+	FILE* fp;            /**< opened for appending and reading */
+	long size;           /**< the number of bytes in the segment file */
+	long live;           /**< the number of bytes in records which are still current */
+	int sealed;          /**< no more records are to be added to this segment */
+	int unsynced;        /**< records have been added since the segment was last synced */
+} LogSegment;
+
+/**
+ * The location of the current data for a key
+ */
+typedef struct
+{
+	char* key;
+	LogSegment* segment;
+	long offset;         /**< offset of the data in the segment file */
+	int datalen;
+	long reclen;         /**< the length of the whole record, header included */
+} LogIndexEntry;
+
+/**
+ * The state of an open log-structured store, the handle passed to the persistence functions
+ */
+typedef struct
+{
+	char* dir;           /**< the client directory, as returned by pstopen */
+	Tree* index;         /**< LogIndexEntry for each key */
+	List* segments;      /**< LogSegment, oldest first.  The last is the one appended to */
+	unsigned int next_number; /**< the number for the next segment to be started */
+	long size;           /**< the total size of all segments */
+	long live;           /**< the total size of the current records in all segments */
+	unsigned int clears; /**< incremented by plogclear, so a compaction can tell its segment has gone */
+	mutex_type mutex;    /**< serializes all access to the store, including from the compaction thread */
+	sem_type compact_sem; /**< posted to wake the compaction thread */
+	sem_type stopped_sem; /**< posted by the compaction thread when it ends */
+	int compacting;      /**< the compaction thread has been started */
+	int stopping;        /**< the compaction thread is to end */
+	int durability;      /**< MQTTCLIENT_PERSISTENCE_DURABILITY_* */
+	int dir_unsynced;    /**< segments have been created or deleted since the directory was last synced */
+} LogStore;
+
+/**
+ * CRC32 table, for the reflected polynomial 0xEDB88320
+ */
+static const unsigned int crc_table[256] =
+{
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+	0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+	0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+	0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+	0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+	0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+	0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+	0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+	0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+	0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+	0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+	0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+	0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+	0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+	0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+	0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+	0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+	0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+static unsigned int plog_crc(unsigned int crc, const char* buf, size_t len);
+static void plog_writeInt(char* p, unsigned int value);
+static unsigned int plog_readInt(const char* p);
+static int plog_indexCompare(void* a, void* b, int value);
+static char* plog_segmentName(LogStore* store, unsigned int number);
+static int plog_openSegment(LogStore* store, unsigned int number);
+static void plog_deleteSegment(LogStore* store, LogSegment* seg);
+static int plog_sync(LogStore* store);
+static int plog_append(LogStore* store, char type, char* key, int bufcount, char* buffers[], int buflens[],
+		LogSegment** segment, long* offset);
+static int plog_indexPut(LogStore* store, char* key, LogSegment* seg, long offset, int datalen, long reclen);
+static int plog_indexRemove(LogStore* store, char* key);
+static int plog_listSegments(char* dir, unsigned int** numbers, int* count);
+static int plog_replaySegment(LogStore* store, LogSegment* seg);
+static int plog_restore(LogStore* store);
+static void plog_free(LogStore* store, int delete_segments);
+static int plog_needsCompaction(LogStore* store);
+static void plog_checkCompaction(LogStore* store);
+static int plog_compactOldest(LogStore* store);
+static thread_return_type WINAPI plog_compactionThread(void* n);
+
+
+/**
+ * Continue a CRC32 calculation over a buffer.  Start with 0xFFFFFFFF and invert the result.
+ */
+static unsigned int plog_crc(unsigned int crc, const char* buf, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)buf;
+
+	while (len-- > 0)
+		crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+
+/* integers in record headers are little endian, so segments can be read on any platform */
+static void plog_writeInt(char* p, unsigned int value)
+{
+	p[0] = (char)(value & 0xFF);
+	p[1] = (char)((value >> 8) & 0xFF);
+	p[2] = (char)((value >> 16) & 0xFF);
+	p[3] = (char)((value >> 24) & 0xFF);
+}
+
+
+static unsigned int plog_readInt(const char* p)
+{
+	const unsigned char* u = (const unsigned char*)p;
+
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((unsigned int)u[3] << 24);
+}
+
+
+static int plog_indexCompare(void* a, void* b, int value)
+{
+	if (value)
+		b = ((LogIndexEntry*)b)->key;
+	return strcmp(((LogIndexEntry*)a)->key, (char*)b);
+}
+
+
+static char* plog_segmentName(LogStore* store, unsigned int number)
+{
+	/* consider '/' + 10 digits + '\0' */
+	size_t alloclen = strlen(store->dir) + strlen(SEGMENT_FILENAME_EXTENSION) + 12;
+	char* name = malloc(alloclen);
+
+	if (name && snprintf(name, alloclen, "%s/%010u%s", store->dir, number, SEGMENT_FILENAME_EXTENSION) >= alloclen)
+	{
+		free(name);
+		name = NULL;
+	}
+	return name;
+}
+
+
+/**
+ * Open a segment file, creating it if it doesn't exist, and add it to the end of the segment list.
+ * @param store the store
+ * @param number the number of the segment
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plog_openSegment(LogStore* store, unsigned int number)
+{
+	int rc = 0;
+	char* name = NULL;
+	LogSegment* seg = NULL;
+
+	FUNC_ENTRY;
+	if ((name = plog_segmentName(store, number)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if ((seg = malloc(sizeof(LogSegment))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(seg, '\0', sizeof(LogSegment));
+	seg->number = number;
+	if ((seg->fp = fopen(name, "a+b")) == NULL)
+	{
+		Log(LOG_ERROR, 0, "Error %d opening persistence segment %s", errno, name);
+		free(seg);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	fseek(seg->fp, 0, SEEK_END);
+	seg->size = ftell(seg->fp);
+	store->size += seg->size;
+	if (number >= store->next_number)
+		store->next_number = number + 1;
+	store->dir_unsynced = 1;
+	ListAppend(store->segments, seg, sizeof(LogSegment));
+exit:
+	if (name)
+		free(name);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Close and delete a segment file, and remove it from the segment list.
+ * @param store the store
+ * @param seg the segment, which has no current records
+ */
+static void plog_deleteSegment(LogStore* store, LogSegment* seg)
+{
+	char* name = plog_segmentName(store, seg->number);
+
+	FUNC_ENTRY;
+	fclose(seg->fp);
+	if (name)
+	{
+		if (remove(name) != 0 && errno != ENOENT)
+			Log(LOG_ERROR, 0, "Error %d deleting persistence segment %s", errno, name);
+		free(name);
+	}
+	store->size -= seg->size;
+	store->live -= seg->live;
+	store->dir_unsynced = 1;
+	ListRemove(store->segments, seg);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Force the records added to the segments, and the creation and deletion of segments, to
+ * stable storage.  Must be called with the store mutex held.
+ * @param store the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plog_sync(LogStore* store)
+{
+	ListElement* current = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while (ListNextElement(store->segments, &current))
+	{
+		LogSegment* seg = (LogSegment*)(current->content);
+
+		if (!seg->unsynced)
+			continue;
+		if (fflush(seg->fp) != 0 || fsync(fileno(seg->fp)) != 0)
+		{
+			Log(LOG_ERROR, 0, "Error %d syncing persistence segment %u", errno, seg->number);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else
+			seg->unsynced = 0;
+	}
+	if (store->dir_unsynced)
+	{
+		if (pstsyncdir(store->dir) != 0)
+		{
+			Log(LOG_ERROR, 0, "Error %d syncing persistence directory %s", errno, store->dir);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else
+			store->dir_unsynced = 0;
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Append a record to the newest segment, starting a new segment if it is full.
+ * @param store the store
+ * @param type the record type
+ * @param key the key for the record
+ * @param bufcount the number of data buffers
+ * @param buffers the data buffers
+ * @param buflens the lengths of the data buffers
+ * @param segment set to the segment the record was written to
+ * @param offset set to the offset of the data in the segment
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plog_append(LogStore* store, char type, char* key, int bufcount, char* buffers[], int buflens[],
+		LogSegment** segment, long* offset)
+{
+	char header[LOG_HEADER_LENGTH];
+	LogSegment* seg = (LogSegment*)(store->segments->last->content);
+	size_t keylen = strlen(key);
+	size_t datalen = 0;
+	size_t written = 0;
+	unsigned int crc = 0xFFFFFFFF;
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (seg->sealed || seg->size >= LOG_SEGMENT_SIZE)
+	{
+		seg->sealed = 1;
+		fflush(seg->fp); /* the compaction thread reads sealed segments through a file handle of its own */
+		if ((rc = plog_openSegment(store, store->next_number)) != 0)
+			goto exit;
+		seg = (LogSegment*)(store->segments->last->content);
+		plog_checkCompaction(store);
+	}
+
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	header[4] = type;
+	plog_writeInt(&header[5], (unsigned int)keylen);
+	plog_writeInt(&header[9], (unsigned int)datalen);
+	crc = plog_crc(crc, &header[4], LOG_HEADER_LENGTH - 4);
+	crc = plog_crc(crc, key, keylen);
+	for (i = 0; i < bufcount; ++i)
+		crc = plog_crc(crc, buffers[i], buflens[i]);
+	plog_writeInt(header, ~crc);
+
+	/* in append mode writes always go to the end, but switching from reading needs a seek */
+	fseek(seg->fp, 0, SEEK_END);
+	written = fwrite(header, 1, LOG_HEADER_LENGTH, seg->fp);
+	written += fwrite(key, 1, keylen, seg->fp);
+	for (i = 0; i < bufcount; ++i)
+		written += fwrite(buffers[i], 1, buflens[i], seg->fp);
+	if ((store->durability != MQTTCLIENT_PERSISTENCE_DURABILITY_NONE && fflush(seg->fp) != 0) ||
+			written != LOG_HEADER_LENGTH + keylen + datalen)
+	{
+		long end = ftell(seg->fp);
+
+		Log(LOG_ERROR, 0, "Error %d writing to persistence segment %u", errno, seg->number);
+		/* a partial record ends the reading of a segment, so nothing more can be added after it */
+		seg->sealed = 1;
+		if (end > seg->size)
+		{
+			store->size += end - seg->size;
+			seg->size = end;
+		}
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	*segment = seg;
+	seg->unsynced = 1;
+	*offset = seg->size + LOG_HEADER_LENGTH + (long)keylen;
+	seg->size += (long)written;
+	store->size += (long)written;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Point the index entry for a key at new data, adding the entry if needed.
+ */
+static int plog_indexPut(LogStore* store, char* key, LogSegment* seg, long offset, int datalen, long reclen)
+{
+	Node* node = TreeFind(store->index, key);
+	LogIndexEntry* entry = NULL;
+	int rc = 0;
+
+	if (node)
+	{
+		entry = (LogIndexEntry*)(node->content);
+		entry->segment->live -= entry->reclen;
+		store->live -= entry->reclen;
+	}
+	else
+	{
+		size_t keylen = strlen(key) + 1;
+
+		if ((entry = malloc(sizeof(LogIndexEntry))) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		if ((entry->key = malloc(keylen)) == NULL)
+		{
+			free(entry);
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		strcpy(entry->key, key);
+		TreeAdd(store->index, entry, sizeof(LogIndexEntry) + keylen);
+	}
+	entry->segment = seg;
+	entry->offset = offset;
+	entry->datalen = datalen;
+	entry->reclen = reclen;
+	seg->live += reclen;
+	store->live += reclen;
+exit:
+	return rc;
+}
+
+
+/**
+ * Remove the index entry for a key.
+ * @return 1 if the key was found, otherwise 0
+ */
+static int plog_indexRemove(LogStore* store, char* key)
+{
+	LogIndexEntry* entry = TreeRemoveKey(store->index, key);
+
+	if (entry)
+	{
+		entry->segment->live -= entry->reclen;
+		store->live -= entry->reclen;
+		free(entry->key);
+		free(entry);
+	}
+	return entry != NULL;
+}
+
+
+static int plog_numberCompare(const void* a, const void* b)
+{
+	unsigned int i = *(const unsigned int*)a;
+	unsigned int j = *(const unsigned int*)b;
+
+	return (i < j) ? -1 : (i == j) ? 0 : 1;
+}
+
+
+/**
+ * Find the numbers of the segment files in a client directory.
+ * @param dir the client directory
+ * @param numbers set to an array of the segment numbers, in ascending order, which the caller must free
+ * @param count set to the number of segments
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plog_listSegments(char* dir, unsigned int** numbers, int* count)
+{
+	int rc = 0;
+	unsigned int* found = NULL;
+	int nfound = 0;
+	int allocated = 0;
+	char* name = NULL;
+#if defined(_WIN32) || defined(_WIN64)
+	char* pattern = NULL;
+	size_t alloclen = strlen(dir) + strlen(SEGMENT_FILENAME_EXTENSION) + 3;
+	WIN32_FIND_DATAA FileData;
+	HANDLE hDir = INVALID_HANDLE_VALUE;
+	int more = 1;
+#else
+	DIR* dp = NULL;
+	struct dirent* dir_entry = NULL;
+#endif
+
+	FUNC_ENTRY;
+#if defined(_WIN32) || defined(_WIN64)
+	if ((pattern = malloc(alloclen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	snprintf(pattern, alloclen, "%s/*%s", dir, SEGMENT_FILENAME_EXTENSION);
+	hDir = FindFirstFileA(pattern, &FileData);
+	free(pattern);
+	if (hDir == INVALID_HANDLE_VALUE)
+		goto exit; /* no segments */
+	while (more)
+	{
+		name = FileData.cFileName;
+#else
+	if ((dp = opendir(dir)) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	while ((dir_entry = readdir(dp)) != NULL)
+	{
+		name = dir_entry->d_name;
+#endif
+		{
+			unsigned int number = 0;
+			int len = 0;
+
+			if (sscanf(name, "%u%n", &number, &len) == 1 && strcmp(&name[len], SEGMENT_FILENAME_EXTENSION) == 0)
+			{
+				if (nfound == allocated)
+				{
+					unsigned int* newfound = NULL;
+
+					allocated = (allocated == 0) ? 16 : allocated * 2;
+					newfound = (found == NULL) ? malloc(allocated * sizeof(unsigned int)) :
+							realloc(found, allocated * sizeof(unsigned int));
+					if (newfound == NULL)
+					{
+						rc = PAHO_MEMORY_ERROR;
+						break;
+					}
+					found = newfound;
+				}
+				found[nfound++] = number;
+			}
+		}
+#if defined(_WIN32) || defined(_WIN64)
+		more = FindNextFileA(hDir, &FileData);
+	}
+	FindClose(hDir);
+#else
+	}
+	closedir(dp);
+#endif
+
+	if (rc == 0 && nfound > 1)
+		qsort(found, nfound, sizeof(unsigned int), plog_numberCompare);
+exit:
+	if (rc != 0 && found)
+	{
+		free(found);
+		found = NULL;
+		nfound = 0;
+	}
+	*numbers = found;
+	*count = nfound;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Read the records in a segment into the index.  Reading stops at the first record which is
+ * incomplete or fails its CRC check, and the segment is then sealed so that nothing is added
+ * after that record.
+ * @param store the store
+ * @param seg the segment
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int plog_replaySegment(LogStore* store, LogSegment* seg)
+{
+	char header[LOG_HEADER_LENGTH];
+	char* buf = NULL;
+	size_t buflen = 0;
+	long pos = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	fseek(seg->fp, 0, SEEK_SET);
+	while (rc == 0 && fread(header, 1, LOG_HEADER_LENGTH, seg->fp) == LOG_HEADER_LENGTH)
+	{
+		char type = header[4];
+		unsigned int keylen = plog_readInt(&header[5]);
+		unsigned int datalen = plog_readInt(&header[9]);
+		long reclen = LOG_HEADER_LENGTH + (long)keylen + (long)datalen;
+		unsigned int crc = 0xFFFFFFFF;
+
+		if ((type != LOG_RECORD_PUT && type != LOG_RECORD_REMOVE) || keylen == 0 || keylen > LOG_MAX_KEY_LENGTH ||
+				datalen > (unsigned int)(seg->size - pos) || reclen > seg->size - pos)
+			break;
+		if (keylen + datalen + 1 > buflen)
+		{
+			char* newbuf = NULL;
+
+			buflen = keylen + datalen + 1;
+			if ((newbuf = (buf == NULL) ? malloc(buflen) : realloc(buf, buflen)) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			buf = newbuf;
+		}
+		/* the data is read after the key's terminating null */
+		if (fread(buf, 1, keylen, seg->fp) != keylen || fread(&buf[keylen + 1], 1, datalen, seg->fp) != datalen)
+			break;
+		crc = plog_crc(crc, &header[4], LOG_HEADER_LENGTH - 4);
+		crc = plog_crc(crc, buf, keylen);
+		crc = plog_crc(crc, &buf[keylen + 1], datalen);
+		if (~crc != plog_readInt(header))
+			break;
+		buf[keylen] = '\0';
+		if (type == LOG_RECORD_PUT)
+			rc = plog_indexPut(store, buf, seg, pos + LOG_HEADER_LENGTH + (long)keylen, (int)datalen, reclen);
+		else
+			plog_indexRemove(store, buf);
+		pos += reclen;
+	}
+	if (rc == 0 && pos < seg->size)
+	{
+		Log(LOG_ERROR, 0, "Persistence segment %u is damaged after offset %ld", seg->number, pos);
+		seg->sealed = 1;
+	}
+	if (buf)
+		free(buf);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Open the segments in the client directory and rebuild the index from them.
+ */
+static int plog_restore(LogStore* store)
+{
+	unsigned int* numbers = NULL;
+	int count = 0;
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if ((rc = plog_listSegments(store->dir, &numbers, &count)) != 0)
+		goto exit;
+	for (i = 0; rc == 0 && i < count; ++i)
+	{
+		if ((rc = plog_openSegment(store, numbers[i])) == 0)
+			rc = plog_replaySegment(store, (LogSegment*)(store->segments->last->content));
+	}
+	if (numbers)
+		free(numbers);
+	if (rc == 0 && (store->segments->count == 0 || ((LogSegment*)(store->segments->last->content))->sealed))
+		rc = plog_openSegment(store, (store->next_number == 0) ? 1 : store->next_number);
+	if (rc == 0)
+		plog_checkCompaction(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Free the index and segment list of a store, and the store itself, but not its directory name.
+ * @param store the store
+ * @param delete_segments whether to delete the segment files too
+ */
+static void plog_free(LogStore* store, int delete_segments)
+{
+	Node* node = NULL;
+	ListElement* current = NULL;
+
+	FUNC_ENTRY;
+	if (store->index)
+	{
+		while ((node = TreeNextElement(store->index, NULL)) != NULL)
+		{
+			LogIndexEntry* entry = (LogIndexEntry*)(node->content);
+
+			TreeRemove(store->index, entry);
+			free(entry->key);
+			free(entry);
+		}
+		TreeFree(store->index);
+	}
+	if (store->segments)
+	{
+		while (ListNextElement(store->segments, &current) != NULL)
+		{
+			LogSegment* seg = (LogSegment*)(current->content);
+
+			if (delete_segments)
+			{
+				seg->live = 0;
+				plog_deleteSegment(store, seg);
+				current = NULL; /* the element has gone, so start again from the head */
+			}
+			else
+				fclose(seg->fp);
+		}
+		ListFree(store->segments);
+	}
+	if (store->mutex)
+		Paho_thread_destroy_mutex(store->mutex);
+	if (store->compact_sem)
+		Thread_destroy_sem(store->compact_sem);
+	if (store->stopped_sem)
+		Thread_destroy_sem(store->stopped_sem);
+	free(store);
+	FUNC_EXIT;
+}
+
+
+/** Open the log-structured store in the client persistence directory, and read its index.
+ *  See ::Persistence_open
+ */
+int plogopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	LogStore* store = NULL;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(LogStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(LogStore));
+	store->durability = MQTTCLIENT_PERSISTENCE_DURABILITY_OS;
+	if ((rc = pstopen((void**)&store->dir, clientID, serverURI, context)) != 0)
+	{
+		free(store);
+		goto exit;
+	}
+	store->index = TreeInitialize(plog_indexCompare);
+	store->segments = ListInitialize();
+	store->mutex = Paho_thread_create_mutex(&rc);
+	if (rc == 0)
+		store->compact_sem = Thread_create_sem(&rc);
+	if (rc == 0)
+		store->stopped_sem = Thread_create_sem(&rc);
+	if (rc == 0)
+		rc = plog_restore(store);
+	if (rc != 0)
+	{
+		char* dir = store->dir;
+
+		plog_free(store, 0);
+		pstclose(dir);
+		goto exit;
+	}
+	*handle = store;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Close the store, stopping the compaction thread.  If the store is empty, the segments
+ *  and the client directory are deleted.
+ *  See ::Persistence_close
+ */
+int plogclose(void* handle)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	char* dir = NULL;
+	int compacting = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	store->stopping = 1;
+	compacting = store->compacting;
+	Paho_thread_unlock_mutex(store->mutex);
+	if (compacting)
+	{
+		Thread_post_sem(store->compact_sem);
+		while (Thread_wait_sem(store->stopped_sem, 1000) == ETIMEDOUT)
+			Thread_post_sem(store->compact_sem);
+	}
+
+	dir = store->dir;
+	plog_free(store, store->index->count == 0);
+	rc = pstclose(dir); /* frees dir, and deletes it if we left it empty */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append the data for a key to the log.
+ *  See ::Persistence_put
+ */
+int plogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	LogStore* store = handle;
+	LogSegment* seg = NULL;
+	long offset = 0;
+	int datalen = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	Paho_thread_lock_mutex(store->mutex);
+	if ((rc = plog_append(store, LOG_RECORD_PUT, key, bufcount, buffers, buflens, &seg, &offset)) == 0)
+	{
+		rc = plog_indexPut(store, key, seg, offset, datalen, LOG_HEADER_LENGTH + (long)strlen(key) + datalen);
+		plog_checkCompaction(store);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Read the current data for a key from its segment.
+ *  See ::Persistence_get
+ */
+int plogget(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	Node* node = NULL;
+	char* buf = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	if ((node = TreeFind(store->index, key)) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+	{
+		LogIndexEntry* entry = (LogIndexEntry*)(node->content);
+
+		if ((buf = malloc(entry->datalen)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else if (fseek(entry->segment->fp, entry->offset, SEEK_SET) != 0 ||
+				fread(buf, 1, entry->datalen, entry->segment->fp) != (size_t)entry->datalen)
+		{
+			Log(LOG_ERROR, 0, "Error %d reading from persistence segment %u", errno, entry->segment->number);
+			free(buf);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		else
+		{
+			*buffer = buf;
+			*buflen = entry->datalen;
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	/* the caller must free buf */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Append a removal record for a key to the log.
+ *  See ::Persistence_remove
+ */
+int plogremove(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	LogSegment* seg = NULL;
+	long offset = 0;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->index, key) != NULL &&
+			(rc = plog_append(store, LOG_RECORD_REMOVE, key, 0, NULL, NULL, &seg, &offset)) == 0)
+	{
+		plog_indexRemove(store, key);
+		plog_checkCompaction(store);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the index.
+ *  See ::Persistence_keys
+ */
+int plogkeys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	if (store->index->count > 0 && (fkeys = malloc(store->index->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		LogIndexEntry* entry = (LogIndexEntry*)(node->content);
+
+		if ((fkeys[nfkeys] = malloc(strlen(entry->key) + 1)) == NULL)
+		{
+			while (--nfkeys >= 0)
+				free(fkeys[nfkeys]);
+			free(fkeys);
+			fkeys = NULL;
+			nfkeys = 0;
+			rc = PAHO_MEMORY_ERROR;
+		}
+		else
+			strcpy(fkeys[nfkeys++], entry->key);
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+
+	*nkeys = nfkeys;
+	*keys = fkeys;
+	/* the caller must free keys */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Delete all the segments and start a new one.
+ *  See ::Persistence_clear
+ */
+int plogclear(void* handle)
+{
+	int rc = 0;
+	LogStore* store = handle;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	while ((node = TreeNextElement(store->index, NULL)) != NULL)
+	{
+		LogIndexEntry* entry = (LogIndexEntry*)(node->content);
+
+		plog_indexRemove(store, entry->key);
+	}
+	while (store->segments->count > 0)
+		plog_deleteSegment(store, (LogSegment*)(store->segments->first->content));
+	++store->clears;
+	rc = plog_openSegment(store, store->next_number);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether the index has an entry for a key.
+ *  See ::Persistence_containskey
+ */
+int plogcontainskey(void* handle, char* key)
+{
+	int rc = 0;
+	LogStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	if (TreeFind(store->index, key) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Set how soon the records appended reach stable storage.
+ *  @param handle the store
+ *  @param durability one of the MQTTCLIENT_PERSISTENCE_DURABILITY_* values.  With
+ *  MQTTCLIENT_PERSISTENCE_DURABILITY_NONE, records are left in the stdio buffers until they
+ *  fill; with MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC, they are flushed as for the default, and
+ *  plogsync must be called to sync them.
+ */
+void plogsetdurability(void* handle, int durability)
+{
+	LogStore* store = handle;
+
+	Paho_thread_lock_mutex(store->mutex);
+	store->durability = (durability == MQTTCLIENT_PERSISTENCE_DURABILITY_DEFAULT) ?
+		MQTTCLIENT_PERSISTENCE_DURABILITY_OS : durability;
+	Paho_thread_unlock_mutex(store->mutex);
+}
+
+
+/** Force all the records appended since the last call to stable storage, with one sync of
+ *  each segment written to, however many records that covers.
+ *  @param handle the store
+ *  @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+int plogsync(void* handle)
+{
+	int rc = 0;
+	LogStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	Paho_thread_lock_mutex(store->mutex);
+	rc = plog_sync(store);
+	Paho_thread_unlock_mutex(store->mutex);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Whether the oldest segment should be compacted: if three quarters of it are no longer
+ * current, or if the segments together hold more than twice as much data as is current.
+ * Must be called with the store mutex held.
+ */
+static int plog_needsCompaction(LogStore* store)
+{
+	LogSegment* oldest = NULL;
+
+	if (store->segments->count < 2)
+		return 0; /* never compact the segment being appended to */
+	oldest = (LogSegment*)(store->segments->first->content);
+	return oldest->live * 4 <= oldest->size || store->size > 2 * store->live + 2 * LOG_SEGMENT_SIZE;
+}
+
+
+/**
+ * Wake the compaction thread, starting it if needed, if there is compaction to be done.
+ * Must be called with the store mutex held.
+ */
+static void plog_checkCompaction(LogStore* store)
+{
+	if (store->stopping || !plog_needsCompaction(store))
+		return;
+	if (!store->compacting)
+	{
+		store->compacting = 1;
+		Paho_thread_start(plog_compactionThread, store);
+	}
+	else
+		Thread_post_sem(store->compact_sem);
+}
+
+
+/**
+ * Copy the current records in the oldest segment to the newest, and delete the oldest.
+ * Called with the store mutex held, which is released while each record is read.
+ * @return 0 if the segment was deleted, or compaction was interrupted by the store being
+ * closed or cleared, otherwise an error code
+ */
+static int plog_compactOldest(LogStore* store)
+{
+	LogSegment* seg = (LogSegment*)(store->segments->first->content);
+	unsigned int clears = store->clears;
+	char header[LOG_HEADER_LENGTH];
+	char* name = NULL;
+	char* buf = NULL;
+	size_t buflen = 0;
+	FILE* fp = NULL;
+	long pos = 0;
+	long size = seg->size;
+	long live = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (seg->live == 0)
+		goto exit;
+	/* a segment which is not appended to any more can be read on its own file handle without the mutex */
+	if ((name = plog_segmentName(store, seg->number)) == NULL || (fp = fopen(name, "rb")) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	while (pos < size && fread(header, 1, LOG_HEADER_LENGTH, fp) == LOG_HEADER_LENGTH)
+	{
+		unsigned int keylen = plog_readInt(&header[5]);
+		unsigned int datalen = plog_readInt(&header[9]);
+		long reclen = LOG_HEADER_LENGTH + (long)keylen + (long)datalen;
+
+		/* records were checked as they were written or restored, so only a length check is needed */
+		if (keylen == 0 || keylen > LOG_MAX_KEY_LENGTH || reclen > size - pos)
+			break;
+		if (keylen + datalen + 1 > buflen)
+		{
+			char* newbuf = NULL;
+
+			buflen = keylen + datalen + 1;
+			if ((newbuf = (buf == NULL) ? malloc(buflen) : realloc(buf, buflen)) == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				break;
+			}
+			buf = newbuf;
+		}
+		if (fread(buf, 1, keylen, fp) != keylen || fread(&buf[keylen + 1], 1, datalen, fp) != datalen)
+			break;
+		buf[keylen] = '\0';
+
+		Paho_thread_lock_mutex(store->mutex);
+		if (store->stopping || store->clears != clears)
+		{
+			Paho_thread_unlock_mutex(store->mutex);
+			break;
+		}
+		if (header[4] == LOG_RECORD_PUT)
+		{
+			Node* node = TreeFind(store->index, buf);
+			long offset = pos + LOG_HEADER_LENGTH + (long)keylen;
+
+			if (node && ((LogIndexEntry*)(node->content))->segment == seg &&
+					((LogIndexEntry*)(node->content))->offset == offset)
+			{
+				LogSegment* newseg = NULL;
+				char* data = &buf[keylen + 1];
+				int len = (int)datalen;
+
+				if ((rc = plog_append(store, LOG_RECORD_PUT, buf, 1, &data, &len, &newseg, &offset)) == 0)
+					rc = plog_indexPut(store, buf, newseg, offset, (int)datalen, reclen);
+			}
+		}
+		/* seg may be deleted by plogclear once the mutex is released, so it is only read here */
+		live = seg->live;
+		Paho_thread_unlock_mutex(store->mutex);
+		if (rc != 0 || live == 0)
+			break; /* an error, or nothing more to copy */
+		pos += reclen;
+	}
+	Paho_thread_lock_mutex(store->mutex);
+exit:
+	if (fp)
+		fclose(fp);
+	if (name)
+		free(name);
+	if (buf)
+		free(buf);
+	if (rc == 0 && !store->stopping && store->clears == clears)
+	{
+		if (seg->live == 0)
+		{
+			/* the copies must be on stable storage before the originals are deleted */
+			if (store->durability != MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC || (rc = plog_sync(store)) == 0)
+				plog_deleteSegment(store, seg);
+		}
+		else
+		{
+			Log(LOG_ERROR, 0, "Could not compact persistence segment %u", seg->number);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/* The compaction thread for a store, started when the store first needs compacting */
+static thread_return_type WINAPI plog_compactionThread(void* n)
+{
+	LogStore* store = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTT_compact");
+	Paho_thread_lock_mutex(store->mutex);
+	while (!store->stopping)
+	{
+		int rc = 0;
+
+		if (!plog_needsCompaction(store) || plog_compactOldest(store) != 0)
+		{
+			Paho_thread_unlock_mutex(store->mutex);
+			if ((rc = Thread_wait_sem(store->compact_sem, 1000)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+			Paho_thread_lock_mutex(store->mutex);
+		}
+	}
+	Paho_thread_unlock_mutex(store->mutex);
+	Thread_post_sem(store->stopped_sem);
+	FUNC_EXIT;
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+#endif /* !defined(NO_PERSISTENCE) */
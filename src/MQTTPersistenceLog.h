@@ -0,0 +1,41 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCELOG_H)
+#define MQTTPERSISTENCELOG_H
+
+/** Extension of the segment filenames */
+#define SEGMENT_FILENAME_EXTENSION ".seg"
+
+/** A new segment is started when the current one reaches this size */
+#if !defined(LOG_SEGMENT_SIZE)
+#define LOG_SEGMENT_SIZE (1024 * 1024)
+#endif
+
+/* prototypes of the functions for the log-structured file persistence */
+int plogopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int plogclose(void* handle);
+int plogput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int plogget(void* handle, char* key, char** buffer, int* buflen);
+int plogremove(void* handle, char* key);
+int plogkeys(void* handle, char*** keys, int* nkeys);
+int plogclear(void* handle);
+int plogcontainskey(void* handle, char* key);
+
+void plogsetdurability(void* handle, int durability);
+int plogsync(void* handle);
+
+#endif
@@ -0,0 +1,618 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief An in-memory persistence implementation, with an optional snapshot file.
+ *
+ * Records are kept in an index in process memory, so putting and removing them costs no
+ * file system operations at all.  If a directory is given as the context, the records left
+ * when the store is closed are written to one snapshot file in the client directory (the
+ * same directory as for the default persistence, see ::pstopen), which is read back, and
+ * deleted, when the store is next opened.  So records survive a clean restart of the
+ * application, but not the process ending without the client being destroyed.
+ *
+ * The snapshot is written to a temporary file which is then renamed, so an existing snapshot
+ * is never left half written.  It starts with a magic string and the number of records, and
+ * each record is the key and data lengths followed by the key and the data.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+	#include <windows.h>
+	#include <io.h>
+	#define snprintf _snprintf
+	#define fsync _commit
+	#define fileno _fileno
+#else
+	#include <unistd.h>
+#endif
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceDefault.h"
+#include "MQTTPersistenceMemory.h"
+#include "Tree.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#define MEMORY_SNAPSHOT_MAGIC "PAHOMEM1" /**< the first bytes of a snapshot file */
+#define MEMORY_SNAPSHOT_MAGIC_LENGTH 8
+#define MEMORY_MAX_KEY_LENGTH 1024 /**< longer keys in a snapshot mean the file is corrupt */
+
+/**
+ * The data for a key.  The key is held in the same allocation, after the structure.
+ */
+typedef struct
+{
+	char* key;
+	char* data;
+	int datalen;
+} MemoryEntry;
+
+/**
+ * The state of an open in-memory store, the handle passed to the persistence functions
+ */
+typedef struct
+{
+	char* dir;           /**< the client directory, as returned by pstopen, or NULL for no snapshot */
+	Tree* index;         /**< MemoryEntry for each key */
+	int durability;      /**< MQTTCLIENT_PERSISTENCE_DURABILITY_* for the snapshot */
+} MemoryStore;
+
+static void pmem_writeInt(char* p, unsigned int value);
+static unsigned int pmem_readInt(const char* p);
+static int pmem_indexCompare(void* a, void* b, int value);
+static char* pmem_fileName(MemoryStore* store, const char* name);
+static MemoryEntry* pmem_add(MemoryStore* store, char* key, size_t keylen);
+static void pmem_freeEntries(MemoryStore* store);
+static int pmem_readSnapshot(MemoryStore* store);
+static int pmem_writeSnapshot(MemoryStore* store);
+
+
+/* integers in snapshots are little endian, so they can be read on any platform */
+static void pmem_writeInt(char* p, unsigned int value)
+{
+	p[0] = (char)(value & 0xFF);
+	p[1] = (char)((value >> 8) & 0xFF);
+	p[2] = (char)((value >> 16) & 0xFF);
+	p[3] = (char)((value >> 24) & 0xFF);
+}
+
+
+static unsigned int pmem_readInt(const char* p)
+{
+	const unsigned char* u = (const unsigned char*)p;
+
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((unsigned int)u[3] << 24);
+}
+
+
+static int pmem_indexCompare(void* a, void* b, int value)
+{
+	if (value)
+		b = ((MemoryEntry*)b)->key;
+	return strcmp(((MemoryEntry*)a)->key, (char*)b);
+}
+
+
+/**
+ * The full name of a file in the client directory.
+ * @return the name, to be freed by the caller, or NULL
+ */
+static char* pmem_fileName(MemoryStore* store, const char* name)
+{
+	/* consider '/' + '\0' */
+	size_t alloclen = strlen(store->dir) + strlen(name) + 2;
+	char* filename = malloc(alloclen);
+
+	if (filename && snprintf(filename, alloclen, "%s/%s", store->dir, name) >= alloclen)
+	{
+		free(filename);
+		filename = NULL;
+	}
+	return filename;
+}
+
+
+/**
+ * Add an entry with no data for a key to the index.
+ * @param keylen the length of the key, not including the terminating null
+ * @return the entry, or NULL if there was no memory for it
+ */
+static MemoryEntry* pmem_add(MemoryStore* store, char* key, size_t keylen)
+{
+	MemoryEntry* entry = NULL;
+
+	if ((entry = malloc(sizeof(MemoryEntry) + keylen + 1)) != NULL)
+	{
+		entry->key = (char*)(entry + 1);
+		memcpy(entry->key, key, keylen);
+		entry->key[keylen] = '\0';
+		entry->data = NULL;
+		entry->datalen = 0;
+		TreeAdd(store->index, entry, sizeof(MemoryEntry) + keylen + 1);
+	}
+	return entry;
+}
+
+
+/**
+ * Remove all the entries from the index, and free them.
+ */
+static void pmem_freeEntries(MemoryStore* store)
+{
+	Node* node = NULL;
+
+	while ((node = TreeNextElement(store->index, NULL)) != NULL)
+	{
+		MemoryEntry* entry = (MemoryEntry*)(node->content);
+
+		TreeRemove(store->index, entry);
+		if (entry->data)
+			free(entry->data);
+		free(entry);
+	}
+}
+
+
+/**
+ * Load the records from the snapshot file in the client directory, if there is one, and
+ * delete it, so that the records can't be restored twice.
+ * @param store the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pmem_readSnapshot(MemoryStore* store)
+{
+	char* filename = NULL;
+	FILE* fp = NULL;
+	char header[MEMORY_SNAPSHOT_MAGIC_LENGTH + 4];
+	unsigned int count = 0;
+	unsigned int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((filename = pmem_fileName(store, MEMORY_SNAPSHOT_FILENAME)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if ((fp = fopen(filename, "rb")) == NULL)
+	{
+		if (errno != ENOENT)
+		{
+			Log(LOG_ERROR, 0, "Error %d opening persistence snapshot %s", errno, filename);
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		}
+		goto exit; /* no snapshot is not an error */
+	}
+
+	if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+			memcmp(header, MEMORY_SNAPSHOT_MAGIC, MEMORY_SNAPSHOT_MAGIC_LENGTH) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+		count = pmem_readInt(&header[MEMORY_SNAPSHOT_MAGIC_LENGTH]);
+	for (i = 0; rc == 0 && i < count; ++i)
+	{
+		char lengths[8];
+		char key[MEMORY_MAX_KEY_LENGTH];
+		unsigned int keylen = 0, datalen = 0;
+		MemoryEntry* entry = NULL;
+
+		if (fread(lengths, 1, sizeof(lengths), fp) != sizeof(lengths))
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if ((keylen = pmem_readInt(lengths)) == 0 || keylen >= MEMORY_MAX_KEY_LENGTH ||
+				(datalen = pmem_readInt(&lengths[4])) > (unsigned int)0x7FFFFFFF)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if (fread(key, 1, keylen, fp) != keylen)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if ((entry = pmem_add(store, key, keylen)) == NULL ||
+				(datalen > 0 && (entry->data = malloc(datalen)) == NULL))
+			rc = PAHO_MEMORY_ERROR;
+		else if (fread(entry->data, 1, datalen, fp) != datalen)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else
+			entry->datalen = (int)datalen;
+	}
+	if (rc == 0 && fgetc(fp) != EOF)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR; /* more data than records */
+	fclose(fp);
+
+	if (rc == MQTTCLIENT_PERSISTENCE_ERROR)
+		Log(LOG_ERROR, 0, "Persistence snapshot %s is not valid", filename);
+	if (rc == 0)
+		remove(filename);
+	else
+		pmem_freeEntries(store); /* the snapshot is left for investigation */
+exit:
+	if (filename)
+		free(filename);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Write the records in the index to the snapshot file in the client directory.
+ * @param store the store
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR otherwise
+ */
+static int pmem_writeSnapshot(MemoryStore* store)
+{
+	char* filename = NULL;
+	char* tmpname = NULL;
+	FILE* fp = NULL;
+	char header[MEMORY_SNAPSHOT_MAGIC_LENGTH + 4];
+	Node* node = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((filename = pmem_fileName(store, MEMORY_SNAPSHOT_FILENAME)) == NULL ||
+			(tmpname = pmem_fileName(store, MEMORY_SNAPSHOT_FILENAME ".tmp")) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if ((fp = fopen(tmpname, "wb")) == NULL)
+	{
+		Log(LOG_ERROR, 0, "Error %d opening persistence snapshot %s", errno, tmpname);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	memcpy(header, MEMORY_SNAPSHOT_MAGIC, MEMORY_SNAPSHOT_MAGIC_LENGTH);
+	pmem_writeInt(&header[MEMORY_SNAPSHOT_MAGIC_LENGTH], (unsigned int)store->index->count);
+	if (fwrite(header, 1, sizeof(header), fp) != sizeof(header))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		MemoryEntry* entry = (MemoryEntry*)(node->content);
+		size_t keylen = strlen(entry->key);
+		char lengths[8];
+
+		pmem_writeInt(lengths, (unsigned int)keylen);
+		pmem_writeInt(&lengths[4], (unsigned int)entry->datalen);
+		if (fwrite(lengths, 1, sizeof(lengths), fp) != sizeof(lengths) ||
+				fwrite(entry->key, 1, keylen, fp) != keylen ||
+				fwrite(entry->data, 1, entry->datalen, fp) != (size_t)entry->datalen)
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	}
+	if (rc == 0 && store->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC &&
+			(fflush(fp) != 0 || fsync(fileno(fp)) != 0))
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	if (fclose(fp) != 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+
+	if (rc == 0)
+	{
+#if defined(_WIN32) || defined(_WIN64)
+		/* rename doesn't replace an existing file on Windows */
+		if (!MoveFileExA(tmpname, filename, MOVEFILE_REPLACE_EXISTING))
+#else
+		if (rename(tmpname, filename) != 0)
+#endif
+			rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		else if (store->durability == MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC)
+			rc = pstsyncdir(store->dir);
+	}
+	if (rc != 0)
+	{
+		Log(LOG_ERROR, 0, "Error %d writing persistence snapshot %s", errno, filename);
+		remove(tmpname);
+	}
+exit:
+	if (filename)
+		free(filename);
+	if (tmpname)
+		free(tmpname);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Create an empty store, and if the context is a directory, load the records from any
+ *  snapshot in the client directory.
+ *  See ::Persistence_open
+ */
+int pmemopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	int rc = 0;
+	MemoryStore* store = NULL;
+
+	FUNC_ENTRY;
+	if ((store = malloc(sizeof(MemoryStore))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(store, '\0', sizeof(MemoryStore));
+	store->durability = MQTTCLIENT_PERSISTENCE_DURABILITY_OS;
+	if ((store->index = TreeInitialize(pmem_indexCompare)) == NULL)
+	{
+		free(store);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if (context != NULL)
+	{
+		if ((rc = pstopen((void**)&store->dir, clientID, serverURI, context)) == 0 &&
+				(rc = pmem_readSnapshot(store)) != 0)
+			pstclose(store->dir);
+		if (rc != 0)
+		{
+			TreeFree(store->index);
+			free(store);
+			goto exit;
+		}
+	}
+	*handle = store;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Free the store, first writing any records left to a snapshot, if it has a directory.
+ *  The client directory is deleted if it is empty.
+ *  See ::Persistence_close
+ */
+int pmemclose(void* handle)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (store->dir && store->index->count > 0)
+		rc = pmem_writeSnapshot(store);
+	pmem_freeEntries(store);
+	TreeFree(store->index);
+	if (store->dir && pstclose(store->dir) != 0 && rc == 0)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	free(store);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Copy the data for a key into the index, replacing any it had.
+ *  See ::Persistence_put
+ */
+int pmemput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+	Node* node = NULL;
+	MemoryEntry* entry = NULL;
+	char* data = NULL;
+	char* ptr = NULL;
+	int datalen = 0;
+	int i;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	if (datalen > 0 && (data = malloc(datalen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	ptr = data;
+	for (i = 0; i < bufcount; ++i)
+	{
+		memcpy(ptr, buffers[i], buflens[i]);
+		ptr += buflens[i];
+	}
+
+	if ((node = TreeFind(store->index, key)) != NULL)
+		entry = (MemoryEntry*)(node->content);
+	else if ((entry = pmem_add(store, key, strlen(key))) == NULL)
+	{
+		if (data)
+			free(data);
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	if (entry->data)
+		free(entry->data);
+	entry->data = data;
+	entry->datalen = datalen;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Return a copy of the data for a key.
+ *  See ::Persistence_get
+ */
+int pmemget(void* handle, char* key, char** buffer, int* buflen)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+	Node* node = NULL;
+	char* buf = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL || (node = TreeFind(store->index, key)) == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	else
+	{
+		MemoryEntry* entry = (MemoryEntry*)(node->content);
+
+		/* at least one byte, so an empty record still has a buffer */
+		if ((buf = malloc(entry->datalen > 0 ? entry->datalen : 1)) == NULL)
+			rc = PAHO_MEMORY_ERROR;
+		else
+		{
+			if (entry->datalen > 0)
+				memcpy(buf, entry->data, entry->datalen);
+			*buffer = buf;
+			*buflen = entry->datalen;
+		}
+	}
+	/* the caller must free buf */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Remove the data for a key from the index.
+ *  See ::Persistence_remove
+ */
+int pmemremove(void* handle, char* key)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+	MemoryEntry* entry = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if ((entry = TreeRemoveKey(store->index, key)) != NULL)
+	{
+		if (entry->data)
+			free(entry->data);
+		free(entry);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns the keys in the index.
+ *  See ::Persistence_keys
+ */
+int pmemkeys(void* handle, char*** keys, int* nkeys)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+	char** fkeys = NULL;
+	int nfkeys = 0;
+	Node* node = NULL;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+	{
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+
+	if (store->index->count > 0 && (fkeys = malloc(store->index->count * sizeof(char*))) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	while (rc == 0 && (node = TreeNextElement(store->index, node)) != NULL)
+	{
+		MemoryEntry* entry = (MemoryEntry*)(node->content);
+
+		if ((fkeys[nfkeys] = malloc(strlen(entry->key) + 1)) == NULL)
+		{
+			while (--nfkeys >= 0)
+				free(fkeys[nfkeys]);
+			free(fkeys);
+			fkeys = NULL;
+			nfkeys = 0;
+			rc = PAHO_MEMORY_ERROR;
+		}
+		else
+			strcpy(fkeys[nfkeys++], entry->key);
+	}
+
+	*nkeys = nfkeys;
+	*keys = fkeys;
+	/* the caller must free keys */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Remove all the data from the index.
+ *  See ::Persistence_clear
+ */
+int pmemclear(void* handle)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else
+		pmem_freeEntries(store);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Returns whether the index has an entry for a key.
+ *  See ::Persistence_containskey
+ */
+int pmemcontainskey(void* handle, char* key)
+{
+	int rc = 0;
+	MemoryStore* store = handle;
+
+	FUNC_ENTRY;
+	if (store == NULL || TreeFind(store->index, key) == NULL)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/** Set how the snapshot is written.
+ *  @param handle the store
+ *  @param durability one of the MQTTCLIENT_PERSISTENCE_DURABILITY_* values.  With
+ *  MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC, the snapshot file and the directory holding it
+ *  are synced before the store is closed.  Records are only ever in memory until then.
+ */
+void pmemsetdurability(void* handle, int durability)
+{
+	MemoryStore* store = handle;
+
+	store->durability = durability;
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCEMEMORY_H)
+#define MQTTPERSISTENCEMEMORY_H
+
+/** Name of the snapshot file in the client directory */
+#define MEMORY_SNAPSHOT_FILENAME "snapshot.mem"
+
+/* prototypes of the functions for the in-memory persistence */
+int pmemopen(void** handle, const char* clientID, const char* serverURI, void* context);
+int pmemclose(void* handle);
+int pmemput(void* handle, char* key, int bufcount, char* buffers[], int buflens[]);
+int pmemget(void* handle, char* key, char** buffer, int* buflen);
+int pmemremove(void* handle, char* key);
+int pmemkeys(void* handle, char*** keys, int* nkeys);
+int pmemclear(void* handle);
+int pmemcontainskey(void* handle, char* key);
+
+void pmemsetdurability(void* handle, int durability);
+
+#endif
@@ -0,0 +1,566 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief A writer thread between a client and its persistence.
+ *
+ * When a writer is started for a client, its persistence is wrapped so that puts and removes
+ * are copied to a queue and carried out, in order, on a thread of their own, rather
+ * than on the application, send or receive thread which asked for them.  Queueing never
+ * waits, as the threads which queue writes may hold the client's locks: the queue is
+ * bounded by the application's calls waiting for room, with ::MQTTPersistenceWriter_waitForRoom,
+ * before they take any locks.  Gets, key lists and
+ * clears wait for the queue to empty first, so they see the results of all earlier writes.
+ *
+ * Packets which depend on persisted records must not be sent before the records are written.
+ * Queueing a record marks the connection as having uncommitted records, and before packets are
+ * written to it, ::MQTTPersistenceWriter_commit is asked whether they have been carried out -
+ * and synced, if the durability requires it.  If not, the packets are held back, and the
+ * written callback is called once the writes have been done, so that they can be sent.
+ *
+ * If a write or a sync fails, the writer keeps the error: nothing carried out after it is
+ * committed, commits fail, so the packets held for the writes are never sent, and further
+ * puts fail straight away.
+ */
+
+#if !defined(NO_PERSISTENCE)
+
+#include "OsWrapper.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	#define WINAPI
+#endif
+
+#include "MQTTPersistenceWriter.h"
+#include "MQTTPersistence.h"
+#include "LinkedList.h"
+#include "Thread.h"
+#include "Log.h"
+#include "StackTrace.h"
+#include "Heap.h"
+
+#define PERSISTENCE_WRITE_PUT 1    /**< write type for the put of a key */
+#define PERSISTENCE_WRITE_REMOVE 2 /**< write type for the removal of a key */
+
+/**
+ * A put or remove waiting to be carried out.  The key and data are held in the same
+ * allocation, after the structure.
+ */
+typedef struct
+{
+	int type;            /**< PERSISTENCE_WRITE_PUT or PERSISTENCE_WRITE_REMOVE */
+	char* key;
+	char* data;          /**< the buffers of a put, copied into one */
+	int datalen;
+} PersistenceWrite;
+
+/**
+ * The state of a writer, which is the handle for the persistence wrapping the target
+ */
+typedef struct
+{
+	MQTTClient_persistence wrapper; /**< the functions called instead of the target's */
+	MQTTClient_persistence* target; /**< the persistence written to */
+	void* handle;        /**< the handle for the target persistence */
+	int (*sync)(void* handle); /**< forces writes to the target to stable storage, or NULL */
+	List* queue;         /**< PersistenceWrite, oldest first */
+	int max_queued;      /**< callers of MQTTPersistenceWriter_waitForRoom wait when the queue has this many */
+	unsigned long queued;    /**< the number of writes queued since the writer was started */
+	unsigned long written;   /**< the number of those which have been carried out */
+	unsigned long committed; /**< the number which have been carried out and, if needed, synced */
+	unsigned long commit_target; /**< the number to be committed before held packets can be sent */
+	int error;           /**< the first error from a write or sync, after which nothing is committed */
+	mutex_type mutex;    /**< for the fields above */
+	mutex_type io_mutex; /**< serializes the calls to the target persistence */
+	sem_type work_sem;   /**< posted when writes are queued */
+	sem_type written_sem; /**< posted for each waiting thread when writes have been carried out */
+	int waiters;         /**< the number of threads waiting on written_sem */
+	int stopping;        /**< the thread is to end once the queue is empty */
+	sem_type stopped_sem; /**< posted by the thread when it ends */
+} PersistenceWriter;
+
+static MQTTPersistenceWriter_written* written_callback = NULL;
+
+static void MQTTPersistenceWriter_waitWritten(PersistenceWriter* w);
+static void MQTTPersistenceWriter_wakeWaiters(PersistenceWriter* w);
+static void MQTTPersistenceWriter_drain(PersistenceWriter* w);
+static int MQTTPersistenceWriter_queue(PersistenceWriter* w, int type, char* key, int bufcount,
+		char* buffers[], int buflens[]);
+static int MQTTPersistenceWriter_write(PersistenceWriter* w, PersistenceWrite* pw);
+static thread_return_type WINAPI MQTTPersistenceWriter_thread(void* n);
+
+
+/**
+ * Set the function to be called, on the writer thread, when writes have been committed,
+ * so that packets held back waiting for them can be sent.
+ * @param callback the function
+ */
+void MQTTPersistenceWriter_setWrittenCallback(MQTTPersistenceWriter_written* callback)
+{
+	written_callback = callback;
+}
+
+
+/**
+ * Wait for the writer thread to carry out more writes.  Must be called with the writer mutex
+ * held, which is released while waiting.
+ * @param w the writer
+ */
+static void MQTTPersistenceWriter_waitWritten(PersistenceWriter* w)
+{
+	int rc = 0;
+
+	w->waiters++;
+	Paho_thread_unlock_mutex(w->mutex);
+	if ((rc = Thread_wait_sem(w->written_sem, 100)) != 0 && rc != ETIMEDOUT)
+		Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+	Paho_thread_lock_mutex(w->mutex);
+	w->waiters--;
+}
+
+
+/**
+ * Wake the threads waiting for writes to be carried out.  Must be called with the writer
+ * mutex held.
+ * @param w the writer
+ */
+static void MQTTPersistenceWriter_wakeWaiters(PersistenceWriter* w)
+{
+	int i;
+
+	for (i = 0; i < w->waiters; ++i)
+		Thread_post_sem(w->written_sem);
+}
+
+
+/**
+ * Wait until all the writes queued have been carried out.  Must be called with the writer
+ * mutex held, which is released while waiting.
+ * @param w the writer
+ */
+static void MQTTPersistenceWriter_drain(PersistenceWriter* w)
+{
+	while (w->written < w->queued)
+		MQTTPersistenceWriter_waitWritten(w);
+}
+
+
+/**
+ * Copy a write to the queue.
+ * @param w the writer
+ * @param type PERSISTENCE_WRITE_PUT or PERSISTENCE_WRITE_REMOVE
+ * @param key the key
+ * @param bufcount the number of data buffers
+ * @param buffers the data buffers
+ * @param buflens the lengths of the data buffers
+ * @return 0 if success, #MQTTCLIENT_PERSISTENCE_ERROR if a put is queued after an earlier
+ * write or sync failed, or #PAHO_MEMORY_ERROR
+ */
+static int MQTTPersistenceWriter_queue(PersistenceWriter* w, int type, char* key, int bufcount,
+		char* buffers[], int buflens[])
+{
+	PersistenceWrite* pw = NULL;
+	size_t keylen = strlen(key) + 1;
+	size_t datalen = 0;
+	char* ptr = NULL;
+	int rc = 0;
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < bufcount; ++i)
+		datalen += buflens[i];
+	if ((pw = malloc(sizeof(PersistenceWrite) + keylen + datalen)) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	pw->type = type;
+	pw->key = (char*)(pw + 1);
+	memcpy(pw->key, key, keylen);
+	ptr = pw->data = pw->key + keylen;
+	for (i = 0; i < bufcount; ++i)
+	{
+		memcpy(ptr, buffers[i], buflens[i]);
+		ptr += buflens[i];
+	}
+	pw->datalen = (int)datalen;
+
+	Paho_thread_lock_mutex(w->mutex);
+	if (type == PERSISTENCE_WRITE_PUT && w->error)
+	{
+		Paho_thread_unlock_mutex(w->mutex);
+		free(pw);
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+		goto exit;
+	}
+	ListAppend(w->queue, pw, sizeof(PersistenceWrite) + keylen + datalen);
+	w->queued++;
+	Paho_thread_unlock_mutex(w->mutex);
+	Thread_post_sem(w->work_sem);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Carry out a queued write on the target persistence, and free it.
+ * @param w the writer
+ * @param pw the write
+ * @return 0 if success, the error from the target's put otherwise
+ */
+static int MQTTPersistenceWriter_write(PersistenceWriter* w, PersistenceWrite* pw)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->io_mutex);
+	if (pw->type == PERSISTENCE_WRITE_PUT)
+	{
+		if ((rc = w->target->pput(w->handle, pw->key, 1, &pw->data, &pw->datalen)) != 0)
+			Log(LOG_ERROR, 0, "Error %d persisting key %s", rc, pw->key);
+	}
+	else
+		w->target->premove(w->handle, pw->key); /* the key might not have been persisted */
+	Paho_thread_unlock_mutex(w->io_mutex);
+	free(pw);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/* The target persistence is opened before the writer is started, and closed after it stops */
+static int pwopen(void** handle, const char* clientID, const char* serverURI, void* context)
+{
+	return MQTTCLIENT_PERSISTENCE_ERROR;
+}
+
+
+static int pwclose(void* handle)
+{
+	return MQTTCLIENT_PERSISTENCE_ERROR;
+}
+
+
+static int pwput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	return MQTTPersistenceWriter_queue(handle, PERSISTENCE_WRITE_PUT, key, bufcount, buffers, buflens);
+}
+
+
+static int pwremove(void* handle, char* key)
+{
+	return MQTTPersistenceWriter_queue(handle, PERSISTENCE_WRITE_REMOVE, key, 0, NULL, NULL);
+}
+
+
+static int pwget(void* handle, char* key, char** buffer, int* buflen)
+{
+	PersistenceWriter* w = handle;
+	int rc = 0;
+
+	Paho_thread_lock_mutex(w->mutex);
+	MQTTPersistenceWriter_drain(w);
+	Paho_thread_unlock_mutex(w->mutex);
+	Paho_thread_lock_mutex(w->io_mutex);
+	rc = w->target->pget(w->handle, key, buffer, buflen);
+	Paho_thread_unlock_mutex(w->io_mutex);
+	return rc;
+}
+
+
+static int pwkeys(void* handle, char*** keys, int* nkeys)
+{
+	PersistenceWriter* w = handle;
+	int rc = 0;
+
+	Paho_thread_lock_mutex(w->mutex);
+	MQTTPersistenceWriter_drain(w);
+	Paho_thread_unlock_mutex(w->mutex);
+	Paho_thread_lock_mutex(w->io_mutex);
+	rc = w->target->pkeys(w->handle, keys, nkeys);
+	Paho_thread_unlock_mutex(w->io_mutex);
+	return rc;
+}
+
+
+static int pwclear(void* handle)
+{
+	PersistenceWriter* w = handle;
+	int rc = 0;
+
+	Paho_thread_lock_mutex(w->mutex);
+	MQTTPersistenceWriter_drain(w);
+	Paho_thread_unlock_mutex(w->mutex);
+	Paho_thread_lock_mutex(w->io_mutex);
+	rc = w->target->pclear(w->handle);
+	Paho_thread_unlock_mutex(w->io_mutex);
+	return rc;
+}
+
+
+static int pwcontainskey(void* handle, char* key)
+{
+	PersistenceWriter* w = handle;
+	int rc = 0;
+
+	Paho_thread_lock_mutex(w->mutex);
+	MQTTPersistenceWriter_drain(w);
+	Paho_thread_unlock_mutex(w->mutex);
+	Paho_thread_lock_mutex(w->io_mutex);
+	rc = w->target->pcontainskey(w->handle, key);
+	Paho_thread_unlock_mutex(w->io_mutex);
+	return rc;
+}
+
+
+/**
+ * Start a writer thread for a client's persistence, which must have been opened.  The
+ * client's persistence and handle are replaced by the writer's.
+ * @param c the client
+ * @param max_queued the number of writes which can be queued before more have to wait
+ * @param sync the function to force the target's writes to stable storage after each batch,
+ * or NULL
+ * @return 0 if success, an error code otherwise
+ */
+int MQTTPersistenceWriter_start(Clients* c, int max_queued, int (*sync)(void* handle))
+{
+	PersistenceWriter* w = NULL;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((w = malloc(sizeof(PersistenceWriter))) == NULL)
+	{
+		rc = PAHO_MEMORY_ERROR;
+		goto exit;
+	}
+	memset(w, '\0', sizeof(PersistenceWriter));
+	w->wrapper.context = w;
+	w->wrapper.popen = pwopen;
+	w->wrapper.pclose = pwclose;
+	w->wrapper.pput = pwput;
+	w->wrapper.pget = pwget;
+	w->wrapper.premove = pwremove;
+	w->wrapper.pkeys = pwkeys;
+	w->wrapper.pclear = pwclear;
+	w->wrapper.pcontainskey = pwcontainskey;
+	w->target = c->persistence;
+	w->handle = c->phandle;
+	w->sync = sync;
+	w->max_queued = max_queued;
+	if ((w->queue = ListInitialize()) == NULL)
+		rc = PAHO_MEMORY_ERROR;
+	if (rc == 0)
+		w->mutex = Paho_thread_create_mutex(&rc);
+	if (rc == 0)
+		w->io_mutex = Paho_thread_create_mutex(&rc);
+	if (rc == 0)
+		w->work_sem = Thread_create_sem(&rc);
+	if (rc == 0)
+		w->written_sem = Thread_create_sem(&rc);
+	if (rc == 0)
+		w->stopped_sem = Thread_create_sem(&rc);
+	if (rc != 0)
+	{
+		if (w->queue)
+			ListFree(w->queue);
+		if (w->mutex)
+			Paho_thread_destroy_mutex(w->mutex);
+		if (w->io_mutex)
+			Paho_thread_destroy_mutex(w->io_mutex);
+		if (w->work_sem)
+			Thread_destroy_sem(w->work_sem);
+		if (w->written_sem)
+			Thread_destroy_sem(w->written_sem);
+		free(w);
+		goto exit;
+	}
+	c->persistence = &w->wrapper;
+	c->phandle = w;
+	Paho_thread_start(MQTTPersistenceWriter_thread, w);
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Stop the writer thread for a client, once it has carried out all the queued writes, and
+ * give the client back its own persistence.
+ * @param c the client
+ */
+void MQTTPersistenceWriter_stop(Clients* c)
+{
+	PersistenceWriter* w = c->phandle;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	w->stopping = 1;
+	Paho_thread_unlock_mutex(w->mutex);
+	Thread_post_sem(w->work_sem);
+	while (Thread_wait_sem(w->stopped_sem, 1000) == ETIMEDOUT)
+		Thread_post_sem(w->work_sem);
+
+	c->persistence = w->target;
+	c->phandle = w->handle;
+	ListFree(w->queue);
+	Paho_thread_destroy_mutex(w->mutex);
+	Paho_thread_destroy_mutex(w->io_mutex);
+	Thread_destroy_sem(w->work_sem);
+	Thread_destroy_sem(w->written_sem);
+	Thread_destroy_sem(w->stopped_sem);
+	free(w);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Whether a persistence is the wrapper of a writer thread.
+ * @param persistence the persistence
+ * @return boolean
+ */
+int MQTTPersistenceWriter_isWriter(MQTTClient_persistence* persistence)
+{
+	return persistence != NULL && persistence->popen == pwopen;
+}
+
+
+/**
+ * Wait until there is room in the queue of a writer.  Queueing a write doesn't wait, so this
+ * must be called first by threads which can wait, before they take any locks.
+ * @param handle the writer
+ */
+void MQTTPersistenceWriter_waitForRoom(void* handle)
+{
+	PersistenceWriter* w = handle;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	while (w->queue->count >= w->max_queued && !w->stopping && !w->error)
+		MQTTPersistenceWriter_waitWritten(w);
+	Paho_thread_unlock_mutex(w->mutex);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Find out whether the writes that packets about to be sent depend on have been committed.
+ * @param handle the writer
+ * @param uncommitted whether writes have been queued since the last call, which the packets
+ * may depend on
+ * @param wait whether to wait for the writes to be committed, rather than return
+ * #PERSISTENCE_COMMIT_PENDING
+ * @return 0 if the writes have been committed, #PERSISTENCE_COMMIT_PENDING if not yet, or
+ * #MQTTCLIENT_PERSISTENCE_ERROR if a write or sync has failed, so they never will be
+ */
+int MQTTPersistenceWriter_commit(void* handle, int uncommitted, int wait)
+{
+	PersistenceWriter* w = handle;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(w->mutex);
+	if (uncommitted)
+		w->commit_target = w->queued;
+	while (wait && !w->error && w->committed < w->commit_target)
+		MQTTPersistenceWriter_waitWritten(w);
+	if (w->error)
+		rc = MQTTCLIENT_PERSISTENCE_ERROR;
+	else if (w->committed < w->commit_target)
+		rc = PERSISTENCE_COMMIT_PENDING;
+	Paho_thread_unlock_mutex(w->mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/* The writer thread for a client's persistence */
+static thread_return_type WINAPI MQTTPersistenceWriter_thread(void* n)
+{
+	PersistenceWriter* w = n;
+
+	FUNC_ENTRY;
+	Thread_set_name("MQTT_persist");
+	Paho_thread_lock_mutex(w->mutex);
+	while (!w->stopping || w->queue->count > 0)
+	{
+		int count = w->queue->count;
+		int rc = 0;
+
+		if (count == 0)
+		{
+			Paho_thread_unlock_mutex(w->mutex);
+			if ((rc = Thread_wait_sem(w->work_sem, 1000)) != 0 && rc != ETIMEDOUT)
+				Log(LOG_ERROR, -1, "Error %d waiting for semaphore", rc);
+			Paho_thread_lock_mutex(w->mutex);
+			continue;
+		}
+
+		/* carry out the writes queued so far, then commit them together */
+		while (count-- > 0)
+		{
+			PersistenceWrite* pw = ListDetachHead(w->queue);
+
+			Paho_thread_unlock_mutex(w->mutex);
+			rc = MQTTPersistenceWriter_write(w, pw);
+			Paho_thread_lock_mutex(w->mutex);
+			if (rc != 0 && w->error == 0)
+				w->error = rc;
+			w->written++;
+			MQTTPersistenceWriter_wakeWaiters(w); /* there is room in the queue */
+		}
+		if (w->error)
+			; /* the failed write, and those after it, are never committed */
+		else if (w->sync)
+		{
+			unsigned long written = w->written;
+
+			Paho_thread_unlock_mutex(w->mutex);
+			Paho_thread_lock_mutex(w->io_mutex);
+			if ((rc = w->sync(w->handle)) != 0)
+				Log(LOG_ERROR, 0, "Error %d syncing persistence", rc);
+			Paho_thread_unlock_mutex(w->io_mutex);
+			Paho_thread_lock_mutex(w->mutex);
+			if (rc != 0)
+				w->error = rc;
+			else
+				w->committed = written;
+		}
+		else
+			w->committed = w->written;
+		MQTTPersistenceWriter_wakeWaiters(w);
+		if (written_callback)
+		{
+			Paho_thread_unlock_mutex(w->mutex);
+			(*written_callback)();
+			Paho_thread_lock_mutex(w->mutex);
+		}
+	}
+	Paho_thread_unlock_mutex(w->mutex);
+	Thread_post_sem(w->stopped_sem);
+	FUNC_EXIT;
+#if defined(_WIN32) || defined(_WIN64)
+	ExitThread(0);
+#endif
+	return 0;
+}
+
+#endif
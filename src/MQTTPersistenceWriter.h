@@ -0,0 +1,31 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+#if !defined(MQTTPERSISTENCEWRITER_H)
+#define MQTTPERSISTENCEWRITER_H
+
+#include "Clients.h"
+
+typedef void MQTTPersistenceWriter_written(void);
+void MQTTPersistenceWriter_setWrittenCallback(MQTTPersistenceWriter_written*);
+
+int MQTTPersistenceWriter_start(Clients* c, int max_queued, int (*sync)(void* handle));
+void MQTTPersistenceWriter_stop(Clients* c);
+int MQTTPersistenceWriter_isWriter(MQTTClient_persistence* persistence);
+void MQTTPersistenceWriter_waitForRoom(void* handle);
+int MQTTPersistenceWriter_commit(void* handle, int uncommitted, int wait);
+
+#endif
@@ -45,16 +45,27 @@
 #define min(A,B) ( (A) < (B) ? (A):(B))
 #endif
 
+/**
+ * Milliseconds before a keepalive or retry check which couldn't be completed is tried again
+ */
+#define MQTTPROTOCOL_RECHECK_INTERVAL 100
+
 extern MQTTProtocol state;
 extern ClientStates* bstate;
 
+static Timers keepalive_timers; /* Clients.keepaliveTimer for each connected client with a keepalive */
+static Timers retry_timers;     /* Clients.retryTimer for each connected client with outbound messages */
+
 static void MQTTProtocol_storeQoS0(Clients* pubclient, Publish* publish);
 static int MQTTProtocol_startPublishCommon(
 		Clients* pubclient,
 		Publish* publish,
 		int qos,
 		int retained);
-static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless);
+static int MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless, START_TIME_TYPE* oldest);
+static void MQTTProtocol_scheduleTimer(Timers* timers, Timer* timer, Clients* client,
+		START_TIME_TYPE from, ELAPSED_TIME_TYPE interval);
+static void MQTTProtocol_scheduleRetries(Clients* client, START_TIME_TYPE* oldest);
 
 static int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId);
 
@@ -77,6 +88,257 @@ int messageIDCompare(void* a, void* b)
 }
 
 
+/**
+ * Add a message id to a message id map.  If the map's words can't be allocated, the map is marked
+ * incomplete, and won't be used to find free message ids until it is next emptied.
+ * @param map the message id map
+ * @param msgid the message id to add
+ */
+void MQTTProtocol_addMsgId(messageIdMap* map, int msgid)
+{
+	if (msgid <= 0 || msgid > MAX_MSG_ID)
+		return;
+	if (map->words == NULL)
+	{
+		if ((map->words = malloc(MSGID_MAP_WORDS * sizeof(uint64_t))) == NULL)
+		{
+			map->incomplete = 1;
+			return;
+		}
+		memset(map->words, '\0', MSGID_MAP_WORDS * sizeof(uint64_t));
+	}
+	map->words[msgid / 64] |= (uint64_t)1 << (msgid % 64);
+}
+
+
+/**
+ * Remove a message id from a message id map
+ * @param map the message id map
+ * @param msgid the message id to remove
+ */
+void MQTTProtocol_removeMsgId(messageIdMap* map, int msgid)
+{
+	if (map->words && msgid > 0 && msgid <= MAX_MSG_ID)
+		map->words[msgid / 64] &= ~((uint64_t)1 << (msgid % 64));
+}
+
+
+/**
+ * Empty a message id map, freeing its words
+ * @param map the message id map
+ */
+void MQTTProtocol_emptyMsgIds(messageIdMap* map)
+{
+	if (map->words)
+	{
+		free(map->words);
+		map->words = NULL;
+	}
+	map->incomplete = 0;
+}
+
+
+/**
+ * Get the position of the lowest bit set in a non-zero word
+ * @param word the word
+ * @return the bit number, from 0
+ */
+static int MQTTProtocol_lowestBit(uint64_t word)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	int bit = 0;
+
+	while ((word & 1) == 0)
+	{
+		word >>= 1;
+		++bit;
+	}
+	return bit;
+#endif
+}
+
+
+/**
+ * Find the lowest message id in a range which is in none of a set of message id maps.
+ * The maps are searched a word, or 64 ids, at a time.
+ * @param maps the message id maps
+ * @param count the number of maps
+ * @param from the first message id in the range, at least 1
+ * @param to the last message id in the range
+ * @return the message id found, or 0 if there are none free in the range
+ */
+static int MQTTProtocol_findFreeMsgIdIn(messageIdMap** maps, int count, int from, int to)
+{
+	int msgid = 0;
+	int w;
+
+	for (w = from / 64; from <= to && w <= to / 64; ++w)
+	{
+		uint64_t used = 0;
+		int i;
+
+		for (i = 0; i < count; ++i)
+		{
+			if (maps[i]->words)
+				used |= maps[i]->words[w];
+		}
+		if (w == from / 64)
+			used |= ((uint64_t)1 << (from % 64)) - 1; /* the ids before the range */
+		if (~used != 0)
+		{
+			int found = w * 64 + MQTTProtocol_lowestBit(~used);
+
+			if (found <= to)
+				msgid = found;
+			break;
+		}
+	}
+	return msgid;
+}
+
+
+/**
+ * Find the next message id after last_msgid which is in none of a set of message id maps,
+ * wrapping round from the maximum to 1, and stopping before stop_msgid.
+ * @param maps the message id maps
+ * @param count the number of maps
+ * @param last_msgid the message id to start the search after
+ * @param stop_msgid the message id to stop the search at, which is not returned.  If it is the same
+ * as last_msgid, all the other message ids are searched.
+ * @return the message id found, 0 if there are none free, or -1 if one of the maps is incomplete
+ * so that the ids have to be checked some other way
+ */
+int MQTTProtocol_findFreeMsgId(messageIdMap** maps, int count, int last_msgid, int stop_msgid)
+{
+	int msgid = 0;
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+	{
+		if (maps[i]->incomplete)
+		{
+			msgid = -1;
+			goto exit;
+		}
+	}
+	if (last_msgid < stop_msgid)
+		msgid = MQTTProtocol_findFreeMsgIdIn(maps, count, last_msgid + 1, stop_msgid - 1);
+	else if ((msgid = MQTTProtocol_findFreeMsgIdIn(maps, count, last_msgid + 1, MAX_MSG_ID)) == 0)
+		msgid = MQTTProtocol_findFreeMsgIdIn(maps, count, 1, stop_msgid - 1);
+exit:
+	FUNC_EXIT_RC(msgid);
+	return msgid;
+}
+
+
+/**
+ * Add a message list element to a message index, replacing any element with the same message id.
+ * If memory for the index can't be allocated, the index is marked incomplete, and the message list
+ * is searched instead until the index is next emptied.
+ * @param index the message index
+ * @param msgid the message id of the message
+ * @param element the message list element, as returned by ListAppend or ListInsert
+ */
+void MQTTProtocol_indexMessage(messageIndex* index, int msgid, ListElement* element)
+{
+	messageIndexPage* page = NULL;
+
+	FUNC_ENTRY;
+	if (element == NULL || msgid <= 0 || msgid > MAX_MSG_ID)
+		goto exit;
+	MQTTProtocol_addMsgId(&index->ids, msgid);
+	if ((page = index->pages[msgid / MESSAGE_INDEX_PAGE_SIZE]) == NULL)
+	{
+		if ((page = malloc(sizeof(messageIndexPage))) == NULL)
+		{
+			index->incomplete = 1; /* the message can still be found by searching the list */
+			goto exit;
+		}
+		memset(page, '\0', sizeof(messageIndexPage));
+		index->pages[msgid / MESSAGE_INDEX_PAGE_SIZE] = page;
+	}
+	if (page->elements[msgid % MESSAGE_INDEX_PAGE_SIZE] == NULL)
+		page->count++;
+	page->elements[msgid % MESSAGE_INDEX_PAGE_SIZE] = element;
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * Remove a message id from a message index.  Must be called before the message is removed from its list.
+ * @param index the message index
+ * @param msgid the message id to remove
+ */
+void MQTTProtocol_unindexMessage(messageIndex* index, int msgid)
+{
+	messageIndexPage* page = NULL;
+
+	FUNC_ENTRY;
+	MQTTProtocol_removeMsgId(&index->ids, msgid);
+	if (msgid > 0 && msgid <= MAX_MSG_ID && (page = index->pages[msgid / MESSAGE_INDEX_PAGE_SIZE]) != NULL &&
+		page->elements[msgid % MESSAGE_INDEX_PAGE_SIZE] != NULL)
+	{
+		page->elements[msgid % MESSAGE_INDEX_PAGE_SIZE] = NULL;
+		if (--page->count == 0)
+		{
+			free(page);
+			index->pages[msgid / MESSAGE_INDEX_PAGE_SIZE] = NULL;
+		}
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Find a message in a message list by message id, using the list's index.  As with ListFindItem,
+ * the list's current pointer is set to the element found, so that it can be removed without a search.
+ * @param msgList the message list
+ * @param index the message index for the list
+ * @param msgid the message id to look for
+ * @return the list element found, or NULL
+ */
+ListElement* MQTTProtocol_findMessage(List* msgList, messageIndex* index, int msgid)
+{
+	ListElement* element = NULL;
+	messageIndexPage* page = NULL;
+
+	if (msgid > 0 && msgid <= MAX_MSG_ID && (page = index->pages[msgid / MESSAGE_INDEX_PAGE_SIZE]) != NULL)
+		element = page->elements[msgid % MESSAGE_INDEX_PAGE_SIZE];
+	if (element)
+		msgList->current = element;
+	else if (index->incomplete)
+		element = ListFindItem(msgList, &msgid, messageIDCompare);
+	return element;
+}
+
+
+/**
+ * Empty a message index, freeing its pages
+ * @param index the message index
+ */
+void MQTTProtocol_emptyMessageIndex(messageIndex* index)
+{
+	int i;
+
+	FUNC_ENTRY;
+	for (i = 0; i < (int)(sizeof(index->pages) / sizeof(index->pages[0])); ++i)
+	{
+		if (index->pages[i])
+		{
+			free(index->pages[i]);
+			index->pages[i] = NULL;
+		}
+	}
+	index->incomplete = 0;
+	MQTTProtocol_emptyMsgIds(&index->ids);
+	FUNC_EXIT;
+}
+
+
 /**
  * Assign a new message id for a client.  Make sure it isn't already being used and does
  * not exceed the maximum.
@@ -86,17 +348,22 @@ int messageIDCompare(void* a, void* b)
 int MQTTProtocol_assignMsgId(Clients* client)
 {
 	int start_msgid = client->msgID;
-	int msgid = start_msgid;
+	int msgid = 0;
+	messageIdMap* ids = &client->outboundIndex.ids;
 
 	FUNC_ENTRY;
-	msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-	while (ListFindItem(client->outboundMsgs, &msgid, messageIDCompare) != NULL)
+	if ((msgid = MQTTProtocol_findFreeMsgId(&ids, 1, start_msgid, start_msgid)) == -1)
 	{
-		msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
-		if (msgid == start_msgid)
-		{ /* we've tried them all - none free */
-			msgid = 0;
-			break;
+		/* the id map is incomplete, so check each id in turn */
+		msgid = (start_msgid == MAX_MSG_ID) ? 1 : start_msgid + 1;
+		while (MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, msgid) != NULL)
+		{
+			msgid = (msgid == MAX_MSG_ID) ? 1 : msgid + 1;
+			if (msgid == start_msgid)
+			{ /* we've tried them all - none free */
+				msgid = 0;
+				break;
+			}
 		}
 	}
 	if (msgid != 0)
@@ -177,7 +444,11 @@ int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int
 	if (qos > 0)
 	{
 		*mm = MQTTProtocol_createMessage(publish, mm, qos, retained, 0);
-		ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len);
+		MQTTProtocol_indexMessage(&pubclient->outboundIndex, (*mm)->msgid,
+				ListAppend(pubclient->outboundMsgs, *mm, (*mm)->len));
+		if (pubclient->retryTimer.position == 0 && pubclient->retryInterval > 0)
+			MQTTProtocol_scheduleTimer(&retry_timers, &pubclient->retryTimer, pubclient,
+					(*mm)->lastTouch, max(pubclient->retryInterval, 10) * 1000);
 		/* we change these pointers to the saved message location just in case the packet could not be written
 		entirely; the socket buffer will use these locations to finish writing the packet */
 		qos12pub.payload = (*mm)->publish->payload;
@@ -326,10 +597,10 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 	Clients* client = NULL;
 	char* clientid = NULL;
 	int rc = TCPSOCKET_COMPLETE;
-	int socketHasPendingWrites = 0;
+	int socketWriteQueueFull = 0;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	clientid = client->clientID;
 	Log(LOG_PROTOCOL, 11, NULL, sock, clientid, publish->msgId, publish->header.bits.qos,
 					publish->header.bits.retain, publish->payloadlen, min(20, publish->payloadlen), publish->payload);
@@ -340,13 +611,13 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 		goto exit;
 	}
 
-	socketHasPendingWrites = !Socket_noPendingWrites(sock);
+	socketWriteQueueFull = Socket_writeQueueFull(sock);
 
 	if (publish->header.bits.qos == 1)
 	{
 		Protocol_processPublication(publish, client, 1);
   
-		if (socketHasPendingWrites)
+		if (socketWriteQueueFull)
 			rc = MQTTProtocol_queueAck(client, PUBACK, publish->msgId);
 		else
 			rc = MQTTPacket_send_puback(publish->MQTTVersion, publish->msgId, &client->net, client->clientID);
@@ -374,17 +645,19 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 		if (m->MQTTVersion >= MQTTVERSION_5)
 			m->properties = MQTTProperties_copy(&publish->properties);
 		m->nextMessageType = PUBREL;
-		if ((listElem = ListFindItem(client->inboundMsgs, &(m->msgid), messageIDCompare)) != NULL)
+		if ((listElem = MQTTProtocol_findMessage(client->inboundMsgs, &client->inboundIndex, m->msgid)) != NULL)
 		{   /* discard queued publication with same msgID that the current incoming message */
 			Messages* msg = (Messages*)(listElem->content);
 			MQTTProtocol_removePublication(msg->publish);
 			if (msg->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&msg->properties);
-			ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem);
+			MQTTProtocol_indexMessage(&client->inboundIndex, m->msgid,
+					ListInsert(client->inboundMsgs, m, sizeof(Messages) + len, listElem));
 			ListRemove(client->inboundMsgs, msg);
 			already_received = 1;
 		} else
-			ListAppend(client->inboundMsgs, m, sizeof(Messages) + len);
+			MQTTProtocol_indexMessage(&client->inboundIndex, m->msgid,
+					ListAppend(client->inboundMsgs, m, sizeof(Messages) + len));
 
 		if (m->MQTTVersion >= MQTTVERSION_5 && already_received == 0)
 		{
@@ -415,7 +688,7 @@ int MQTTProtocol_handlePublishes(void* pack, SOCKET sock)
 			}
 			memcpy(m->publish->payload, temp, m->publish->payloadlen);
 		}
-		if (socketHasPendingWrites)
+		if (socketWriteQueueFull)
 			rc = MQTTProtocol_queueAck(client, PUBREC, publish->msgId);
 		else
 			rc = MQTTPacket_send_pubrec(publish->MQTTVersion, publish->msgId, &client->net, client->clientID);
@@ -440,11 +713,11 @@ int MQTTProtocol_handlePubacks(void* pack, SOCKET sock, Publications** pubToRemo
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 14, NULL, sock, client->clientID, puback->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(puback->msgId), messageIDCompare) == NULL)
+	if (MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, puback->msgId) == NULL)
 		Log(TRACE_MIN, 3, NULL, "PUBACK", client->clientID, puback->msgId);
 	else
 	{
@@ -465,6 +738,7 @@ int MQTTProtocol_handlePubacks(void* pack, SOCKET sock, Publications** pubToRemo
 				MQTTProtocol_removePublication(m->publish);
 			if (m->MQTTVersion >= MQTTVERSION_5)
 				MQTTProperties_free(&m->properties);
+			MQTTProtocol_unindexMessage(&client->outboundIndex, m->msgid);
 			ListRemove(client->outboundMsgs, m);
 		}
 	}
@@ -490,12 +764,11 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 	int send_pubrel = 1; /* boolean to send PUBREL or not */
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 15, NULL, sock, client->clientID, pubrec->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	client->outboundMsgs->current = NULL;
-	if (ListFindItem(client->outboundMsgs, &(pubrec->msgId), messageIDCompare) == NULL)
+	if (MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, pubrec->msgId) == NULL)
 	{
 		if (pubrec->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREC", client->clientID, pubrec->msgId);
@@ -530,6 +803,7 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 					MQTTProtocol_removePublication(m->publish);
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
+				MQTTProtocol_unindexMessage(&client->outboundIndex, m->msgid);
 				ListRemove(client->outboundMsgs, m);
 				(++state.msgs_sent);
 				send_pubrel = 0; /* in MQTT v5, stop the exchange if there is an error reported */
@@ -543,7 +817,7 @@ int MQTTProtocol_handlePubrecs(void* pack, SOCKET sock, Publications** pubToRemo
 	}
 	if (!send_pubrel)
 		; /* only don't send ack on MQTT v5 PUBREC error, otherwise send ack under all circumstances because MQTT state can get out of step */
-	else if (!Socket_noPendingWrites(sock))
+	else if (Socket_writeQueueFull(sock))
 		rc = MQTTProtocol_queueAck(client, PUBREL, pubrec->msgId);
 	else
 		rc = MQTTPacket_send_pubrel(pubrec->MQTTVersion, pubrec->msgId, 0, &client->net, client->clientID);
@@ -569,11 +843,11 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 17, NULL, sock, client->clientID, pubrel->msgId);
 
 	/* look for the message by message id in the records of inbound messages for this client */
-	if (ListFindItem(client->inboundMsgs, &(pubrel->msgId), messageIDCompare) == NULL)
+	if (MQTTProtocol_findMessage(client->inboundMsgs, &client->inboundIndex, pubrel->msgId) == NULL)
 	{
 		if (pubrel->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBREL", client->clientID, pubrel->msgId);
@@ -615,12 +889,13 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock)
 				MQTTProperties_free(&m->properties);
 			if (m->publish)
 				ListRemove(&(state.publications), m->publish);
+			MQTTProtocol_unindexMessage(&client->inboundIndex, m->msgid);
 			ListRemove(client->inboundMsgs, m);
 			++(state.msgs_received);
 		}
 	}
 	/* Send ack under all circumstances because MQTT state can get out of step - this standard also says to do this */
-	if (!Socket_noPendingWrites(sock))
+	if (Socket_writeQueueFull(sock))
 		rc = MQTTProtocol_queueAck(client, PUBCOMP, pubrel->msgId);
 	else
 		rc = MQTTPacket_send_pubcomp(pubrel->MQTTVersion, pubrel->msgId, &client->net, client->clientID);
@@ -646,11 +921,11 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 19, NULL, sock, client->clientID, pubcomp->msgId);
 
 	/* look for the message by message id in the records of outbound messages for this client */
-	if (ListFindItem(client->outboundMsgs, &(pubcomp->msgId), messageIDCompare) == NULL)
+	if (MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, pubcomp->msgId) == NULL)
 	{
 		if (pubcomp->header.bits.dup == 0)
 			Log(TRACE_MIN, 3, NULL, "PUBCOMP", client->clientID, pubcomp->msgId);
@@ -680,6 +955,7 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 					MQTTProtocol_removePublication(m->publish);
 				if (m->MQTTVersion >= MQTTVERSION_5)
 					MQTTProperties_free(&m->properties);
+				MQTTProtocol_unindexMessage(&client->outboundIndex, m->msgid);
 				ListRemove(client->outboundMsgs, m);
 				(++state.msgs_sent);
 			}
@@ -694,19 +970,84 @@ int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRem
 
 
 /**
- * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required.
+ * Schedule a keepalive or retry check for a client.  A check which is already overdue, because
+ * what it was waiting for couldn't be done, is rescheduled a short interval from now.
+ * @param timers the set of timers
+ * @param timer the client's timer
+ * @param client the client
+ * @param from the time the interval is measured from
+ * @param interval the milliseconds after from that the check is due
+ */
+static void MQTTProtocol_scheduleTimer(Timers* timers, Timer* timer, Clients* client,
+		START_TIME_TYPE from, ELAPSED_TIME_TYPE interval)
+{
+	START_TIME_TYPE now = MQTTTime_now();
+
+	FUNC_ENTRY;
+	timer->context = client;
+	if (MQTTTime_difftime(now, from) >= (DIFF_TIME_TYPE)interval)
+	{
+		from = now;
+		interval = MQTTPROTOCOL_RECHECK_INTERVAL;
+	}
+	if (Timers_schedule(timers, timer, from, interval) != 0)
+		Log(LOG_ERROR, -1, "Couldn't schedule a timer for client %s", client->clientID);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Schedule the next keepalive check for a client, for when the keepalive processing could next
+ * have something to do.  Packets sent or received since only make that later, in which case the
+ * check does nothing but schedule the next one.
+ * @param client the client
+ */
+void MQTTProtocol_scheduleKeepalive(Clients* client)
+{
+	START_TIME_TYPE from;
+	ELAPSED_TIME_TYPE interval = 0;
+
+	FUNC_ENTRY;
+	if (client->connected == 0 || client->keepAliveInterval == 0)
+	{
+		Timers_cancel(&keepalive_timers, &client->keepaliveTimer);
+		goto exit;
+	}
+	if (client->ping_outstanding == 1)
+	{
+		/* the later of the ping and the last packet received */
+		from = (MQTTTime_difftime(client->net.lastPing, client->net.lastReceived) > 0) ?
+				client->net.lastPing : client->net.lastReceived;
+		interval = client->keepAliveInterval * 1500;
+	}
+	else if (client->ping_due == 1)
+		from = MQTTTime_now(); /* try to send the ping again soon */
+	else
+	{
+		/* the earlier of the last packets sent and received */
+		from = (MQTTTime_difftime(client->net.lastSent, client->net.lastReceived) < 0) ?
+				client->net.lastSent : client->net.lastReceived;
+		interval = client->keepAliveInterval * 1000;
+	}
+	MQTTProtocol_scheduleTimer(&keepalive_timers, &client->keepaliveTimer, client, from, interval);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * MQTT protocol keepAlive processing.  Sends PINGREQ packets as required, for the clients whose
+ * keepalive checks are due.
  * @param now current time
  */
 void MQTTProtocol_keepalive(START_TIME_TYPE now)
 {
-	ListElement* current = NULL;
+	Timer* timer = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
-	while (current)
+	while ((timer = Timers_nextDue(&keepalive_timers, now)) != NULL)
 	{
-		Clients* client =	(Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
+		Clients* client = (Clients*)(timer->context);
 
 		if (client->connected == 0 || client->keepAliveInterval == 0)
 			continue;
@@ -777,6 +1118,7 @@ void MQTTProtocol_keepalive(START_TIME_TYPE now)
 				}
 			}
 		}
+		MQTTProtocol_scheduleKeepalive(client);
 	}
 	FUNC_EXIT;
 }
@@ -787,10 +1129,13 @@ void MQTTProtocol_keepalive(START_TIME_TYPE now)
  * @param now current time
  * @param client - the client to which to apply the retry processing
  * @param regardless boolean - retry packets regardless of retry interval (used on reconnect)
+ * @param oldest set to the time the least recently touched outbound message was last touched
+ * @return boolean - were all the outbound messages looked at, so that oldest is set?
  */
-static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless)
+static int MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regardless, START_TIME_TYPE* oldest)
 {
 	ListElement* outcurrent = NULL;
+	int looked = 0;
 
 	FUNC_ENTRY;
 
@@ -857,9 +1202,13 @@ static void MQTTProtocol_retries(START_TIME_TYPE now, Clients* client, int regar
 					m->lastTouch = MQTTTime_now();
 			}
 		}
+		if (client && (looked++ == 0 || MQTTTime_difftime(m->lastTouch, *oldest) < 0))
+			*oldest = m->lastTouch;
 	}
+	looked = (client != NULL && outcurrent == NULL && looked > 0);
 exit:
-	FUNC_EXIT;
+	FUNC_EXIT_RC(looked);
+	return looked;
 }
 
 
@@ -893,22 +1242,69 @@ int MQTTProtocol_queueAck(Clients* client, int ackType, int msgId)
 
 
 /**
- * MQTT retry protocol and socket pending writes processing.
+ * Schedule the next retry check for a client, for when the first of its outbound messages is
+ * due to be retried.  The messages are not looked at again: if the retry processing didn't get
+ * through them all, the check is made again soon.
+ * @param client the client
+ * @param oldest the time the least recently touched outbound message was last touched, from
+ * the retry processing, or NULL if it isn't known
+ */
+static void MQTTProtocol_scheduleRetries(Clients* client, START_TIME_TYPE* oldest)
+{
+	START_TIME_TYPE from;
+	ELAPSED_TIME_TYPE interval = 0;
+
+	FUNC_ENTRY;
+	if (client->connected == 0 || client->outboundMsgs->count == 0 ||
+			(client->retryInterval <= 0 && client->connect_sent == client->connect_count))
+	{
+		Timers_cancel(&retry_timers, &client->retryTimer);
+		goto exit;
+	}
+	if (client->connect_sent < client->connect_count || oldest == NULL)
+		from = MQTTTime_now(); /* continue the retry on connect, or the retry processing, soon */
+	else
+	{
+		from = *oldest;
+		interval = max(client->retryInterval, 10) * 1000;
+	}
+	MQTTProtocol_scheduleTimer(&retry_timers, &client->retryTimer, client, from, interval);
+exit:
+	FUNC_EXIT;
+}
+
+
+/**
+ * MQTT retry protocol processing.  Without regardless, only the clients whose retry checks are
+ * due are looked at.
  * @param now current time
- * @param doRetry boolean - retries as well as pending writes?
+ * @param doRetry boolean - retry packets whose retry interval has passed?
  * @param regardless boolean - retry packets regardless of retry interval (used on reconnect)
  */
 void MQTTProtocol_retry(START_TIME_TYPE now, int doRetry, int regardless)
 {
 	ListElement* current = NULL;
+	Timer* timer = NULL;
 
 	FUNC_ENTRY;
-	ListNextElement(bstate->clients, &current);
+	if (!doRetry)
+		goto exit;
+	if (regardless)
+		ListNextElement(bstate->clients, &current);
 	/* look through the outbound message list of each client, checking to see if a retry is necessary */
-	while (current)
+	while (regardless ? current != NULL : (timer = Timers_nextDue(&retry_timers, now)) != NULL)
 	{
-		Clients* client = (Clients*)(current->content);
-		ListNextElement(bstate->clients, &current);
+		Clients* client = NULL;
+		START_TIME_TYPE oldest;
+		int looked = 0;
+
+		if (regardless)
+		{
+			client = (Clients*)(current->content);
+			ListNextElement(bstate->clients, &current);
+		}
+		else
+			client = (Clients*)(timer->context);
 		if (client->connected == 0)
 			continue;
 		if (client->good == 0)
@@ -916,11 +1312,11 @@ void MQTTProtocol_retry(START_TIME_TYPE now, int doRetry, int regardless)
 			MQTTProtocol_closeSession(client, 1);
 			continue;
 		}
-		if (Socket_noPendingWrites(client->net.socket) == 0)
-			continue;
-		if (doRetry)
-			MQTTProtocol_retries(now, client, regardless);
+		if (Socket_noPendingWrites(client->net.socket))
+			looked = MQTTProtocol_retries(now, client, regardless, &oldest);
+		MQTTProtocol_scheduleRetries(client, looked ? &oldest : NULL);
 	}
+exit:
 	FUNC_EXIT;
 }
 
@@ -932,9 +1328,14 @@ void MQTTProtocol_retry(START_TIME_TYPE now, int doRetry, int regardless)
 void MQTTProtocol_freeClient(Clients* client)
 {
 	FUNC_ENTRY;
+	Timers_cancel(&keepalive_timers, &client->keepaliveTimer);
+	Timers_cancel(&retry_timers, &client->retryTimer);
+	Clients_removeSocket(bstate, client);
 	/* free up pending message lists here, and any other allocated data */
 	MQTTProtocol_freeMessageList(client->outboundMsgs);
 	MQTTProtocol_freeMessageList(client->inboundMsgs);
+	MQTTProtocol_emptyMessageIndex(&client->outboundIndex);
+	MQTTProtocol_emptyMessageIndex(&client->inboundIndex);
 	ListFree(client->messageQueue);
 	ListFree(client->outboundQueue);
 	free(client->clientID);
@@ -956,6 +1357,7 @@ void MQTTProtocol_freeClient(Clients* client)
 		free(client->httpsProxy);
 	if (client->net.http_proxy_auth)
 		free(client->net.http_proxy_auth);
+	MQTTPacket_freeCoalesced(&client->net);
 #if defined(OPENSSL)
 	if (client->net.https_proxy_auth)
 		free(client->net.https_proxy_auth);
@@ -1038,7 +1440,7 @@ void MQTTProtocol_writeAvailable(SOCKET socket)
 
 	FUNC_ENTRY;
 
-	client = (Clients*)(ListFindItem(bstate->clients, &socket, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, socket);
 
 	current = NULL;
 	while (ListNextElement(client->outboundQueue, &current) && rc == 0)
@@ -30,11 +30,20 @@
 
 #define MAX_MSG_ID 65535
 #define MAX_CLIENTID_LEN 65535
+#define MSGID_MAP_WORDS ((MAX_MSG_ID + 1) / 64)
 
 int MQTTProtocol_startPublish(Clients* pubclient, Publish* publish, int qos, int retained, Messages** m);
 Messages* MQTTProtocol_createMessage(Publish* publish, Messages** mm, int qos, int retained, int allocatePayload);
 Publications* MQTTProtocol_storePublication(Publish* publish, int* len);
 int messageIDCompare(void* a, void* b);
+void MQTTProtocol_addMsgId(messageIdMap* map, int msgid);
+void MQTTProtocol_removeMsgId(messageIdMap* map, int msgid);
+void MQTTProtocol_emptyMsgIds(messageIdMap* map);
+int MQTTProtocol_findFreeMsgId(messageIdMap** maps, int count, int last_msgid, int stop_msgid);
+void MQTTProtocol_indexMessage(messageIndex* index, int msgid, ListElement* element);
+void MQTTProtocol_unindexMessage(messageIndex* index, int msgid);
+ListElement* MQTTProtocol_findMessage(List* msgList, messageIndex* index, int msgid);
+void MQTTProtocol_emptyMessageIndex(messageIndex* index);
 int MQTTProtocol_assignMsgId(Clients* client);
 void MQTTProtocol_removePublication(Publications* p);
 void Protocol_processPublication(Publish* publish, Clients* client, int allocatePayload);
@@ -46,6 +55,7 @@ int MQTTProtocol_handlePubrels(void* pack, SOCKET sock);
 int MQTTProtocol_handlePubcomps(void* pack, SOCKET sock, Publications** pubToRemove);
 
 void MQTTProtocol_closeSession(Clients* c, int sendwill);
+void MQTTProtocol_scheduleKeepalive(Clients* client);
 void MQTTProtocol_keepalive(START_TIME_TYPE);
 void MQTTProtocol_retry(START_TIME_TYPE, int, int);
 void MQTTProtocol_freeClient(Clients* client);
@@ -300,6 +300,8 @@ int MQTTProtocol_connect(const char* ip_address, Clients* aClient, int websocket
 		rc = Socket_new(ip_address, addr_len, port, &(aClient->net.socket));
 #endif
 	}
+	if (rc == 0 || rc == EINPROGRESS || rc == EWOULDBLOCK)
+		Clients_addSocket(bstate, aClient); /* so packets on the new socket can be matched to the client */
 	if (rc == EINPROGRESS || rc == EWOULDBLOCK)
 		aClient->connect_state = TCP_IN_PROGRESS; /* TCP connect called - wait for connect completion */
 	else if (rc == 0)
@@ -369,9 +371,10 @@ int MQTTProtocol_handlePingresps(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 21, NULL, sock, client->clientID);
 	client->ping_outstanding = 0;
+	MQTTProtocol_scheduleKeepalive(client); /* the next ping may be due before the PINGRESP was */
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -411,7 +414,7 @@ int MQTTProtocol_handleSubacks(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 23, NULL, sock, client->clientID, suback->msgId);
 	MQTTPacket_freeSuback(suback);
 	FUNC_EXIT_RC(rc);
@@ -449,7 +452,7 @@ int MQTTProtocol_handleUnsubacks(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 24, NULL, sock, client->clientID, unsuback->msgId);
 	MQTTPacket_freeUnsuback(unsuback);
 	FUNC_EXIT_RC(rc);
@@ -470,7 +473,7 @@ int MQTTProtocol_handleDisconnects(void* pack, SOCKET sock)
 	int rc = TCPSOCKET_COMPLETE;
 
 	FUNC_ENTRY;
-	client = (Clients*)(ListFindItem(bstate->clients, &sock, clientSocketCompare)->content);
+	client = Clients_findSocket(bstate, sock);
 	Log(LOG_PROTOCOL, 30, NULL, sock, client->clientID, disconnect->rc);
 	MQTTPacket_freeAck(disconnect);
 	FUNC_EXIT_RC(rc);
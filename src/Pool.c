@@ -0,0 +1,244 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Pools of storage for the structures allocated and freed for every message
+ *
+ * Storage is kept in free lists by size class, carved from slabs which are never returned
+ * to the heap.  Each thread keeps a cache of free storage for each size class, so most
+ * allocations and frees need no lock; the caches are refilled from, and drained to, the
+ * shared free lists in batches.  Storage from the pools is not heap tracked.
+ *
+ * Only built when USE_POOLS is defined.
+ */
+
+#include "Pool.h"
+
+#if defined(USE_POOLS)
+
+#include "Thread.h"
+
+#include <stdlib.h>
+
+#define POOL_MIN_SIZE 16      /**< the size of the smallest size class */
+#define POOL_CLASSES 7        /**< the number of size classes, 16 to 1024 bytes */
+#define POOL_SLAB_SIZE 65536  /**< the number of bytes allocated from the heap at once */
+#define POOL_CACHE_BATCH 64   /**< the number of items moved between a thread's cache and the shared list */
+#define POOL_CACHE_MAX 256    /**< a thread's cache is drained when it has more items than this */
+
+#if defined(_WIN32) || defined(_WIN64)
+#define POOL_THREAD_LOCAL __declspec(thread)
+mutex_type pool_mutex;
+#else
+#define POOL_THREAD_LOCAL __thread
+static pthread_mutex_t pool_mutex_store = PTHREAD_MUTEX_INITIALIZER;
+static mutex_type pool_mutex = &pool_mutex_store;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+#endif
+
+/**
+ * A free item, linked through its own storage
+ */
+typedef struct pool_item
+{
+	struct pool_item* next;
+} pool_item;
+
+/**
+ * A list of free items of one size class
+ */
+typedef struct
+{
+	pool_item* first;
+	int count;
+} pool_list;
+
+static pool_list pools[POOL_CLASSES]; /**< the shared free lists, changed with pool_mutex locked */
+static void* slabs = NULL; /**< the slabs allocated, linked through their first bytes, changed with pool_mutex locked */
+static POOL_THREAD_LOCAL pool_list caches[POOL_CLASSES]; /**< this thread's free lists */
+static POOL_THREAD_LOCAL int cache_registered = 0; /**< will this thread's cache be drained when it ends? */
+
+static int Pool_class(size_t size);
+static int Pool_addSlab(int i);
+static void Pool_move(pool_list* from, pool_list* to, int count);
+static void Pool_drainCache(void* cache);
+static void Pool_registerCache(void);
+
+
+/**
+ * Find the size class for a size
+ * @param size the size
+ * @return the index of the size class, or -1 if the size is too large to be pooled
+ */
+static int Pool_class(size_t size)
+{
+	size_t class_size = POOL_MIN_SIZE;
+	int i = 0;
+
+	while (class_size < size)
+	{
+		if (++i == POOL_CLASSES)
+			return -1;
+		class_size *= 2;
+	}
+	return i;
+}
+
+
+/**
+ * Add the items in a new slab to a shared free list.  Must be called with pool_mutex locked.
+ * @param i the index of the size class
+ * @return the number of items added, 0 if the slab couldn't be allocated
+ */
+static int Pool_addSlab(int i)
+{
+	size_t item_size = (size_t)POOL_MIN_SIZE << i;
+	char* slab = malloc(POOL_SLAB_SIZE);
+	char* item = NULL;
+	int count = 0;
+
+	if (slab == NULL)
+		return 0;
+	/* the first item of each slab links the slabs, so they stay reachable */
+	*(void**)slab = slabs;
+	slabs = slab;
+	for (item = slab + item_size; item + item_size <= slab + POOL_SLAB_SIZE; item += item_size)
+	{
+		((pool_item*)item)->next = pools[i].first;
+		pools[i].first = (pool_item*)item;
+		++count;
+	}
+	pools[i].count += count;
+	return count;
+}
+
+
+/**
+ * Move items from the head of one free list to another
+ * @param from the list to take the items from
+ * @param to the list to add the items to
+ * @param count the maximum number of items to move
+ */
+static void Pool_move(pool_list* from, pool_list* to, int count)
+{
+	while (count-- > 0 && from->first)
+	{
+		pool_item* item = from->first;
+
+		from->first = item->next;
+		--from->count;
+		item->next = to->first;
+		to->first = item;
+		++to->count;
+	}
+}
+
+
+/**
+ * Return all the items in a thread's cache to the shared free lists
+ * @param cache the thread's array of free lists
+ */
+static void Pool_drainCache(void* cache)
+{
+	pool_list* lists = (pool_list*)cache;
+	int i;
+
+	Paho_thread_lock_mutex(pool_mutex);
+	for (i = 0; i < POOL_CLASSES; ++i)
+		Pool_move(&lists[i], &pools[i], lists[i].count);
+	Paho_thread_unlock_mutex(pool_mutex);
+}
+
+
+#if !defined(_WIN32) && !defined(_WIN64)
+static void Pool_createKey(void)
+{
+	pthread_key_create(&pool_key, Pool_drainCache);
+}
+#endif
+
+
+/**
+ * Arrange for this thread's cache to be returned to the shared free lists when the thread
+ * ends.  On Windows the cache of an ending thread is not returned, so at most POOL_CACHE_MAX
+ * items of each size class are lost for each thread which has used the pools.
+ */
+static void Pool_registerCache(void)
+{
+	cache_registered = 1;
+#if !defined(_WIN32) && !defined(_WIN64)
+	pthread_once(&pool_key_once, Pool_createKey);
+	pthread_setspecific(pool_key, caches);
+#endif
+}
+
+
+void* Pool_malloc(size_t size)
+{
+	int i = Pool_class(size);
+	pool_list* cache = NULL;
+	pool_item* item = NULL;
+
+	if (i == -1)
+		return malloc(size);
+	if (!cache_registered)
+		Pool_registerCache();
+	cache = &caches[i];
+	if (cache->first == NULL)
+	{
+		Paho_thread_lock_mutex(pool_mutex);
+		if (pools[i].first != NULL || Pool_addSlab(i) > 0)
+			Pool_move(&pools[i], cache, POOL_CACHE_BATCH);
+		Paho_thread_unlock_mutex(pool_mutex);
+	}
+	if ((item = cache->first) != NULL)
+	{
+		cache->first = item->next;
+		--cache->count;
+	}
+	return item;
+}
+
+
+void Pool_free(void* p, size_t size)
+{
+	int i = Pool_class(size);
+	pool_list* cache = NULL;
+	pool_item* item = (pool_item*)p;
+
+	if (i == -1)
+	{
+		free(p);
+		return;
+	}
+	if (p == NULL)
+		return;
+	if (!cache_registered)
+		Pool_registerCache();
+	cache = &caches[i];
+	item->next = cache->first;
+	cache->first = item;
+	if (++cache->count > POOL_CACHE_MAX)
+	{
+		Paho_thread_lock_mutex(pool_mutex);
+		Pool_move(cache, &pools[i], POOL_CACHE_BATCH);
+		Paho_thread_unlock_mutex(pool_mutex);
+	}
+}
+
+#endif
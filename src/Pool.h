@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+#if !defined(POOL_H)
+#define POOL_H
+
+#include <stddef.h>
+
+#if defined(USE_POOLS)
+
+/**
+ * Allocate the storage for a structure from the pool for its size
+ * @param size the size of the structure
+ * @return pointer to the storage, or NULL if it couldn't be allocated
+ */
+void* Pool_malloc(size_t size);
+
+/**
+ * Return the storage for a structure to the pool it was allocated from
+ * @param p pointer to the storage, which must have been allocated with Pool_malloc
+ * @param size the size of the structure, as passed to Pool_malloc
+ */
+void Pool_free(void* p, size_t size);
+
+#else
+
+/* without pools, structures are allocated from the heap as everything else is */
+#define Pool_malloc(size) malloc(size)
+#define Pool_free(p, size) free(p)
+
+#endif
+
+#endif
@@ -972,6 +972,7 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 	char *ptr;
 	iobuf iovec;
 	int sslerror;
+	int frees = 1;
 
 	FUNC_ENTRY;
 	iovec.iov_len = (ULONG)buf0len;
@@ -995,39 +996,50 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 		}
 	}
 
-	SSL_lock_mutex(&sslCoreMutex);
-	ERR_clear_error();
-	if ((rc = SSL_write(ssl, iovec.iov_base, iovec.iov_len)) == iovec.iov_len)
-		rc = TCPSOCKET_COMPLETE;
+	/* if a write is already in progress on the socket, this packet has to follow it */
+	if ((rc = SocketBuffer_queueWrite(socket, ssl, 1, &iovec, &frees, iovec.iov_len)) != SOCKETBUFFER_COMPLETE)
+	{
+		if (rc == SOCKET_ERROR)
+			Log(LOG_SEVERE, -1, "Trying to write to SSL socket %d for which the output queue is full", socket);
+	}
 	else
 	{
-		sslerror = SSLSocket_error("SSL_write", ssl, socket, rc, NULL, NULL);
-
-		if (sslerror == SSL_ERROR_WANT_WRITE)
+		SSL_lock_mutex(&sslCoreMutex);
+		ERR_clear_error();
+		if ((rc = SSL_write(ssl, iovec.iov_base, iovec.iov_len)) == iovec.iov_len)
+			rc = TCPSOCKET_COMPLETE;
+		else
 		{
-			SOCKET* sockmem = (SOCKET*)malloc(sizeof(SOCKET));
-			int free = 1;
+			sslerror = SSLSocket_error("SSL_write", ssl, socket, rc, NULL, NULL);
 
-			if (!sockmem)
+			if (sslerror == SSL_ERROR_WANT_WRITE)
 			{
-				rc = PAHO_MEMORY_ERROR;
-				SSL_unlock_mutex(&sslCoreMutex);
-				goto exit;
-			}
-			Log(TRACE_MIN, -1, "Partial write: incomplete write of %lu bytes on SSL socket %d",
-				iovec.iov_len, socket);
-			SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &free, iovec.iov_len, 0);
-			*sockmem = socket;
-			ListAppend(mod_s.write_pending, sockmem, sizeof(int));
+				SOCKET* sockmem = (SOCKET*)malloc(sizeof(SOCKET));
+
+				if (!sockmem)
+				{
+					rc = PAHO_MEMORY_ERROR;
+					SSL_unlock_mutex(&sslCoreMutex);
+					free(iovec.iov_base);
+					goto exit;
+				}
+				Log(TRACE_MIN, -1, "Partial write: incomplete write of %lu bytes on SSL socket %d",
+					iovec.iov_len, socket);
+				SocketBuffer_pendingWrite(socket, ssl, 1, &iovec, &frees, iovec.iov_len, 0);
+				*sockmem = socket;
+				ListAppend(mod_s.write_pending, sockmem, sizeof(int));
 #if defined(USE_SELECT)
-			FD_SET(socket, &(mod_s.pending_wset));
+				FD_SET(socket, &(mod_s.pending_wset));
+#elif defined(USE_EPOLL)
+				Socket_addPendingWrite(socket);
 #endif
-			rc = TCPSOCKET_INTERRUPTED;
+				rc = TCPSOCKET_INTERRUPTED;
+			}
+			else
+				rc = SOCKET_ERROR;
 		}
-		else
-			rc = SOCKET_ERROR;
+		SSL_unlock_mutex(&sslCoreMutex);
 	}
-	SSL_unlock_mutex(&sslCoreMutex);
 
 	if (rc != TCPSOCKET_INTERRUPTED)
 		free(iovec.iov_base);
@@ -1082,6 +1094,18 @@ SOCKET SSLSocket_getPendingRead(void)
 }
 
 
+/**
+ * Remove a socket from the list of those with data pending in the SSL buffer, when its
+ * data is going to be read straight away
+ * @param sock the socket
+ * @return boolean - was the socket in the list?
+ */
+int SSLSocket_removePendingRead(SOCKET sock)
+{
+	return ListRemoveItem(&pending_reads, &sock, intcompare);
+}
+
+
 int SSLSocket_continueWrite(pending_writes* pw)
 {
 	int rc = 0;
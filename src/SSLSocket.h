@@ -48,6 +48,7 @@ int SSLSocket_putdatas(SSL* ssl, SOCKET socket, char* buf0, size_t buf0len, Pack
 int SSLSocket_connect(SSL* ssl, SOCKET sock, const char* hostname, int verify, int (*cb)(const char *str, size_t len, void *u), void* u);
 
 SOCKET SSLSocket_getPendingRead(void);
+int SSLSocket_removePendingRead(SOCKET sock);
 int SSLSocket_continueWrite(pending_writes* pw);
 int SSLSocket_abortWrite(pending_writes* pw);
 
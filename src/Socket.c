@@ -41,6 +41,9 @@
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #include "Heap.h"
 
@@ -51,14 +54,23 @@ int Socket_continueWrites(fd_set* pwset, SOCKET* socket, mutex_type mutex);
 int isReady(int index);
 int Socket_continueWrites(SOCKET* socket, mutex_type mutex);
 #endif
+#if defined(USE_EPOLL)
+static void Socket_epollUpdate(SOCKET socket, int want_write);
+static int Socket_epollWritable(SOCKET socket);
+#endif
 int Socket_setnonblocking(SOCKET sock);
 int Socket_error(char* aString, SOCKET sock);
 int Socket_addSocket(SOCKET newSd);
 int Socket_writev(SOCKET socket, iobuf* iovecs, int count, unsigned long* bytes);
 int Socket_close_only(SOCKET socket);
 int Socket_continueWrite(SOCKET socket);
+static int Socket_continuePendingWrite(pending_writes* pw);
 char* Socket_getaddrname(struct sockaddr* sa, SOCKET sock);
 int Socket_abortWrite(SOCKET socket);
+static int Socket_recv(SOCKET socket, char* buf, size_t len);
+static SOCKET Socket_getPendingRead(int first);
+static void Socket_createWakeup(void);
+static void Socket_clearWakeup(void);
 
 #if defined(_WIN32) || defined(_WIN64)
 #define iov_len len
@@ -153,6 +165,14 @@ void Socket_outInitialize(void)
 	FD_ZERO(&(mod_s.pending_wset));
 	mod_s.maxfdp1 = 0;
 	memcpy((void*)&(mod_s.rset_saved), (void*)&(mod_s.rset), sizeof(mod_s.rset_saved));
+#elif defined(USE_EPOLL)
+	mod_s.nfds = 0;
+	if ((mod_s.epfd = epoll_create1(EPOLL_CLOEXEC)) == SOCKET_ERROR)
+		Socket_error("epoll_create1", 0);
+	mod_s.events = NULL;
+	mod_s.events_size = 0;
+	mod_s.nevents = 0;
+	mod_s.cur_event = 0;
 #else
 	mod_s.nfds = 0;
 	mod_s.fds_read = NULL;
@@ -163,6 +183,7 @@ void Socket_outInitialize(void)
 	mod_s.saved.fds_read = NULL;
 	mod_s.saved.nfds = 0;
 #endif
+	Socket_createWakeup();
 	FUNC_EXIT;
 }
 
@@ -175,8 +196,23 @@ void Socket_outTerminate(void)
 	FUNC_ENTRY;
 	ListFree(mod_s.connect_pending);
 	ListFree(mod_s.write_pending);
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (mod_s.wakeup_fds[0] != INVALID_SOCKET)
+		close(mod_s.wakeup_fds[0]);
+	if (mod_s.wakeup_fds[1] != INVALID_SOCKET && mod_s.wakeup_fds[1] != mod_s.wakeup_fds[0])
+		close(mod_s.wakeup_fds[1]);
+#endif
+	mod_s.wakeup_fds[0] = mod_s.wakeup_fds[1] = INVALID_SOCKET;
 #if defined(USE_SELECT)
 	ListFree(mod_s.clientsds);
+#elif defined(USE_EPOLL)
+	if (mod_s.epfd != SOCKET_ERROR)
+		close(mod_s.epfd);
+	mod_s.epfd = SOCKET_ERROR;
+	if (mod_s.events)
+		free(mod_s.events);
+	mod_s.events = NULL;
+	mod_s.events_size = mod_s.nevents = mod_s.cur_event = 0;
 #else
 	if (mod_s.fds_read)
 		free(mod_s.fds_read);
@@ -233,6 +269,7 @@ int Socket_addSocket(SOCKET newSd)
 			rc = Socket_setnonblocking(newSd);
 			if (rc == SOCKET_ERROR)
 				Log(LOG_ERROR, -1, "addSocket: setnonblocking");
+			Socket_wakeup(); /* so that select is restarted with the new socket */
 		}
 	}
 	else
@@ -242,6 +279,79 @@ exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+#elif defined(USE_EPOLL)
+/**
+ * Add a socket to the set of sockets registered with epoll
+ * @param newSd the new socket to add
+ */
+int Socket_addSocket(SOCKET newSd)
+{
+	struct epoll_event ev;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(socket_mutex);
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = newSd;
+	if (epoll_ctl(mod_s.epfd, EPOLL_CTL_ADD, newSd, &ev) == SOCKET_ERROR)
+	{
+		Socket_error("epoll_ctl add", newSd);
+		Log(LOG_ERROR, -1, "addSocket: epoll_ctl failed for socket %d", newSd);
+		rc = SOCKET_ERROR;
+		goto exit;
+	}
+	mod_s.nfds++;
+
+	rc = Socket_setnonblocking(newSd);
+	if (rc == SOCKET_ERROR)
+		Log(LOG_ERROR, -1, "addSocket: setnonblocking");
+	Socket_wakeup(); /* so that epoll_wait is restarted */
+
+exit:
+	Paho_thread_unlock_mutex(socket_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Set the epoll events of interest for a socket.  Writeability is only asked for while
+ * a connect or write is pending, as level triggered EPOLLOUT would otherwise wake
+ * epoll_wait continuously.
+ * @param socket the socket to update
+ * @param want_write force writeability to be checked, as in Socket_addPendingWrite
+ */
+static void Socket_epollUpdate(SOCKET socket, int want_write)
+{
+	struct epoll_event ev;
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	if (want_write || !Socket_noPendingWrites(socket) || ListFindItem(mod_s.connect_pending, &socket, intcompare))
+		ev.events |= EPOLLOUT;
+	ev.data.fd = socket;
+	if (epoll_ctl(mod_s.epfd, EPOLL_CTL_MOD, socket, &ev) == SOCKET_ERROR)
+		Socket_error("epoll_ctl mod", socket);
+}
+
+
+/**
+ * Was a socket reported as writeable by the last epoll_wait?
+ * @param socket the socket to check
+ * @return boolean - is the socket writeable?
+ */
+static int Socket_epollWritable(SOCKET socket)
+{
+	int i;
+
+	for (i = mod_s.cur_event; i < mod_s.nevents; ++i)
+	{
+		if (mod_s.events[i].data.fd == socket)
+			return (mod_s.events[i].events & EPOLLOUT) != 0;
+	}
+	return 0;
+}
 #else
 static int cmpfds(const void *p1, const void *p2)
 {
@@ -308,6 +418,7 @@ int Socket_addSocket(SOCKET newSd)
 	rc = Socket_setnonblocking(newSd);
 	if (rc == SOCKET_ERROR)
 		Log(LOG_ERROR, -1, "addSocket: setnonblocking");
+	Socket_wakeup(); /* so that poll is restarted with the new socket */
 
 exit:
 	Paho_thread_unlock_mutex(socket_mutex);
@@ -331,13 +442,55 @@ int isReady(int socket, fd_set* read_set, fd_set* write_set)
 	int rc = 1;
 
 	FUNC_ENTRY;
-	if  (ListFindItem(mod_s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set))
+	if (socket == mod_s.wakeup_fds[0])
+	{
+		if (FD_ISSET(socket, read_set))
+			Socket_clearWakeup();
+		rc = 0; /* not a client socket */
+	}
+	else if  (ListFindItem(mod_s.connect_pending, &socket, intcompare) && FD_ISSET(socket, write_set))
 		ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
 	else
 		rc = FD_ISSET(socket, read_set) && FD_ISSET(socket, write_set) && Socket_noPendingWrites(socket);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+#elif defined(USE_EPOLL)
+/**
+ * Don't accept work from a client unless it is accepting work back.  Writeability is only
+ * registered with epoll while a write is pending, so a socket with no pending writes is taken
+ * to be writeable; a full send buffer shows up as a pending write.
+ * @param index the index into the epoll events array to check
+ * @return boolean - is the socket ready to go?
+ */
+int isReady(int index)
+{
+	int rc = 1;
+	struct epoll_event* ev = &mod_s.events[index];
+	SOCKET socket = ev->data.fd;
+
+	FUNC_ENTRY;
+	if (socket == INVALID_SOCKET)
+		rc = 0; /* the socket has been closed since epoll_wait returned */
+	else if (socket == mod_s.wakeup_fds[0])
+	{
+		if (ev->events & EPOLLIN)
+			Socket_clearWakeup();
+		rc = 0; /* not a client socket */
+	}
+	else if (ev->events & (EPOLLHUP | EPOLLERR))
+		; /* signal work to be done if there is an error on the socket */
+	else if (ListFindItem(mod_s.connect_pending, &socket, intcompare) && (ev->events & EPOLLOUT))
+	{
+		ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
+		Socket_epollUpdate(socket, 0);
+	}
+	else
+		rc = (ev->events & EPOLLIN) && Socket_noPendingWrites(socket);
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
 #else
 /**
  * Don't accept work from a client unless it is accepting work back, i.e. its socket is writeable
@@ -352,11 +505,20 @@ int isReady(int index)
 
 	FUNC_ENTRY;
 
-	if ((mod_s.saved.fds_read[index].revents & POLLHUP) || (mod_s.saved.fds_read[index].revents & POLLNVAL))
+	if (*socket == mod_s.wakeup_fds[0])
+	{
+		if (mod_s.saved.fds_read[index].revents & POLLIN)
+			Socket_clearWakeup();
+		rc = 0; /* not a client socket */
+	}
+	else if ((mod_s.saved.fds_read[index].revents & POLLHUP) || (mod_s.saved.fds_read[index].revents & POLLNVAL))
 		; /* signal work to be done if there is an error on the socket */
 	else if  (ListFindItem(mod_s.connect_pending, socket, intcompare) &&
-			(mod_s.saved.fds_write[index].revents & POLLOUT))
+			((mod_s.saved.fds_write[index].revents | mod_s.saved.fds_read[index].revents) & POLLOUT))
+	{
 		ListRemoveItem(mod_s.connect_pending, socket, intcompare);
+		Socket_clearPendingWrite(*socket);
+	}
 	else
 		rc = (mod_s.saved.fds_read[index].revents & POLLIN) &&
 			 (mod_s.saved.fds_write[index].revents & POLLOUT) &&
@@ -385,10 +547,12 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 
 	FUNC_ENTRY;
 	Paho_thread_lock_mutex(mutex);
+	if ((sock = Socket_getPendingRead(1)) != 0)
+		goto exit;
 	if (mod_s.clientsds->count == 0)
 		goto exit;
 		
-	if (more_work)
+	if (more_work || SocketBuffer_pendingReads() > 0)
 		timeout_ms = 0;
 	else if (timeout >= 0)
 		timeout_ms = timeout;
@@ -473,6 +637,117 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 		ListNextElement(mod_s.clientsds, &mod_s.cur_clientsds);
 	}
 exit:
+	if (sock == 0 && *rc == 0)
+		sock = Socket_getPendingRead(0);
+	Paho_thread_unlock_mutex(mutex);
+	FUNC_EXIT_RC(sock);
+	return sock;
+} /* end getReadySocket */
+#elif defined(USE_EPOLL)
+/**
+ *  Returns the next socket ready for communications as indicated by epoll
+ *  @param more_work flag to indicate more work is waiting, and thus a timeout value of 0 should
+ *  be used for the epoll_wait
+ *  @param timeout the timeout to be used in ms
+ *  @param rc a value other than 0 indicates an error of the returned socket
+ *  @return the socket next ready, or 0 if none is ready
+ */
+SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int* rc)
+{
+	SOCKET sock = 0;
+	*rc = 0;
+	int timeout_ms = 1000;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(mutex);
+	if ((sock = Socket_getPendingRead(1)) != 0)
+		goto exit;
+	if (mod_s.nfds == 0 && mod_s.cur_event >= mod_s.nevents)
+		goto exit;
+
+	if (more_work || SocketBuffer_pendingReads() > 0)
+		timeout_ms = 0;
+	else if (timeout >= 0)
+		timeout_ms = timeout;
+
+	while (mod_s.cur_event < mod_s.nevents)
+	{
+		if (isReady(mod_s.cur_event))
+			break;
+		mod_s.cur_event++;
+	}
+
+	if (mod_s.cur_event >= mod_s.nevents)
+	{
+		int nevents = 0;
+
+		mod_s.nevents = mod_s.cur_event = 0;
+		if (mod_s.nfds == 0)
+		{
+			sock = 0;
+			goto exit; /* no work to do */
+		}
+
+		if ((int)mod_s.nfds > mod_s.events_size)
+		{
+			struct epoll_event* events = NULL;
+
+			if (mod_s.events)
+				events = realloc(mod_s.events, mod_s.nfds * sizeof(struct epoll_event));
+			else
+				events = malloc(mod_s.nfds * sizeof(struct epoll_event));
+
+			if (events == NULL)
+			{
+				*rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+			mod_s.events = events;
+			mod_s.events_size = (int)mod_s.nfds;
+		}
+
+		/* Prevent performance issue by unlocking the socket_mutex while waiting for a ready socket. */
+		Paho_thread_unlock_mutex(mutex);
+		nevents = epoll_wait(mod_s.epfd, mod_s.events, mod_s.events_size, timeout_ms);
+		Paho_thread_lock_mutex(mutex);
+		if (nevents == SOCKET_ERROR)
+		{
+			*rc = nevents;
+			Socket_error("epoll_wait", 0);
+			goto exit;
+		}
+		Log(TRACE_MAX, -1, "Return code %d from epoll_wait", nevents);
+
+		if (nevents == 0)
+		{
+			sock = 0;
+			goto exit; /* no work to do */
+		}
+		mod_s.nevents = nevents;
+
+		/* Continue any pending writes on sockets which are now writeable */
+		if (mod_s.write_pending->count > 0 && Socket_continueWrites(&sock, mutex) == SOCKET_ERROR)
+		{
+			*rc = SOCKET_ERROR;
+			goto exit;
+		}
+
+		while (mod_s.cur_event < mod_s.nevents)
+		{
+			if (isReady(mod_s.cur_event))
+				break;
+			mod_s.cur_event++;
+		}
+	}
+
+	*rc = 0;
+	if (mod_s.cur_event >= mod_s.nevents)
+		sock = 0;
+	else
+		sock = mod_s.events[mod_s.cur_event++].data.fd;
+exit:
+	if (sock == 0 && *rc == 0)
+		sock = Socket_getPendingRead(0);
 	Paho_thread_unlock_mutex(mutex);
 	FUNC_EXIT_RC(sock);
 	return sock;
@@ -494,10 +769,12 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 
 	FUNC_ENTRY;
 	Paho_thread_lock_mutex(mutex);
+	if ((sock = Socket_getPendingRead(1)) != 0)
+		goto exit;
 	if (mod_s.nfds == 0 && mod_s.saved.nfds == 0)
 		goto exit;
 
-	if (more_work)
+	if (more_work || SocketBuffer_pendingReads() > 0)
 		timeout_ms = 0;
 	else if (timeout >= 0)
 		timeout_ms = timeout;
@@ -600,6 +877,8 @@ SOCKET Socket_getReadySocket(int more_work, int timeout, mutex_type mutex, int*
 		mod_s.saved.cur_fd = (mod_s.saved.cur_fd == mod_s.saved.nfds - 1) ? -1 : mod_s.saved.cur_fd + 1;
 	}
 exit:
+	if (sock == 0 && *rc == 0)
+		sock = Socket_getPendingRead(0);
 	Paho_thread_unlock_mutex(mutex);
 	FUNC_EXIT_RC(sock);
 	return sock;
@@ -607,6 +886,61 @@ exit:
 #endif
 
 
+/**
+ *  Sockets with data read ahead into SocketBuffer are not reported by poll or select, so they
+ *  are returned from here.  Before poll or select is checked, they are only returned every
+ *  other time, so that one busy connection can't starve the others.
+ *  @param first is poll or select still to be checked?
+ *  @return a socket with data read ahead, or 0 if there is none
+ */
+static SOCKET Socket_getPendingRead(int first)
+{
+	static int turn = 0;
+	SOCKET sock = 0;
+
+	if (SocketBuffer_pendingReads() > 0 && (!first || (turn = !turn)))
+		sock = SocketBuffer_getPendingRead();
+	return sock;
+}
+
+
+/**
+ *  Reads data from a socket through its read ahead buffer, so that the small reads used to get
+ *  the fixed header of a packet, and small packets, don't each need a system call.
+ *  @param socket the socket to read from
+ *  @param buf the buffer to read into
+ *  @param len the number of bytes wanted
+ *  @return the number of bytes read, 0 if the socket has been closed, or SOCKET_ERROR
+ */
+static int Socket_recv(SOCKET socket, char* buf, size_t len)
+{
+	size_t count = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((count = SocketBuffer_getReadAhead(socket, buf, len)) < len)
+	{
+		size_t size = 0;
+		char* ra_buf = NULL;
+
+		/* large reads go straight into the caller's buffer */
+		if (len - count >= SOCKETBUFFER_READAHEAD_SIZE ||
+				(ra_buf = SocketBuffer_getReadAheadBuffer(socket, &size)) == NULL)
+			rc = recv(socket, buf + count, (int)(len - count), 0);
+		else if ((rc = recv(socket, ra_buf, (int)size, 0)) > 0)
+		{
+			SocketBuffer_readAheadFilled(socket, (size_t)rc);
+			rc = (int)SocketBuffer_getReadAhead(socket, buf + count, len - count);
+		}
+	}
+	/* return any data we have - an error or close will be seen again on the next read */
+	if (count > 0)
+		rc = (rc > 0) ? rc + (int)count : (int)count;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  *  Reads one byte from a socket
  *  @param socket the socket to read from
@@ -621,7 +955,7 @@ int Socket_getch(SOCKET socket, char* c)
 	if ((rc = SocketBuffer_getQueuedChar(socket, c)) != SOCKETBUFFER_INTERRUPTED)
 		goto exit;
 
-	if ((rc = recv(socket, c, (size_t)1, 0)) == SOCKET_ERROR)
+	if ((rc = Socket_recv(socket, c, (size_t)1)) == SOCKET_ERROR)
 	{
 		int err = Socket_error("recv - getch", socket);
 		if (err == EWOULDBLOCK || err == EAGAIN)
@@ -659,12 +993,15 @@ char *Socket_getdata(SOCKET socket, size_t bytes, size_t* actual_len, int *rc)
 	if (bytes == 0)
 	{
 		buf = SocketBuffer_complete(socket);
+		/* there might be more packets in the read ahead buffer, which poll or select won't see */
+		if (SocketBuffer_hasReadAhead(socket))
+			SocketBuffer_addPendingRead(socket);
 		goto exit;
 	}
 
 	buf = SocketBuffer_getQueuedData(socket, bytes, actual_len);
 
-	if ((*rc = recv(socket, buf + (*actual_len), (int)(bytes - (*actual_len)), 0)) == SOCKET_ERROR)
+	if ((*rc = Socket_recv(socket, buf + (*actual_len), bytes - (*actual_len))) == SOCKET_ERROR)
 	{
 		*rc = Socket_error("recv - getdata", socket);
 		if (*rc != EAGAIN && *rc != EWOULDBLOCK)
@@ -682,7 +1019,11 @@ char *Socket_getdata(SOCKET socket, size_t bytes, size_t* actual_len, int *rc)
 		*actual_len += *rc;
 
 	if (*actual_len == bytes)
+	{
 		SocketBuffer_complete(socket);
+		if (SocketBuffer_hasReadAhead(socket))
+			SocketBuffer_addPendingRead(socket);
+	}
 	else /* we didn't read the whole packet */
 	{
 		SocketBuffer_interrupted(socket, *actual_len);
@@ -705,6 +1046,17 @@ int Socket_noPendingWrites(SOCKET socket)
 }
 
 
+/**
+ *  Indicate whether so much data is queued outbound for a socket that no more can be written
+ *  to it for now.  While the queue isn't full, packets can be written behind a partial write.
+ *  @return boolean - true == the write queue is full.
+ */
+int Socket_writeQueueFull(SOCKET socket)
+{
+	return SocketBuffer_writeQueueFull(socket);
+}
+
+
 /**
  *  Attempts to write a series of iovec buffers to a socket in *one* system call so that
  *  they are sent as one packet.
@@ -795,13 +1147,6 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 	size_t total = buf0len;
 
 	FUNC_ENTRY;
-	if (!Socket_noPendingWrites(socket))
-	{
-		Log(LOG_SEVERE, -1, "Trying to write to socket %d for which there is already pending output", socket);
-		rc = SOCKET_ERROR;
-		goto exit;
-	}
-
 	for (i = 0; i < bufs.count; i++)
 		total += bufs.buflens[i];
 
@@ -815,6 +1160,20 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 		frees1[i+1] = bufs.frees[i];
 	}
 
+	/* if a write is already in progress on the socket, this packet has to follow it */
+#if defined(OPENSSL)
+	if ((rc = SocketBuffer_queueWrite(socket, NULL, bufs.count+1, iovecs, frees1, total)) != SOCKETBUFFER_COMPLETE)
+#else
+	if ((rc = SocketBuffer_queueWrite(socket, bufs.count+1, iovecs, frees1, total)) != SOCKETBUFFER_COMPLETE)
+#endif
+	{
+		if (rc == SOCKET_ERROR)
+			Log(LOG_SEVERE, -1, "Trying to write to socket %d for which the output queue is full", socket);
+		else if (rc == TCPSOCKET_INTERRUPTED)
+			Log(TRACE_MIN, -1, "Queued write of %lu bytes behind pending output on socket %d", total, socket);
+		goto exit;
+	}
+
 	if ((rc = Socket_writev(socket, iovecs, bufs.count+1, &bytes)) != SOCKET_ERROR)
 	{
 		if (bytes == total)
@@ -844,6 +1203,8 @@ int Socket_putdatas(SOCKET socket, char* buf0, size_t buf0len, PacketBuffers buf
 			}
 #if defined(USE_SELECT)
 			FD_SET(socket, &(mod_s.pending_wset));
+#elif defined(USE_EPOLL)
+			Socket_epollUpdate(socket, 1);
 #endif
 			rc = TCPSOCKET_INTERRUPTED;
 		}
@@ -864,6 +1225,15 @@ void Socket_addPendingWrite(SOCKET socket)
 {
 #if defined(USE_SELECT)
 	FD_SET(socket, &(mod_s.pending_wset));
+#elif defined(USE_EPOLL)
+	Socket_epollUpdate(socket, 1);
+#else
+	struct pollfd* fd;
+
+	/* wait for writeability in the blocking poll too, so that connect completion is seen straight away */
+	if (mod_s.nfds > 0 &&
+		(fd = bsearch(&socket, mod_s.fds_read, (size_t)mod_s.nfds, sizeof(mod_s.fds_read[0]), cmpsockfds)) != NULL)
+		fd->events |= POLLOUT;
 #endif
 }
 
@@ -877,6 +1247,14 @@ void Socket_clearPendingWrite(SOCKET socket)
 #if defined(USE_SELECT)
 	if (FD_ISSET(socket, &(mod_s.pending_wset)))
 		FD_CLR(socket, &(mod_s.pending_wset));
+#elif defined(USE_EPOLL)
+	Socket_epollUpdate(socket, 0);
+#else
+	struct pollfd* fd;
+
+	if (mod_s.nfds > 0 &&
+		(fd = bsearch(&socket, mod_s.fds_read, (size_t)mod_s.nfds, sizeof(mod_s.fds_read[0]), cmpsockfds)) != NULL)
+		fd->events &= ~POLLOUT;
 #endif
 }
 
@@ -953,6 +1331,45 @@ exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
+#elif defined(USE_EPOLL)
+/**
+ *  Close a socket and remove it from the epoll set.
+ *  @param socket the socket to close
+ *  @return completion code
+ */
+int Socket_close(SOCKET socket)
+{
+	int i, rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(socket_mutex);
+	/* the socket must be removed from the epoll set before it is closed */
+	if (epoll_ctl(mod_s.epfd, EPOLL_CTL_DEL, socket, NULL) == SOCKET_ERROR)
+	{
+		Log(LOG_ERROR, -1, "Failed to remove socket %d", socket);
+		rc = SOCKET_ERROR;
+	}
+	else
+	{
+		mod_s.nfds--;
+		Log(TRACE_MIN, -1, "Removed socket %d", socket);
+	}
+	Socket_close_only(socket);
+	Socket_abortWrite(socket);
+	SocketBuffer_cleanup(socket);
+	ListRemoveItem(mod_s.connect_pending, &socket, intcompare);
+	ListRemoveItem(mod_s.write_pending, &socket, intcompare);
+
+	/* make sure any events not yet processed are not returned for the closed socket */
+	for (i = mod_s.cur_event; i < mod_s.nevents; ++i)
+	{
+		if (mod_s.events[i].data.fd == socket)
+			mod_s.events[i].data.fd = INVALID_SOCKET;
+	}
+	Paho_thread_unlock_mutex(socket_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
 #else
 /**
  *  Close a socket and remove it from the select list.
@@ -1208,6 +1625,10 @@ int Socket_new(const char* addr, size_t addr_len, int port, SOCKET* sock)
 					*pnewSd = *sock;
 					Paho_thread_lock_mutex(socket_mutex);
 					result = ListAppend(mod_s.connect_pending, pnewSd, sizeof(SOCKET));
+#if defined(USE_EPOLL)
+					if (result)
+						Socket_epollUpdate(*sock, 1);
+#endif
 					Paho_thread_unlock_mutex(socket_mutex);
 					if (!result)
 					{
@@ -1258,30 +1679,50 @@ void Socket_setWriteAvailableCallback(Socket_writeAvailable* mywriteavailable)
 }
 
 /**
- *  Continue an outstanding write for a particular socket
+ *  Continue the outstanding writes for a particular socket, in the order they were queued
  *  @param socket that socket
- *  @return completion code: 0=incomplete, 1=complete, -1=socket error
+ *  @return completion code: 0=incomplete, 1=all complete, -1=socket error
  */
 int Socket_continueWrite(SOCKET socket)
 {
-	int rc = 0;
+	int rc = 1;
 	pending_writes* pw;
+
+	FUNC_ENTRY;
+	while ((pw = SocketBuffer_getWrite(socket)) != NULL)
+	{
+#if defined(OPENSSL)
+		if (pw->ssl)
+			rc = SSLSocket_continueWrite(pw);
+		else
+#endif
+			rc = Socket_continuePendingWrite(pw);
+		if (rc != 1)
+			break;
+		/* that write is complete, so go on to the next one queued, if any */
+		if (!SocketBuffer_writeComplete(socket))
+			Log(LOG_SEVERE, -1, "Failed to remove pending write from socket buffer list");
+	}
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ *  Continue one outstanding write
+ *  @param pw the write
+ *  @return completion code: 0=incomplete, 1=complete, -1=socket error
+ */
+static int Socket_continuePendingWrite(pending_writes* pw)
+{
+	int rc = 0;
+	SOCKET socket = pw->socket;
 	unsigned long curbuflen = 0L, /* cumulative total of buffer lengths */
 		bytes = 0L;
 	int curbuf = -1, i;
 	iobuf iovecs1[5];
 
 	FUNC_ENTRY;
-	pw = SocketBuffer_getWrite(socket);
-
-#if defined(OPENSSL)
-	if (pw->ssl)
-	{
-		rc = SSLSocket_continueWrite(pw);
-		goto exit;
-	}
-#endif
-
 	for (i = 0; i < pw->count; ++i)
 	{
 		if (pw->bytes <= curbuflen)
@@ -1333,9 +1774,6 @@ int Socket_continueWrite(SOCKET socket)
             }
 		}
 	}
-#if defined(OPENSSL)
-exit:
-#endif
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1343,9 +1781,9 @@ exit:
 
 
 /**
- *  Continue an outstanding write for a particular socket
+ *  Abandon all the outstanding writes for a particular socket
  *  @param socket that socket
- *  @return completion code: 0=incomplete, 1=complete, -1=socket error
+ *  @return completion code
  */
 int Socket_abortWrite(SOCKET socket)
 {
@@ -1353,26 +1791,25 @@ int Socket_abortWrite(SOCKET socket)
 	pending_writes* pw;
 
 	FUNC_ENTRY;
-	if ((pw = SocketBuffer_getWrite(socket)) == NULL)
-	  goto exit;
-
-#if defined(OPENSSL)
-	if (pw->ssl)
+	while ((pw = SocketBuffer_getWrite(socket)) != NULL)
 	{
-		rc = SSLSocket_abortWrite(pw);
-		goto exit;
-	}
+#if defined(OPENSSL)
+		if (pw->ssl)
+			rc = SSLSocket_abortWrite(pw);
+		else
 #endif
-
-	for (i = 0; i < pw->count; i++)
-	{
-		if (pw->frees[i])
 		{
-			Log(TRACE_MIN, -1, "Cleaning in abortWrite for socket %d", socket);
-			free(pw->iovecs[i].iov_base);
+			for (i = 0; i < pw->count; i++)
+			{
+				if (pw->frees[i])
+				{
+					Log(TRACE_MIN, -1, "Cleaning in abortWrite for socket %d", socket);
+					free(pw->iovecs[i].iov_base);
+				}
+			}
 		}
+		SocketBuffer_writeComplete(socket);
 	}
-exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -1407,6 +1844,8 @@ int Socket_continueWrites(SOCKET* sock, mutex_type mutex)
 #if defined(USE_SELECT)
 
 		if (FD_ISSET(socket, pwset) && ((rc = Socket_continueWrite(socket)) != 0))
+#elif defined(USE_EPOLL)
+		if (Socket_epollWritable(socket) && ((rc = Socket_continueWrite(socket)) != 0))
 #else
 		struct pollfd* fd;
 
@@ -1416,7 +1855,8 @@ int Socket_continueWrites(SOCKET* sock, mutex_type mutex)
 		if ((fd->revents & POLLOUT) && ((rc = Socket_continueWrite(socket)) != 0))
 #endif
 		{
-			if (!SocketBuffer_writeComplete(socket))
+			/* completed writes have been removed already, but a failed one has not */
+			if (rc != 1 && !SocketBuffer_writeComplete(socket))
 				Log(LOG_SEVERE, -1, "Failed to remove pending write from socket buffer list");
 #if defined(USE_SELECT)
 			FD_CLR(socket, &(mod_s.pending_wset));
@@ -1427,6 +1867,10 @@ int Socket_continueWrites(SOCKET* sock, mutex_type mutex)
 				ListNextElement(mod_s.write_pending, &curpending);
 			}
 			curpending = mod_s.write_pending->current;
+#if defined(USE_EPOLL)
+			if (rc > 0)
+				Socket_epollUpdate(socket, 0);
+#endif
 
 			if (writeAvailable && rc > 0)
 				(*writeAvailable)(socket);
@@ -1455,6 +1899,95 @@ int Socket_continueWrites(SOCKET* sock, mutex_type mutex)
 }
 
 
+/**
+ *  Create the file descriptor used to interrupt a wait in Socket_getReadySocket, and add it to
+ *  the set of sockets waited on.  On Linux this is an eventfd, elsewhere a pipe.  On Windows,
+ *  where WSAPoll and select only take sockets, there is none.
+ */
+static void Socket_createWakeup(void)
+{
+	SOCKET fds[2] = {INVALID_SOCKET, INVALID_SOCKET};
+
+	FUNC_ENTRY;
+	mod_s.wakeup_fds[0] = mod_s.wakeup_fds[1] = INVALID_SOCKET;
+#if defined(__linux__)
+	if ((fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == INVALID_SOCKET)
+		Socket_error("eventfd", 0);
+#elif !defined(_WIN32) && !defined(_WIN64)
+	if (pipe(fds) == SOCKET_ERROR)
+	{
+		Socket_error("pipe", 0);
+		fds[0] = fds[1] = INVALID_SOCKET;
+	}
+	else
+		Socket_setnonblocking(fds[1]);
+#endif
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (fds[0] != INVALID_SOCKET)
+	{
+		if (Socket_addSocket(fds[0]) == 0)
+		{
+			mod_s.wakeup_fds[0] = fds[0];
+			mod_s.wakeup_fds[1] = fds[1];
+		}
+		else
+		{
+			close(fds[0]);
+			if (fds[1] != fds[0])
+				close(fds[1]);
+		}
+	}
+#endif
+	FUNC_EXIT;
+}
+
+
+/**
+ *  Interrupt any wait for a ready socket, for instance when the set of sockets has changed or
+ *  there is other work for the waiting thread to do.  Can be called from any thread.
+ */
+void Socket_wakeup(void)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	if (mod_s.wakeup_fds[1] != INVALID_SOCKET)
+	{
+#if defined(__linux__)
+		uint64_t value = 1;
+#else
+		char value = 1;
+#endif
+		/* if the pipe is full, a wakeup is already pending */
+		if (write(mod_s.wakeup_fds[1], &value, sizeof(value)) == SOCKET_ERROR)
+			Socket_error("write - wakeup", mod_s.wakeup_fds[1]);
+	}
+#endif
+}
+
+
+/**
+ *  Reset the wakeup file descriptor after it has been signalled
+ */
+static void Socket_clearWakeup(void)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+	char buf[64];
+
+	while (read(mod_s.wakeup_fds[0], buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+
+/**
+ *  Can waits in Socket_getReadySocket be interrupted by Socket_wakeup?
+ *  @return boolean - is there a wakeup file descriptor?
+ */
+int Socket_hasWakeup(void)
+{
+	return mod_s.wakeup_fds[0] != INVALID_SOCKET;
+}
+
+
 /**
  *  Convert a numeric address to character string
  *  @param sa	socket numerical address
@@ -48,6 +48,9 @@
 #else
 #define INVALID_SOCKET SOCKET_ERROR
 #include <sys/socket.h>
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#endif
 #if !defined(_WRS_KERNEL)
 #include <sys/param.h>
 #include <sys/time.h>
@@ -113,6 +116,7 @@ typedef struct
 {
 	List* connect_pending; /**< list of sockets for which a connect is pending */
 	List* write_pending; /**< list of sockets for which a write is pending */
+	SOCKET wakeup_fds[2]; /**< read and write ends of the pipe used to interrupt a wait for a ready socket */
 
 #if defined(USE_SELECT)
 	fd_set rset, /**< socket read set (see select doc) */
@@ -121,6 +125,13 @@ typedef struct
 	List* clientsds; /**< list of client socket descriptors */
 	ListElement* cur_clientsds; /**< current client socket descriptor (iterator) */
 	fd_set pending_wset; /**< socket pending write set for select */
+#elif defined(USE_EPOLL)
+	int epfd;                  /**< epoll instance in which all sockets are registered */
+	unsigned int nfds;         /**< no of sockets registered with epoll */
+	struct epoll_event* events; /**< ready events returned by the last epoll_wait */
+	int events_size;           /**< number of entries allocated in the events array */
+	int nevents;               /**< number of valid entries in the events array */
+	int cur_event;             /**< index of the next entry in the events array to check */
 #else
 	unsigned int nfds;         /**< no of file descriptors for poll */
 	struct pollfd* fds_read;        /**< poll read file descriptors */
@@ -151,8 +162,12 @@ int Socket_new(const char* addr, size_t addr_len, int port, SOCKET* socket);
 #endif
 
 int Socket_noPendingWrites(SOCKET socket);
+int Socket_writeQueueFull(SOCKET socket);
 char* Socket_getpeer(SOCKET sock);
 
+void Socket_wakeup(void);
+int Socket_hasWakeup(void);
+
 void Socket_addPendingWrite(SOCKET socket);
 void Socket_clearPendingWrite(SOCKET socket);
 
@@ -27,6 +27,7 @@
 #include "Log.h"
 #include "Messages.h"
 #include "StackTrace.h"
+#include "Thread.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -50,15 +51,53 @@ static socket_queue* def_queue;
 static List* queues;
 
 /**
- * List of queued write buffers
+ * List of queued write buffers.  There can be more than one for a socket, in the order they
+ * are to be written.
  */
 static List writes;
 
+/**
+ * Protects the writes list, as packets can be queued by one thread while another
+ * is completing the writes
+ */
+static mutex_type writes_mutex = NULL;
+
+/**
+ * List of the sockets with writes on the writes list, each with the number of bytes
+ * queued behind the write in progress, so a socket's write queue size is known without
+ * a search of the writes.  Protected by writes_mutex.
+ */
+static List write_queues;
+
+/**
+ * Read ahead buffers indexed by socket, for sockets below SOCKETBUFFER_READAHEAD_INDEX_MAX.
+ * Allocated while any are in it.
+ */
+static socket_readahead** readahead_index;
+static int readahead_index_size;  /* number of sockets the index has room for */
+static int readahead_index_count; /* number of read ahead buffers in the index */
+
+/**
+ * List of read ahead buffers for sockets which are too high to be indexed
+ */
+static List readaheads;
+
+#define SocketBuffer_readAheadIndexed(sock) ((sock) > 0 && (sock) < SOCKETBUFFER_READAHEAD_INDEX_MAX)
+
+/**
+ * List of sockets with data in their read ahead buffers, which poll and select can't see
+ */
+static List pending_reads;
+
 
 int socketcompare(void* a, void* b);
+int readahead_socketcompare(void* a, void* b);
+static socket_readahead* SocketBuffer_findReadAhead(SOCKET socket);
+static void SocketBuffer_freeReadAhead(SOCKET socket);
 int SocketBuffer_newDefQ(void);
 void SocketBuffer_freeDefQ(void);
 int pending_socketcompare(void* a, void* b);
+int write_queue_socketcompare(void* a, void* b);
 
 
 /**
@@ -111,6 +150,11 @@ int SocketBuffer_initialize(void)
 			rc = PAHO_MEMORY_ERROR;
 	}
 	ListZero(&writes);
+	ListZero(&write_queues);
+	ListZero(&readaheads);
+	ListZero(&pending_reads);
+	if (rc == 0)
+		writes_mutex = Paho_thread_create_mutex(&rc);
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -134,12 +178,39 @@ void SocketBuffer_terminate(void)
 {
 	ListElement* cur = NULL;
 	ListEmpty(&writes);
+	ListEmpty(&write_queues);
 
 	FUNC_ENTRY;
 	while (ListNextElement(queues, &cur))
 		free(((socket_queue*)(cur->content))->buf);
 	ListFree(queues);
+	cur = NULL;
+	while (ListNextElement(&readaheads, &cur))
+		free(((socket_readahead*)(cur->content))->buf);
+	ListEmpty(&readaheads);
+	if (readahead_index)
+	{
+		int i;
+
+		for (i = 0; i < readahead_index_size; ++i)
+		{
+			if (readahead_index[i])
+			{
+				free(readahead_index[i]->buf);
+				free(readahead_index[i]);
+			}
+		}
+		free(readahead_index);
+		readahead_index = NULL;
+		readahead_index_size = readahead_index_count = 0;
+	}
+	ListEmpty(&pending_reads);
 	SocketBuffer_freeDefQ();
+	if (writes_mutex)
+	{
+		Paho_thread_destroy_mutex(writes_mutex);
+		writes_mutex = NULL;
+	}
 	FUNC_EXIT;
 }
 
@@ -151,7 +222,8 @@ void SocketBuffer_terminate(void)
 void SocketBuffer_cleanup(SOCKET socket)
 {
 	FUNC_ENTRY;
-	SocketBuffer_writeComplete(socket); /* clean up write buffers */
+	while (SocketBuffer_writeComplete(socket))
+		; /* clean up write buffers */
 	if (ListFindItem(queues, &socket, socketcompare))
 	{
 		free(((socket_queue*)(queues->current->content))->buf);
@@ -162,6 +234,8 @@ void SocketBuffer_cleanup(SOCKET socket)
 		def_queue->socket = def_queue->index = 0;
 		def_queue->headerlen = def_queue->datalen = 0;
 	}
+	SocketBuffer_freeReadAhead(socket);
+	ListRemoveItem(&pending_reads, &socket, intcompare);
 	FUNC_EXIT;
 }
 
@@ -206,6 +280,8 @@ char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len
 				goto exit;
 			}
 		}
+		else if (queue->buf == NULL) /* the last buffer was taken by SocketBuffer_takeData */
+			queue->buf = malloc(bytes);
 		else
 			queue->buf = realloc(queue->buf, bytes);
 		queue->buflen = bytes;
@@ -301,6 +377,32 @@ char* SocketBuffer_complete(SOCKET socket)
 }
 
 
+/**
+ * Take the buffer holding the last packet read, so that part of the packet can be used after
+ * the next one is read, without copying it.  The buffer is only taken if it holds the
+ * data, and the data is at least half of it, so a small message doesn't keep a large buffer
+ * allocated.  A new buffer is allocated for the next packet when it is read.
+ * @param data pointer to the data wanted from the last packet
+ * @param len the length of the data
+ * @return the buffer, to be freed by the caller, or NULL if the data must be copied
+ */
+char* SocketBuffer_takeData(char* data, size_t len)
+{
+	char* buf = NULL;
+
+	FUNC_ENTRY;
+	if (def_queue->buf && len > 0 && data >= def_queue->buf && len <= def_queue->buflen &&
+			data <= def_queue->buf + def_queue->buflen - len && len >= def_queue->buflen / 2)
+	{
+		buf = def_queue->buf;
+		def_queue->buf = NULL;
+		def_queue->buflen = 0;
+	}
+	FUNC_EXIT;
+	return buf;
+}
+
+
 /**
  * Queued a Charactor to a specific socket
  * @param socket the socket for which to queue char for
@@ -341,8 +443,8 @@ void SocketBuffer_queueChar(SOCKET socket, char c)
 
 
 /**
- * A socket write was interrupted so store the remaining data
- * @param socket the socket for which the write was interrupted
+ * Add a write to the end of the queue for its socket.  Must be called with writes_mutex locked.
+ * @param socket the socket to be written to
  * @param count the number of iovec buffers
  * @param iovecs buffer array
  * @param frees a set of flags indicating which of the iovecs array should be freed
@@ -350,19 +452,37 @@ void SocketBuffer_queueChar(SOCKET socket, char c)
  * @param bytes actual data length that was written
  */
 #if defined(OPENSSL)
-int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+static int SocketBuffer_addWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
 #else
-int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+static int SocketBuffer_addWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
 #endif
 {
 	int i = 0;
 	pending_writes* pw = NULL;
+	socket_writes* sw = NULL;
+	ListElement* le = NULL;
 	int rc = 0;
 
 	FUNC_ENTRY;
+	if ((le = ListFindItem(&write_queues, &socket, write_queue_socketcompare)) != NULL)
+		sw = (socket_writes*)(le->content);
+	else
+	{
+		if ((sw = malloc(sizeof(socket_writes))) == NULL)
+		{
+			rc = PAHO_MEMORY_ERROR;
+			goto exit;
+		}
+		sw->socket = socket;
+		sw->count = 0;
+		sw->queued = 0;
+		ListAppend(&write_queues, sw, sizeof(socket_writes));
+	}
 	/* store the buffers until the whole packet is written */
 	if ((pw = malloc(sizeof(pending_writes))) == NULL)
 	{
+		if (sw->count == 0)
+			ListRemove(&write_queues, sw);
 		rc = PAHO_MEMORY_ERROR;
 		goto exit;
 	}
@@ -379,12 +499,116 @@ int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* free
 		pw->frees[i] = frees[i];
 	}
 	ListAppend(&writes, pw, sizeof(pw) + total);
+	if (sw->count++ > 0)
+		sw->queued += total;
 exit:
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
 
 
+/**
+ * The number of bytes queued to be written to a socket behind the write in progress.
+ * Must be called with writes_mutex locked.
+ * @param socket the socket
+ * @param in_progress set to whether there is a write in progress for the socket
+ * @return the number of bytes queued
+ */
+static size_t SocketBuffer_queuedWriteBytes(SOCKET socket, int* in_progress)
+{
+	ListElement* le = ListFindItem(&write_queues, &socket, write_queue_socketcompare);
+
+	*in_progress = (le != NULL);
+	return (le) ? ((socket_writes*)(le->content))->queued : 0;
+}
+
+
+/**
+ * A socket write was interrupted so store the remaining data
+ * @param socket the socket for which the write was interrupted
+ * @param count the number of iovec buffers
+ * @param iovecs buffer array
+ * @param frees a set of flags indicating which of the iovecs array should be freed
+ * @param total total data length to be written
+ * @param bytes actual data length that was written
+ */
+#if defined(OPENSSL)
+int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+#else
+int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes)
+#endif
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(writes_mutex);
+#if defined(OPENSSL)
+	rc = SocketBuffer_addWrite(socket, ssl, count, iovecs, frees, total, bytes);
+#else
+	rc = SocketBuffer_addWrite(socket, count, iovecs, frees, total, bytes);
+#endif
+	Paho_thread_unlock_mutex(writes_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Queue a packet to be written to a socket after the write already in progress, if there is one.
+ * @param socket the socket to be written to
+ * @param count the number of iovec buffers
+ * @param iovecs buffer array
+ * @param frees a set of flags indicating which of the iovecs array should be freed
+ * @param total total data length to be written
+ * @return SOCKETBUFFER_INTERRUPTED if the packet was queued, SOCKETBUFFER_COMPLETE if there is no
+ * write in progress so the packet can be written straight away, SOCKET_ERROR if the queue is full
+ */
+#if defined(OPENSSL)
+int SocketBuffer_queueWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total)
+#else
+int SocketBuffer_queueWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total)
+#endif
+{
+	int in_progress = 0;
+	int rc = SOCKETBUFFER_COMPLETE;
+
+	FUNC_ENTRY;
+	Paho_thread_lock_mutex(writes_mutex);
+	if (SocketBuffer_queuedWriteBytes(socket, &in_progress) >= SOCKETBUFFER_WRITE_QUEUE_SIZE)
+		rc = SOCKET_ERROR;
+	else if (in_progress)
+	{
+#if defined(OPENSSL)
+		if ((rc = SocketBuffer_addWrite(socket, ssl, count, iovecs, frees, total, 0)) == 0)
+#else
+		if ((rc = SocketBuffer_addWrite(socket, count, iovecs, frees, total, 0)) == 0)
+#endif
+			rc = SOCKETBUFFER_INTERRUPTED;
+	}
+	Paho_thread_unlock_mutex(writes_mutex);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Indicate whether a socket's write queue is full, so that no more packets can be written
+ * to it until some of those queued have been.
+ * @param socket the socket
+ * @return boolean - true == the queue is full
+ */
+int SocketBuffer_writeQueueFull(SOCKET socket)
+{
+	int in_progress = 0;
+	int rc = 0;
+
+	Paho_thread_lock_mutex(writes_mutex);
+	rc = SocketBuffer_queuedWriteBytes(socket, &in_progress) >= SOCKETBUFFER_WRITE_QUEUE_SIZE;
+	Paho_thread_unlock_mutex(writes_mutex);
+	return rc;
+}
+
+
 /**
  * List callback function for comparing pending_writes by socket
  * @param a first integer value
@@ -398,30 +622,65 @@ int pending_socketcompare(void* a, void* b)
 
 
 /**
- * Get any queued write data for a specific socket
+ * List callback function for comparing socket_writes by socket
+ * @param a first integer value
+ * @param b second integer value
+ * @return boolean indicating whether a and b are equal
+ */
+int write_queue_socketcompare(void* a, void* b)
+{
+	return ((socket_writes*)a)->socket == *(int*)b;
+}
+
+
+/**
+ * Get the write in progress for a specific socket - the first of any queued
  * @param socket the socket to get queued data for
  * @return pointer to the queued data or NULL
  */
 pending_writes* SocketBuffer_getWrite(SOCKET socket)
 {
-	ListElement* le = ListFindItem(&writes, &socket, pending_socketcompare);
+	ListElement* le = NULL;
+
+	Paho_thread_lock_mutex(writes_mutex);
+	le = ListFindItem(&writes, &socket, pending_socketcompare);
+	Paho_thread_unlock_mutex(writes_mutex);
 	return (le) ? (pending_writes*)(le->content) : NULL;
 }
 
 
 /**
- * A socket write has now completed so we can get rid of the queue
+ * The write in progress for a socket has now completed so we can get rid of it.  Any
+ * write queued behind it becomes the one in progress.
  * @param socket the socket for which the operation is now complete
- * @return completion code, boolean - was the queue removed?
+ * @return completion code, boolean - was the write removed?
  */
 int SocketBuffer_writeComplete(SOCKET socket)
 {
-	return ListRemoveItem(&writes, &socket, pending_socketcompare);
+	int rc = 0;
+
+	Paho_thread_lock_mutex(writes_mutex);
+	if ((rc = ListRemoveItem(&writes, &socket, pending_socketcompare)) != 0)
+	{
+		ListElement* le = ListFindItem(&write_queues, &socket, write_queue_socketcompare);
+
+		if (le)
+		{
+			socket_writes* sw = (socket_writes*)(le->content);
+
+			if (--sw->count == 0)
+				ListRemove(&write_queues, sw);
+			else if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
+				sw->queued -= ((pending_writes*)(le->content))->total; /* now in progress */
+		}
+	}
+	Paho_thread_unlock_mutex(writes_mutex);
+	return rc;
 }
 
 
 /**
- * Update the queued write data for a socket in the case of QoS 0 messages.
+ * Update the last queued write data for a socket in the case of QoS 0 messages.
  * @param socket the socket for which the operation is now complete
  * @param topic the topic of the QoS 0 write
  * @param payload the payload of the QoS 0 write
@@ -433,16 +692,289 @@ pending_writes* SocketBuffer_updateWrite(SOCKET socket, char* topic, char* paylo
 	ListElement* le = NULL;
 
 	FUNC_ENTRY;
-	if ((le = ListFindItem(&writes, &socket, pending_socketcompare)) != NULL)
+	Paho_thread_lock_mutex(writes_mutex);
+	while (ListNextElement(&writes, &le))
+	{
+		if (((pending_writes*)(le->content))->socket == socket)
+			pw = (pending_writes*)(le->content); /* the last write queued for the socket */
+	}
+	if (pw)
 	{
-		pw = (pending_writes*)(le->content);
 		if (pw->count == 4)
 		{
 			pw->iovecs[2].iov_base = topic;
 			pw->iovecs[3].iov_base = payload;
 		}
+		else if (pw->count == 2)
+		{
+			/* a publish written along with coalesced packets: only the payload wasn't copied */
+			pw->iovecs[1].iov_base = payload;
+		}
 	}
-
+	Paho_thread_unlock_mutex(writes_mutex);
 	FUNC_EXIT;
 	return pw;
 }
+
+
+/**
+ * List callback function for comparing read ahead buffers by socket
+ * @param a first integer value
+ * @param b second integer value
+ * @return boolean indicating whether a and b are equal
+ */
+int readahead_socketcompare(void* a, void* b)
+{
+	return ((socket_readahead*)a)->socket == *(int*)b;
+}
+
+
+/**
+ * Find the read ahead buffer of a socket
+ * @param socket the socket
+ * @return the read ahead structure, or NULL if the socket has none
+ */
+static socket_readahead* SocketBuffer_findReadAhead(SOCKET socket)
+{
+	socket_readahead* ra = NULL;
+
+	if (SocketBuffer_readAheadIndexed(socket))
+	{
+		if ((int)socket < readahead_index_size)
+			ra = readahead_index[socket];
+	}
+	else if (ListFindItem(&readaheads, &socket, readahead_socketcompare))
+		ra = (socket_readahead*)(readaheads.current->content);
+	return ra;
+}
+
+
+/**
+ * Add a new read ahead structure to the index, or to the list if its socket is too high
+ * @param ra the read ahead structure
+ * @return completion code, 0 for success
+ */
+static int SocketBuffer_addReadAhead(socket_readahead* ra)
+{
+	int rc = PAHO_MEMORY_ERROR;
+
+	if (!SocketBuffer_readAheadIndexed(ra->socket))
+	{
+		if (ListAppend(&readaheads, ra, sizeof(socket_readahead)))
+			rc = 0;
+		goto exit;
+	}
+	if ((int)ra->socket >= readahead_index_size)
+	{
+		int size = (readahead_index_size == 0) ? 64 : readahead_index_size;
+		socket_readahead** index = NULL;
+
+		while (size <= (int)ra->socket)
+			size *= 2;
+		if (readahead_index == NULL)
+			index = malloc(size * sizeof(socket_readahead*));
+		else
+			index = realloc(readahead_index, size * sizeof(socket_readahead*));
+		if (index == NULL)
+			goto exit;
+		memset(&index[readahead_index_size], '\0', (size - readahead_index_size) * sizeof(socket_readahead*));
+		readahead_index = index;
+		readahead_index_size = size;
+	}
+	readahead_index[ra->socket] = ra;
+	readahead_index_count++;
+	rc = 0;
+exit:
+	return rc;
+}
+
+
+/**
+ * Free the read ahead structure and buffer of a socket, if it has one.
+ * The index is freed when there are no read ahead structures left in it.
+ * @param socket the socket
+ */
+static void SocketBuffer_freeReadAhead(SOCKET socket)
+{
+	socket_readahead* ra = NULL;
+
+	if (!SocketBuffer_readAheadIndexed(socket))
+	{
+		if (ListFindItem(&readaheads, &socket, readahead_socketcompare))
+		{
+			free(((socket_readahead*)(readaheads.current->content))->buf);
+			ListRemove(&readaheads, readaheads.current->content);
+		}
+	}
+	else if ((ra = SocketBuffer_findReadAhead(socket)) != NULL)
+	{
+		free(ra->buf);
+		free(ra);
+		readahead_index[socket] = NULL;
+		if (--readahead_index_count == 0)
+		{
+			free(readahead_index);
+			readahead_index = NULL;
+			readahead_index_size = 0;
+		}
+	}
+}
+
+
+/**
+ * Get data already read ahead for a specific socket.  When the data runs out, and the last
+ * read didn't fill the buffer, so the socket had nothing more waiting, the buffer is freed
+ * rather than being kept by an idle connection.
+ * @param socket the socket to get the data for
+ * @param buf the buffer into which the data is copied
+ * @param len the maximum number of bytes to copy
+ * @return the number of bytes copied, 0 if none were available
+ */
+size_t SocketBuffer_getReadAhead(SOCKET socket, char* buf, size_t len)
+{
+	socket_readahead* ra = NULL;
+	size_t count = 0;
+
+	if ((ra = SocketBuffer_findReadAhead(socket)) != NULL && ra->buf)
+	{
+		if ((count = ra->len - ra->pos) > len)
+			count = len;
+		if (count == 1)
+			*buf = ra->buf[ra->pos]; /* the common case of reading the fixed header */
+		else if (count > 0)
+			memcpy(buf, &ra->buf[ra->pos], count);
+		ra->pos += count;
+		if (ra->pos == ra->len && ra->len < SOCKETBUFFER_READAHEAD_SIZE)
+		{
+			free(ra->buf);
+			ra->buf = NULL;
+			ra->pos = ra->len = 0;
+		}
+	}
+	return count;
+}
+
+
+/**
+ * Get the read ahead buffer for a socket, ready to be filled from the network.  Any data in
+ * the buffer must have been consumed first.
+ * @param socket the socket to get the buffer for
+ * @param size the size of the buffer returned
+ * @return the buffer, or NULL if it could not be allocated
+ */
+char* SocketBuffer_getReadAheadBuffer(SOCKET socket, size_t* size)
+{
+	socket_readahead* ra = NULL;
+
+	FUNC_ENTRY;
+	if ((ra = SocketBuffer_findReadAhead(socket)) == NULL)
+	{
+		if ((ra = malloc(sizeof(socket_readahead))) == NULL)
+			goto exit;
+		ra->socket = socket;
+		ra->buf = NULL;
+		if (SocketBuffer_addReadAhead(ra) != 0)
+		{
+			free(ra);
+			ra = NULL;
+			goto exit;
+		}
+	}
+	if (ra->buf == NULL && (ra->buf = malloc(SOCKETBUFFER_READAHEAD_SIZE)) == NULL)
+		goto exit;
+	ra->pos = ra->len = 0;
+	*size = SOCKETBUFFER_READAHEAD_SIZE;
+exit:
+	FUNC_EXIT;
+	return (ra) ? ra->buf : NULL;
+}
+
+
+/**
+ * Data has been read into the read ahead buffer of a socket
+ * @param socket the socket
+ * @param len the number of bytes read into the buffer
+ */
+void SocketBuffer_readAheadFilled(SOCKET socket, size_t len)
+{
+	socket_readahead* ra = NULL;
+
+	if ((ra = SocketBuffer_findReadAhead(socket)) != NULL)
+	{
+		ra->pos = 0;
+		ra->len = len;
+	}
+}
+
+
+/**
+ * Is there unread data in the read ahead buffer of a socket?
+ * @param socket the socket
+ * @return boolean - is there any data?
+ */
+int SocketBuffer_hasReadAhead(SOCKET socket)
+{
+	socket_readahead* ra = SocketBuffer_findReadAhead(socket);
+
+	return ra && ra->pos < ra->len;
+}
+
+
+/**
+ * Add a socket to the list of those with data read ahead, which poll and select won't report
+ * as readable.
+ * @param socket the socket
+ */
+void SocketBuffer_addPendingRead(SOCKET socket)
+{
+	FUNC_ENTRY;
+	if (ListFindItem(&pending_reads, &socket, intcompare) == NULL) /* make sure we don't add the same socket twice */
+	{
+		SOCKET* psock = (SOCKET*)malloc(sizeof(SOCKET));
+		if (psock)
+		{
+			*psock = socket;
+			ListAppend(&pending_reads, psock, sizeof(socket));
+		}
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Get the next socket with data read ahead, removing it from the pending list
+ * @return the socket, or 0 if there is none
+ */
+SOCKET SocketBuffer_getPendingRead(void)
+{
+	SOCKET sock = 0;
+
+	if (pending_reads.count > 0)
+	{
+		sock = *(SOCKET*)(pending_reads.first->content);
+		ListRemoveHead(&pending_reads);
+	}
+	return sock;
+}
+
+
+/**
+ * Remove a socket from the list of those with data read ahead, when its data is
+ * going to be read straight away
+ * @param socket the socket
+ * @return boolean - was the socket in the list?
+ */
+int SocketBuffer_removePendingRead(SOCKET socket)
+{
+	return ListRemoveItem(&pending_reads, &socket, intcompare);
+}
+
+
+/**
+ * Get the number of sockets with data read ahead
+ * @return the number of sockets
+ */
+int SocketBuffer_pendingReads(void)
+{
+	return pending_reads.count;
+}
@@ -41,6 +41,37 @@ typedef struct
 	char* buf;
 } socket_queue;
 
+/**
+ * Size of the buffer into which socket data is read ahead, so that the small reads of the
+ * MQTT fixed header don't each need a system call
+ */
+#if !defined(SOCKETBUFFER_READAHEAD_SIZE)
+#define SOCKETBUFFER_READAHEAD_SIZE 16384
+#endif
+
+typedef struct
+{
+	SOCKET socket;
+	size_t len,             /**< length of data in buf */
+		pos;                /**< position of the next byte to be read from buf */
+	char* buf;              /**< SOCKETBUFFER_READAHEAD_SIZE bytes, or NULL once drained */
+} socket_readahead;
+
+/**
+ * Sockets below this have their read ahead buffers found from a table, higher ones by searching
+ */
+#if !defined(SOCKETBUFFER_READAHEAD_INDEX_MAX)
+#define SOCKETBUFFER_READAHEAD_INDEX_MAX 65536
+#endif
+
+/**
+ * Number of bytes of packets which can be queued to be written to a socket behind a write
+ * which is in progress.  A packet is always accepted when nothing is queued, however large.
+ */
+#if !defined(SOCKETBUFFER_WRITE_QUEUE_SIZE)
+#define SOCKETBUFFER_WRITE_QUEUE_SIZE 1048576
+#endif
+
 typedef struct
 {
 	SOCKET socket;
@@ -54,6 +85,13 @@ typedef struct
 	int frees[5];
 } pending_writes;
 
+typedef struct
+{
+	SOCKET socket;
+	int count;              /**< number of writes on the writes list for the socket */
+	size_t queued;          /**< bytes queued behind the write in progress */
+} socket_writes;
+
 #define SOCKETBUFFER_COMPLETE 0
 #if !defined(SOCKET_ERROR)
 	#define SOCKET_ERROR -1
@@ -67,13 +105,29 @@ char* SocketBuffer_getQueuedData(SOCKET socket, size_t bytes, size_t* actual_len
 int SocketBuffer_getQueuedChar(SOCKET socket, char* c);
 void SocketBuffer_interrupted(SOCKET socket, size_t actual_len);
 char* SocketBuffer_complete(SOCKET socket);
+char* SocketBuffer_takeData(char* data, size_t len);
 void SocketBuffer_queueChar(SOCKET socket, char c);
 
+size_t SocketBuffer_getReadAhead(SOCKET socket, char* buf, size_t len);
+char* SocketBuffer_getReadAheadBuffer(SOCKET socket, size_t* size);
+void SocketBuffer_readAheadFilled(SOCKET socket, size_t len);
+int SocketBuffer_hasReadAhead(SOCKET socket);
+void SocketBuffer_addPendingRead(SOCKET socket);
+SOCKET SocketBuffer_getPendingRead(void);
+int SocketBuffer_removePendingRead(SOCKET socket);
+int SocketBuffer_pendingReads(void);
+
 #if defined(OPENSSL)
 int SocketBuffer_pendingWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
 #else
 int SocketBuffer_pendingWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total, size_t bytes);
 #endif
+#if defined(OPENSSL)
+int SocketBuffer_queueWrite(SOCKET socket, SSL* ssl, int count, iobuf* iovecs, int* frees, size_t total);
+#else
+int SocketBuffer_queueWrite(SOCKET socket, int count, iobuf* iovecs, int* frees, size_t total);
+#endif
+int SocketBuffer_writeQueueFull(SOCKET socket);
 pending_writes* SocketBuffer_getWrite(SOCKET socket);
 int SocketBuffer_writeComplete(SOCKET socket);
 pending_writes* SocketBuffer_updateWrite(SOCKET socket, char* topic, char* payload);
@@ -46,6 +46,9 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <limits.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define USE_CLOCKWAIT /* sem_clockwait is available */
+#endif
 #endif
 #include <stdlib.h>
 
@@ -257,16 +260,22 @@ int Thread_wait_sem(sem_type sem, int timeout)
 {
 /* sem_timedwait is the obvious call to use, but seemed not to work on the Viper,
  * so I've used trywait in a loop instead. Ian Craggs 23/7/2010
+ * The trywait loop adds up to 10ms latency to every wait, so it is now only used
+ * when USE_TRYWAIT is defined at build time.
  */
 	int rc = -1;
 #if !defined(_WIN32) && !defined(_WIN64) && !defined(OSX)
-#define USE_TRYWAIT
 #if defined(USE_TRYWAIT)
 	int i = 0;
 	useconds_t interval = 10000; /* 10000 microseconds: 10 milliseconds */
 	int count = (1000 * timeout) / interval; /* how many intervals in timeout period */
 #else
 	struct timespec ts;
+#if defined(USE_CLOCKWAIT)
+	clockid_t clock_id = CLOCK_MONOTONIC;
+#else
+	clockid_t clock_id = CLOCK_REALTIME;
+#endif
 #endif
 #endif
 
@@ -292,14 +301,28 @@ int Thread_wait_sem(sem_type sem, int timeout)
 			usleep(interval); /* microseconds - .1 of a second */
 		}
 	#else
-		/* We have to use CLOCK_REALTIME rather than MONOTONIC for sem_timedwait interval.
-		 * Does this make it susceptible to system clock changes?
-		 * The intervals are small enough, and repeated, that I think it's not an issue.
+		/* sem_clockwait lets us wait against CLOCK_MONOTONIC, so the wait is not affected by
+		 * changes to the system clock.  sem_timedwait only takes a CLOCK_REALTIME deadline.
 		 */
-		if (clock_gettime(CLOCK_REALTIME, &ts) != -1)
+		if (clock_gettime(clock_id, &ts) != -1)
 		{
-			ts.tv_sec += timeout;
-			rc = sem_timedwait(sem, &ts);
+			if (timeout < 0)
+				timeout = 0;
+			ts.tv_sec += timeout / 1000;
+			ts.tv_nsec += (timeout % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+		#if defined(USE_CLOCKWAIT)
+			while ((rc = sem_clockwait(sem, clock_id, &ts)) == -1 && errno == EINTR)
+		#else
+			while ((rc = sem_timedwait(sem, &ts)) == -1 && errno == EINTR)
+		#endif
+				;
+			if (rc == -1)
+				rc = errno; /* ETIMEDOUT if the timeout expired */
 		}
 	#endif
 
@@ -464,7 +487,7 @@ int Thread_wait_cond(cond_type condvar, int timeout_ms)
 	if (cond_timeout.tv_nsec >= 1000000000L)
 	{
 		cond_timeout.tv_sec++;
-		cond_timeout.tv_nsec += (cond_timeout.tv_nsec - 1000000000L);
+		cond_timeout.tv_nsec -= 1000000000L;
 	}
 
 	pthread_mutex_lock(&condvar->mutex);
@@ -0,0 +1,224 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+/**
+ * @file
+ * \brief Timers for time driven processing, such as keepalive and retries.
+ *
+ * Each set of timers is a binary heap ordered by due time, so the timers which are due can
+ * be found without looking at the ones which aren't.  A timer records its position in the
+ * heap, so it can be rescheduled or cancelled without a search.  The timers are not locked,
+ * so a set of timers must only be used with the client library's mutex locked.
+ */
+
+#include "Timers.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+
+#include "Heap.h"
+
+
+static void Timers_place(Timers* timers, Timer* timer, int index);
+static void Timers_up(Timers* timers, int index);
+static void Timers_down(Timers* timers, int index);
+static void Timers_remove(Timers* timers, Timer* timer);
+
+
+/**
+ * Put a timer in a position in the heap
+ * @param timers the set of timers
+ * @param timer the timer
+ * @param index the heap index
+ */
+static void Timers_place(Timers* timers, Timer* timer, int index)
+{
+	FUNC_ENTRY;
+	timers->heap[index] = timer;
+	timer->position = index + 1;
+	FUNC_EXIT;
+}
+
+
+/**
+ * Move a timer up the heap until the one above it is due no later
+ * @param timers the set of timers
+ * @param index the heap index of the timer
+ */
+static void Timers_up(Timers* timers, int index)
+{
+	Timer* timer = timers->heap[index];
+
+	FUNC_ENTRY;
+	while (index > 0)
+	{
+		int parent = (index - 1) / 2;
+
+		if (timers->heap[parent]->due <= timer->due)
+			break;
+		Timers_place(timers, timers->heap[parent], index);
+		index = parent;
+	}
+	Timers_place(timers, timer, index);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Move a timer down the heap until the ones below it are due no earlier
+ * @param timers the set of timers
+ * @param index the heap index of the timer
+ */
+static void Timers_down(Timers* timers, int index)
+{
+	Timer* timer = timers->heap[index];
+
+	FUNC_ENTRY;
+	while (index * 2 + 1 < timers->count)
+	{
+		int child = index * 2 + 1;
+
+		if (child + 1 < timers->count && timers->heap[child + 1]->due < timers->heap[child]->due)
+			++child;
+		if (timer->due <= timers->heap[child]->due)
+			break;
+		Timers_place(timers, timers->heap[child], index);
+		index = child;
+	}
+	Timers_place(timers, timer, index);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Take a scheduled timer out of the heap.  The heap memory is freed when there are no timers left.
+ * @param timers the set of timers
+ * @param timer the timer, which must be scheduled
+ */
+static void Timers_remove(Timers* timers, Timer* timer)
+{
+	int index = timer->position - 1;
+	Timer* last = timers->heap[--timers->count];
+
+	FUNC_ENTRY;
+	timer->position = 0;
+	if (last != timer)
+	{
+		Timers_place(timers, last, index);
+		if (index > 0 && timers->heap[(index - 1) / 2]->due > last->due)
+			Timers_up(timers, index);
+		else
+			Timers_down(timers, index);
+	}
+	if (timers->count == 0)
+	{
+		free(timers->heap);
+		timers->heap = NULL;
+		timers->size = 0;
+	}
+	FUNC_EXIT;
+}
+
+
+/**
+ * Schedule a timer, or reschedule it if it is already scheduled
+ * @param timers the set of timers
+ * @param timer the timer
+ * @param from the time the interval is measured from
+ * @param interval the number of milliseconds after from that the timer is due
+ * @return completion code, 0 or PAHO_MEMORY_ERROR
+ */
+int Timers_schedule(Timers* timers, Timer* timer, START_TIME_TYPE from, ELAPSED_TIME_TYPE interval)
+{
+	DIFF_TIME_TYPE due;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (!timers->started)
+	{
+		timers->epoch = MQTTTime_now();
+		timers->started = 1;
+	}
+	due = MQTTTime_difftime(from, timers->epoch) + (DIFF_TIME_TYPE)interval;
+	if (timer->position == 0)
+	{
+		if (timers->count == timers->size)
+		{
+			int size = (timers->size == 0) ? 16 : timers->size * 2;
+			Timer** heap = (timers->heap == NULL) ? malloc(size * sizeof(Timer*)) : realloc(timers->heap, size * sizeof(Timer*));
+
+			if (heap == NULL)
+			{
+				rc = PAHO_MEMORY_ERROR;
+				goto exit;
+			}
+			timers->heap = heap;
+			timers->size = size;
+		}
+		timer->due = due;
+		Timers_place(timers, timer, timers->count++);
+		Timers_up(timers, timer->position - 1);
+	}
+	else if (due < timer->due)
+	{
+		timer->due = due;
+		Timers_up(timers, timer->position - 1);
+	}
+	else if (due > timer->due)
+	{
+		timer->due = due;
+		Timers_down(timers, timer->position - 1);
+	}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+ * Cancel a timer, if it is scheduled
+ * @param timers the set of timers
+ * @param timer the timer
+ */
+void Timers_cancel(Timers* timers, Timer* timer)
+{
+	FUNC_ENTRY;
+	if (timer->position > 0)
+		Timers_remove(timers, timer);
+	FUNC_EXIT;
+}
+
+
+/**
+ * Take the next timer which was due before a given time out of a set of timers.  A timer
+ * rescheduled with no interval from a later time is not returned again for the same time.
+ * @param timers the set of timers
+ * @param now the time
+ * @return the timer, which is no longer scheduled, or NULL if none are due
+ */
+Timer* Timers_nextDue(Timers* timers, START_TIME_TYPE now)
+{
+	Timer* timer = NULL;
+
+	FUNC_ENTRY;
+	if (timers->count > 0 && timers->heap[0]->due < MQTTTime_difftime(now, timers->epoch))
+	{
+		timer = timers->heap[0];
+		Timers_remove(timers, timer);
+	}
+	FUNC_EXIT;
+	return timer;
+}
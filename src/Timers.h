@@ -0,0 +1,49 @@
+/*******************************************************************************
+ * Copyright (c) 2026 IBM Corp., Ian Craggs and others
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Paho contributors - initial implementation
+ *******************************************************************************/
+
+#if !defined(TIMERS_H)
+#define TIMERS_H
+
+#include "MQTTTime.h"
+
+/**
+ * A timer, held in the structure it is for, which can be scheduled in one set of timers
+ */
+typedef struct
+{
+	DIFF_TIME_TYPE due;  /**< when the timer is due, in milliseconds from the epoch of its timers */
+	int position;        /**< position in the heap of its timers + 1, or 0 if it isn't scheduled */
+	void* context;       /**< the structure the timer is for */
+} Timer;
+
+/**
+ * A set of timers, as a heap ordered by the time they are due, so that the next one due
+ * can be found without looking at the others
+ */
+typedef struct
+{
+	Timer** heap;           /**< the scheduled timers, allocated while there are any */
+	int count;              /**< number of timers scheduled */
+	int size;               /**< number of timers the heap has room for */
+	START_TIME_TYPE epoch;  /**< the time the due times are measured from */
+	int started;            /**< has the epoch been set? */
+} Timers;
+
+int Timers_schedule(Timers* timers, Timer* timer, START_TIME_TYPE from, ELAPSED_TIME_TYPE interval);
+void Timers_cancel(Timers* timers, Timer* timer);
+Timer* Timers_nextDue(Timers* timers, START_TIME_TYPE now);
+
+#endif
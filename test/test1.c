@@ -1168,10 +1168,112 @@ exit:
 	return failures;
 }
 
+
+/*********************************************************************
+
+Test 7: publish buffer
+
+Messages at each QoS are published with MQTTClient_publishBuffer, which takes over the
+payload buffers rather than copying them, and are received intact.
+
+*********************************************************************/
+int test7(struct Options options)
+{
+	char* testname = "test 7";
+	char* test_topic = "C client test7";
+	MQTTClient c;
+	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer;
+	MQTTClient_deliveryToken dt;
+	MQTTClient_message* m = NULL;
+	char* topicName = NULL;
+	char* buffer = NULL;
+	char payload[32];
+	int topicLen;
+	int i, qos, rc;
+
+	fprintf(xml, "<testcase classname=\"test1\" name=\"publish buffer\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 7 - publish buffer");
+
+	rc = MQTTClient_create(&c, options.connection, "publish_buffer_test",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL);
+	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_destroy(&c);
+		goto exit;
+	}
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	if (options.haconnections != NULL)
+	{
+		opts.serverURIs = options.haconnections;
+		opts.serverURIcount = options.hacount;
+	}
+
+	MyLog(LOGA_DEBUG, "Connecting");
+	rc = MQTTClient_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTClient_subscribe(c, test_topic, 2);
+	assert("Good rc from subscribe", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+	for (qos = 0; qos < 3; ++qos)
+	{
+		for (i = 0; i < 10; ++i)
+		{
+			snprintf(payload, sizeof(payload), "buffer message %d %d", qos, i);
+			/* the library takes over the buffer, and frees it */
+			buffer = MQTTClient_malloc(strlen(payload));
+			memcpy(buffer, payload, strlen(payload));
+			rc = MQTTClient_publishBuffer(c, test_topic, (int)strlen(payload), buffer, qos, 0, &dt);
+			assert("Good rc from publishBuffer", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+			if (qos > 0)
+			{
+				rc = MQTTClient_waitForCompletion(c, dt, 5000L);
+				assert("Good rc from waitforCompletion", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+			}
+
+			rc = MQTTClient_receive(c, &topicName, &topicLen, &m, 5000);
+			assert("Good rc from receive", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+			if (topicName)
+			{
+				assert1("Message received intact", m->payloadlen == (int)strlen(payload) &&
+						memcmp(m->payload, payload, m->payloadlen) == 0,
+						"received %.*s", m->payloadlen, (char*)(m->payload));
+				MQTTClient_free(topicName);
+				MQTTClient_freeMessage(&m);
+			}
+		}
+	}
+
+	rc = MQTTClient_unsubscribe(c, test_topic);
+	assert("Unsubscribe successful", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+	rc = MQTTClient_disconnect(c, 0);
+	assert("Disconnect successful", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+	MQTTClient_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test6a};
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test6a, test7};
 	int i;
 
 	xml = fopen("TEST-test1.xml", "w");
@@ -1413,10 +1413,119 @@ exit:
 	return failures;
 }
 
+
+/*********************************************************************
+
+Test 7: publish buffer
+
+Messages at each QoS are published with MQTTClient_publishBuffer5, which takes over the
+payload buffers rather than copying them, and are received intact.
+
+*********************************************************************/
+int test7(struct Options options)
+{
+	char* testname = "test 7";
+	char* test_topic = "C client test7";
+	MQTTClient c;
+	MQTTClient_connectOptions opts = MQTTClient_connectOptions_initializer5;
+	MQTTClient_createOptions createOpts = MQTTClient_createOptions_initializer;
+	MQTTResponse response = MQTTResponse_initializer;
+	MQTTClient_deliveryToken dt;
+	MQTTClient_message* m = NULL;
+	char* topicName = NULL;
+	char* buffer = NULL;
+	char payload[32];
+	int topicLen;
+	int i, qos, rc;
+
+	fprintf(xml, "<testcase classname=\"test15\" name=\"publish buffer\"");
+	global_start_time = start_clock();
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting test 7 - publish buffer");
+
+	createOpts.MQTTVersion = MQTTVERSION_5;
+	rc = MQTTClient_createWithOptions(&c, options.connection, "publish_buffer_test",
+			MQTTCLIENT_PERSISTENCE_DEFAULT, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTCLIENT_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_destroy(&c);
+		goto exit;
+	}
+
+	opts.keepAliveInterval = 20;
+	opts.cleanstart = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	if (options.haconnections != NULL)
+	{
+		opts.serverURIs = options.haconnections;
+		opts.serverURIcount = options.hacount;
+	}
+
+	MyLog(LOGA_DEBUG, "Connecting");
+	response = MQTTClient_connect5(c, &opts, NULL, NULL);
+	assert("Good rc from connect", response.reasonCode == MQTTCLIENT_SUCCESS, "rc was %d", response.reasonCode);
+	MQTTResponse_free(response);
+	if (response.reasonCode != MQTTCLIENT_SUCCESS)
+	{
+		MQTTClient_destroy(&c);
+		goto exit;
+	}
+
+	response = MQTTClient_subscribe5(c, test_topic, 2, NULL, NULL);
+	assert("Good rc from subscribe", response.reasonCode == 2, "rc was %d", response.reasonCode);
+	MQTTResponse_free(response);
+
+	for (qos = 0; qos < 3; ++qos)
+	{
+		for (i = 0; i < 10; ++i)
+		{
+			snprintf(payload, sizeof(payload), "buffer message %d %d", qos, i);
+			/* the library takes over the buffer, and frees it */
+			buffer = MQTTClient_malloc(strlen(payload));
+			memcpy(buffer, payload, strlen(payload));
+			response = MQTTClient_publishBuffer5(c, test_topic, (int)strlen(payload), buffer, qos, 0, NULL, &dt);
+			assert("Good rc from publishBuffer5", response.reasonCode == MQTTCLIENT_SUCCESS, "rc was %d", response.reasonCode);
+			MQTTResponse_free(response);
+
+			if (qos > 0)
+			{
+				rc = MQTTClient_waitForCompletion(c, dt, 5000L);
+				assert("Good rc from waitforCompletion", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+			}
+
+			rc = MQTTClient_receive(c, &topicName, &topicLen, &m, 5000);
+			assert("Good rc from receive", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+			if (topicName)
+			{
+				assert1("Message received intact", m->payloadlen == (int)strlen(payload) &&
+						memcmp(m->payload, payload, m->payloadlen) == 0,
+						"received %.*s", m->payloadlen, (char*)(m->payload));
+				MQTTClient_free(topicName);
+				MQTTClient_freeMessage(&m);
+			}
+		}
+	}
+
+	response = MQTTClient_unsubscribe5(c, test_topic, NULL);
+	assert("Unsubscribe successful", response.reasonCode == MQTTCLIENT_SUCCESS, "rc was %d", response.reasonCode);
+	MQTTResponse_free(response);
+	rc = MQTTClient_disconnect5(c, 0, MQTTREASONCODE_SUCCESS, NULL);
+	assert("Disconnect successful", rc == MQTTCLIENT_SUCCESS, "rc was %d", rc);
+
+	MQTTClient_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test6a};
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test6a, test7};
 	int i;
 
 	xml = fopen("TEST-test1.xml", "w");
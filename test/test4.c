@@ -1743,6 +1743,1260 @@ exit:
 
 
 
+/*********************************************************************
+
+Test9: Burst of messages processed with maxPacketsPerRead
+
+*********************************************************************/
+
+char* test9_topic = "C client test9";
+int test9_subscribed = 0;
+int test9_messageCount = 0;
+int test9_outOfOrder = 0;
+int test9_drained = 0;
+
+void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message);
+
+/* counts the packets processed straight from the read ahead buffer, without polling */
+void test9_traceCallback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
+{
+	if (strstr(message, "next packet already read") != NULL)
+		++test9_drained;
+}
+
+int test9_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char expected[32];
+
+	snprintf(expected, sizeof(expected), "burst message %d", test9_messageCount);
+	if (message->payloadlen != (int)strlen(expected) || memcmp(message->payload, expected, message->payloadlen) != 0)
+		++test9_outOfOrder;
+	test9_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test9_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test9_subscribed = 1;
+}
+
+
+void test9_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test9_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test9_topic, 1, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+void test9_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In onDisconnect callback %p", context);
+	test_finished = 1;
+}
+
+
+int test9(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	START_TIME_TYPE start;
+	int rc = 0, i;
+	int msg_count = 100;
+
+	MyLog(LOGA_INFO, "Starting test 9 - burst of messages with maxPacketsPerRead");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"burst of messages with maxPacketsPerRead\"");
+	global_start_time = start_clock();
+	test_finished = test9_subscribed = test9_messageCount = test9_outOfOrder = test9_drained = 0;
+	MQTTAsync_setTraceCallback(test9_traceCallback);
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_MAXIMUM);
+
+	createOpts.maxPacketsPerRead = 20;
+	createOpts.MQTTVersion = options.MQTTVersion;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, "async_test9",
+			MQTTCLIENT_PERSISTENCE_NONE, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test9_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test9_onConnect;
+	opts.context = c;
+
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	start = start_clock();
+	while (!test9_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test9_subscribed, "test9_subscribed was %d", test9_subscribed);
+
+	for (i = 0; i < msg_count; ++i)
+	{
+		char payload[32];
+
+		snprintf(payload, sizeof(payload), "burst message %d", i);
+		rc = MQTTAsync_send(c, test9_topic, (int)strlen(payload), payload, 1, 0, NULL);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	start = start_clock();
+	while (test9_messageCount < msg_count && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received", test9_messageCount == msg_count,
+			"test9_messageCount was %d", test9_messageCount);
+	assert("Messages received in order", test9_outOfOrder == 0,
+			"test9_outOfOrder was %d", test9_outOfOrder);
+	assert("Packets already read were processed without polling", test9_drained > 0,
+			"test9_drained was %d", test9_drained);
+
+	test_finished = 0;
+	dopts.onSuccess = test9_onDisconnect;
+	dopts.context = c;
+	rc = MQTTAsync_disconnect(c, &dopts);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+	MQTTAsync_destroy(&c);
+
+exit:
+	MQTTAsync_setTraceLevel(MQTTASYNC_TRACE_ERROR);
+	MQTTAsync_setTraceCallback(trace_callback);
+	MyLog(LOGA_INFO, "TEST9: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+
+/*********************************************************************
+
+Test10: messageArrived called on callback threads doesn't block other clients
+
+*********************************************************************/
+
+char* test10_topic = "C client test10";
+int test10_subscribed = 0;
+int test10a_messageCount = 0;
+int test10a_outOfOrder = 0;
+int test10b_messageCount = 0;
+volatile int test10_release = 0;
+
+int test10a_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char expected[32];
+	START_TIME_TYPE start = start_clock();
+
+	/* hold on to the first message until client b has received them all */
+	while (test10a_messageCount == 0 && !test10_release && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+
+	snprintf(expected, sizeof(expected), "callback message %d", test10a_messageCount);
+	if (message->payloadlen != (int)strlen(expected) || memcmp(message->payload, expected, message->payloadlen) != 0)
+		++test10a_outOfOrder;
+	test10a_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+int test10b_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	test10b_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test10_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test10_subscribed++;
+}
+
+
+void test10_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test10_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test10_topic, 1, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test10(struct Options options)
+{
+	MQTTAsync a, b;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	START_TIME_TYPE start;
+	int rc = 0, i;
+	int msg_count = 20;
+
+	MyLog(LOGA_INFO, "Starting test 10 - messageArrived on callback threads");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"messageArrived on callback threads\"");
+	global_start_time = start_clock();
+	test_finished = test10_subscribed = test10_release = 0;
+	test10a_messageCount = test10a_outOfOrder = test10b_messageCount = 0;
+
+	createOpts.callbackThreads = 2;
+	createOpts.MQTTVersion = options.MQTTVersion;
+	rc = MQTTAsync_createWithOptions(&a, options.connection, "async_test10_a",
+			MQTTCLIENT_PERSISTENCE_NONE, NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&a);
+		goto exit;
+	}
+
+	rc = MQTTAsync_create(&b, options.connection, "async_test10_b", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&a);
+		MQTTAsync_destroy(&b);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(a, a, NULL, test10a_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	rc = MQTTAsync_setCallbacks(b, b, NULL, test10b_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test10_onConnect;
+
+	opts.context = a;
+	rc = MQTTAsync_connect(a, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	opts.context = b;
+	rc = MQTTAsync_connect(b, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (test10_subscribed < 2 && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Both clients subscribed", test10_subscribed == 2, "test10_subscribed was %d", test10_subscribed);
+
+	for (i = 0; i < msg_count; ++i)
+	{
+		char payload[32];
+
+		snprintf(payload, sizeof(payload), "callback message %d", i);
+		rc = MQTTAsync_send(b, test10_topic, (int)strlen(payload), payload, 1, 0, NULL);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	/* client a's callback is blocked, but client b must still get its messages */
+	start = start_clock();
+	while (test10b_messageCount < msg_count && elapsed(start) < 5000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received by client b", test10b_messageCount == msg_count,
+			"test10b_messageCount was %d", test10b_messageCount);
+	assert("No messages delivered to client a yet", test10a_messageCount == 0,
+			"test10a_messageCount was %d", test10a_messageCount);
+
+	test10_release = 1;
+	start = start_clock();
+	while (test10a_messageCount < msg_count && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received by client a", test10a_messageCount == msg_count,
+			"test10a_messageCount was %d", test10a_messageCount);
+	assert("Messages received in order", test10a_outOfOrder == 0,
+			"test10a_outOfOrder was %d", test10a_outOfOrder);
+
+	rc = MQTTAsync_disconnect(a, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	rc = MQTTAsync_disconnect(b, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	#if defined(_WIN32)
+		Sleep(200);
+	#else
+		usleep(200000L);
+	#endif
+	MQTTAsync_destroy(&a);
+	MQTTAsync_destroy(&b);
+
+exit:
+	MyLog(LOGA_INFO, "TEST10: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test11: publish a batch of messages with MQTTAsync_sendMany
+
+*********************************************************************/
+
+char* test11_topic = "C client test11";
+int test11_subscribed = 0;
+int test11_messageCount = 0;
+int test11_outOfOrder = 0;
+int test11_published = 0;
+
+int test11_lastIndex[3] = {-1, -1, -1};
+
+int test11_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char payload[32];
+	int index = -1;
+
+	/* messages are only ordered within a QoS: QoS 2 ones are delivered when the PUBREL arrives */
+	snprintf(payload, sizeof(payload), "%.*s", message->payloadlen, (char*)message->payload);
+	if (sscanf(payload, "batch message %d", &index) != 1 || message->qos < 0 || message->qos > 2 ||
+			index % 3 != message->qos || index <= test11_lastIndex[message->qos])
+		++test11_outOfOrder;
+	else
+		test11_lastIndex[message->qos] = index;
+	test11_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test11_onPublish(void* context, MQTTAsync_successData* response)
+{
+	test11_published++;
+}
+
+
+void test11_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test11_subscribed = 1;
+}
+
+
+void test11_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test11_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test11_topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test11(struct Options options)
+{
+	#define TEST11_MSG_COUNT 100
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_message msgs[TEST11_MSG_COUNT];
+	MQTTAsync_responseOptions responses[TEST11_MSG_COUNT];
+	char* topics[TEST11_MSG_COUNT];
+	char payloads[TEST11_MSG_COUNT][32];
+	START_TIME_TYPE start;
+	int rc = 0, i, j;
+	int duplicate_tokens = 0;
+
+	MyLog(LOGA_INFO, "Starting test 11 - publish a batch of messages");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"publish a batch of messages\"");
+	global_start_time = start_clock();
+	test_finished = test11_subscribed = test11_messageCount = test11_outOfOrder = test11_published = 0;
+	test11_lastIndex[0] = test11_lastIndex[1] = test11_lastIndex[2] = -1;
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test11", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test11_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test11_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test11_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test11_subscribed == 1, "test11_subscribed was %d", test11_subscribed);
+
+	for (i = 0; i < TEST11_MSG_COUNT; ++i)
+	{
+		MQTTAsync_message msg = MQTTAsync_message_initializer;
+		MQTTAsync_responseOptions response = MQTTAsync_responseOptions_initializer;
+
+		snprintf(payloads[i], sizeof(payloads[i]), "batch message %d", i);
+		msg.payload = payloads[i];
+		msg.payloadlen = (int)strlen(payloads[i]);
+		msg.qos = i % 3;
+		msgs[i] = msg;
+		response.onSuccess = test11_onPublish;
+		response.context = c;
+		responses[i] = response;
+		topics[i] = test11_topic;
+	}
+
+	/* a batch with one bad message is rejected as a whole */
+	msgs[TEST11_MSG_COUNT / 2].qos = 3;
+	rc = MQTTAsync_sendMany(c, TEST11_MSG_COUNT, topics, msgs, responses);
+	assert("Bad qos rc from sendMany", rc == MQTTASYNC_BAD_QOS, "rc was %d", rc);
+	msgs[TEST11_MSG_COUNT / 2].qos = (TEST11_MSG_COUNT / 2) % 3;
+
+	rc = MQTTAsync_sendMany(c, TEST11_MSG_COUNT, topics, msgs, responses);
+	assert("Good rc from sendMany", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	for (i = 0; i < TEST11_MSG_COUNT; ++i)
+	{
+		if (msgs[i].qos == 0)
+			continue;
+		for (j = i + 1; j < TEST11_MSG_COUNT; ++j)
+			if (msgs[j].qos > 0 && responses[j].token == responses[i].token)
+				++duplicate_tokens;
+	}
+	assert("Tokens are unique", duplicate_tokens == 0, "duplicate_tokens was %d", duplicate_tokens);
+
+	start = start_clock();
+	while ((test11_messageCount < TEST11_MSG_COUNT || test11_published < TEST11_MSG_COUNT) && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received", test11_messageCount == TEST11_MSG_COUNT,
+			"test11_messageCount was %d", test11_messageCount);
+	assert("Messages received in order", test11_outOfOrder == 0,
+			"test11_outOfOrder was %d", test11_outOfOrder);
+	assert("All messages published", test11_published == TEST11_MSG_COUNT,
+			"test11_published was %d", test11_published);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	#if defined(_WIN32)
+		Sleep(200);
+	#else
+		usleep(200000L);
+	#endif
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST11: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test12: small messages published behind a large one, which is only partly
+written at first, are queued and delivered in order
+
+*********************************************************************/
+
+char* test12_topic = "C client test12";
+int test12_subscribed = 0;
+int test12_messageCount = 0;
+int test12_outOfOrder = 0;
+int test12_badLargeMessage = 0;
+int test12_published = 0;
+
+#define TEST12_LARGE_MSG_SIZE (8 * 1024 * 1024)
+#define TEST12_MSG_COUNT 50
+
+int test12_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char payload[32];
+	int index = -1;
+
+	if (test12_messageCount == 0)
+	{
+		int i;
+
+		/* the large message is first, as all the messages are published at the same QoS */
+		if (message->payloadlen != TEST12_LARGE_MSG_SIZE)
+			++test12_badLargeMessage;
+		else
+		{
+			for (i = 0; i < message->payloadlen; ++i)
+			{
+				if (((char*)message->payload)[i] != (char)(i % 251))
+				{
+					++test12_badLargeMessage;
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		snprintf(payload, sizeof(payload), "%.*s", message->payloadlen < 32 ? message->payloadlen : 31,
+				(char*)message->payload);
+		if (sscanf(payload, "small message %d", &index) != 1 || index != test12_messageCount)
+			++test12_outOfOrder;
+	}
+	test12_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test12_onPublish(void* context, MQTTAsync_successData* response)
+{
+	test12_published++;
+}
+
+
+void test12_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test12_subscribed = 1;
+}
+
+
+void test12_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test12_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test12_topic, 1, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test12(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_responseOptions response = MQTTAsync_responseOptions_initializer;
+	char* large_payload = NULL;
+	START_TIME_TYPE start;
+	int rc = 0, i;
+
+	MyLog(LOGA_INFO, "Starting test 12 - small messages queued behind a large one");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"small messages queued behind a large one\"");
+	global_start_time = start_clock();
+	test_finished = test12_subscribed = test12_messageCount = test12_outOfOrder = 0;
+	test12_badLargeMessage = test12_published = 0;
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test12", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test12_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test12_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test12_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test12_subscribed == 1, "test12_subscribed was %d", test12_subscribed);
+
+	large_payload = malloc(TEST12_LARGE_MSG_SIZE);
+	for (i = 0; i < TEST12_LARGE_MSG_SIZE; ++i)
+		large_payload[i] = (char)(i % 251);
+	response.onSuccess = test12_onPublish;
+	response.context = c;
+	rc = MQTTAsync_send(c, test12_topic, TEST12_LARGE_MSG_SIZE, large_payload, 1, 0, &response);
+	assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	for (i = 1; i < TEST12_MSG_COUNT; ++i)
+	{
+		char payload[32];
+
+		snprintf(payload, sizeof(payload), "small message %d", i);
+		rc = MQTTAsync_send(c, test12_topic, (int)strlen(payload), payload, 1, 0, &response);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	start = start_clock();
+	while ((test12_messageCount < TEST12_MSG_COUNT || test12_published < TEST12_MSG_COUNT) && elapsed(start) < 30000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received", test12_messageCount == TEST12_MSG_COUNT,
+			"test12_messageCount was %d", test12_messageCount);
+	assert("Large message received intact", test12_badLargeMessage == 0,
+			"test12_badLargeMessage was %d", test12_badLargeMessage);
+	assert("Messages received in order", test12_outOfOrder == 0,
+			"test12_outOfOrder was %d", test12_outOfOrder);
+	assert("All messages published", test12_published == TEST12_MSG_COUNT,
+			"test12_published was %d", test12_published);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	#if defined(_WIN32)
+		Sleep(200);
+	#else
+		usleep(200000L);
+	#endif
+	MQTTAsync_destroy(&c);
+	free(large_payload);
+
+exit:
+	MyLog(LOGA_INFO, "TEST12: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test13: zero copy receive
+
+Large and small messages, at each QoS, are received with zeroCopyReceive set.  Some of the
+messages are kept until all have arrived, to check that their payloads are not overwritten
+by later packets.
+
+*********************************************************************/
+char* test13_topic = "C client test13";
+int test13_subscribed = 0;
+int test13_messageCount = 0;
+int test13_badMessages = 0;
+
+#define TEST13_LARGE_MSG_SIZE (256 * 1024)
+#define TEST13_MSG_COUNT 12
+
+MQTTAsync_message* test13_kept[TEST13_MSG_COUNT];
+
+/* the payload of message index is index * 2 bytes long if small, with byte i set to (i + index) % 251 */
+int test13_payloadlen(int index)
+{
+	return (index % 2) ? index * 2 : TEST13_LARGE_MSG_SIZE;
+}
+
+
+int test13_checkPayload(MQTTAsync_message* message, int index)
+{
+	int i;
+
+	if (message->payloadlen != test13_payloadlen(index))
+		return 0;
+	for (i = 0; i < message->payloadlen; ++i)
+	{
+		if (((char*)message->payload)[i] != (char)((i + index) % 251))
+			return 0;
+	}
+	return 1;
+}
+
+
+int test13_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	int index = test13_messageCount++;
+
+	if (index >= TEST13_MSG_COUNT || !test13_checkPayload(message, index))
+		++test13_badMessages;
+	if (index < TEST13_MSG_COUNT && index % 4 == 0)
+		test13_kept[index] = message; /* checked and freed when all the messages have arrived */
+	else
+		MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test13_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test13_subscribed = 1;
+}
+
+
+void test13_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test13_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test13_topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test13(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer;
+	char* payload = NULL;
+	START_TIME_TYPE start;
+	int rc = 0, i, j;
+
+	MyLog(LOGA_INFO, "Starting test 13 - zero copy receive");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"zero copy receive\"");
+	global_start_time = start_clock();
+	test_finished = test13_subscribed = test13_messageCount = test13_badMessages = 0;
+	memset(test13_kept, '\0', sizeof(test13_kept));
+
+	createOpts.zeroCopyReceive = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, "async_test13", MQTTCLIENT_PERSISTENCE_NONE,
+			NULL, &createOpts);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test13_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test13_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test13_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test13_subscribed == 1, "test13_subscribed was %d", test13_subscribed);
+
+	payload = malloc(TEST13_LARGE_MSG_SIZE);
+	for (i = 0; i < TEST13_MSG_COUNT; ++i)
+	{
+		int qos = i % 3;
+
+		for (j = 0; j < test13_payloadlen(i); ++j)
+			payload[j] = (char)((j + i) % 251);
+		rc = MQTTAsync_send(c, test13_topic, test13_payloadlen(i), payload, qos, 0, NULL);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+		/* wait for each message, so that they arrive in order whatever their QoS */
+		start = start_clock();
+		while (test13_messageCount <= i && elapsed(start) < 10000)
+			#if defined(_WIN32)
+				Sleep(100);
+			#else
+				usleep(10000L);
+			#endif
+	}
+	assert("All messages received", test13_messageCount == TEST13_MSG_COUNT,
+			"test13_messageCount was %d", test13_messageCount);
+	assert("Messages received intact", test13_badMessages == 0,
+			"test13_badMessages was %d", test13_badMessages);
+
+	for (i = 0; i < TEST13_MSG_COUNT; ++i)
+	{
+		if (test13_kept[i] == NULL)
+			continue;
+		assert("Kept message intact", test13_checkPayload(test13_kept[i], i),
+				"message %d was overwritten", i);
+		MQTTAsync_freeMessage(&test13_kept[i]);
+	}
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	#if defined(_WIN32)
+		Sleep(200);
+	#else
+		usleep(200000L);
+	#endif
+	MQTTAsync_destroy(&c);
+	free(payload);
+
+exit:
+	MyLog(LOGA_INFO, "TEST13: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test14: send buffer
+
+Messages at each QoS are published with MQTTAsync_sendBuffer, which takes over the payload
+buffers rather than copying them, and are received intact.  A buffer passed with a bad QoS
+is freed by the library too.
+
+*********************************************************************/
+char* test14_topic = "C client test14";
+int test14_subscribed = 0;
+int test14_messageCount = 0;
+int test14_badMessages = 0;
+int test14_published = 0;
+
+#define TEST14_MSG_COUNT 30
+
+int test14_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char payload[32];
+
+	snprintf(payload, sizeof(payload), "buffer message %d", test14_messageCount);
+	if (message->payloadlen != (int)strlen(payload) || memcmp(message->payload, payload, message->payloadlen) != 0)
+		++test14_badMessages;
+	test14_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test14_onPublish(void* context, MQTTAsync_successData* response)
+{
+	test14_published++;
+}
+
+
+void test14_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test14_subscribed = 1;
+}
+
+
+void test14_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test14_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test14_topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test14(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_responseOptions response = MQTTAsync_responseOptions_initializer;
+	char* buffer = NULL;
+	START_TIME_TYPE start;
+	int rc = 0, i;
+
+	MyLog(LOGA_INFO, "Starting test 14 - send buffer");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"send buffer\"");
+	global_start_time = start_clock();
+	test_finished = test14_subscribed = test14_messageCount = test14_badMessages = test14_published = 0;
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test14", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test14_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test14_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test14_subscribed == 1, "test14_subscribed was %d", test14_subscribed);
+
+	buffer = MQTTAsync_malloc(32);
+	rc = MQTTAsync_sendBuffer(c, test14_topic, 32, buffer, 3, 0, NULL);
+	assert("Bad QoS rc from sendBuffer", rc == MQTTASYNC_BAD_QOS, "rc was %d", rc);
+
+	response.onSuccess = test14_onPublish;
+	response.context = c;
+	for (i = 0; i < TEST14_MSG_COUNT; ++i)
+	{
+		buffer = MQTTAsync_malloc(32);
+		snprintf(buffer, 32, "buffer message %d", i);
+		/* one QoS at a time, so that the messages arrive in order */
+		rc = MQTTAsync_sendBuffer(c, test14_topic, (int)strlen(buffer), buffer, i * 3 / TEST14_MSG_COUNT, 0, &response);
+		assert("Good rc from sendBuffer", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	start = start_clock();
+	while ((test14_messageCount < TEST14_MSG_COUNT || test14_published < TEST14_MSG_COUNT) && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received", test14_messageCount == TEST14_MSG_COUNT,
+			"test14_messageCount was %d", test14_messageCount);
+	assert("Messages received intact", test14_badMessages == 0,
+			"test14_badMessages was %d", test14_badMessages);
+	assert("All messages published", test14_published == TEST14_MSG_COUNT,
+			"test14_published was %d", test14_published);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	#if defined(_WIN32)
+		Sleep(200);
+	#else
+		usleep(200000L);
+	#endif
+	MQTTAsync_destroy(&c);
+
+exit:
+	MyLog(LOGA_INFO, "TEST14: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test15: coalesced QoS 0 publishes
+
+Many QoS 0 messages are published in a burst, so that the send thread coalesces their
+packets.  Each publish completes once, in order, with its payload still intact, after its
+packet has been written.  Publishes still outstanding when the client disconnects straight
+afterwards complete once too, whether they succeed or fail.
+
+*********************************************************************/
+char* test15_topic = "C client test15";
+int test15_subscribed = 0;
+int test15_messageCount = 0;
+int test15_outOfOrder = 0;
+int test15_lastIndex = -1;
+int test15_disconnected = 0;
+
+#define TEST15_MSG_COUNT 1000
+
+int test15_completions[2 * TEST15_MSG_COUNT];
+int test15_succeeded = 0;
+int test15_failed = 0;
+int test15_badCompletions = 0;
+int test15_lastCompleted = -1;
+
+int test15_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	char payload[32];
+	int index = -1;
+
+	snprintf(payload, sizeof(payload), "%.*s", message->payloadlen, (char*)message->payload);
+	if (sscanf(payload, "coalesced message %d", &index) != 1 || index <= test15_lastIndex)
+		++test15_outOfOrder;
+	else
+		test15_lastIndex = index;
+	test15_messageCount++;
+
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+	return 1;
+}
+
+
+void test15_onPublish(void* context, MQTTAsync_successData* response)
+{
+	int index = (int)((int*)context - test15_completions);
+	char payload[32];
+
+	snprintf(payload, sizeof(payload), "coalesced message %d", index);
+	if (++test15_completions[index] > 1 || index <= test15_lastCompleted ||
+			response->alt.pub.message.payloadlen != (int)strlen(payload) ||
+			memcmp(response->alt.pub.message.payload, payload, strlen(payload)) != 0)
+		++test15_badCompletions;
+	test15_lastCompleted = index;
+	test15_succeeded++;
+}
+
+
+void test15_onPublishFailure(void* context, MQTTAsync_failureData* response)
+{
+	int index = (int)((int*)context - test15_completions);
+
+	if (++test15_completions[index] > 1)
+		++test15_badCompletions;
+	test15_failed++;
+}
+
+
+void test15_onSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback %p", context);
+	test15_subscribed = 1;
+}
+
+
+void test15_onDisconnect(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In disconnect onSuccess callback %p", context);
+	test15_disconnected = 1;
+}
+
+
+void test15_onConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback, context %p", context);
+	opts.onSuccess = test15_onSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test15_topic, 0, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		test_finished = 1;
+}
+
+
+int test15_publish(MQTTAsync c, int index)
+{
+	MQTTAsync_responseOptions response = MQTTAsync_responseOptions_initializer;
+	char payload[32];
+
+	snprintf(payload, sizeof(payload), "coalesced message %d", index);
+	response.onSuccess = test15_onPublish;
+	response.onFailure = test15_onPublishFailure;
+	response.context = &test15_completions[index];
+	return MQTTAsync_send(c, test15_topic, (int)strlen(payload), payload, 0, 0, &response);
+}
+
+
+int test15(struct Options options)
+{
+	MQTTAsync c;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_disconnectOptions dopts = MQTTAsync_disconnectOptions_initializer;
+	START_TIME_TYPE start;
+	int rc = 0, i;
+
+	MyLog(LOGA_INFO, "Starting test 15 - coalesced QoS 0 publishes");
+	fprintf(xml, "<testcase classname=\"test4\" name=\"coalesced QoS 0 publishes\"");
+	global_start_time = start_clock();
+	test_finished = test15_subscribed = test15_messageCount = test15_outOfOrder = test15_disconnected = 0;
+	test15_succeeded = test15_failed = test15_badCompletions = 0;
+	test15_lastIndex = test15_lastCompleted = -1;
+	memset(test15_completions, '\0', sizeof(test15_completions));
+
+	rc = MQTTAsync_create(&c, options.connection, "async_test15", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create",  rc == MQTTASYNC_SUCCESS, "rc was %d\n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(c, c, NULL, test15_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.keepAliveInterval = 20;
+	opts.cleansession = 1;
+	opts.MQTTVersion = options.MQTTVersion;
+	opts.onSuccess = test15_onConnect;
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test15_subscribed && !test_finished && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("Subscribed", test15_subscribed == 1, "test15_subscribed was %d", test15_subscribed);
+
+	for (i = 0; i < TEST15_MSG_COUNT; ++i)
+	{
+		rc = test15_publish(c, i);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+
+	start = start_clock();
+	while ((test15_messageCount < TEST15_MSG_COUNT || test15_succeeded < TEST15_MSG_COUNT) && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	assert("All messages received", test15_messageCount == TEST15_MSG_COUNT,
+			"test15_messageCount was %d", test15_messageCount);
+	assert("Messages received in order", test15_outOfOrder == 0,
+			"test15_outOfOrder was %d", test15_outOfOrder);
+	assert1("All publishes succeeded", test15_succeeded == TEST15_MSG_COUNT && test15_failed == 0,
+			"test15_succeeded was %d, test15_failed was %d", test15_succeeded, test15_failed);
+	assert("Publishes completed once, in order, with their payloads", test15_badCompletions == 0,
+			"test15_badCompletions was %d", test15_badCompletions);
+
+	/* disconnect with publishes outstanding */
+	for (i = TEST15_MSG_COUNT; i < 2 * TEST15_MSG_COUNT; ++i)
+	{
+		rc = test15_publish(c, i);
+		assert("Good rc from send", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+	dopts.timeout = 0;
+	dopts.onSuccess = test15_onDisconnect;
+	dopts.context = c;
+	rc = MQTTAsync_disconnect(c, &dopts);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	start = start_clock();
+	while (!test15_disconnected && elapsed(start) < 10000)
+		#if defined(_WIN32)
+			Sleep(100);
+		#else
+			usleep(10000L);
+		#endif
+	MQTTAsync_destroy(&c);
+
+	assert1("All publishes completed", test15_succeeded + test15_failed == 2 * TEST15_MSG_COUNT,
+			"test15_succeeded was %d, test15_failed was %d", test15_succeeded, test15_failed);
+	assert("Publishes completed once, in order, with their payloads", test15_badCompletions == 0,
+			"test15_badCompletions was %d", test15_badCompletions);
+
+exit:
+	MyLog(LOGA_INFO, "TEST15: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
 void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 {
 	printf("Trace : %d, %s\n", level, message);
@@ -1754,7 +3008,7 @@ void trace_callback(enum MQTTASYNC_TRACE_LEVELS level, char* message)
 int main(int argc, char** argv)
 {
 	int rc = 0;
- 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test7, test8}; /* indexed starting from 1 */
+ 	int (*tests[])() = {NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14, test15}; /* indexed starting from 1 */
 	MQTTAsync_nameValue* info;
 	int i;
 
@@ -2686,11 +2686,1275 @@ exit:
 }
 
 
+/*********************************************************************
+
+Test11: a disconnected client with a deep buffer of messages doesn't hold up
+        the commands of other clients
+
+*********************************************************************/
+int test11_messages_received = 0;
+int test11MessageSeqno = 0;
+int test11OnFailureCalled = 0;
+int test11dConnected = 0;
+int test11dSubscribed = 0;
+int test11BufferedMessages = 1000;
+int test11MessagesToSend = 100;
+
+int test11_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	int sequence_no = atoi(message->payload);
+
+	test11_messages_received++;
+
+	assert("Expected message sequence no", test11MessageSeqno == sequence_no, "sequence_no was %d\n", sequence_no);
+
+	test11MessageSeqno++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+
+	return 1;
+}
+
+void test11donSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback for client d, %p granted qos %d", c, response->alt.qos);
+	test11dSubscribed = 1;
+}
+
+void test11dOnConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync c = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback for client d, context %p\n", context);
+	test11dConnected = 1;
+
+	opts.onSuccess = test11donSubscribe;
+	opts.context = c;
+
+	rc = MQTTAsync_subscribe(c, test_topic, 1, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+}
+
+void test11OnFailure(void* context, MQTTAsync_failureData* response)
+{
+	MyLog(LOGA_DEBUG, "In connect onFailure callback, context %p", context);
+
+	test11OnFailureCalled++;
+}
+
+
+int test11(struct Options options)
+{
+	char* testname = "test11";
+	MQTTAsync c, d;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	MQTTAsync_token *tokens = NULL;
+	int rc = 0;
+	int count = 0;
+	char clientidc[70];
+	char clientidd[70];
+	int i = 0;
+
+	sprintf(clientidc, "paho-test9-11-c-%s", unique);
+	sprintf(clientidd, "paho-test9-11-d-%s", unique);
+	sprintf(test_topic, "paho-test9-11-test topic %s", unique);
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 11 - buffered messages for one client don't delay others");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.maxBufferedMessages = test11BufferedMessages;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_NONE,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	/* client c is never connected, so all these messages stay queued */
+	for (i = 0; i < test11BufferedMessages; ++i)
+	{
+		char buf[50];
+
+		MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+		pubmsg.qos = 1;
+		sprintf(buf, "%d buffered message", i);
+		pubmsg.payload = buf;
+		pubmsg.payloadlen = (int)(strlen(pubmsg.payload) + 1);
+		rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	}
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		MQTTAsync_destroy(&d);
+		goto exit;
+	}
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test11_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test11dOnConnect;
+	opts.onFailure = test11OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit_destroy;
+
+	while (!test11dSubscribed && test11OnFailureCalled == 0 && ++count < 100)
+		MySleep(100);
+	assert("Client d should have subscribed", test11dSubscribed == 1, "test11dSubscribed was %d", test11dSubscribed);
+
+	for (i = 0; i < test11MessagesToSend; ++i)
+	{
+		char buf[50];
+
+		MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+		pubmsg.qos = 1;
+		sprintf(buf, "%d message no", i);
+		pubmsg.payload = buf;
+		pubmsg.payloadlen = (int)(strlen(pubmsg.payload) + 1);
+		rc = MQTTAsync_sendMessage(d, test_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	}
+
+	count = 0;
+	while (test11_messages_received < test11MessagesToSend && ++count < 100)
+		MySleep(100);
+	assert("All messages received", test11_messages_received == test11MessagesToSend,
+			"received %d messages", test11_messages_received);
+
+	waitForNoPendingTokens(d);
+
+	/* the messages for c must still all be there */
+	rc = MQTTAsync_getPendingTokens(c, &tokens);
+	assert("Good rc from getPendingTokens", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	i = 0;
+	if (tokens)
+	{
+		while (tokens[i] != -1)
+			++i;
+		MQTTAsync_free(tokens);
+	}
+	assert("All messages buffered for client c", i == test11BufferedMessages, "i was %d\n", i);
+
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit_destroy:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test12: message ids held by buffered commands
+
+1. Create a client which is never connected
+2. Buffer QoS 1 messages until all the message ids are held
+3. Check that all the message ids are different
+4. Check that another QoS 1 message is refused, but a QoS 0 one isn't
+
+*********************************************************************/
+
+int test12(struct Options options)
+{
+	char* testname = "test12";
+	MQTTAsync c;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	MQTTAsync_token *tokens = NULL;
+	char* used = NULL;
+	int rc = 0;
+	int i = 0;
+	int duplicates = 0;
+	char clientidc[70];
+
+	sprintf(clientidc, "paho-test9-12-c-%s", unique);
+	sprintf(test_topic, "paho-test9-12-test topic %s", unique);
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 12 - message ids held by buffered commands");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.maxBufferedMessages = 70000;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_NONE,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	pubmsg.qos = 1;
+	pubmsg.payload = "a buffered message";
+	pubmsg.payloadlen = (int)(strlen(pubmsg.payload) + 1);
+	for (i = 0; i < 65535; ++i)
+	{
+		if ((rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL)) != MQTTASYNC_SUCCESS)
+			break;
+	}
+	assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	rc = MQTTAsync_getPendingTokens(c, &tokens);
+	assert("Good rc from getPendingTokens", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	used = calloc(65536, 1);
+	i = 0;
+	if (tokens)
+	{
+		while (tokens[i] != -1)
+		{
+			if (tokens[i] <= 0 || tokens[i] > 65535 || used[tokens[i]]++)
+				++duplicates;
+			++i;
+		}
+		MQTTAsync_free(tokens);
+	}
+	free(used);
+	assert("All messages buffered", i == 65535, "i was %d\n", i);
+	assert("All message ids different", duplicates == 0, "duplicates was %d\n", duplicates);
+
+	rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+	assert("No more message ids", rc == MQTTASYNC_NO_MORE_MSGIDS, "rc was %d ", rc);
+
+	pubmsg.qos = 0;
+	rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+	assert("Good rc from QoS 0 sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+	MQTTAsync_destroy(&c);
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test13: buffered messages limited by bytes
+
+1. Create a client which is never connected, with a limit on buffered bytes
+2. Buffer messages up to the limit, and check the next is refused
+3. Check that a message larger than the limit is refused
+4. With deleteOldestMessages, check that the oldest messages are deleted to
+   keep within the limit
+
+*********************************************************************/
+
+#define TEST13_MAX_BYTES 1000
+#define TEST13_PAYLOAD_SIZE 100
+
+int test13(struct Options options)
+{
+	char* testname = "test13";
+	MQTTAsync c;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+	MQTTAsync_token *tokens = NULL;
+	char payload[TEST13_MAX_BYTES + 1];
+	size_t bytes = 0;
+	int rc = 0;
+	int i = 0;
+	int oldest = 0;
+	char clientidc[70];
+
+	sprintf(clientidc, "paho-test9-13-c-%s", unique);
+	sprintf(test_topic, "paho-test9-13-test topic %s", unique);
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 13 - buffered messages limited by bytes");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	memset(payload, 'x', sizeof(payload));
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.maxBufferedMessages = 100;
+	createOptions.maxBufferedBytes = TEST13_MAX_BYTES;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_NONE,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	pubmsg.qos = 1;
+	pubmsg.payload = payload;
+	pubmsg.payloadlen = TEST13_PAYLOAD_SIZE;
+	for (i = 0; i < TEST13_MAX_BYTES / TEST13_PAYLOAD_SIZE; ++i)
+	{
+		rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+	rc = MQTTAsync_getBufferedBytes(c, &bytes);
+	assert("Good rc from getBufferedBytes", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	assert("All bytes buffered", bytes == TEST13_MAX_BYTES, "bytes was %d", (int)bytes);
+
+	rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+	assert("Buffer full", rc == MQTTASYNC_MAX_BUFFERED_MESSAGES, "rc was %d", rc);
+	MQTTAsync_destroy(&c);
+
+	/* now delete the oldest messages when the buffer is full */
+	createOptions.deleteOldestMessages = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_NONE,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+	{
+		MQTTAsync_destroy(&c);
+		goto exit;
+	}
+
+	pubmsg.payloadlen = TEST13_MAX_BYTES + 1;
+	rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+	assert("Message too large to buffer", rc == MQTTASYNC_MAX_BUFFERED_MESSAGES, "rc was %d", rc);
+
+	pubmsg.payloadlen = TEST13_PAYLOAD_SIZE;
+	for (i = 0; i < 15; ++i)
+	{
+		rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	}
+	rc = MQTTAsync_getBufferedBytes(c, &bytes);
+	assert("Good rc from getBufferedBytes", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+	assert("Buffered bytes within limit", bytes == TEST13_MAX_BYTES, "bytes was %d", (int)bytes);
+
+	rc = MQTTAsync_getPendingTokens(c, &tokens);
+	assert("Good rc from getPendingTokens", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	i = 0;
+	oldest = 65536;
+	if (tokens)
+	{
+		while (tokens[i] != -1)
+		{
+			if (tokens[i] < oldest)
+				oldest = tokens[i];
+			++i;
+		}
+		MQTTAsync_free(tokens);
+	}
+	assert("Messages kept", i == TEST13_MAX_BYTES / TEST13_PAYLOAD_SIZE, "i was %d\n", i);
+	/* msgid 1 went to the refused message, so 2 to 16 were sent and 7 to 16 kept */
+	assert("Oldest messages deleted", oldest == 7, "oldest was %d\n", oldest);
+
+	MQTTAsync_destroy(&c);
+exit:
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test14: messages buffered with log-structured persistence
+
+1. Create a client with MQTTCLIENT_PERSISTENCE_LOG persistence, which is
+   not connected, and buffer enough messages to fill more than one segment
+2. Destroy and recreate the client, and check the messages are restored
+3. Connect, and check all the messages are received in order, so that the
+   segments holding them are compacted away
+4. Buffer some more messages, destroy and recreate the client, and check
+   those are restored and received too
+
+*********************************************************************/
+#define TEST14_BUFFERED_MESSAGES 5000
+int test14_messages_received = 0;
+char test14_received[TEST14_BUFFERED_MESSAGES + 10];
+int test14OnFailureCalled = 0;
+int test14cConnected = 0;
+int test14dSubscribed = 0;
+int test14BufferedMessages = TEST14_BUFFERED_MESSAGES;
+
+int test14_messageArrived(void* context, char* topicName, int topicLen, MQTTAsync_message* message)
+{
+	int sequence_no = atoi(message->payload);
+
+	MyLog(LOGA_DEBUG, "Message received on topic %s, \"%.*s\"", topicName, message->payloadlen, message->payload);
+
+	/* QoS 1 and 2 messages can be forwarded in a different order, so just check each arrives once */
+	assert("Expected message sequence no", sequence_no >= 0 && sequence_no < sizeof(test14_received),
+			"sequence_no was %d\n", sequence_no);
+	if (sequence_no >= 0 && sequence_no < sizeof(test14_received))
+	{
+		assert("Message not duplicated", test14_received[sequence_no] == 0, "sequence_no was %d\n", sequence_no);
+		test14_received[sequence_no] = 1;
+	}
+	test14_messages_received++;
+	MQTTAsync_freeMessage(&message);
+	MQTTAsync_free(topicName);
+
+	return 1;
+}
+
+void test14dOnSubscribe(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In subscribe onSuccess callback for client d, %p granted qos %d", context, response->alt.qos);
+	test14dSubscribed = 1;
+}
+
+void test14dOnConnect(void* context, MQTTAsync_successData* response)
+{
+	MQTTAsync d = (MQTTAsync)context;
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	int rc;
+
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback for client d, context %p\n", context);
+	opts.onSuccess = test14dOnSubscribe;
+	opts.context = d;
+	rc = MQTTAsync_subscribe(d, test_topic, 2, &opts);
+	assert("Good rc from subscribe", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+}
+
+void test14OnFailure(void* context, MQTTAsync_failureData* response)
+{
+	MyLog(LOGA_DEBUG, "In connect onFailure callback, context %p", context);
+	test14OnFailureCalled++;
+}
+
+void test14cOnConnect(void* context, MQTTAsync_successData* response)
+{
+	MyLog(LOGA_DEBUG, "In connect onSuccess callback for client c, context %p\n", context);
+	test14cConnected = 1;
+}
+
+int test14_countPendingTokens(MQTTAsync c)
+{
+	MQTTAsync_token *tokens = NULL;
+	int i = 0;
+	int rc = 0;
+
+	rc = MQTTAsync_getPendingTokens(c, &tokens);
+	assert("Good rc from getPendingTokens", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (tokens)
+	{
+		while (tokens[i] != -1)
+			++i;
+		MQTTAsync_free(tokens);
+	}
+	return i;
+}
+
+int test14_sendMessages(MQTTAsync c, int first, int count)
+{
+	int rc = MQTTASYNC_SUCCESS;
+	int i = 0;
+
+	for (i = first; i < first + count && rc == MQTTASYNC_SUCCESS; ++i)
+	{
+		char buf[200];
+		MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
+
+		memset(buf, ' ', sizeof(buf));
+		sprintf(buf, "%d message no", i);
+		pubmsg.payload = buf;
+		pubmsg.payloadlen = sizeof(buf);
+		pubmsg.qos = 1 + i % 2;
+		rc = MQTTAsync_sendMessage(c, test_topic, &pubmsg, NULL);
+		assert("Good rc from sendMessage", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	}
+	return rc;
+}
+
+int test14(struct Options options)
+{
+	char* testname = "test14";
+	MQTTAsync c = NULL, d = NULL;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	int rc = 0;
+	int count = 0;
+	int pending = 0;
+	char clientidc[70];
+	char clientidd[70];
+
+	sprintf(clientidc, "paho-test9-14-c-%s", unique);
+	sprintf(clientidd, "paho-test9-14-d-%s", unique);
+	sprintf(test_topic, "paho-test9-14-test topic %s", unique);
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 14 - messages buffered with log-structured persistence");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test14dOnConnect;
+	opts.onFailure = test14OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (!test14dSubscribed && !test14OnFailureCalled && ++count < 10000)
+		MySleep(100);
+	assert("Client d subscribed", test14dSubscribed, "test14dSubscribed was %d", test14dSubscribed);
+
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.maxBufferedMessages = test14BufferedMessages;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_LOG,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	if (test14_sendMessages(c, 0, test14BufferedMessages) != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("All messages buffered", pending == test14BufferedMessages, "pending was %d", pending);
+
+	/* re-read persistence */
+	MQTTAsync_destroy(&c);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_LOG,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("All messages restored", pending == test14BufferedMessages, "pending was %d", pending);
+
+	opts.onSuccess = test14cOnConnect;
+	opts.context = c;
+	opts.cleansession = 0;
+	MyLog(LOGA_DEBUG, "Connecting client c");
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (test14_messages_received < test14BufferedMessages && !test14OnFailureCalled && ++count < 1200)
+		MySleep(100);
+	assert("All messages received", test14_messages_received == test14BufferedMessages,
+			"messages received %d", test14_messages_received);
+	waitForNoPendingTokens(c);
+
+	/* buffer a few more, which have to be found in the compacted log */
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	count = 0;
+	while (MQTTAsync_isConnected(c) && ++count < 100)
+		MySleep(100);
+	if (test14_sendMessages(c, test14BufferedMessages, 10) != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	MQTTAsync_destroy(&c);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_LOG,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("Messages restored", pending == 10, "pending was %d", pending);
+
+	opts.context = c;
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (test14_messages_received < test14BufferedMessages + 10 && !test14OnFailureCalled && ++count < 100)
+		MySleep(100);
+	assert("All messages received", test14_messages_received == test14BufferedMessages + 10,
+			"messages received %d", test14_messages_received);
+	waitForNoPendingTokens(c);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test15: messages sent with synced persistence and group commit
+
+1. Check that a create with a bad durability option fails
+2. For both the default and log-structured file persistence, create a
+   client with MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC and a group commit
+   window, connect and send QoS 1 and 2 messages
+3. Check each message is received once, and that nothing is left persisted
+
+*********************************************************************/
+#define TEST15_MESSAGES 200
+
+int test15(struct Options options)
+{
+	char* testname = "test15";
+	MQTTAsync c = NULL, d = NULL;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	int persistence_types[] = {MQTTCLIENT_PERSISTENCE_DEFAULT, MQTTCLIENT_PERSISTENCE_LOG};
+	int rc = 0;
+	int count = 0;
+	int pending = 0;
+	int i;
+	char clientidc[70];
+	char clientidd[70];
+
+	sprintf(clientidc, "paho-test9-15-c-%s", unique);
+	sprintf(clientidd, "paho-test9-15-d-%s", unique);
+	sprintf(test_topic, "paho-test9-15-test topic %s", unique);
+	memset(test14_received, '\0', sizeof(test14_received));
+	test14_messages_received = 0;
+	test14OnFailureCalled = 0;
+	test14dSubscribed = 0;
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 15 - messages sent with synced persistence and group commit");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.persistenceDurability = MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC + 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("bad rc from create", rc == MQTTASYNC_PERSISTENCE_ERROR, "rc was %d \n", rc);
+	MQTTAsync_destroy(&c);
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test14dOnConnect;
+	opts.onFailure = test14OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (!test14dSubscribed && !test14OnFailureCalled && ++count < 10000)
+		MySleep(100);
+	assert("Client d subscribed", test14dSubscribed, "test14dSubscribed was %d", test14dSubscribed);
+
+	createOptions.persistenceDurability = MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC;
+	createOptions.groupCommitWindow = 10;
+	createOptions.maxBufferedMessages = TEST15_MESSAGES;
+	for (i = 0; i < ARRAY_SIZE(persistence_types); ++i)
+	{
+		int expected = (i + 1) * TEST15_MESSAGES;
+
+		MyLog(LOGA_DEBUG, "Using persistence type %d", persistence_types[i]);
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, persistence_types[i],
+		      NULL, &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+
+		test14cConnected = 0;
+		opts.onSuccess = test14cOnConnect;
+		opts.context = c;
+		opts.maxInflight = TEST15_MESSAGES;
+		MyLog(LOGA_DEBUG, "Connecting client c");
+		rc = MQTTAsync_connect(c, &opts);
+		assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		count = 0;
+		while (!test14cConnected && !test14OnFailureCalled && ++count < 100)
+			MySleep(100);
+		assert("Client c connected", test14cConnected, "test14cConnected was %d", test14cConnected);
+
+		if (test14_sendMessages(c, i * TEST15_MESSAGES, TEST15_MESSAGES) != MQTTASYNC_SUCCESS)
+			goto exit;
+		count = 0;
+		while (test14_messages_received < expected && !test14OnFailureCalled && ++count < 300)
+			MySleep(100);
+		assert("All messages received", test14_messages_received == expected,
+				"messages received %d", test14_messages_received);
+		waitForNoPendingTokens(c);
+
+		rc = MQTTAsync_disconnect(c, NULL);
+		assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+		count = 0;
+		while (MQTTAsync_isConnected(c) && ++count < 100)
+			MySleep(100);
+		MQTTAsync_destroy(&c);
+
+		/* everything was acknowledged, so nothing should be restored */
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, persistence_types[i],
+		      NULL, &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		pending = test14_countPendingTokens(c);
+		assert("No messages restored", pending == 0, "pending was %d", pending);
+		MQTTAsync_destroy(&c);
+	}
+
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test16: messages sent through a persistence writer thread
+
+1. Check that a create with a negative number of queued writes fails
+2. For both the default and log-structured file persistence, create a
+   client with a persistence writer thread, buffer QoS 1 and 2 messages
+   while disconnected, then destroy and recreate it and check they are
+   restored
+3. Connect, send more messages, and check each message is received once,
+   and that nothing is left persisted
+
+*********************************************************************/
+#define TEST16_BUFFERED_MESSAGES 50
+#define TEST16_MESSAGES 200
+
+int test16(struct Options options)
+{
+	char* testname = "test16";
+	MQTTAsync c = NULL, d = NULL;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	int persistence_types[] = {MQTTCLIENT_PERSISTENCE_DEFAULT, MQTTCLIENT_PERSISTENCE_LOG};
+	int durabilities[] = {MQTTCLIENT_PERSISTENCE_DURABILITY_DEFAULT, MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC};
+	int rc = 0;
+	int count = 0;
+	int pending = 0;
+	int i;
+	char clientidc[70];
+	char clientidd[70];
+
+	sprintf(clientidc, "paho-test9-16-c-%s", unique);
+	sprintf(clientidd, "paho-test9-16-d-%s", unique);
+	sprintf(test_topic, "paho-test9-16-test topic %s", unique);
+	memset(test14_received, '\0', sizeof(test14_received));
+	test14_messages_received = 0;
+	test14OnFailureCalled = 0;
+	test14dSubscribed = 0;
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 16 - messages sent through a persistence writer thread");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.maxQueuedPersistenceWrites = -1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("bad rc from create", rc == MQTTASYNC_PERSISTENCE_ERROR, "rc was %d \n", rc);
+	MQTTAsync_destroy(&c);
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test14dOnConnect;
+	opts.onFailure = test14OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (!test14dSubscribed && !test14OnFailureCalled && ++count < 10000)
+		MySleep(100);
+	assert("Client d subscribed", test14dSubscribed, "test14dSubscribed was %d", test14dSubscribed);
+
+	createOptions.maxQueuedPersistenceWrites = 16;
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	createOptions.maxBufferedMessages = TEST16_MESSAGES;
+	for (i = 0; i < ARRAY_SIZE(persistence_types); ++i)
+	{
+		int first = i * (TEST16_BUFFERED_MESSAGES + TEST16_MESSAGES);
+		int expected = first + TEST16_BUFFERED_MESSAGES + TEST16_MESSAGES;
+
+		MyLog(LOGA_DEBUG, "Using persistence type %d", persistence_types[i]);
+		createOptions.persistenceDurability = durabilities[i];
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, persistence_types[i],
+		      NULL, &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+
+		if (test14_sendMessages(c, first, TEST16_BUFFERED_MESSAGES) != MQTTASYNC_SUCCESS)
+			goto exit;
+
+		/* the queued writes have to be carried out before the client is destroyed */
+		MQTTAsync_destroy(&c);
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, persistence_types[i],
+		      NULL, &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		pending = test14_countPendingTokens(c);
+		assert("All messages restored", pending == TEST16_BUFFERED_MESSAGES, "pending was %d", pending);
+
+		test14cConnected = 0;
+		opts.onSuccess = test14cOnConnect;
+		opts.context = c;
+		opts.cleansession = 0;
+		opts.maxInflight = TEST16_MESSAGES;
+		MyLog(LOGA_DEBUG, "Connecting client c");
+		rc = MQTTAsync_connect(c, &opts);
+		assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		count = 0;
+		while (!test14cConnected && !test14OnFailureCalled && ++count < 100)
+			MySleep(100);
+		assert("Client c connected", test14cConnected, "test14cConnected was %d", test14cConnected);
+
+		if (test14_sendMessages(c, first + TEST16_BUFFERED_MESSAGES, TEST16_MESSAGES) != MQTTASYNC_SUCCESS)
+			goto exit;
+		count = 0;
+		while (test14_messages_received < expected && !test14OnFailureCalled && ++count < 300)
+			MySleep(100);
+		assert("All messages received", test14_messages_received == expected,
+				"messages received %d", test14_messages_received);
+		waitForNoPendingTokens(c);
+
+		rc = MQTTAsync_disconnect(c, NULL);
+		assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+		count = 0;
+		while (MQTTAsync_isConnected(c) && ++count < 100)
+			MySleep(100);
+		MQTTAsync_destroy(&c);
+
+		/* everything was acknowledged, so nothing should be restored */
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, persistence_types[i],
+		      NULL, &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		pending = test14_countPendingTokens(c);
+		assert("No messages restored", pending == 0, "pending was %d", pending);
+		MQTTAsync_destroy(&c);
+	}
+
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test17: messages buffered with in-memory persistence and a snapshot
+
+1. Create a client with in-memory persistence and no snapshot directory,
+   buffer messages, and check that none are restored when it is recreated
+2. With a snapshot directory, buffer messages, destroy and recreate the
+   client twice, and check they are restored each time
+3. Connect, check all the messages are received, and that nothing is
+   restored afterwards
+
+*********************************************************************/
+#define TEST17_BUFFERED_MESSAGES 1000
+
+int test17(struct Options options)
+{
+	char* testname = "test17";
+	MQTTAsync c = NULL, d = NULL;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	int rc = 0;
+	int count = 0;
+	int pending = 0;
+	int i;
+	char clientidc[70];
+	char clientidd[70];
+
+	sprintf(clientidc, "paho-test9-17-c-%s", unique);
+	sprintf(clientidd, "paho-test9-17-d-%s", unique);
+	sprintf(test_topic, "paho-test9-17-test topic %s", unique);
+	memset(test14_received, '\0', sizeof(test14_received));
+	test14_messages_received = 0;
+	test14OnFailureCalled = 0;
+	test14dSubscribed = 0;
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 17 - messages buffered with in-memory persistence and a snapshot");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	createOptions.maxBufferedMessages = TEST17_BUFFERED_MESSAGES;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_MEMORY,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (test14_sendMessages(c, 0, 10) != MQTTASYNC_SUCCESS)
+		goto exit;
+	MQTTAsync_destroy(&c);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_MEMORY,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("No messages restored without a snapshot", pending == 0, "pending was %d", pending);
+	MQTTAsync_destroy(&c);
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test14dOnConnect;
+	opts.onFailure = test14OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (!test14dSubscribed && !test14OnFailureCalled && ++count < 10000)
+		MySleep(100);
+	assert("Client d subscribed", test14dSubscribed, "test14dSubscribed was %d", test14dSubscribed);
+
+	createOptions.persistenceDurability = MQTTCLIENT_PERSISTENCE_DURABILITY_SYNC;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_MEMORY,
+	      ".", &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (test14_sendMessages(c, 0, TEST17_BUFFERED_MESSAGES) != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	/* the snapshot is deleted when it is read, and written again when the client is destroyed */
+	for (i = 0; i < 2; ++i)
+	{
+		MQTTAsync_destroy(&c);
+		rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_MEMORY,
+		      ".", &createOptions);
+		assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+		if (rc != MQTTASYNC_SUCCESS)
+			goto exit;
+		pending = test14_countPendingTokens(c);
+		assert("All messages restored", pending == TEST17_BUFFERED_MESSAGES, "pending was %d", pending);
+	}
+
+	opts.onSuccess = test14cOnConnect;
+	opts.context = c;
+	opts.cleansession = 0;
+	MyLog(LOGA_DEBUG, "Connecting client c");
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (test14_messages_received < TEST17_BUFFERED_MESSAGES && !test14OnFailureCalled && ++count < 600)
+		MySleep(100);
+	assert("All messages received", test14_messages_received == TEST17_BUFFERED_MESSAGES,
+			"messages received %d", test14_messages_received);
+	waitForNoPendingTokens(c);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	count = 0;
+	while (MQTTAsync_isConnected(c) && ++count < 100)
+		MySleep(100);
+	MQTTAsync_destroy(&c);
+
+	/* everything was acknowledged, so nothing should be restored */
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_MEMORY,
+	      ".", &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("No messages restored", pending == 0, "pending was %d", pending);
+
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test18: messages restored from the persistence index
+
+1. Buffer messages while disconnected, destroy the client, and check the
+   persistence index was written, and that all the messages are restored
+   when the client is recreated
+2. Delete the index, and check the messages are restored from the store
+3. Buffer more messages so that the oldest are deleted, and check the rest
+   are restored from the index
+4. Connect, check all the messages are received, and that nothing is
+   restored afterwards
+
+*********************************************************************/
+#define TEST18_BUFFERED_MESSAGES 3000
+#define TEST18_DELETED_MESSAGES 10
+
+/* the file of the persistence index of a client using the default persistence */
+void test18_indexFileName(char* filename, size_t len, char* clientid, char* serverURI)
+{
+	char* ptr = NULL;
+
+	if ((ptr = strstr(serverURI, "://")) != NULL)
+		serverURI = ptr + 3; /* the client's server URI doesn't include the protocol */
+	snprintf(filename, len, "./%s-%s/i-0.msg", clientid, serverURI);
+	ptr = filename + strlen(clientid) + 3;
+	while ((ptr = strchr(ptr, ':')) != NULL)
+		*ptr = '-';
+}
+
+int test18(struct Options options)
+{
+	char* testname = "test18";
+	MQTTAsync c = NULL, d = NULL;
+	MQTTAsync_connectOptions opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions createOptions = MQTTAsync_createOptions_initializer;
+	int rc = 0;
+	int count = 0;
+	int pending = 0;
+	FILE* index = NULL;
+	char clientidc[70];
+	char clientidd[70];
+	char indexfile[300];
+
+	sprintf(clientidc, "paho-test9-18-c-%s", unique);
+	sprintf(clientidd, "paho-test9-18-d-%s", unique);
+	sprintf(test_topic, "paho-test9-18-test topic %s", unique);
+	test18_indexFileName(indexfile, sizeof(indexfile), clientidc, options.connection);
+	memset(test14_received, '\0', sizeof(test14_received));
+	test14_messages_received = 0;
+	test14OnFailureCalled = 0;
+	test14dSubscribed = 0;
+
+	failures = 0;
+	MyLog(LOGA_INFO, "Starting Offline buffering 18 - messages restored from the persistence index");
+	fprintf(xml, "<testcase classname=\"test9\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	createOptions.sendWhileDisconnected = 1;
+	createOptions.allowDisconnectedSendAtAnyTime = 1;
+	createOptions.maxBufferedMessages = TEST18_BUFFERED_MESSAGES;
+	createOptions.deleteOldestMessages = 1;
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	if (test14_sendMessages(c, 0, TEST18_BUFFERED_MESSAGES) != MQTTASYNC_SUCCESS)
+		goto exit;
+	MQTTAsync_destroy(&c);
+
+	index = fopen(indexfile, "rb");
+	assert("Persistence index written", index != NULL, "index file %s not found", indexfile);
+	if (index)
+		fclose(index);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("All messages restored", pending == TEST18_BUFFERED_MESSAGES, "pending was %d", pending);
+	index = fopen(indexfile, "rb");
+	assert("Persistence index removed when read", index == NULL, "index file %s found", indexfile);
+	if (index)
+		fclose(index);
+
+	MQTTAsync_destroy(&c);
+
+	/* as if the client had not been destroyed cleanly */
+	rc = remove(indexfile);
+	assert("Persistence index deleted", rc == 0, "rc was %d", rc);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("All messages restored", pending == TEST18_BUFFERED_MESSAGES, "pending was %d", pending);
+
+	/* the buffer is full, so the oldest messages are deleted */
+	if (test14_sendMessages(c, TEST18_BUFFERED_MESSAGES, TEST18_DELETED_MESSAGES) != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("Oldest messages deleted", pending == TEST18_BUFFERED_MESSAGES, "pending was %d", pending);
+	MQTTAsync_destroy(&c);
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("All messages restored", pending == TEST18_BUFFERED_MESSAGES, "pending was %d", pending);
+
+	rc = MQTTAsync_create(&d, options.connection, clientidd, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	rc = MQTTAsync_setCallbacks(d, d, NULL, test14_messageArrived, NULL);
+	assert("Good rc from setCallbacks", rc == MQTTASYNC_SUCCESS, "rc was %d", rc);
+
+	opts.MQTTVersion = MQTTVERSION_3_1_1;
+	opts.onSuccess = test14dOnConnect;
+	opts.onFailure = test14OnFailure;
+	opts.context = d;
+	MyLog(LOGA_DEBUG, "Connecting client d");
+	rc = MQTTAsync_connect(d, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (!test14dSubscribed && !test14OnFailureCalled && ++count < 10000)
+		MySleep(100);
+	assert("Client d subscribed", test14dSubscribed, "test14dSubscribed was %d", test14dSubscribed);
+
+	opts.onSuccess = test14cOnConnect;
+	opts.context = c;
+	opts.cleansession = 0;
+	MyLog(LOGA_DEBUG, "Connecting client c");
+	rc = MQTTAsync_connect(c, &opts);
+	assert("Good rc from connect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+
+	count = 0;
+	while (test14_messages_received < TEST18_BUFFERED_MESSAGES && !test14OnFailureCalled && ++count < 1200)
+		MySleep(100);
+	assert("All messages received", test14_messages_received == TEST18_BUFFERED_MESSAGES,
+			"messages received %d", test14_messages_received);
+	assert("Oldest messages not received", test14_received[0] == 0 &&
+			test14_received[TEST18_DELETED_MESSAGES - 1] == 0 && test14_received[TEST18_DELETED_MESSAGES] == 1,
+			"message %d not received", TEST18_DELETED_MESSAGES);
+	waitForNoPendingTokens(c);
+
+	rc = MQTTAsync_disconnect(c, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+	count = 0;
+	while (MQTTAsync_isConnected(c) && ++count < 100)
+		MySleep(100);
+	MQTTAsync_destroy(&c);
+
+	/* everything was acknowledged, so nothing should be restored */
+	rc = MQTTAsync_createWithOptions(&c, options.connection, clientidc, MQTTCLIENT_PERSISTENCE_DEFAULT,
+	      NULL, &createOptions);
+	assert("good rc from create", rc == MQTTASYNC_SUCCESS, "rc was %d \n", rc);
+	if (rc != MQTTASYNC_SUCCESS)
+		goto exit;
+	pending = test14_countPendingTokens(c);
+	assert("No messages restored", pending == 0, "pending was %d", pending);
+
+	rc = MQTTAsync_disconnect(d, NULL);
+	assert("Good rc from disconnect", rc == MQTTASYNC_SUCCESS, "rc was %d ", rc);
+
+exit:
+	MySleep(200);
+	MQTTAsync_destroy(&c);
+	MQTTAsync_destroy(&d);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
 int main(int argc, char** argv)
 {
 	int* numtests = &tests;
 	int rc = 0;
-	int (*tests[])() = { NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10};
+	int (*tests[])() = { NULL, test1, test2, test3, test4, test5, test6, test7, test8, test9, test10, test11, test12, test13, test14, test15, test16, test17, test18};
 	time_t randtime;
 
 	srand((unsigned) time(&randtime));
@@ -0,0 +1,1060 @@
+/*******************************************************************************
+ * Copyright (c) 2009, 2023 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    https://www.eclipse.org/legal/epl-2.0/
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    Ian Craggs - initial API and implementation and/or initial documentation
+ *******************************************************************************/
+
+
+/**
+ * @file
+ * Unit tests for internal modules, which are not exported from the shared libraries,
+ * so are linked into this program directly
+ */
+
+
+#include "MQTTClientPersistence.h"
+#include "MQTTPersistenceLog.h"
+#include "MQTTPersistenceWriter.h"
+#include "MQTTPersistence.h"
+#include "MQTTProtocolClient.h"
+#include "Timers.h"
+#include "Socket.h"
+#include "SocketBuffer.h"
+#include "Thread.h"
+#include "Log.h"
+#include <string.h>
+#include <stdlib.h>
+#include "Heap.h" /* buffers returned by the internal modules are freed with the same allocator */
+
+#if !defined(_WINDOWS)
+	#include <sys/time.h>
+	#include <sys/socket.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#define WINAPI
+#else
+	#include <windows.h>
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+void usage(void)
+{
+	printf("help!!\n");
+	exit(EXIT_FAILURE);
+}
+
+struct Options
+{
+	int verbose;
+	int test_no;
+	int iterations;
+} options =
+{
+	0,
+	-1,
+	1,
+};
+
+void getopts(int argc, char** argv)
+{
+	int count = 1;
+
+	while (count < argc)
+	{
+		if (strcmp(argv[count], "--test_no") == 0)
+		{
+			if (++count < argc)
+				options.test_no = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--iterations") == 0)
+		{
+			if (++count < argc)
+				options.iterations = atoi(argv[count]);
+			else
+				usage();
+		}
+		else if (strcmp(argv[count], "--verbose") == 0)
+			options.verbose = 1;
+		count++;
+	}
+}
+
+#define LOGA_DEBUG 0
+#define LOGA_INFO 1
+#include <stdarg.h>
+#include <time.h>
+#include <sys/timeb.h>
+void MyLog(int LOGA_level, char* format, ...)
+{
+	static char msg_buf[256];
+	va_list args;
+#if defined(_WIN32) || defined(_WINDOWS)
+	struct timeb ts;
+#else
+	struct timeval ts;
+#endif
+	struct tm *timeinfo;
+
+	if (LOGA_level == LOGA_DEBUG && options.verbose == 0)
+	  return;
+
+#if defined(_WIN32) || defined(_WINDOWS)
+	ftime(&ts);
+	timeinfo = localtime(&ts.time);
+#else
+	gettimeofday(&ts, NULL);
+	timeinfo = localtime(&ts.tv_sec);
+#endif
+	strftime(msg_buf, 80, "%Y%m%d %H%M%S", timeinfo);
+
+#if defined(_WIN32) || defined(_WINDOWS)
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3hu ", ts.millitm);
+#else
+	sprintf(&msg_buf[strlen(msg_buf)], ".%.3lu ", ts.tv_usec / 1000L);
+#endif
+
+	va_start(args, format);
+	vsnprintf(&msg_buf[strlen(msg_buf)], sizeof(msg_buf) - strlen(msg_buf), format, args);
+	va_end(args);
+
+	printf("%s\n", msg_buf);
+	fflush(stdout);
+}
+
+
+#if defined(_WIN32) || defined(_WINDOWS)
+#define msleep Sleep
+#define usleep(A) Sleep((A) / 1000)
+#define START_TIME_TYPE DWORD
+START_TIME_TYPE start_clock(void)
+{
+	return GetTickCount();
+}
+#else
+#define msleep(A) usleep(A*1000)
+#define START_TIME_TYPE struct timeval
+START_TIME_TYPE start_clock(void)
+{
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	return start_time;
+}
+#endif
+
+
+#if defined(_WIN32)
+long elapsed(START_TIME_TYPE start_time)
+{
+	return GetTickCount() - start_time;
+}
+#else
+long elapsed(START_TIME_TYPE start_time)
+{
+	struct timeval now, res;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start_time, &res);
+	return (res.tv_sec)*1000 + (res.tv_usec)/1000;
+}
+#endif
+
+#define assert(a, b, c, d) myassert(__FILE__, __LINE__, a, b, c, d)
+#define assert1(a, b, c, d, e) myassert(__FILE__, __LINE__, a, b, c, d, e)
+
+int tests = 0;
+int failures = 0;
+FILE* xml;
+START_TIME_TYPE global_start_time;
+char output[3000];
+char* cur_output = output;
+
+void write_test_result(void)
+{
+	long duration = elapsed(global_start_time);
+
+	fprintf(xml, " time=\"%ld.%.3ld\" >\n", duration / 1000, duration % 1000);
+	if (cur_output != output)
+	{
+		fprintf(xml, "%s", output);
+		cur_output = output;
+	}
+	fprintf(xml, "</testcase>\n");
+}
+
+void myassert(char* filename, int lineno, char* description, int value, char* format, ...)
+{
+	++tests;
+	if (!value)
+	{
+		va_list args;
+
+		++failures;
+		printf("Assertion failed, file %s, line %d, description: %s, ", filename, lineno, description);
+
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+
+		printf("\n");
+
+		cur_output += sprintf(cur_output, "<failure type=\"%s\">file %s, line %d </failure>\n",
+                        description, filename, lineno);
+	}
+    else
+    	MyLog(LOGA_DEBUG, "Assertion succeeded, file %s, line %d, description: %s", filename, lineno, description);
+}
+
+
+/*********************************************************************
+
+Test1: clearing a log-structured store while its oldest segment is being compacted
+
+*********************************************************************/
+#define LOG_TEST_RECORDS 200
+#define LOG_TEST_DATALEN (16 * 1024)
+
+int test_log_clear_compaction(struct Options options)
+{
+	char* testname = "test_log_clear_compaction";
+	void* handle = NULL;
+	char* data = NULL;
+	char key[20];
+	char** keys = NULL;
+	int nkeys = 0;
+	char* buffer = NULL;
+	int buflen = 0;
+	int rc = 0, i = 0, j = 0;
+
+	MyLog(LOGA_INFO, "Starting log store clear during compaction test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	data = malloc(LOG_TEST_DATALEN);
+	memset(data, 'x', LOG_TEST_DATALEN);
+
+	rc = plogopen(&handle, "test_internals", "localhost:1883", ".");
+	assert("rc 0 from plogopen", rc == 0, "rc was %d", rc);
+	if (rc != 0)
+		goto exit;
+
+	for (i = 0; i < 40; ++i)
+	{
+		/* fill several segments, then remove most of the records in the oldest.  The last
+		 * removals leave it a quarter current, which starts the compaction thread copying
+		 * its records, so the clear deletes the segment while it is being compacted */
+		for (j = 0; j < LOG_TEST_RECORDS; ++j)
+		{
+			int len = LOG_TEST_DATALEN;
+
+			sprintf(key, "k-%d", j);
+			rc = plogput(handle, key, 1, &data, &len);
+			assert("rc 0 from plogput", rc == 0, "rc was %d", rc);
+		}
+		for (j = 0; j < LOG_SEGMENT_SIZE / LOG_TEST_DATALEN; ++j)
+		{
+			if (j % 5 == 0)
+				continue;
+			sprintf(key, "k-%d", j);
+			rc = plogremove(handle, key);
+			assert("rc 0 from plogremove", rc == 0, "rc was %d", rc);
+		}
+		usleep((i % 10) * 100); /* for the compaction to start, and get part way through */
+
+		rc = plogclear(handle);
+		assert("rc 0 from plogclear", rc == 0, "rc was %d", rc);
+	}
+
+	rc = plogkeys(handle, &keys, &nkeys);
+	assert("rc 0 from plogkeys", rc == 0, "rc was %d", rc);
+	assert("no keys after plogclear", nkeys == 0, "nkeys was %d", nkeys);
+	if (keys)
+	{
+		for (j = 0; j < nkeys; ++j)
+			free(keys[j]);
+		free(keys);
+	}
+
+	/* the store is still usable after the compactions were interrupted */
+	buflen = LOG_TEST_DATALEN;
+	rc = plogput(handle, "last", 1, &data, &buflen);
+	assert("rc 0 from plogput", rc == 0, "rc was %d", rc);
+	rc = plogget(handle, "last", &buffer, &buflen);
+	assert("rc 0 from plogget", rc == 0, "rc was %d", rc);
+	assert("data length is correct", buflen == LOG_TEST_DATALEN, "buflen was %d", buflen);
+	if (buffer)
+	{
+		assert("data is correct", memcmp(buffer, data, LOG_TEST_DATALEN) == 0, "%s", "data differs");
+		free(buffer);
+	}
+	rc = plogremove(handle, "last");
+	assert("rc 0 from plogremove", rc == 0, "rc was %d", rc);
+
+	rc = plogclose(handle);
+	assert("rc 0 from plogclose", rc == 0, "rc was %d", rc);
+
+exit:
+	free(data);
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test2: keepalive, retry and timeout scheduling
+
+*********************************************************************/
+
+/**
+ * A time a number of milliseconds after another
+ */
+START_TIME_TYPE test_timers_later(START_TIME_TYPE from, ELAPSED_TIME_TYPE milliseconds)
+{
+#if defined(_WIN32) || defined(_WIN64)
+	return from + milliseconds;
+#else
+	struct timeval interval, res;
+
+	interval.tv_sec = (time_t)(milliseconds / 1000);
+	interval.tv_usec = (suseconds_t)((milliseconds % 1000) * 1000);
+	timeradd(&from, &interval, &res);
+	return res;
+#endif
+}
+
+
+/**
+ * Are two times in milliseconds the same, allowing for the truncation of each to milliseconds?
+ */
+int test_timers_near(DIFF_TIME_TYPE a, DIFF_TIME_TYPE b)
+{
+	return a - b >= -1 && a - b <= 1;
+}
+
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/**
+ * Read the next MQTT packet written by the client, if there is one
+ * @param sock the peer of the client's socket
+ * @param type set to the first byte of the packet
+ * @param msgid set to the message id of a QoS 1 or 2 PUBLISH
+ * @return boolean - was a packet read?
+ */
+int test_timers_readPacket(int sock, unsigned char* type, int* msgid)
+{
+	unsigned char buf[256];
+	int len = 0;
+
+	if (recv(sock, buf, 2, 0) != 2)
+		return 0;
+	*type = buf[0];
+	len = buf[1]; /* the packets written here are short */
+	if (len > 0 && recv(sock, buf, len, 0) != len)
+		return 0;
+	if ((*type & 0xF0) == 0x30 && (*type & 0x06) != 0)
+	{
+		int topiclen = buf[0] * 256 + buf[1];
+
+		*msgid = buf[2 + topiclen] * 256 + buf[3 + topiclen];
+	}
+	return 1;
+}
+#endif
+
+
+int test_timer_scheduling(struct Options options)
+{
+	char* testname = "test_timer_scheduling";
+	Timers timers;
+	Timer timer[100];
+	Timer* next = NULL;
+	START_TIME_TYPE start;
+	DIFF_TIME_TYPE last = 0;
+	int i = 0, count = 0;
+
+	MyLog(LOGA_INFO, "Starting keepalive, retry and timeout scheduling test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	/* the timers used for connect and disconnect timeouts are taken in the order they are due */
+	memset(&timers, '\0', sizeof(timers));
+	memset(timer, '\0', sizeof(timer));
+	start = MQTTTime_now();
+	for (i = 0; i < ARRAY_SIZE(timer); ++i)
+	{
+		timer[i].context = &timer[i];
+		Timers_schedule(&timers, &timer[i], start, ((i * 37) % 101) * 10 + 1);
+	}
+	assert("all timers are scheduled", timers.count == ARRAY_SIZE(timer), "count was %d", timers.count);
+	next = Timers_nextDue(&timers, start);
+	assert("no timer is due before its interval", next == NULL, "next was %p", next);
+	while ((next = Timers_nextDue(&timers, test_timers_later(start, 500))) != NULL)
+	{
+		assert("timer is not scheduled once due", next->position == 0, "position was %d", next->position);
+		assert("timers are due in order", next->due >= last, "due was %d", (int)next->due);
+		last = next->due;
+		++count;
+	}
+	assert("only the timers due are taken", count == 50 && timers.count == 50,
+			"count was %d", count);
+
+	/* rescheduling moves a timer in either direction, and cancelling unschedules it */
+	Timers_schedule(&timers, &timer[0], start, 2000);
+	Timers_schedule(&timers, &timer[1], start, 10);
+	Timers_cancel(&timers, &timer[1]);
+	assert("cancelled timer is not scheduled", timer[1].position == 0, "position was %d", timer[1].position);
+	next = Timers_nextDue(&timers, test_timers_later(start, 1500));
+	assert("rescheduled timer is due later", next != NULL && next != &timer[0], "next was %p", next);
+	Timers_schedule(&timers, &timer[0], start, 0);
+	next = Timers_nextDue(&timers, test_timers_later(start, 1));
+	assert("rescheduled timer is due earlier", next == &timer[0], "next was %p", next);
+	Timers_schedule(&timers, &timer[0], test_timers_later(start, 1), 0);
+	next = Timers_nextDue(&timers, test_timers_later(start, 1));
+	assert("timer rescheduled for now is not taken again", next != &timer[0], "next was %p", next);
+	for (i = 0; i < ARRAY_SIZE(timer); ++i)
+		Timers_cancel(&timers, &timer[i]);
+	assert("heap is freed with no timers", timers.count == 0 && timers.heap == NULL, "count was %d", timers.count);
+
+#if !defined(_WIN32) && !defined(_WIN64)
+	{
+		extern ClientStates* bstate;
+		Clients* client = NULL;
+		Messages* m = NULL;
+		Publish publish;
+		DIFF_TIME_TYPE first_due = 0;
+		START_TIME_TYPE first_touched;
+		unsigned char type = 0;
+		int sockets[2];
+		int msgid = 0;
+
+		Socket_outInitialize();
+		assert("socketpair created", socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0, "errno was %d", errno);
+		fcntl(sockets[1], F_SETFL, fcntl(sockets[1], F_GETFL) | O_NONBLOCK);
+
+		client = malloc(sizeof(Clients));
+		memset(client, '\0', sizeof(Clients));
+		client->clientID = MQTTStrdup("test_timer_scheduling");
+		client->outboundMsgs = ListInitialize();
+		client->inboundMsgs = ListInitialize();
+		client->messageQueue = ListInitialize();
+		client->outboundQueue = ListInitialize();
+		client->MQTTVersion = MQTTVERSION_3_1_1;
+		client->net.socket = sockets[0];
+		client->connected = client->good = 1;
+		client->keepAliveInterval = 1;
+		client->retryInterval = 10;
+		bstate->clients = ListInitialize(); /* as the first client created would */
+		ListAppend(bstate->clients, client, sizeof(Clients));
+
+		/* keepalive: a ping is sent once the interval has passed since the last packet */
+		start = MQTTTime_now();
+		client->net.lastSent = client->net.lastReceived = start;
+		MQTTProtocol_scheduleKeepalive(client);
+		first_due = client->keepaliveTimer.due;
+		assert("keepalive is scheduled", client->keepaliveTimer.position > 0, "position was %d", client->keepaliveTimer.position);
+		MQTTProtocol_keepalive(test_timers_later(start, 900));
+		assert("no ping before the keepalive interval", test_timers_readPacket(sockets[1], &type, &msgid) == 0,
+				"type was %d", type);
+		assert("keepalive still scheduled", client->keepaliveTimer.position > 0 &&
+				client->keepaliveTimer.due == first_due, "due was %d", (int)client->keepaliveTimer.due);
+		MQTTProtocol_keepalive(test_timers_later(start, 1100));
+		assert("ping sent after the keepalive interval", test_timers_readPacket(sockets[1], &type, &msgid) == 1 &&
+				type == 0xC0, "type was %d", type);
+		assert("ping is outstanding", client->ping_outstanding == 1, "ping_outstanding was %d", client->ping_outstanding);
+		/* the response is due within one and a half intervals of the ping, give or take the
+		 * millisecond lost converting each time */
+		assert1("keepalive rescheduled for the ping response", client->keepaliveTimer.position > 0 &&
+				test_timers_near(client->keepaliveTimer.due - first_due, 1600), "due was %d after %d",
+				(int)client->keepaliveTimer.due, (int)first_due);
+		client->keepAliveInterval = 0;
+		MQTTProtocol_scheduleKeepalive(client);
+		assert("keepalive cancelled", client->keepaliveTimer.position == 0, "position was %d", client->keepaliveTimer.position);
+
+		/* retry: the check is scheduled from the least recently touched message */
+		for (i = 1; i <= 2; ++i)
+		{
+			memset(&publish, '\0', sizeof(publish));
+			publish.topic = MQTTStrdup("test_timer_scheduling");
+			publish.payload = MQTTStrdup("payload");
+			publish.payloadlen = (int)strlen(publish.payload);
+			publish.msgId = i;
+			publish.MQTTVersion = client->MQTTVersion;
+			m = NULL;
+			MQTTProtocol_startPublish(client, &publish, 1, 0, &m);
+			if (i == 1)
+			{
+				first_due = client->retryTimer.due;
+				first_touched = m->lastTouch;
+			}
+			assert("publish written", test_timers_readPacket(sockets[1], &type, &msgid) == 1 &&
+					(type & 0xF0) == 0x30 && msgid == i, "msgid was %d", msgid);
+		}
+		assert("retry is scheduled for the first message", client->retryTimer.position > 0 &&
+				client->retryTimer.due == first_due, "due was %d", (int)client->retryTimer.due);
+
+		/* the second message has been touched since, so only the first is due when the check is made.
+		 * Messages retried are touched with the current time, so the checks are made as it passes */
+		((Messages*)(client->outboundMsgs->last->content))->lastTouch = test_timers_later(start, 4000);
+		MQTTProtocol_retry(MQTTTime_now(), 1, 0);
+		assert("retry check not made before it is due", client->retryTimer.due == first_due,
+				"due was %d", (int)client->retryTimer.due);
+		count = 0;
+		while (count == 0 && MQTTTime_difftime(MQTTTime_now(), first_touched) < 12000)
+		{
+			MQTTTime_sleep(100);
+			MQTTProtocol_retry(MQTTTime_now(), 1, 0);
+			count = test_timers_readPacket(sockets[1], &type, &msgid);
+		}
+		assert("message due is retried", count == 1 && (type & 0xF8) == 0x38 && msgid == 1,
+				"msgid was %d", msgid);
+		assert("only the message due is retried", test_timers_readPacket(sockets[1], &type, &msgid) == 0,
+				"msgid was %d", msgid);
+		assert("retry rescheduled from the least recently touched message", client->retryTimer.position > 0 &&
+				test_timers_near(client->retryTimer.due - first_due,
+				MQTTTime_difftime(test_timers_later(start, 4000), first_touched)),
+				"due was %d", (int)client->retryTimer.due);
+
+		client->connected = 0;
+		MQTTProtocol_freeClient(client);
+		assert("timers cancelled when the client is freed", client->keepaliveTimer.position == 0 &&
+				client->retryTimer.position == 0, "retry position was %d", client->retryTimer.position);
+		ListDetach(bstate->clients, client);
+		ListFree(bstate->clients);
+		bstate->clients = NULL;
+		free(client);
+		close(sockets[0]);
+		close(sockets[1]);
+		Socket_outTerminate();
+	}
+#endif
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test3: in flight message ids across index pages, acknowledged out of order
+
+*********************************************************************/
+#define INDEX_TEST_MESSAGES 700
+
+int test_message_index(struct Options options)
+{
+	char* testname = "test_message_index";
+	Clients* client = NULL;
+	int msgids[INDEX_TEST_MESSAGES];
+	int order[INDEX_TEST_MESSAGES];
+	int found = 0;
+	int i = 0, j = 0;
+
+	MyLog(LOGA_INFO, "Starting message index test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	client = malloc(sizeof(Clients));
+	memset(client, '\0', sizeof(Clients));
+	client->outboundMsgs = ListInitialize();
+
+	/* start near the top of the id range, so that the ids wrap round, and cross several pages */
+	for (j = 0; j < 2; ++j)
+	{
+		client->msgID = (j == 0) ? 100 : MAX_MSG_ID - INDEX_TEST_MESSAGES / 2;
+		for (i = 0; i < INDEX_TEST_MESSAGES; ++i)
+		{
+			Messages* m = malloc(sizeof(Messages));
+
+			memset(m, '\0', sizeof(Messages));
+			m->msgid = msgids[i] = MQTTProtocol_assignMsgId(client);
+			MQTTProtocol_indexMessage(&client->outboundIndex, m->msgid,
+					ListAppend(client->outboundMsgs, m, sizeof(Messages)));
+		}
+		assert("ids are in sequence", msgids[0] == client->msgID - INDEX_TEST_MESSAGES + 1 ||
+				(j == 1 && msgids[INDEX_TEST_MESSAGES - 1] < msgids[0]), "first msgid was %d", msgids[0]);
+
+		for (i = found = 0; i < INDEX_TEST_MESSAGES; ++i)
+		{
+			ListElement* elem = MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, msgids[i]);
+
+			if (elem && ((Messages*)(elem->content))->msgid == msgids[i])
+				++found;
+		}
+		assert("all in flight messages found", found == INDEX_TEST_MESSAGES, "found was %d", found);
+
+		/* acknowledge every third message, then the rest in reverse order */
+		for (i = 1, found = 0; i < INDEX_TEST_MESSAGES; i += 3)
+			order[found++] = i;
+		for (i = INDEX_TEST_MESSAGES - 1; i >= 0; --i)
+		{
+			if (i % 3 != 1)
+				order[found++] = i;
+		}
+		for (i = 0; i < INDEX_TEST_MESSAGES; ++i)
+		{
+			int pos = order[i];
+			ListElement* elem = NULL;
+
+			elem = MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, msgids[pos]);
+			assert("acknowledged message found", elem != NULL && ((Messages*)(elem->content))->msgid == msgids[pos],
+					"msgid was %d", msgids[pos]);
+			if (elem == NULL)
+				continue;
+			MQTTProtocol_unindexMessage(&client->outboundIndex, msgids[pos]);
+			ListRemove(client->outboundMsgs, elem->content);
+			elem = MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, msgids[pos]);
+			assert("acknowledged message not found again", elem == NULL, "msgid was %d", msgids[pos]);
+
+			if (pos % 3 == 1 && order[i + 1] % 3 != 1)
+			{
+				int k;
+
+				/* the ids acknowledged are free to be used again, and the others are still found */
+				client->msgID = msgids[0];
+				k = MQTTProtocol_assignMsgId(client);
+				assert("acknowledged id is reused", k == msgids[1], "msgid was %d", k);
+				for (k = found = 0; k < INDEX_TEST_MESSAGES; ++k)
+				{
+					if (k % 3 != 1)
+						found += (MQTTProtocol_findMessage(client->outboundMsgs, &client->outboundIndex, msgids[k]) != NULL);
+				}
+				assert("unacknowledged messages found", found == client->outboundMsgs->count,
+						"found was %d", found);
+			}
+		}
+		assert("all messages acknowledged", client->outboundMsgs->count == 0,
+				"count was %d", client->outboundMsgs->count);
+		for (i = found = 0; i < (int)ARRAY_SIZE(client->outboundIndex.pages); ++i)
+			found += (client->outboundIndex.pages[i] != NULL);
+		assert("index pages freed", found == 0, "pages in use were %d", found);
+	}
+
+	MQTTProtocol_emptyMessageIndex(&client->outboundIndex);
+	ListFree(client->outboundMsgs);
+	free(client);
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test4: clients found by socket, with sockets too high to be indexed
+
+*********************************************************************/
+int test_socket_index(struct Options options)
+{
+	char* testname = "test_socket_index";
+	ClientStates states;
+	Clients clients[4];
+	SOCKET sockets[ARRAY_SIZE(clients)] = {5, 100, CLIENTS_SOCKET_INDEX_MAX, CLIENTS_SOCKET_INDEX_MAX + 4464};
+	Clients* found = NULL;
+	int i = 0;
+
+	MyLog(LOGA_INFO, "Starting socket index test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	memset(&states, '\0', sizeof(states));
+	memset(clients, '\0', sizeof(clients));
+	states.clients = ListInitialize();
+	for (i = 0; i < ARRAY_SIZE(clients); ++i)
+	{
+		clients[i].net.socket = sockets[i];
+		ListAppend(states.clients, &clients[i], sizeof(Clients));
+		Clients_addSocket(&states, &clients[i]);
+	}
+	assert("only the low sockets are indexed", states.sockets_count == 2 && states.sockets_size == 128,
+			"sockets_size was %d", states.sockets_size);
+
+	for (i = 0; i < ARRAY_SIZE(clients); ++i)
+	{
+		found = Clients_findSocket(&states, sockets[i]);
+		assert1("client found by socket", found == &clients[i], "found %p for socket %d", found, (int)sockets[i]);
+	}
+	found = Clients_findSocket(&states, 6);
+	assert("no client for an unused low socket", found == NULL, "found was %p", found);
+	found = Clients_findSocket(&states, CLIENTS_SOCKET_INDEX_MAX + 1);
+	assert("no client for an unused high socket", found == NULL, "found was %p", found);
+
+	/* a client whose high socket changes is found by its new socket, by searching */
+	clients[3].net.socket = CLIENTS_SOCKET_INDEX_MAX + 1;
+	Clients_addSocket(&states, &clients[3]);
+	found = Clients_findSocket(&states, CLIENTS_SOCKET_INDEX_MAX + 1);
+	assert("client found by its new high socket", found == &clients[3], "found was %p", found);
+	found = Clients_findSocket(&states, sockets[3]);
+	assert("client not found by its old high socket", found == NULL, "found was %p", found);
+
+	/* removing the high sockets from the index does nothing, and the index is freed with the last low one */
+	for (i = ARRAY_SIZE(clients) - 1; i >= 0; --i)
+	{
+		Clients_removeSocket(&states, &clients[i]);
+		if (i >= 2)
+		{
+			found = Clients_findSocket(&states, clients[i].net.socket);
+			assert("client still found by searching", found == &clients[i], "found was %p", found);
+		}
+	}
+	assert("index freed", states.sockets == NULL && states.sockets_count == 0 && states.sockets_size == 0,
+			"sockets_count was %d", states.sockets_count);
+	found = Clients_findSocket(&states, sockets[0]);
+	assert("client found by searching without the index", found == &clients[0], "found was %p", found);
+
+	for (i = 0; i < ARRAY_SIZE(clients); ++i)
+		ListDetach(states.clients, &clients[i]);
+	ListFree(states.clients);
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test5: read ahead buffers found by socket, and freed once drained
+
+*********************************************************************/
+int test_readahead_index(struct Options options)
+{
+	char* testname = "test_readahead_index";
+	SOCKET sockets[] = {5, 100, SOCKETBUFFER_READAHEAD_INDEX_MAX + 3};
+	char* bufs[ARRAY_SIZE(sockets)];
+	char data[16];
+	size_t size = 0;
+	size_t count = 0;
+	char* buf = NULL;
+	int i = 0;
+#if !defined(NO_HEAP_TRACKING)
+	size_t heap_start = 0;
+	size_t heap_full = 0;
+#endif
+
+	MyLog(LOGA_INFO, "Starting read ahead index test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	SocketBuffer_initialize();
+#if !defined(NO_HEAP_TRACKING)
+	heap_start = Heap_get_info()->current_size;
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(sockets); ++i)
+	{
+		bufs[i] = SocketBuffer_getReadAheadBuffer(sockets[i], &size);
+		assert1("read ahead buffer allocated", bufs[i] != NULL && size == SOCKETBUFFER_READAHEAD_SIZE,
+				"size was %d for socket %d", (int)size, (int)sockets[i]);
+		if (bufs[i] == NULL)
+			goto exit;
+		memset(bufs[i], 'a' + i, 10);
+		SocketBuffer_readAheadFilled(sockets[i], 10);
+	}
+#if !defined(NO_HEAP_TRACKING)
+	heap_full = Heap_get_info()->current_size;
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(sockets); ++i)
+	{
+		count = SocketBuffer_getReadAhead(sockets[i], data, 4);
+		assert1("data read from the socket's own buffer", count == 4 && data[0] == 'a' + i && data[3] == 'a' + i,
+				"count was %d for socket %d", (int)count, (int)sockets[i]);
+		assert("data left", SocketBuffer_hasReadAhead(sockets[i]), "socket was %d", (int)sockets[i]);
+	}
+	assert("no data for an unused low socket", !SocketBuffer_hasReadAhead(6) &&
+			SocketBuffer_getReadAhead(6, data, sizeof(data)) == 0, "%s", "");
+	assert("no data for an unused high socket", !SocketBuffer_hasReadAhead(SOCKETBUFFER_READAHEAD_INDEX_MAX + 4) &&
+			SocketBuffer_getReadAhead(SOCKETBUFFER_READAHEAD_INDEX_MAX + 4, data, sizeof(data)) == 0, "%s", "");
+
+	/* draining a buffer which wasn't filled frees it */
+	for (i = 0; i < ARRAY_SIZE(sockets); ++i)
+	{
+		count = SocketBuffer_getReadAhead(sockets[i], data, sizeof(data));
+		assert1("rest of the data read", count == 6 && data[5] == 'a' + i,
+				"count was %d for socket %d", (int)count, (int)sockets[i]);
+		assert("no data left", !SocketBuffer_hasReadAhead(sockets[i]), "socket was %d", (int)sockets[i]);
+	}
+#if !defined(NO_HEAP_TRACKING)
+	assert1("drained buffers freed", heap_full - Heap_get_info()->current_size == ARRAY_SIZE(sockets) * SOCKETBUFFER_READAHEAD_SIZE,
+			"heap was %d, now %d", (int)heap_full, (int)Heap_get_info()->current_size);
+#endif
+
+	/* a buffer which was filled is kept for the next read */
+	buf = SocketBuffer_getReadAheadBuffer(sockets[0], &size);
+	assert("read ahead buffer allocated again", buf != NULL, "buf was %p", buf);
+	if (buf == NULL)
+		goto exit;
+	memset(buf, 'z', size);
+	SocketBuffer_readAheadFilled(sockets[0], size);
+	while (SocketBuffer_getReadAhead(sockets[0], data, sizeof(data)) > 0)
+		;
+	assert("full buffer kept", SocketBuffer_getReadAheadBuffer(sockets[0], &size) == buf, "buf was %p", buf);
+
+exit:
+	for (i = 0; i < ARRAY_SIZE(sockets); ++i)
+		SocketBuffer_cleanup(sockets[i]);
+#if !defined(NO_HEAP_TRACKING)
+	assert1("read ahead structures and index freed", Heap_get_info()->current_size == heap_start,
+			"heap was %d, now %d", (int)heap_start, (int)Heap_get_info()->current_size);
+#endif
+	SocketBuffer_terminate();
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test6: a failed write or sync on a persistence writer thread stops anything more being committed
+
+*********************************************************************/
+int test_writer_fail_put = 0;
+int test_writer_fail_sync = 0;
+
+int test_writer_pput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	return test_writer_fail_put ? MQTTCLIENT_PERSISTENCE_ERROR : 0;
+}
+
+int test_writer_premove(void* handle, char* key)
+{
+	return 0;
+}
+
+int test_writer_sync(void* handle)
+{
+	return test_writer_fail_sync ? MQTTCLIENT_PERSISTENCE_ERROR : 0;
+}
+
+int test_writer_errors(struct Options options)
+{
+	char* testname = "test_writer_errors";
+	char* data = "data";
+	int datalen = 4;
+	int sync_fails = 0;
+	int rc = 0;
+
+	MyLog(LOGA_INFO, "Starting persistence writer errors test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	/* first a put fails, then a sync */
+	for (sync_fails = 0; sync_fails <= 1; ++sync_fails)
+	{
+		MQTTClient_persistence persistence;
+		Clients c;
+
+		memset(&persistence, '\0', sizeof(persistence));
+		persistence.pput = test_writer_pput;
+		persistence.premove = test_writer_premove;
+		memset(&c, '\0', sizeof(c));
+		c.persistence = &persistence;
+		c.phandle = &persistence;
+		test_writer_fail_put = test_writer_fail_sync = 0;
+
+		rc = MQTTPersistenceWriter_start(&c, 10, sync_fails ? test_writer_sync : NULL);
+		assert("writer started", rc == 0, "rc was %d", rc);
+		if (rc != 0)
+			break;
+
+		rc = c.persistence->pput(c.phandle, "good", 1, &data, &datalen);
+		assert("put queued", rc == 0, "rc was %d", rc);
+		rc = MQTTPersistenceWriter_commit(c.phandle, 1, 1);
+		assert("put committed", rc == 0, "rc was %d", rc);
+
+		if (sync_fails)
+			test_writer_fail_sync = 1;
+		else
+			test_writer_fail_put = 1;
+		rc = c.persistence->pput(c.phandle, "bad", 1, &data, &datalen);
+		assert("put queued", rc == 0, "rc was %d", rc);
+		rc = MQTTPersistenceWriter_commit(c.phandle, 1, 1);
+		assert1("failed write not committed", rc == MQTTCLIENT_PERSISTENCE_ERROR, "rc was %d, sync_fails %d", rc, sync_fails);
+
+		/* the error is kept after the persistence recovers */
+		test_writer_fail_put = test_writer_fail_sync = 0;
+		rc = MQTTPersistenceWriter_commit(c.phandle, 0, 0);
+		assert("commit still fails", rc == MQTTCLIENT_PERSISTENCE_ERROR, "rc was %d", rc);
+		rc = c.persistence->pput(c.phandle, "later", 1, &data, &datalen);
+		assert("later put fails", rc == MQTTCLIENT_PERSISTENCE_ERROR, "rc was %d", rc);
+		rc = c.persistence->premove(c.phandle, "good");
+		assert("remove still queued", rc == 0, "rc was %d", rc);
+		rc = MQTTPersistenceWriter_commit(c.phandle, 1, 1);
+		assert("commit after remove fails", rc == MQTTCLIENT_PERSISTENCE_ERROR, "rc was %d", rc);
+
+		MQTTPersistenceWriter_stop(&c);
+		assert("persistence given back", c.persistence == &persistence && c.phandle == &persistence,
+				"persistence was %p", c.persistence);
+	}
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+/*********************************************************************
+
+Test7: queueing persistence writes doesn't wait for a slow writer thread,
+the calls which can wait for room do so separately
+
+*********************************************************************/
+sem_type test_writer_gate = NULL;
+volatile int test_writer_released = 0;
+
+int test_writer_slow_pput(void* handle, char* key, int bufcount, char* buffers[], int buflens[])
+{
+	if (!test_writer_released)
+		Thread_wait_sem(test_writer_gate, 10000); /* a disk which is slow until released */
+	return 0;
+}
+
+thread_return_type WINAPI test_writer_release(void* n)
+{
+	msleep(200);
+	test_writer_released = 1;
+	Thread_post_sem(test_writer_gate);
+	return 0;
+}
+
+int test_writer_queue_full(struct Options options)
+{
+	char* testname = "test_writer_queue_full";
+	MQTTClient_persistence persistence;
+	Clients c;
+	char* data = "data";
+	int datalen = 4;
+	START_TIME_TYPE start;
+	long duration = 0;
+	int rc = 0;
+	int i;
+
+	MyLog(LOGA_INFO, "Starting persistence writer queue full test");
+	fprintf(xml, "<testcase classname=\"test_internals\" name=\"%s\"", testname);
+	global_start_time = start_clock();
+
+	memset(&persistence, '\0', sizeof(persistence));
+	persistence.pput = test_writer_slow_pput;
+	persistence.premove = test_writer_premove;
+	memset(&c, '\0', sizeof(c));
+	c.persistence = &persistence;
+	c.phandle = &persistence;
+	test_writer_released = 0;
+	test_writer_gate = Thread_create_sem(&rc);
+	assert("semaphore created", rc == 0, "rc was %d", rc);
+	rc = MQTTPersistenceWriter_start(&c, 2, NULL);
+	assert("writer started", rc == 0, "rc was %d", rc);
+	if (rc != 0)
+		goto exit;
+
+	/* the library's threads queue writes while holding locks, so queueing mustn't wait */
+	start = start_clock();
+	for (i = 0; i < 5; ++i)
+	{
+		rc = c.persistence->pput(c.phandle, "key", 1, &data, &datalen);
+		assert("put queued", rc == 0, "rc was %d", rc);
+	}
+	duration = elapsed(start);
+	assert("puts queued beyond the limit without waiting", duration < 5000, "duration was %ld", duration);
+
+	/* an application call waits for room, before it takes any locks */
+	Paho_thread_start(test_writer_release, NULL);
+	start = start_clock();
+	MQTTPersistenceWriter_waitForRoom(c.phandle);
+	duration = elapsed(start);
+	assert("waited for room", duration >= 100, "duration was %ld", duration);
+	rc = MQTTPersistenceWriter_commit(c.phandle, 1, 1);
+	assert("puts committed", rc == 0, "rc was %d", rc);
+
+	MQTTPersistenceWriter_stop(&c);
+exit:
+	if (test_writer_gate)
+		Thread_destroy_sem(test_writer_gate);
+	test_writer_gate = NULL;
+
+	MyLog(LOGA_INFO, "%s: test %s. %d tests run, %d failures.",
+			(failures == 0) ? "passed" : "failed", testname, tests, failures);
+	write_test_result();
+	return failures;
+}
+
+
+int main(int argc, char** argv)
+{
+	int rc = 0;
+	int (*tests[])() = {NULL,
+		test_log_clear_compaction,
+		test_timer_scheduling,
+		test_message_index,
+		test_socket_index,
+		test_readahead_index,
+		test_writer_errors,
+		test_writer_queue_full,
+	}; /* indexed starting from 1 */
+	int i;
+
+	xml = fopen("TEST-test_internals.xml", "w");
+	fprintf(xml, "<testsuite name=\"test_internals\" tests=\"%d\">\n", (int)(ARRAY_SIZE(tests)) - 1);
+
+	getopts(argc, argv);
+#if !defined(NO_HEAP_TRACKING)
+	Heap_initialize(); /* as the first client created would */
+#endif
+	Log_initialize(NULL);
+
+	for (i = 0; i < options.iterations; ++i)
+	{
+		if (options.test_no == -1)
+		{ /* run all the tests */
+			for (options.test_no = 1; options.test_no < ARRAY_SIZE(tests); ++options.test_no)
+			{
+				failures = 0;
+				rc += tests[options.test_no](options); /* return number of failures.  0 = test succeeded */
+			}
+		}
+		else
+		{
+			if (options.test_no >= ARRAY_SIZE(tests))
+				MyLog(LOGA_INFO, "No test number %d", options.test_no);
+			else
+			{
+				rc = tests[options.test_no](options); /* run just the selected test */
+			}
+		}
+	}
+
+	if (rc == 0)
+		MyLog(LOGA_INFO, "verdict pass");
+	else
+		MyLog(LOGA_INFO, "verdict fail");
+
+	fprintf(xml, "</testsuite>\n");
+	fclose(xml);
+
+	return rc;
+}